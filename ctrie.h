@@ -2,44 +2,86 @@
 #define _CTRIE_H
  
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <exception>
 #include <iterator>
 #include <limits>
 #include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <string>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
  
-// TODO Consider getting rid of mParent.
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define _CTRIE_HAS_PMR 1
+#endif
+#endif
+#if __cplusplus >= 201703L
+#include <string_view>
+#define _CTRIE_HAS_STRING_VIEW 1
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
 // TODO Consider breaking STL conformance and adding a fast find() that
 //      just returns a T* (no iterator).
-// TODO Consider changing the way node strings are managed by having non-leaf
-//      nodes have a fixed array of chars (maybe 16), where the first is the
-//      string length, the second is the parent index, and the other 14 are
-//      the string.  The leaf would remain a char* allocated separately.
-// TODO Consider making a non-leaf node not have a value.  Instead, add a
-//      leaf node to the beginning of mChildren that represents the null
-//      character.
 // TODO Add a regex iterator that would iterate over all entries that match
 //      the regular expression.
 
 namespace ctrie {
 
 // Forward declarations
+template<typename T, template<u_char> class Next, class Alloc> class _NodePath;
+template<typename T, template<u_char> class Next, class Alloc> class _InnerNode;
 template<typename T, template<u_char> class Next, class Alloc> class _Leaf;
 template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
     class _CmprNode;
-template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
-    class _CmprValueNode;
+template<typename T, template<u_char> class Next, class Alloc> class _IndexNode;
 template<typename T, template<u_char> class Next, class Alloc> class _FullNode;
+template<class TrieT, class Visit> class _ParallelWalk;
 template<typename T, template<u_char> class Next, class Alloc>
-    class _FullValueNode;
+    class ConcurrentCTrie;
+template<typename T> class _FrozenWriter;
+template<typename T> class LoudsCTrie;
+template<typename T> class DoubleArrayCTrie;
 
 } // end namespace ctrie
 
 #include "ctrie_base.h"
 #include "ctrie_leaf.h"
 #include "ctrie_cmpr.h"
+#include "ctrie_index.h"
 #include "ctrie_full.h"
 #include "ctrie_main.h"
+#include "ctrie_parallel.h"
+#include "ctrie_concurrent.h"
+#include "ctrie_sharded.h"
+#include "ctrie_frozen.h"
+#include "ctrie_louds.h"
+#include "ctrie_darray.h"
+#include "ctrie_slab.h"
+#include "ctrie_arena.h"
+#include "ctrie_compact.h"
+#include "ctrie_hugepage.h"
 
 #endif
@@ -0,0 +1,227 @@
+#ifndef _CTRIE_ARENA_H
+#define _CTRIE_ARENA_H
+ 
+namespace ctrie {
+
+// A monotonic arena.  Memory is handed out from the current chunk in order,
+// freeing it does nothing, and all of it is given back at once when the
+// arena is released.  Chunks start small and double in size up to
+// sMaxChunkSize, so that a small trie does not hold on to a large chunk.
+//
+// An arena is shared by all of the ArenaAllocators that are copied from the
+// one that created it, and it is deleted along with the last of them.
+class _Arena {
+private:
+  struct Chunk {
+    Chunk* next;
+    size_t size;
+  };
+
+  static const size_t sMinChunkSize = 4096;
+  static const size_t sMaxChunkSize = 1024 * 1024;
+
+  Chunk* mChunks;
+  char* mNext;                // The free space left in the current chunk
+  char* mEnd;
+  size_t mChunkSize;          // The size of the next chunk
+  size_t mRefs;
+
+public:
+  _Arena()
+    : mChunks(nullptr), mNext(nullptr), mEnd(nullptr),
+      mChunkSize(sMinChunkSize), mRefs(1) {}
+  _Arena(const _Arena&) = delete;
+  _Arena& operator=(const _Arena&) = delete;
+  ~_Arena()                                                     {release();}
+
+  void ref()                                                      {++mRefs;}
+  bool unref()                                       {return --mRefs == 0;}
+  bool shared() const                                   {return mRefs > 1;}
+
+  void* allocate(size_t bytes, size_t align);
+  void release();
+  size_t chunkCount() const;
+  size_t bytesReserved() const;
+
+private:
+  Chunk* newChunk(size_t size);
+  void* allocateChunk(size_t bytes, size_t align);
+  static char* alignUp(char* p, size_t align);
+};
+
+// An allocator that can be given to CTrie as its Alloc, which takes all of
+// the trie's nodes and key fragments from an _Arena.  Each default
+// constructed allocator creates its own arena, so each trie built with one
+// owns its arena, and a copy of the trie shares it.
+//
+// When the values have trivial destructors, clear() and the destructor do
+// not visit the nodes.  They release the arena instead, if no other trie or
+// allocator shares it.  Otherwise the memory is given back when the last
+// sharer goes away.
+//
+// A trie that is moved or swapped takes its arena with it.  A trie that is
+// copy assigned keeps its own arena and copies the nodes into it.
+template<class T>
+class ArenaAllocator {
+private:
+  _Arena* mArena;
+
+  template<class U> friend class ArenaAllocator;
+
+public:
+  typedef T value_type;
+  typedef T* pointer;
+  typedef const T* const_pointer;
+  typedef T& reference;
+  typedef const T& const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+
+  template<class U> struct rebind {typedef ArenaAllocator<U> other;};
+
+  ArenaAllocator() : mArena(new _Arena)                                    {}
+  ArenaAllocator(const ArenaAllocator& x) : mArena(x.mArena) {mArena->ref();}
+  template<class U> ArenaAllocator(const ArenaAllocator<U>& x)
+    : mArena(x.mArena)                                       {mArena->ref();}
+  ArenaAllocator& operator=(const ArenaAllocator& x);
+  ~ArenaAllocator()                       {if (mArena->unref()) delete mArena;}
+
+  T* allocate(size_t n)
+      {return static_cast<T*>(mArena->allocate(n * sizeof(T), alignof(T)));}
+  void deallocate(T*, size_t)                                              {}
+  size_t max_size() const
+                    {return std::numeric_limits<size_t>::max() / sizeof(T);}
+
+  template<class U, class... Args> void construct(U* p, Args&&... args)
+               {::new(static_cast<void*>(p)) U(std::forward<Args>(args)...);}
+  template<class U> void destroy(U* p)                               {p->~U();}
+
+  void release();
+  size_t chunkCount() const                    {return mArena->chunkCount();}
+  size_t bytesReserved() const              {return mArena->bytesReserved();}
+
+  template<class U> bool operator==(const ArenaAllocator<U>& x) const
+                                                 {return mArena == x.mArena;}
+  template<class U> bool operator!=(const ArenaAllocator<U>& x) const
+                                                 {return mArena != x.mArena;}
+};
+
+template<class T>
+struct _MonotonicTraits<ArenaAllocator<T> > {
+  static const bool sMonotonic = true;
+  static bool canDrop(const ArenaAllocator<T>&)               {return true;}
+  static void release(ArenaAllocator<T>& alloc)             {alloc.release();}
+};
+
+inline void*
+_Arena::allocate(size_t bytes, size_t align)
+{
+  if (mNext) {
+    char* p = alignUp(mNext, align);
+    if (p + bytes <= mEnd) {
+      mNext = p + bytes;
+      return p;
+    }
+  }
+  return allocateChunk(bytes, align);
+}
+
+// Give back every chunk.  Nothing that was allocated may still be in use.
+inline void
+_Arena::release()
+{
+  while (mChunks) {
+    Chunk* next = mChunks->next;
+    ::operator delete(mChunks);
+    mChunks = next;
+  }
+  mNext = mEnd = nullptr;
+  mChunkSize = sMinChunkSize;
+}
+
+inline size_t
+_Arena::chunkCount() const
+{
+  size_t count = 0;
+  for (const Chunk* chunk = mChunks; chunk; chunk = chunk->next) {
+    ++count;
+  }
+  return count;
+}
+
+inline size_t
+_Arena::bytesReserved() const
+{
+  size_t bytes = 0;
+  for (const Chunk* chunk = mChunks; chunk; chunk = chunk->next) {
+    bytes += chunk->size;
+  }
+  return bytes;
+}
+
+inline _Arena::Chunk*
+_Arena::newChunk(size_t size)
+{
+  Chunk* chunk = static_cast<Chunk*>(::operator new(size));
+  chunk->next = mChunks;
+  chunk->size = size;
+  mChunks = chunk;
+  return chunk;
+}
+
+// Start a new chunk for a request that does not fit in the current one.  A
+// request that is large compared with the largest chunks gets a chunk of its
+// own, so that the rest of the current chunk is still used.
+inline void*
+_Arena::allocateChunk(size_t bytes, size_t align)
+{
+  size_t size = sizeof(Chunk) + align - 1 + bytes;
+  if (size > sMaxChunkSize / 4) {
+    return alignUp(reinterpret_cast<char*>(newChunk(size) + 1), align);
+  }
+
+  while (mChunkSize < size) {
+    mChunkSize *= 2;
+  }
+  Chunk* chunk = newChunk(mChunkSize);
+  mNext = reinterpret_cast<char*>(chunk + 1);
+  mEnd = reinterpret_cast<char*>(chunk) + mChunkSize;
+  if (mChunkSize < sMaxChunkSize) {
+    mChunkSize *= 2;
+  }
+  return allocate(bytes, align);
+}
+
+inline char*
+_Arena::alignUp(char* p, size_t align)
+{
+  uintptr_t addr = reinterpret_cast<uintptr_t>(p);
+  return p + ((align - addr % align) % align);
+}
+
+template<class T>
+inline ArenaAllocator<T>&
+ArenaAllocator<T>::operator=(const ArenaAllocator& x)
+{
+  x.mArena->ref();
+  if (mArena->unref()) {
+    delete mArena;
+  }
+  mArena = x.mArena;
+  return *this;
+}
+
+// Give back all of the arena's memory, unless the arena is still shared.
+template<class T>
+inline void
+ArenaAllocator<T>::release()
+{
+  if (!mArena->shared()) {
+    mArena->release();
+  }
+}
+
+} // end namespace ctrie
+#endif
@@ -3,11 +3,291 @@
  
 namespace ctrie {
 
+// Maps a size class of the Next policy to the node types that implement it.
+// Sizes up to 32 use a sorted character table, 48 uses a byte index into
+// the child array, and the maximum u_char value is the uncompressed node.
+template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
+struct _NodeSize {
+  typedef _CmprNode<T,Sz,Next,Alloc> Type;
+};
+
+template<typename T, template<u_char> class Next, class Alloc>
+struct _NodeSize<T,48,Next,Alloc> {
+  typedef _IndexNode<T,Next,Alloc> Type;
+};
+
+template<typename T, template<u_char> class Next, class Alloc>
+struct _NodeSize<T,std::numeric_limits<u_char>::max(),Next,Alloc> {
+  typedef _FullNode<T,Next,Alloc> Type;
+};
+
+// The set of keys (0-255) present in a node that is indexed by key, so that
+// the occupied entries can be found without scanning the child pointers.
+class _KeyBitmap {
+private:
+  static const size_t sNumWords = 4;
+  uint64_t mWords[sNumWords];
+
+public:
+  static const size_t npos = static_cast<size_t>(-1);
+
+  void clear()                {std::fill(mWords, mWords + sNumWords, 0);}
+  void set(size_t i)          {mWords[i >> 6] |= bit(i);}
+  void reset(size_t i)        {mWords[i >> 6] &= ~bit(i);}
+  bool test(size_t i) const   {return (mWords[i >> 6] & bit(i)) != 0;}
+  size_t count() const;
+  size_t next(size_t i) const;
+  size_t prev(size_t i) const;
+
+private:
+  static uint64_t bit(size_t i) {return static_cast<uint64_t>(1) << (i & 63);}
+};
+
+inline size_t
+_KeyBitmap::count() const
+{
+  size_t count = 0;
+  for (size_t word = 0; word < sNumWords; ++word) {
+    count += static_cast<size_t>(__builtin_popcountll(mWords[word]));
+  }
+  return count;
+}
+
+// Return the first key >= i in the set, or npos if there is none.
+inline size_t
+_KeyBitmap::next(size_t i) const
+{
+  for (size_t word = i >> 6; word < sNumWords; ++word) {
+    uint64_t bits = mWords[word];
+    if (word == i >> 6) {
+      bits &= ~(bit(i) - 1);
+    }
+    if (bits) {
+      return (word << 6) + static_cast<size_t>(__builtin_ctzll(bits));
+    }
+  }
+  return npos;
+}
+
+// Return the last key <= i in the set, or npos if there is none.
+inline size_t
+_KeyBitmap::prev(size_t i) const
+{
+  for (size_t word = (i >> 6) + 1; word-- > 0; ) {
+    uint64_t bits = mWords[word];
+    if (word == i >> 6) {
+      bits &= bit(i) | (bit(i) - 1);
+    }
+    if (bits) {
+      return (word << 6) + 63 - static_cast<size_t>(__builtin_clzll(bits));
+    }
+  }
+  return npos;
+}
+
+// The part of a key that a node holds, after the key character that indexes
+// the node in its parent.  Short fragments are stored in place, so following a
+// node does not require following another pointer to its string.  Longer
+// fragments overflow to a block from the trie's allocator, and the in-place
+// bytes hold the pointer and length instead.  The block starts with its
+// capacity, so that it can be given back to the allocator with its size.
+//
+// The fragment does not know its allocator, so its owner must clear() it
+// before destroying it.
+class _KeyFragment {
+private:
+  static const size_t sInlineSize = 13;
+  static const u_char sOverflow = std::numeric_limits<u_char>::max();
+  u_char mLen;                // The length, or sOverflow
+  char mData[sInlineSize];
+
+public:
+  _KeyFragment() : mLen(0) {}
+  _KeyFragment(_KeyFragment&& x);
+  _KeyFragment(const _KeyFragment&) = delete;
+  _KeyFragment& operator=(const _KeyFragment&) = delete;
+  ~_KeyFragment()                                                          {}
+
+  size_t size() const    {return overflow() ? heapSize() : mLen;}
+  char* data()           {return overflow() ? heapData() : mData;}
+  const char* data() const {return overflow() ? heapData() : mData;}
+  template<class Alloc> void assign(Alloc& alloc, const char* str, size_t len);
+  template<class Alloc> void clear(Alloc& alloc);
+
+private:
+  bool overflow() const                             {return mLen == sOverflow;}
+  char* heapData() const;
+  size_t heapSize() const;
+  void setHeap(char* data, size_t len);
+  static size_t heapCapacity(const char* data);
+  template<class Alloc> static char* allocateHeap(Alloc& alloc, size_t len);
+  template<class Alloc> static void deallocateHeap(Alloc& alloc, char* data);
+};
+
+// Take over the fragment of x, which is left empty.
+inline
+_KeyFragment::_KeyFragment(_KeyFragment&& x)
+  : mLen(x.mLen)
+{
+  memcpy(mData, x.mData, sizeof(mData));
+  x.mLen = 0;
+}
+
+inline char*
+_KeyFragment::heapData() const
+{
+  char* data;
+  memcpy(&data, mData, sizeof(data));
+  return data;
+}
+
+inline size_t
+_KeyFragment::heapSize() const
+{
+  uint32_t len;
+  memcpy(&len, mData + sizeof(char*), sizeof(len));
+  return len;
+}
+
+inline void
+_KeyFragment::setHeap(char* data, size_t len)
+{
+  assert(len <= std::numeric_limits<uint32_t>::max());
+  uint32_t len32 = static_cast<uint32_t>(len);
+  memcpy(mData, &data, sizeof(data));
+  memcpy(mData + sizeof(char*), &len32, sizeof(len32));
+  mLen = sOverflow;
+}
+
+inline size_t
+_KeyFragment::heapCapacity(const char* data)
+{
+  uint32_t capacity;
+  memcpy(&capacity, data - sizeof(capacity), sizeof(capacity));
+  return capacity;
+}
+
+template<class Alloc>
+inline char*
+_KeyFragment::allocateHeap(Alloc& alloc, size_t len)
+{
+  assert(len <= std::numeric_limits<uint32_t>::max());
+  typename std::allocator_traits<Alloc>::template rebind_alloc<char>
+      charAlloc(alloc);
+  uint32_t capacity = static_cast<uint32_t>(len);
+  char* block = charAlloc.allocate(sizeof(capacity) + len);
+  memcpy(block, &capacity, sizeof(capacity));
+  return block + sizeof(capacity);
+}
+
+template<class Alloc>
+inline void
+_KeyFragment::deallocateHeap(Alloc& alloc, char* data)
+{
+  typename std::allocator_traits<Alloc>::template rebind_alloc<char>
+      charAlloc(alloc);
+  charAlloc.deallocate(data - sizeof(uint32_t),
+      sizeof(uint32_t) + heapCapacity(data));
+}
+
+template<class Alloc>
+inline void
+_KeyFragment::clear(Alloc& alloc)
+{
+  if (overflow()) {
+    deallocateHeap(alloc, heapData());
+  }
+  mLen = 0;
+}
+
+// Set the fragment to the given string, which may be part of this fragment.
+template<class Alloc>
+inline void
+_KeyFragment::assign(Alloc& alloc, const char* str, size_t len)
+{
+  if (len < sOverflow && len <= sInlineSize) {
+    char* oldHeap = overflow() ? heapData() : nullptr;
+    memmove(mData, str, len * sizeof(char));
+    mLen = static_cast<u_char>(len);
+    if (oldHeap) {
+      deallocateHeap(alloc, oldHeap);
+    }
+  } else if (overflow() && heapCapacity(heapData()) >= len) {
+    char* heap = heapData();
+    memmove(heap, str, len * sizeof(char));
+    setHeap(heap, len);
+  } else {
+    char* heap = allocateHeap(alloc, len);
+    memcpy(heap, str, len * sizeof(char));
+    clear(alloc);
+    setHeap(heap, len);
+  }
+}
+
+// The lock that a ConcurrentCTrie writer takes on an inner node before it
+// replaces the node, or one of the node's entries.  Once the node has been
+// replaced, it is marked obsolete and can never be locked again, so a writer
+// that found the node before then knows to look again.  Readers do not need
+// it, since they never see a node change.  It fits in the byte after the key
+// fragment, so it does not make the nodes any larger.
+class _NodeLock {
+private:
+  static const u_char sLocked = 1;
+  static const u_char sObsolete = 2;
+  std::atomic<u_char> mState;
+
+public:
+  _NodeLock() : mState(0) {}
+  _NodeLock(const _NodeLock&) = delete;
+  _NodeLock& operator=(const _NodeLock&) = delete;
+
+  bool tryLock()
+  {
+    u_char unlocked = 0;
+    return mState.compare_exchange_strong(unlocked, sLocked,
+        std::memory_order_acquire);
+  }
+  void unlock()                {mState.fetch_and(static_cast<u_char>(~sLocked),
+                                                  std::memory_order_release);}
+  void makeObsolete()                              {mState.fetch_or(sObsolete);}
+};
+
+// How an inner node stores the entries of its children.  An entry is a
+// pointer unless the allocator keeps the nodes somewhere that allows a smaller
+// reference (see CompactAllocator).  A slot must convert to and be assigned
+// from an entry, and may be copied with memmove within a node.
+template<class NodeT, class Alloc>
+struct _EntrySlot {
+  typedef NodeT* Type;
+};
+
+// Read and write a slot as an atomic, since a ConcurrentCTrie writer links a
+// new node into a slot that readers may be reading.  The store releases the
+// writes that built the node, and the load carries the dependency from the
+// entry to the node, which on most machines costs no more than a plain load.
+// Another kind of slot must overload these.
+template<class NodeT>
+inline NodeT*
+_loadSlot(NodeT* const& slot)
+{
+  return __atomic_load_n(&slot, __ATOMIC_CONSUME);
+}
+
+template<class NodeT>
+inline void
+_storeSlot(NodeT*& slot, NodeT* entry)
+{
+  __atomic_store_n(&slot, entry, __ATOMIC_RELEASE);
+}
+
 template<typename T, template<u_char> class Next, class Alloc>
 class _BaseNode {
 public:
   typedef _BaseNode<T,Next,Alloc> NodeT;
+  typedef typename _EntrySlot<NodeT,Alloc>::Type SlotT;
+  typedef _InnerNode<T,Next,Alloc> InnerNodeT;
   typedef _Leaf<T,Next,Alloc> LeafT;
+  typedef _NodePath<T,Next,Alloc> PathT;
 
   class FindRtn {
   public:
@@ -30,119 +310,835 @@ public:
   };
 
 private:
-  char* mStr;
-  size_t mStrLen;
+  u_char mNodeSize;         // The Next policy size, or 0 for a leaf
+  // The parents and trie tops that hold the node, which is more than one
+  // only once CTrie::snapshot() has shared it.
+  std::atomic<uint32_t> mRefs;
 
 public:
   static size_t valueIndex()                  {return static_cast<size_t>(-1);}
   static size_t endIndex()                    {return static_cast<size_t>(-2);}
 
-  virtual NodeT* clone() const = 0;
-  virtual NodeT* moveAddValue(const T&) { assert(false); }
-  virtual NodeT* moveRemoveValue()                            {assert(false);}
-  virtual void destroy() = 0;
+  // The node classes do not have virtual functions.  Instead, each node is
+  // tagged with its size, and the functions below switch on the tag to call
+  // the function of the actual node class.
+  //
+  // Nodes do not keep their allocator.  The functions that allocate or free
+  // memory are given the trie's allocator, which they rebind to the type they
+  // need.
+  NodeT* clone(Alloc& alloc) const;
+  void destroy(Alloc& alloc);
+  NodeT* cloneShell(Alloc& alloc, size_t extraChildren);
+  void destroyShell(Alloc& alloc);
   _BaseNode& operator=(const _BaseNode&) = delete;
 
-  void setStr(const char* str, size_t len);
-  size_t strLen() const                                       {return mStrLen;}
-  char* str()                                                 {return mStr;}
-  const char* str() const                                     {return mStr;}
-
-  virtual bool hasValue() const                               {return false;}
-  virtual T& value()                                          {assert(false);}
-  virtual const T& value() const                              {assert(false);}
-  virtual T&& valueToMove()                                   {assert(false);}
-
-  static InsertRtn insert(NodeT** node, const char* searchKey,
-      size_t searchKeyLen, size_t pos, const T& value);
-  static NodeT* createNode(NodeT* parent, const char* str, size_t strLen,
-      char parentIndex);
-  static NodeT* createNode(NodeT* parent, const char* str, size_t strLen,
-      char parentIndex, const T& value);
-  static NodeT* createNode(NodeT* parent, const char* str, size_t strLen,
-      char parentIndex, T&& value);
-
-  virtual bool empty() const                                  {assert(false);}
-  virtual size_t size() const = 0;
-  virtual size_t treeSize() const = 0;
-  virtual NodeT* parent() const                               {assert(false);}
-  virtual void setParent(NodeT*)                              {assert(false);}
-  virtual char parentIndex() const                            {assert(false);}
-  virtual void setParentIndex(char)                           {assert(false);}
-  FindRtn find(const char* searchKeyData, size_t searchKeyLen);
-  virtual char key(size_t)                                    {assert(false);}
-
-  virtual NodeT** getEntryPtr(size_t)                         {assert(false);}
-  virtual NodeT* getEntry(size_t) const                       {assert(false);}
-  virtual size_t insertEntry(NodeT*, size_t, char, NodeT** p=nullptr)
-                         {assert(false); assert(p); /* eliminate a warning */}
-  virtual size_t eraseEntry(size_t, NodeT**)                  {assert(false);}
-  virtual std::pair<size_t, bool> findEntry(char) const       {assert(false);}
-  virtual size_t firstEntry() const                           {assert(false);}
-  virtual size_t lastEntry() const                            {assert(false);}
-  virtual size_t nextEntry(size_t) const                      {assert(false);}
-  virtual size_t prevEntry(size_t) const                      {assert(false);}
+  void setStr(Alloc& alloc, const char* str, size_t len);
+  size_t strLen() const;
+  char* str();
+  const char* str() const;
+
+  bool isLeaf() const                                    {return !mNodeSize;}
+  static bool isLeafEntry(const NodeT* entry);
+  static NodeT* makeEntry(NodeT* node);
+  static NodeT* entryNode(NodeT* entry);
+  static LeafT* entryLeaf(NodeT* entry);
+  static NodeT* cloneEntry(Alloc& alloc, const NodeT* entry);
+  static void destroyEntry(Alloc& alloc, NodeT* entry);
+  static size_t entryTreeSize(const NodeT* entry);
+  u_char nodeSize() const                                  {return mNodeSize;}
+  bool shared() const;
+  void addRef()             {mRefs.fetch_add(1, std::memory_order_relaxed);}
+  bool dropRef();
+  bool hasValue() const;
+  T& value();
+  const T& value() const;
+  T&& valueToMove();
+  void addValue(Alloc& alloc, const T& value);
+  void removeValue(Alloc& alloc);
+
+  static InsertRtn insert(Alloc& alloc, NodeT** node, const char* searchKey,
+      size_t searchKeyLen, size_t pos, const T& value, PathT* path = nullptr);
+  static NodeT* createNode(Alloc& alloc, const char* str, size_t strLen);
+  static NodeT* createNode(
+      Alloc& alloc, const char* str, size_t strLen, const T& value);
+  static NodeT* createNode(
+      Alloc& alloc, const char* str, size_t strLen, T&& value);
+  static NodeT* createSizedNode(
+      Alloc& alloc, const char* str, size_t strLen, size_t numChildren);
+
+  bool empty() const;
+  size_t size() const;
+  size_t treeSize() const;
+  FindRtn find(const char* searchKeyData, size_t searchKeyLen,
+      PathT* path = nullptr);
+  char key(size_t index);
+
+  SlotT* getEntryPtr(size_t index);
+  NodeT* getEntry(size_t index) const;
+  size_t insertEntry(Alloc& alloc, NodeT* entry, size_t index, char key,
+      NodeT** replacement = nullptr);
+  size_t eraseEntry(Alloc& alloc, size_t index, NodeT** newNode);
+  std::pair<size_t, bool> findEntry(char key) const;
+  size_t firstEntry() const;
+  size_t lastEntry() const;
+  size_t nextEntry(size_t index) const;
+  size_t prevEntry(size_t index) const;
 
 protected:
-  _BaseNode(const char* str, size_t len);
-  _BaseNode(const NodeT& src);
-  virtual ~_BaseNode();
+  explicit _BaseNode(u_char nodeSize);
+  ~_BaseNode()                                             {}
 
 private:
   static size_t matchLength(const char* s1, const char* s2, size_t len);
+
+  template<class Op> typename Op::result_type dispatch(const Op& op) const;
+
+  // The operations that dispatch() can apply to a node of any class.
+  struct CloneOp;
+  struct DestroyOp;
+  struct DetachEntriesOp;
+  struct EmptyOp;
+  struct SizeOp;
+  struct TreeSizeOp;
+  struct KeyOp;
+  struct GetEntryPtrOp;
+  struct GetEntryOp;
+  struct InsertEntryOp;
+  struct EraseEntryOp;
+  struct FindEntryOp;
+  struct FirstEntryOp;
+  struct LastEntryOp;
+  struct NextEntryOp;
+  struct PrevEntryOp;
+};
+
+// The base of the nodes that have children, which holds the node's key
+// fragment.  A leaf keeps its suffix after the leaf itself instead.
+//
+// The value of the key that ends at an inner node is kept in a leaf with an
+// empty suffix, in the end-of-key slot.  It sorts before all of the children,
+// like a null character would, but it is kept apart from them, so keys may
+// still contain null characters.  Adding or removing the value only changes
+// the slot, so the node classes do not need twins that hold a value.
+template<typename T, template<u_char> class Next, class Alloc>
+class _InnerNode : public _BaseNode<T,Next,Alloc> {
+public:
+  typedef _Leaf<T,Next,Alloc> LeafT;
+
+private:
+  _KeyFragment mStr;
+  _NodeLock mLock;
+  LeafT* mEndLeaf;            // The end-of-key slot, or null for no value
+
+public:
+  void setStr(Alloc& alloc, const char* str, size_t len)
+                                                 {mStr.assign(alloc, str, len);}
+  size_t strLen() const                                   {return mStr.size();}
+  char* str()                                             {return mStr.data();}
+  const char* str() const                                 {return mStr.data();}
+
+  LeafT* endLeaf() const                                  {return mEndLeaf;}
+  _NodeLock& lock()                                         {return mLock;}
+  void addValue(Alloc& alloc, const T& value);
+  void addValue(Alloc& alloc, T&& value);
+  void removeValue(Alloc& alloc);
+
+protected:
+  _InnerNode(Alloc& alloc, const char* str, size_t len, u_char nodeSize);
+  _InnerNode(Alloc& alloc, const _InnerNode& src, u_char nodeSize);
+  _InnerNode(_InnerNode&& src, u_char nodeSize);
+  ~_InnerNode()                                                            {}
+
+  void destroyInner(Alloc& alloc);
+};
+
+// The nodes from the top of a trie down to some node, each with the index of
+// the entry that leads to the next node.  Nodes do not point back to their
+// parents, so an iterator keeps this path to move back up the tree.  Most
+// paths are short, so the steps are stored in place, and only a deep path
+// moves them to the heap.
+template<typename T, template<u_char> class Next, class Alloc>
+class _NodePath {
+public:
+  typedef _BaseNode<T,Next,Alloc> NodeT;
+
+  struct Step {
+    NodeT* node;
+    size_t index;
+  };
+
+private:
+  static const size_t sInlineSize = 16;
+  Step* mSteps;                       // mInline, or a heap array
+  size_t mSize;
+  size_t mCapacity;
+  Step mInline[sInlineSize];
+
+public:
+  _NodePath() : mSteps(mInline), mSize(0), mCapacity(sInlineSize) {}
+  _NodePath(const _NodePath& x);
+  _NodePath& operator=(const _NodePath& x);
+  ~_NodePath()                       {if (mSteps != mInline) delete [] mSteps;}
+
+  bool empty() const                                       {return mSize == 0;}
+  size_t size() const                                      {return mSize;}
+  Step& operator[](size_t i)             {assert(i < mSize); return mSteps[i];}
+  const Step& operator[](size_t i) const {assert(i < mSize); return mSteps[i];}
+  Step& back()                                  {return operator[](mSize - 1);}
+  const Step& back() const                      {return operator[](mSize - 1);}
+
+  void push(NodeT* node, size_t index);
+  void pop()                                  {assert(mSize > 0); --mSize;}
+  void resize(size_t size)               {assert(size <= mSize); mSize = size;}
+  void clear()                                             {mSize = 0;}
+
+private:
+  void reserve(size_t capacity);
 };
 
 template<typename T, template<u_char> class Next, class Alloc>
 inline
-_BaseNode<T,Next,Alloc>::_BaseNode(const char* str, size_t len)
-  : mStr(nullptr),
-    mStrLen(0)
+_InnerNode<T,Next,Alloc>::_InnerNode(
+    Alloc& alloc, const char* str, size_t len, u_char nodeSize)
+  : _BaseNode<T,Next,Alloc>(nodeSize),
+    mEndLeaf(nullptr)
 {
-  setStr(str, len);
+  setStr(alloc, str, len);
 }
 
 template<typename T, template<u_char> class Next, class Alloc>
 inline
-_BaseNode<T,Next,Alloc>::_BaseNode(const NodeT& src)
-  : mStr(nullptr),
-    mStrLen(0)
+_InnerNode<T,Next,Alloc>::_InnerNode(
+    Alloc& alloc, const _InnerNode& src, u_char nodeSize)
+  : _BaseNode<T,Next,Alloc>(nodeSize),
+    mEndLeaf(src.mEndLeaf ? static_cast<LeafT*>(src.mEndLeaf->clone(alloc)) :
+             nullptr)
 {
-  setStr(src.mStr, src.mStrLen);
+  setStr(alloc, src.str(), src.strLen());
 }
 
 template<typename T, template<u_char> class Next, class Alloc>
 inline
-_BaseNode<T,Next,Alloc>::~_BaseNode()
+_InnerNode<T,Next,Alloc>::_InnerNode(_InnerNode&& src, u_char nodeSize)
+  : _BaseNode<T,Next,Alloc>(nodeSize),
+    mStr(std::move(src.mStr)),
+    mEndLeaf(src.mEndLeaf)
+{
+  src.mEndLeaf = nullptr;
+}
+
+// Free what the inner node owns apart from its children, before the node
+// itself is destroyed.
+template<typename T, template<u_char> class Next, class Alloc>
+inline void
+_InnerNode<T,Next,Alloc>::destroyInner(Alloc& alloc)
+{
+  mStr.clear(alloc);
+  if (mEndLeaf) {
+    mEndLeaf->destroy(alloc);
+    mEndLeaf = nullptr;
+  }
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline void
+_InnerNode<T,Next,Alloc>::addValue(Alloc& alloc, const T& value)
+{
+  assert(!mEndLeaf);
+  mEndLeaf = LeafT::create(alloc, "", 0, value);
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline void
+_InnerNode<T,Next,Alloc>::addValue(Alloc& alloc, T&& value)
+{
+  assert(!mEndLeaf);
+  mEndLeaf = LeafT::create(alloc, "", 0, std::move(value));
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline void
+_InnerNode<T,Next,Alloc>::removeValue(Alloc& alloc)
+{
+  assert(mEndLeaf);
+  mEndLeaf->destroy(alloc);
+  mEndLeaf = nullptr;
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline
+_NodePath<T,Next,Alloc>::_NodePath(const _NodePath& x)
+  : mSteps(mInline), mSize(0), mCapacity(sInlineSize)
+{
+  operator=(x);
+}
+
+// Copy only the steps that are in use.
+template<typename T, template<u_char> class Next, class Alloc>
+inline _NodePath<T,Next,Alloc>&
+_NodePath<T,Next,Alloc>::operator=(const _NodePath& x)
 {
-  delete [] mStr;
-  mStr = nullptr;
-  mStrLen = 0;
+  if (this != &x) {
+    reserve(x.mSize);
+    std::copy(x.mSteps, x.mSteps + x.mSize, mSteps);
+    mSize = x.mSize;
+  }
+  return *this;
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline void
+_NodePath<T,Next,Alloc>::push(NodeT* node, size_t index)
+{
+  if (mSize == mCapacity) {
+    reserve(2 * mCapacity);
+  }
+  mSteps[mSize].node = node;
+  mSteps[mSize].index = index;
+  ++mSize;
 }
 
 template<typename T, template<u_char> class Next, class Alloc>
 void
-_BaseNode<T,Next,Alloc>::setStr(const char* str, size_t len)
-{
-  // FIXME I should be using Alloc, not new/delete.  But this means I need to
-  // keep around the size, which is really a pain.
-  if (len == 0 || mStrLen < len) {
-    delete [] mStr;
-    mStr = nullptr;
-    mStrLen = 0;
-  }
-  if (len > 0) {
-    if (mStr == nullptr) {
-      mStr = new char[len];
+_NodePath<T,Next,Alloc>::reserve(size_t capacity)
+{
+  if (capacity <= mCapacity) {
+    return;
+  }
+  Step* steps = new Step[capacity];
+  std::copy(mSteps, mSteps + mSize, steps);
+  if (mSteps != mInline) {
+    delete [] mSteps;
+  }
+  mSteps = steps;
+  mCapacity = capacity;
+}
+
+// Calls op with node cast to the inner node class of size Sz, if that is the
+// node's size, and otherwise tries the next size up.  Only the sizes that the
+// Next policy can reach are tried, and the chain of tag compares compiles down
+// to a switch.
+template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
+struct _NodeDispatch {
+  typedef _BaseNode<T,Next,Alloc> NodeT;
+  typedef _NodeSize<T,Sz,Next,Alloc> SizeT;
+
+  template<class Op>
+  static typename Op::result_type apply(NodeT* node, const Op& op) {
+    if (node->nodeSize() == Sz) {
+      return op(static_cast<typename SizeT::Type*>(node));
     }
-    memmove(mStr, str, len * sizeof(char));
-    mStrLen = len;
+    return _NodeDispatch<T,Next<Sz>::up,Next,Alloc>::apply(node, op);
+  }
+};
+
+template<typename T, template<u_char> class Next, class Alloc>
+struct _NodeDispatch<T,std::numeric_limits<u_char>::max(),Next,Alloc> {
+  typedef _BaseNode<T,Next,Alloc> NodeT;
+  typedef _NodeSize<T,std::numeric_limits<u_char>::max(),Next,Alloc> SizeT;
+
+  template<class Op>
+  static typename Op::result_type apply(NodeT* node, const Op& op) {
+    assert(node->nodeSize() == std::numeric_limits<u_char>::max());
+    return op(static_cast<typename SizeT::Type*>(node));
+  }
+};
+
+// Create the smallest node, from size class Sz up, that has room for
+// numChildren entries.
+template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
+struct _NodeCreate {
+  typedef _BaseNode<T,Next,Alloc> NodeT;
+  typedef _NodeSize<T,Sz,Next,Alloc> SizeT;
+
+  static NodeT* create(
+      Alloc& alloc, const char* str, size_t strLen, size_t numChildren) {
+    if (numChildren <= Sz) {
+      return SizeT::Type::create(alloc, str, strLen);
+    }
+    return _NodeCreate<T,Next<Sz>::up,Next,Alloc>::create(
+        alloc, str, strLen, numChildren);
+  }
+};
+
+template<typename T, template<u_char> class Next, class Alloc>
+struct _NodeCreate<T,std::numeric_limits<u_char>::max(),Next,Alloc> {
+  typedef _BaseNode<T,Next,Alloc> NodeT;
+  typedef _NodeSize<T,std::numeric_limits<u_char>::max(),Next,Alloc> SizeT;
+
+  static NodeT* create(
+      Alloc& alloc, const char* str, size_t strLen, size_t) {
+    return SizeT::Type::create(alloc, str, strLen);
+  }
+};
+
+template<typename T, template<u_char> class Next, class Alloc>
+struct _BaseNode<T,Next,Alloc>::CloneOp {
+  typedef NodeT* result_type;
+  Alloc& alloc;
+  explicit CloneOp(Alloc& _alloc) : alloc(_alloc) {}
+  template<class N> NodeT* operator()(N* n) const{return n->N::clone(alloc);}
+};
+
+template<typename T, template<u_char> class Next, class Alloc>
+struct _BaseNode<T,Next,Alloc>::DestroyOp {
+  typedef void result_type;
+  Alloc& alloc;
+  explicit DestroyOp(Alloc& _alloc) : alloc(_alloc) {}
+  template<class N> void operator()(N* n) const        {n->N::destroy(alloc);}
+};
+
+template<typename T, template<u_char> class Next, class Alloc>
+struct _BaseNode<T,Next,Alloc>::DetachEntriesOp {
+  typedef void result_type;
+  template<class N> void operator()(N* n) const       {n->N::detachEntries();}
+};
+
+template<typename T, template<u_char> class Next, class Alloc>
+struct _BaseNode<T,Next,Alloc>::EmptyOp {
+  typedef bool result_type;
+  template<class N> bool operator()(N* n) const       {return n->N::empty();}
+};
+
+template<typename T, template<u_char> class Next, class Alloc>
+struct _BaseNode<T,Next,Alloc>::SizeOp {
+  typedef size_t result_type;
+  template<class N> size_t operator()(N* n) const      {return n->N::size();}
+};
+
+template<typename T, template<u_char> class Next, class Alloc>
+struct _BaseNode<T,Next,Alloc>::TreeSizeOp {
+  typedef size_t result_type;
+  template<class N> size_t operator()(N* n) const  {return n->N::treeSize();}
+};
+
+template<typename T, template<u_char> class Next, class Alloc>
+struct _BaseNode<T,Next,Alloc>::KeyOp {
+  typedef char result_type;
+  size_t index;
+  explicit KeyOp(size_t _index) : index(_index) {}
+  template<class N> char operator()(N* n) const     {return n->N::key(index);}
+};
+
+template<typename T, template<u_char> class Next, class Alloc>
+struct _BaseNode<T,Next,Alloc>::GetEntryPtrOp {
+  typedef SlotT* result_type;
+  size_t index;
+  explicit GetEntryPtrOp(size_t _index) : index(_index) {}
+  template<class N> SlotT* operator()(N* n) const
+                                            {return n->N::getEntryPtr(index);}
+};
+
+template<typename T, template<u_char> class Next, class Alloc>
+struct _BaseNode<T,Next,Alloc>::GetEntryOp {
+  typedef NodeT* result_type;
+  size_t index;
+  explicit GetEntryOp(size_t _index) : index(_index) {}
+  template<class N> NodeT* operator()(N* n) const
+                                               {return n->N::getEntry(index);}
+};
+
+template<typename T, template<u_char> class Next, class Alloc>
+struct _BaseNode<T,Next,Alloc>::InsertEntryOp {
+  typedef size_t result_type;
+  Alloc& alloc;
+  NodeT* entry;
+  size_t index;
+  char key;
+  NodeT** replacement;
+  InsertEntryOp(Alloc& _alloc, NodeT* _entry, size_t _index, char _key,
+      NodeT** _replacement)
+    : alloc(_alloc), entry(_entry), index(_index), key(_key),
+      replacement(_replacement) {}
+  template<class N> size_t operator()(N* n) const
+          {return n->N::insertEntry(alloc, entry, index, key, replacement);}
+};
+
+template<typename T, template<u_char> class Next, class Alloc>
+struct _BaseNode<T,Next,Alloc>::EraseEntryOp {
+  typedef size_t result_type;
+  Alloc& alloc;
+  size_t index;
+  NodeT** newNode;
+  EraseEntryOp(Alloc& _alloc, size_t _index, NodeT** _newNode)
+    : alloc(_alloc), index(_index), newNode(_newNode) {}
+  template<class N> size_t operator()(N* n) const
+                              {return n->N::eraseEntry(alloc, index, newNode);}
+};
+
+template<typename T, template<u_char> class Next, class Alloc>
+struct _BaseNode<T,Next,Alloc>::FindEntryOp {
+  typedef std::pair<size_t, bool> result_type;
+  char key;
+  explicit FindEntryOp(char _key) : key(_key) {}
+  template<class N> result_type operator()(N* n) const
+                                                {return n->N::findEntry(key);}
+};
+
+template<typename T, template<u_char> class Next, class Alloc>
+struct _BaseNode<T,Next,Alloc>::FirstEntryOp {
+  typedef size_t result_type;
+  template<class N> size_t operator()(N* n) const{return n->N::firstEntry();}
+};
+
+template<typename T, template<u_char> class Next, class Alloc>
+struct _BaseNode<T,Next,Alloc>::LastEntryOp {
+  typedef size_t result_type;
+  template<class N> size_t operator()(N* n) const {return n->N::lastEntry();}
+};
+
+template<typename T, template<u_char> class Next, class Alloc>
+struct _BaseNode<T,Next,Alloc>::NextEntryOp {
+  typedef size_t result_type;
+  size_t index;
+  explicit NextEntryOp(size_t _index) : index(_index) {}
+  template<class N> size_t operator()(N* n) const
+                                              {return n->N::nextEntry(index);}
+};
+
+template<typename T, template<u_char> class Next, class Alloc>
+struct _BaseNode<T,Next,Alloc>::PrevEntryOp {
+  typedef size_t result_type;
+  size_t index;
+  explicit PrevEntryOp(size_t _index) : index(_index) {}
+  template<class N> size_t operator()(N* n) const
+                                              {return n->N::prevEntry(index);}
+};
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline
+_BaseNode<T,Next,Alloc>::_BaseNode(u_char nodeSize)
+  : mNodeSize(nodeSize), mRefs(1)
+{}
+
+// Whether anything else holds the node.  A node held only by the caller
+// cannot gain a reference behind its back, so the caller may change it if
+// this is false.  The acquire pairs with the release of whoever dropped a
+// reference, so their reads of the node are done before it changes.
+template<typename T, template<u_char> class Next, class Alloc>
+inline bool
+_BaseNode<T,Next,Alloc>::shared() const
+{
+  return mRefs.load(std::memory_order_acquire) != 1;
+}
+
+// Drop a reference to the node.  Return true if it was the last one, and the
+// caller is to free the node.  Dropping the reference and finding out whether
+// it was the last are one atomic step, so when two holders drop theirs at
+// once, exactly one of them frees the node.
+template<typename T, template<u_char> class Next, class Alloc>
+inline bool
+_BaseNode<T,Next,Alloc>::dropRef()
+{
+  return mRefs.fetch_sub(1, std::memory_order_acq_rel) == 1;
+}
+
+// Only inner nodes change their string.  A leaf is replaced instead, since its
+// suffix is part of its allocation.
+template<typename T, template<u_char> class Next, class Alloc>
+inline void
+_BaseNode<T,Next,Alloc>::setStr(Alloc& alloc, const char* str, size_t len)
+{
+  assert(!isLeaf());
+  static_cast<InnerNodeT*>(this)->setStr(alloc, str, len);
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline size_t
+_BaseNode<T,Next,Alloc>::strLen() const
+{
+  return isLeaf() ? static_cast<const LeafT*>(this)->strLen() :
+      static_cast<const InnerNodeT*>(this)->strLen();
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline char*
+_BaseNode<T,Next,Alloc>::str()
+{
+  return isLeaf() ? static_cast<LeafT*>(this)->str() :
+      static_cast<InnerNodeT*>(this)->str();
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline const char*
+_BaseNode<T,Next,Alloc>::str() const
+{
+  return isLeaf() ? static_cast<const LeafT*>(this)->str() :
+      static_cast<const InnerNodeT*>(this)->str();
+}
+
+// The children of an inner node are stored as entries.  An entry that is a
+// leaf has the low bit of its pointer set, so a search can tell a leaf from an
+// inner node without loading the child.
+template<typename T, template<u_char> class Next, class Alloc>
+inline bool
+_BaseNode<T,Next,Alloc>::isLeafEntry(const NodeT* entry)
+{
+  return (reinterpret_cast<uintptr_t>(entry) & 1) != 0;
+}
+
+// Return the entry for node, which must not be an entry already.
+template<typename T, template<u_char> class Next, class Alloc>
+inline _BaseNode<T,Next,Alloc>*
+_BaseNode<T,Next,Alloc>::makeEntry(NodeT* node)
+{
+  assert(!isLeafEntry(node));
+  return node->isLeaf() ?
+      reinterpret_cast<NodeT*>(reinterpret_cast<uintptr_t>(node) | 1) : node;
+}
+
+// Return the node that an entry refers to, whether it is a leaf or not.
+template<typename T, template<u_char> class Next, class Alloc>
+inline _BaseNode<T,Next,Alloc>*
+_BaseNode<T,Next,Alloc>::entryNode(NodeT* entry)
+{
+  return reinterpret_cast<NodeT*>(
+      reinterpret_cast<uintptr_t>(entry) & ~static_cast<uintptr_t>(1));
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline _Leaf<T,Next,Alloc>*
+_BaseNode<T,Next,Alloc>::entryLeaf(NodeT* entry)
+{
+  assert(isLeafEntry(entry));
+  return static_cast<LeafT*>(entryNode(entry));
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline _BaseNode<T,Next,Alloc>*
+_BaseNode<T,Next,Alloc>::cloneEntry(Alloc& alloc, const NodeT* entry)
+{
+  return makeEntry(entryNode(const_cast<NodeT*>(entry))->clone(alloc));
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline void
+_BaseNode<T,Next,Alloc>::destroyEntry(Alloc& alloc, NodeT* entry)
+{
+  if (isLeafEntry(entry)) {
+    entryLeaf(entry)->destroy(alloc);
+  } else {
+    entry->destroy(alloc);
+  }
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline size_t
+_BaseNode<T,Next,Alloc>::entryTreeSize(const NodeT* entry)
+{
+  return isLeafEntry(entry) ? 1 : entry->treeSize();
+}
+
+// Apply op to this inner node, as an instance of its _NodeSize Type class.
+template<typename T, template<u_char> class Next, class Alloc>
+template<class Op>
+inline typename Op::result_type
+_BaseNode<T,Next,Alloc>::dispatch(const Op& op) const
+{
+  assert(!isLeaf());
+  return _NodeDispatch<T,Next<std::numeric_limits<u_char>::max()>::up,Next,
+      Alloc>::apply(const_cast<NodeT*>(this), op);
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline _BaseNode<T,Next,Alloc>*
+_BaseNode<T,Next,Alloc>::clone(Alloc& alloc) const
+{
+  if (isLeaf()) {
+    return static_cast<const LeafT*>(this)->clone(alloc);
+  }
+  return dispatch(CloneOp(alloc));
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline void
+_BaseNode<T,Next,Alloc>::destroy(Alloc& alloc)
+{
+  if (isLeaf()) {
+    static_cast<LeafT*>(this)->destroy(alloc);
+  } else {
+    dispatch(DestroyOp(alloc));
   }
 }
 
+// Return a new inner node with the string, value and entries of this one,
+// and room for extraChildren more entries.  The entries are shared, not
+// copied, so that a concurrent trie can change the copy while readers still
+// walk the original.  The original must then go with destroyShell().
+template<typename T, template<u_char> class Next, class Alloc>
+_BaseNode<T,Next,Alloc>*
+_BaseNode<T,Next,Alloc>::cloneShell(Alloc& alloc, size_t extraChildren)
+{
+  assert(!isLeaf());
+  NodeT* node = createSizedNode(alloc, str(), strLen(), size() + extraChildren);
+  if (hasValue()) {
+    node->addValue(alloc, value());
+  }
+  for (size_t i = firstEntry(); i != endIndex(); i = nextEntry(i)) {
+    char ch = key(i);
+    node->insertEntry(
+        alloc, entryNode(getEntry(i)), node->findEntry(ch).first, ch);
+  }
+  return node;
+}
+
+// Free this inner node, but not its entries, which belong to another node.
+template<typename T, template<u_char> class Next, class Alloc>
+inline void
+_BaseNode<T,Next,Alloc>::destroyShell(Alloc& alloc)
+{
+  dispatch(DetachEntriesOp());
+  destroy(alloc);
+}
+
+// A leaf always has a value, and an inner node has one when its end-of-key
+// slot holds a leaf.
+template<typename T, template<u_char> class Next, class Alloc>
+inline bool
+_BaseNode<T,Next,Alloc>::hasValue() const
+{
+  return isLeaf() || static_cast<const InnerNodeT*>(this)->endLeaf() != nullptr;
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline T&
+_BaseNode<T,Next,Alloc>::value()
+{
+  assert(hasValue());
+  return isLeaf() ? static_cast<LeafT*>(this)->value() :
+      static_cast<InnerNodeT*>(this)->endLeaf()->value();
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline const T&
+_BaseNode<T,Next,Alloc>::value() const
+{
+  assert(hasValue());
+  return isLeaf() ? static_cast<const LeafT*>(this)->value() :
+      static_cast<const InnerNodeT*>(this)->endLeaf()->value();
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline T&&
+_BaseNode<T,Next,Alloc>::valueToMove()
+{
+  return std::move(value());
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline void
+_BaseNode<T,Next,Alloc>::addValue(Alloc& alloc, const T& value)
+{
+  assert(!isLeaf());
+  static_cast<InnerNodeT*>(this)->addValue(alloc, value);
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline void
+_BaseNode<T,Next,Alloc>::removeValue(Alloc& alloc)
+{
+  assert(!isLeaf());
+  static_cast<InnerNodeT*>(this)->removeValue(alloc);
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline bool
+_BaseNode<T,Next,Alloc>::empty() const
+{
+  return dispatch(EmptyOp());
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline size_t
+_BaseNode<T,Next,Alloc>::size() const
+{
+  return isLeaf() ? 1 : dispatch(SizeOp());
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline size_t
+_BaseNode<T,Next,Alloc>::treeSize() const
+{
+  return isLeaf() ? 1 : dispatch(TreeSizeOp());
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline char
+_BaseNode<T,Next,Alloc>::key(size_t index)
+{
+  return dispatch(KeyOp(index));
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline typename _BaseNode<T,Next,Alloc>::SlotT*
+_BaseNode<T,Next,Alloc>::getEntryPtr(size_t index)
+{
+  return dispatch(GetEntryPtrOp(index));
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline _BaseNode<T,Next,Alloc>*
+_BaseNode<T,Next,Alloc>::getEntry(size_t index) const
+{
+  return dispatch(GetEntryOp(index));
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline size_t
+_BaseNode<T,Next,Alloc>::insertEntry(
+    Alloc& alloc, NodeT* entry, size_t index, char key, NodeT** replacement)
+{
+  return dispatch(InsertEntryOp(alloc, entry, index, key, replacement));
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline size_t
+_BaseNode<T,Next,Alloc>::eraseEntry(
+    Alloc& alloc, size_t index, NodeT** newNode)
+{
+  return dispatch(EraseEntryOp(alloc, index, newNode));
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline std::pair<size_t, bool>
+_BaseNode<T,Next,Alloc>::findEntry(char key) const
+{
+  return dispatch(FindEntryOp(key));
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline size_t
+_BaseNode<T,Next,Alloc>::firstEntry() const
+{
+  return dispatch(FirstEntryOp());
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline size_t
+_BaseNode<T,Next,Alloc>::lastEntry() const
+{
+  return dispatch(LastEntryOp());
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline size_t
+_BaseNode<T,Next,Alloc>::nextEntry(size_t index) const
+{
+  return dispatch(NextEntryOp(index));
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline size_t
+_BaseNode<T,Next,Alloc>::prevEntry(size_t index) const
+{
+  return dispatch(PrevEntryOp(index));
+}
+
 template<typename T, template<u_char> class Next, class Alloc>
 typename _BaseNode<T,Next,Alloc>::InsertRtn
-_BaseNode<T,Next,Alloc>::insert(NodeT** node, const char* searchKey,
-    size_t searchKeyLen, size_t pos, const T& value)
+_BaseNode<T,Next,Alloc>::insert(Alloc& alloc, NodeT** node,
+    const char* searchKey, size_t searchKeyLen, size_t pos, const T& value,
+    PathT* path)
 {
   NodeT* origNode = *node;
   size_t nodeStrLen = origNode->strLen();
@@ -159,14 +1155,13 @@ _BaseNode<T,Next,Alloc>::insert(NodeT** node, const char* searchKey,
       char indexCh = nodeStr[matchLen];
       bool insertValue = (pos + matchLen == searchKeyLen);
       if (insertValue) {
-        *node = NodeT::createNode(origNode->parent(), nodeStr, matchLen,
-            origNode->parentIndex(), value);
+        *node = NodeT::createNode(alloc, nodeStr, matchLen, value);
       } else {
-        *node = NodeT::createNode(
-            origNode->parent(), nodeStr, matchLen, origNode->parentIndex());
+        *node = NodeT::createNode(alloc, nodeStr, matchLen);
       }
-      origNode->setStr(nodeStr + matchLen + 1, nodeStrLen - matchLen - 1);
-      (*node)->insertEntry(origNode, 0, indexCh);
+      origNode->setStr(
+          alloc, nodeStr + matchLen + 1, nodeStrLen - matchLen - 1);
+      (*node)->insertEntry(alloc, origNode, 0, indexCh);
       if (insertValue) {
         return InsertRtn(*node, valueIndex(), true);
       }
@@ -182,9 +1177,8 @@ _BaseNode<T,Next,Alloc>::insert(NodeT** node, const char* searchKey,
       return InsertRtn(origNode, valueIndex(), false);
     }
 
-    *node = origNode->moveAddValue(value);
-    origNode->destroy();
-    return InsertRtn(*node, valueIndex(), true);
+    origNode->addValue(alloc, value);
+    return InsertRtn(origNode, valueIndex(), true);
   }
   
   // Find the next character of the search key in the node table.
@@ -194,18 +1188,26 @@ _BaseNode<T,Next,Alloc>::insert(NodeT** node, const char* searchKey,
   if (!findRtn.second) {
     // The next character of the search key is not in the array, so
     // insert a new leaf node into the vector.
-    LeafT *leaf = LeafT::create(searchKey + pos, searchKeyLen - pos, value);
-    index = origNode->insertEntry(leaf, index, searchCh, node);
+    LeafT *leaf =
+        LeafT::create(alloc, searchKey + pos, searchKeyLen - pos, value);
+    index = origNode->insertEntry(alloc, leaf, index, searchCh, node);
     return InsertRtn(*node, index, true);
   }
 
   // The next character of the search key is in the table.  If the entry is
   // not a leaf node, traverse down to that node for further searching.
-  NodeT** entry = origNode->getEntryPtr(index);
-  LeafT* leaf = dynamic_cast<LeafT*>(*entry);
-  if (leaf == nullptr) {
-    return insert(entry, searchKey, searchKeyLen, pos, value);
+  SlotT* entry = origNode->getEntryPtr(index);
+  if (!isLeafEntry(*entry)) {
+    if (path) {
+      path->push(origNode, index);
+    }
+    NodeT* child = *entry;
+    InsertRtn rtn =
+        insert(alloc, &child, searchKey, searchKeyLen, pos, value, path);
+    *entry = child;
+    return rtn;
   }
+  LeafT* leaf = entryLeaf(*entry);
 
   // We have hit a leaf node.  Compare the leaf node and search strings.
   size_t leafStrLen = leaf->strLen();
@@ -218,36 +1220,43 @@ _BaseNode<T,Next,Alloc>::insert(NodeT** node, const char* searchKey,
     return InsertRtn(origNode, index, false);
   }
 
+  // The rest of the cases replace the leaf with a new node, which is returned.
+  if (path) {
+    path->push(origNode, index);
+  }
+
   if (pos + matchLen == searchKeyLen) {
     // The insertion value goes into a new node, and the existing leaf node
     // becomes a child of the new node.
-    *entry = NodeT::createNode(origNode, leafStr, matchLen, searchCh, value);
-    (*entry)->insertEntry(leaf, 0, leafStr[matchLen]);
-    leaf->setStr(leafStr + matchLen + 1, leafStrLen - matchLen - 1);
+    *entry = NodeT::createNode(alloc, leafStr, matchLen, value);
+    char leafCh = leafStr[matchLen];
+    (*entry)->insertEntry(
+        alloc, leaf->moveTail(alloc, matchLen + 1), 0, leafCh);
     return InsertRtn(*entry, valueIndex(), true);
   }
 
-  NodeT *newLeaf = LeafT::create(
-      searchKey + pos + matchLen + 1, searchKeyLen - pos - matchLen - 1, value);
+  NodeT *newLeaf = LeafT::create(alloc, searchKey + pos + matchLen + 1,
+      searchKeyLen - pos - matchLen - 1, value);
+  char newCh = searchKey[pos + matchLen];
   if (matchLen == leafStrLen) {
     // Move the leaf node to a non-leaf node, and the insertion value goes into
     // a new leaf node.
-    *entry = NodeT::createNode(
-        origNode, leafStr, leafStrLen, searchCh, leaf->valueToMove());
-    index = (*entry)->insertEntry(newLeaf, 0, searchKey[pos + matchLen]);
-    leaf->destroy();
+    *entry = NodeT::createNode(alloc, leafStr, leafStrLen, leaf->valueToMove());
+    index = (*entry)->insertEntry(alloc, newLeaf, 0, newCh);
+    leaf->destroy(alloc);
   } else {
     // The new value and the existing leaf node are both children of a new
     // node.
-    *entry = NodeT::createNode(origNode, leafStr, matchLen, searchCh);
-    if (searchKey[pos + matchLen] < leafStr[matchLen]) {
-      index = (*entry)->insertEntry(newLeaf, 0, searchKey[pos + matchLen]);
-      (*entry)->insertEntry(leaf, 1, leafStr[matchLen]);
+    *entry = NodeT::createNode(alloc, leafStr, matchLen);
+    char leafCh = leafStr[matchLen];
+    leaf = leaf->moveTail(alloc, matchLen + 1);
+    if (newCh < leafCh) {
+      index = (*entry)->insertEntry(alloc, newLeaf, 0, newCh);
+      (*entry)->insertEntry(alloc, leaf, 1, leafCh);
     } else {
-      (*entry)->insertEntry(leaf, 0, leafStr[matchLen]);
-      index = (*entry)->insertEntry(newLeaf, 1, searchKey[pos + matchLen]);
+      (*entry)->insertEntry(alloc, leaf, 0, leafCh);
+      index = (*entry)->insertEntry(alloc, newLeaf, 1, newCh);
     }
-    leaf->setStr(leafStr + matchLen + 1, leafStrLen - matchLen - 1);
   }
   return InsertRtn(*entry, index, true);
 }
@@ -262,10 +1271,12 @@ _BaseNode<T,Next,Alloc>::insert(NodeT** node, const char* searchKey,
 //                partial match, the nodes would be considered a match;
 //                otherwise, the node key is lexically after the search key.
 //          > 1 - The node key is after the search key.
+//    path - If not null, the nodes above the returned node are pushed onto it.
 //
 template<typename T, template<u_char> class Next, class Alloc>
 typename _BaseNode<T,Next,Alloc>::FindRtn
-_BaseNode<T,Next,Alloc>::find(const char* searchKeyData, size_t searchKeyLen)
+_BaseNode<T,Next,Alloc>::find(
+    const char* searchKeyData, size_t searchKeyLen, PathT* path)
 {
   // Compare to the string in this node if there is one.
   size_t nodeStrLen = strLen();
@@ -321,16 +1332,20 @@ _BaseNode<T,Next,Alloc>::find(const char* searchKeyData, size_t searchKeyLen)
   ++searchKeyData;
   --searchKeyLen;
   NodeT* entry = getEntry(index);
-  if (dynamic_cast<LeafT*>(entry) == nullptr) {
+  if (!isLeafEntry(entry)) {
     // A non-leaf node, so continue searching down the tree.
-    return entry->find(searchKeyData, searchKeyLen);
+    if (path) {
+      path->push(this, index);
+    }
+    return entry->find(searchKeyData, searchKeyLen, path);
   }
 
   // Figure out how much of the two strings match
-  size_t minLen = std::min(searchKeyLen, entry->strLen());
-  int cmp = memcmp(entry->str(), searchKeyData, minLen);
+  LeafT* leaf = entryLeaf(entry);
+  size_t minLen = std::min(searchKeyLen, leaf->strLen());
+  int cmp = memcmp(leaf->str(), searchKeyData, minLen);
   if (cmp == 0) {
-    cmp = static_cast<int>(entry->strLen()) - static_cast<int>(searchKeyLen);
+    cmp = static_cast<int>(leaf->strLen()) - static_cast<int>(searchKeyLen);
     if (cmp > 0) {
       cmp = 1;
     }
@@ -342,31 +1357,44 @@ _BaseNode<T,Next,Alloc>::find(const char* searchKeyData, size_t searchKeyLen)
 
 template<typename T, template<u_char> class Next, class Alloc>
 inline _BaseNode<T,Next,Alloc>*
-_BaseNode<T,Next,Alloc>::createNode(NodeT* parent, const char* str,
-    size_t strLen, char parentIndex)
+_BaseNode<T,Next,Alloc>::createNode(
+    Alloc& alloc, const char* str, size_t strLen)
 {
   return _CmprNode<T,Next<std::numeric_limits<u_char>::max()>::up,Next,Alloc>::
-      create(parent, str, strLen, parentIndex);
+      create(alloc, str, strLen);
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline _BaseNode<T,Next,Alloc>*
+_BaseNode<T,Next,Alloc>::createNode(
+    Alloc& alloc, const char* str, size_t strLen, const T& value)
+{
+  NodeT* node = createNode(alloc, str, strLen);
+  node->addValue(alloc, value);
+  return node;
 }
 
 template<typename T, template<u_char> class Next, class Alloc>
 inline _BaseNode<T,Next,Alloc>*
-_BaseNode<T,Next,Alloc>::createNode(NodeT* parent, const char* str,
-    size_t strLen, char parentIndex, const T& value)
+_BaseNode<T,Next,Alloc>::createNode(
+    Alloc& alloc, const char* str, size_t strLen, T&& valueToMove)
 {
-  return _CmprValueNode<T,Next<std::numeric_limits<u_char>::max()>::up,Next,
-         Alloc>::
-      create(parent, str, strLen, parentIndex, value);
+  _CmprNode<T,Next<std::numeric_limits<u_char>::max()>::up,Next,Alloc>* node =
+      _CmprNode<T,Next<std::numeric_limits<u_char>::max()>::up,Next,Alloc>::
+          create(alloc, str, strLen);
+  node->addValue(alloc, std::move(valueToMove));
+  return node;
 }
 
+// Create a node that is already big enough for numChildren entries, for a
+// caller that knows how many it is going to add.
 template<typename T, template<u_char> class Next, class Alloc>
 inline _BaseNode<T,Next,Alloc>*
-_BaseNode<T,Next,Alloc>::createNode(NodeT* parent, const char* str,
-    size_t strLen, char parentIndex, T&& valueToMove)
+_BaseNode<T,Next,Alloc>::createSizedNode(
+    Alloc& alloc, const char* str, size_t strLen, size_t numChildren)
 {
-  return _CmprValueNode<T,Next<std::numeric_limits<u_char>::max()>::up,Next,
-         Alloc>::
-      create(parent, str, strLen, parentIndex, valueToMove);
+  return _NodeCreate<T,Next<std::numeric_limits<u_char>::max()>::up,Next,
+      Alloc>::create(alloc, str, strLen, numChildren);
 }
 
 template<typename T, template<u_char> class Next, class Alloc>
@@ -3,262 +3,189 @@
  
 namespace ctrie {
 
-template<typename T, u_char Sz, template<u_char Sz> class Next, class Alloc>
-class _CmprNode : public _BaseNode<T,Next,Alloc> {
+template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
+class _CmprNode : public _InnerNode<T,Next,Alloc> {
 public:
   typedef _BaseNode<T,Next,Alloc> NodeT;
+  typedef typename NodeT::SlotT SlotT;
   typedef _Leaf<T,Next,Alloc> LeafT;
   typedef _CmprNode<T,Sz,Next,Alloc> CmprNodeT;
+  typedef _IndexNode<T,Next,Alloc> IndexNodeT;
   typedef _FullNode<T,Next,Alloc> FullNodeT;
-  typedef _CmprValueNode<T,Sz,Next,Alloc> CmprValueNodeT;
-  typedef _FullValueNode<T,Next,Alloc> FullValueNodeT;
 
 private:
-  NodeT* mParent;
   u_char mNumChildren;
-  u_char mCharTable[Sz + 1];
-  NodeT* mChildren[Sz];
+  u_char mCharTable[Sz];
+  SlotT mChildren[Sz];
 
 public:
-  static _CmprNode*
-      create(NodeT* parent, const char* str, size_t strLen, char parentIndex);
+  static _CmprNode* create(Alloc& alloc, const char* str, size_t strLen);
   template<u_char SrcSz>
-    static _CmprNode* move(_CmprNode<T,SrcSz,Next,Alloc>& src);
-  static _CmprNode* move(CmprNodeT& x);
-  static _CmprNode* move(FullNodeT& x);
-  NodeT* moveAddValue(const T& valueToAdd) /*override*/;
-  NodeT* clone() const /*override*/;
-  void destroy() /*override*/;
+    static _CmprNode* move(Alloc& alloc, _CmprNode<T,SrcSz,Next,Alloc>& src);
+  static _CmprNode* move(Alloc& alloc, CmprNodeT& x);
+  static _CmprNode* move(Alloc& alloc, IndexNodeT& x);
+  static _CmprNode* move(Alloc& alloc, FullNodeT& x);
+  NodeT* clone(Alloc& alloc) const;
+  void destroy(Alloc& alloc);
+  void detachEntries()                               {mNumChildren = 0;}
   _CmprNode& operator=(const CmprNodeT&) = delete;
   _CmprNode& operator=(CmprNodeT&&) = delete;
 
-  bool empty() const /*override*/                {return mNumChildren == 0;}
-  size_t size() const /*override*/               {return mNumChildren;};
-  size_t treeSize() const /*override*/;
-  NodeT* parent() const /*override*/             {return mParent;}
-  void setParent(NodeT* parent)                  {mParent = parent;}
-  char parentIndex() const /*override*/          {return (char) mCharTable[Sz];}
-  void setParentIndex(char i) /*override*/       {mCharTable[Sz] = (u_char) i;}
-  char key(size_t i) /*override*/                {return (char) mCharTable[i];}
-
-  NodeT** getEntryPtr(size_t i) /*override*/     {return mChildren + i;}
-  NodeT* getEntry(size_t i) const /*override*/   {return mChildren[i];}
-  std::pair<size_t, bool> findEntry(char key) const /*override*/;
-  size_t insertEntry(NodeT* entry, size_t index, char key, NodeT** replacement)
-      /*override*/;
-  size_t eraseEntry(size_t index, NodeT** newNode) /*override*/;
-  size_t firstEntry() const /*override*/;
-  size_t lastEntry() const /*override*/          {return mNumChildren - 1;}
-  size_t nextEntry(size_t index) const /*override*/;
-  size_t prevEntry(size_t index) const /*override*/;
+  bool empty() const                             {return mNumChildren == 0;}
+  size_t size() const                            {return mNumChildren;};
+  size_t treeSize() const;
+  char key(size_t i)                             {return (char) mCharTable[i];}
+
+  SlotT* getEntryPtr(size_t i)                   {return mChildren + i;}
+  NodeT* getEntry(size_t i) const          {return _loadSlot(mChildren[i]);}
+  std::pair<size_t, bool> findEntry(char key) const;
+  size_t insertEntry(Alloc& alloc,
+      NodeT* entry, size_t index, char key, NodeT** replacement);
+  size_t eraseEntry(Alloc& alloc, size_t index, NodeT** newNode);
+  size_t firstEntry() const;
+  size_t lastEntry() const                       {return mNumChildren - 1;}
+  size_t nextEntry(size_t index) const;
+  size_t prevEntry(size_t index) const;
 
 protected:
-  _CmprNode(NodeT* parent, const char* str, size_t strLen, char parentIndex);
-  _CmprNode(const CmprNodeT& x);
+  _CmprNode(Alloc& alloc, const char* str, size_t strLen);
+  _CmprNode(Alloc& alloc, const CmprNodeT& x);
   _CmprNode(CmprNodeT&& x);
   template<u_char SrcSz>
     _CmprNode(_CmprNode<T,SrcSz,Next,Alloc>&& src);
+  _CmprNode(IndexNodeT&& x);
   _CmprNode(FullNodeT&& x);
-  ~_CmprNode();
+  ~_CmprNode()                                                             {}
 
 private:
-  static CmprNodeT* allocate();
+  static CmprNodeT* allocate(Alloc& alloc);
   void init();
+  std::pair<size_t, bool> findEntryVector(u_char ukey) const;
   template<u_char SrcSz>
     void moveChildren(_CmprNode<T,SrcSz,Next,Alloc>& x);
+  template<class SrcT>
+    void moveKeyedChildren(SrcT& src);
 
   friend class _CmprNode<T,2,Next,Alloc>;
   friend class _CmprNode<T,4,Next,Alloc>;
   friend class _CmprNode<T,8,Next,Alloc>;
   friend class _CmprNode<T,16,Next,Alloc>;
   friend class _CmprNode<T,32,Next,Alloc>;
-  friend class _CmprNode<T,std::numeric_limits<u_char>::max(),Next,Alloc>;
+  friend class _IndexNode<T,Next,Alloc>;
   friend class _FullNode<T,Next,Alloc>;
 };
 
-template<typename T, u_char Sz, template<u_char Sz> class Next, class Alloc>
-class _CmprValueNode : public _CmprNode<T,Sz,Next,Alloc> {
-private:
-  T mValue;
-
-public:
-  typedef _BaseNode<T,Next,Alloc> NodeT;
-  typedef _CmprNode<T,Sz,Next,Alloc> CmprNodeT;
-  typedef _CmprValueNode<T,Sz,Next,Alloc> ValueNodeT;
-
-  static ValueNodeT* create(NodeT* parent, const char* str, size_t strLen,
-      char parentIndex, const T& value);
-  static ValueNodeT* create(NodeT* parent, const char* str, size_t strLen,
-      char parentIndex, T&& value);
-  static ValueNodeT* move(_CmprNode<T,Sz,Next,Alloc>& x, const T& value);
-  template<u_char SrcSz>
-    static ValueNodeT* move(_CmprValueNode<T,SrcSz,Next,Alloc>& x);
-  static ValueNodeT* move(_FullValueNode<T,Next,Alloc>& x);
-
-  NodeT* clone() const /*override*/;
-  NodeT* moveRemoveValue() /*override*/        {return CmprNodeT::move(*this);}
-  void destroy() /*override*/;
-  _CmprValueNode(const ValueNodeT&&) = delete;
-  ValueNodeT& operator=(const ValueNodeT&) = delete;
-  ValueNodeT& operator=(const ValueNodeT&&) = delete;
-
-  bool hasValue() const /*override*/           {return true;}
-  T& value() /*override*/                      {return mValue;}
-  const T& value() const /*override*/          {return mValue;}
-  T&& valueToMove() /*override*/               {return std::move(mValue);}
-
-protected:
-  ~_CmprValueNode() {}
-
-private:
-  _CmprValueNode(NodeT* parent, const char* str, size_t strLen,
-      char parentIndex, const T& value);
-  _CmprValueNode(NodeT* parent, const char* str, size_t strLen,
-      char parentIndex, T&& value);
-  _CmprValueNode(CmprNodeT&& src, const T& value);
-  _CmprValueNode(const ValueNodeT& src);
-  _CmprValueNode(_FullValueNode<T,Next,Alloc>&& src);
-  template<u_char SrcSz>
-  _CmprValueNode(_CmprValueNode<T,SrcSz,Next,Alloc>&& src);
-
-  static ValueNodeT* allocate();
-};
-
 template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
 inline _CmprNode<T,Sz,Next,Alloc>::_CmprNode(
-    NodeT* parent, const char* str, size_t strLen, char parentIndex)
-  : _BaseNode<T,Next,Alloc>(str, strLen), mParent(parent), mNumChildren(0)
+    Alloc& alloc, const char* str, size_t strLen)
+  : _InnerNode<T,Next,Alloc>(alloc, str, strLen, Sz), mNumChildren(0)
 {
   init();
-  setParentIndex(parentIndex);
 }
 
 template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
-inline _CmprNode<T,Sz,Next,Alloc>::_CmprNode(const CmprNodeT& x)
-  : _BaseNode<T,Next,Alloc>(x), mParent(x.mParent), mNumChildren(x.mNumChildren)
+inline _CmprNode<T,Sz,Next,Alloc>::_CmprNode(Alloc& alloc, const CmprNodeT& x)
+  : _InnerNode<T,Next,Alloc>(alloc, x, Sz), mNumChildren(x.mNumChildren)
 {
   init();
   std::copy(x.mCharTable, x.mCharTable + x.mNumChildren, mCharTable);
   for (u_char i = 0; i < mNumChildren; ++i) {
-    mChildren[i] = x.mChildren[i]->clone();
-    if (dynamic_cast<LeafT*>(mChildren[i]) == 0) {
-      mChildren[i]->setParent(this);
-    }
+    mChildren[i] = NodeT::cloneEntry(alloc, x.mChildren[i]);
   }
-  setParentIndex(x.parentIndex());
 }
 
 template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
 _CmprNode<T,Sz,Next,Alloc>::_CmprNode(_CmprNode<T,Sz,Next,Alloc>&& src)
-  : _BaseNode<T,Next,Alloc>(src), mParent(0), mNumChildren(0)
+  : _InnerNode<T,Next,Alloc>(std::move(src), Sz), mNumChildren(0)
 {
   init();
   moveChildren(src);
-  std::swap(mParent, src.mParent);
   std::swap(mNumChildren, src.mNumChildren);
-  setParentIndex(src.parentIndex());
 }
 
 template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
 template<u_char SrcSz>
 _CmprNode<T,Sz,Next,Alloc>::_CmprNode(_CmprNode<T,SrcSz,Next,Alloc>&& src)
-  : _BaseNode<T,Next,Alloc>(src), mParent(0), mNumChildren(0)
+  : _InnerNode<T,Next,Alloc>(std::move(src), Sz), mNumChildren(0)
 {
   init();
   moveChildren(src);
-  std::swap(mParent, src.mParent);
   std::swap(mNumChildren, src.mNumChildren);
-  setParentIndex(src.parentIndex());
 }
 
 template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
-_CmprNode<T,Sz,Next,Alloc>::_CmprNode(FullNodeT&& src)
-  : _BaseNode<T,Next,Alloc>(std::move(src)), mParent(0), mNumChildren(0)
+_CmprNode<T,Sz,Next,Alloc>::_CmprNode(IndexNodeT&& src)
+  : _InnerNode<T,Next,Alloc>(std::move(src), Sz), mNumChildren(0)
 {
-  assert(src.mNumChildren <= Sz);
-  init();
-
-  size_t count = 0;
-  for (size_t i = 0;
-      i < FullNodeT::sMaxNumChildren && count <= src.mNumChildren; ++i) {
-    NodeT** node = src.getEntryPtr(i);
-    if (*node) {
-      mCharTable[count] = static_cast<u_char>(i);
-      mChildren[count] = *node;
-      if (dynamic_cast<LeafT*>(*node) == 0) {
-        (*node)->setParent(this);
-      }
-      *node = 0;
-      ++count;
-    }
-  }
-  assert(count == static_cast<size_t>(src.mNumChildren) + 1);
-  std::swap(mParent, src.mParent);
-  mNumChildren = static_cast<u_char>(src.mNumChildren + 1);
-  setParentIndex(src.parentIndex());
+  moveKeyedChildren(src);
+  src.clearEntries();
 }
 
 template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
-_CmprNode<T,Sz,Next,Alloc>::~_CmprNode()
+_CmprNode<T,Sz,Next,Alloc>::_CmprNode(FullNodeT&& src)
+  : _InnerNode<T,Next,Alloc>(std::move(src), Sz), mNumChildren(0)
 {
-  for (u_char i = 0; i < mNumChildren; ++i) {
-    mChildren[i]->destroy();
-    mChildren[i] = nullptr;
-  }
-  mNumChildren = 0;
+  moveKeyedChildren(src);
+  src.mBitmap.clear();
 }
 
 template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
 inline _CmprNode<T,Sz,Next,Alloc>*
 _CmprNode<T,Sz,Next,Alloc>::create(
-    NodeT* parent, const char* str, size_t strLen, char parentIndex)
+    Alloc& alloc, const char* str, size_t strLen)
 {
-  return new(allocate()) CmprNodeT(parent, str, strLen, parentIndex);
+  return new(allocate(alloc)) CmprNodeT(alloc, str, strLen);
 }
 
 template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
 template<u_char SrcSz>
 inline _CmprNode<T,Sz,Next,Alloc>*
-_CmprNode<T,Sz,Next,Alloc>::move(_CmprNode<T,SrcSz,Next,Alloc>& x)
+_CmprNode<T,Sz,Next,Alloc>::move(
+    Alloc& alloc, _CmprNode<T,SrcSz,Next,Alloc>& x)
 {
-  return new(allocate()) CmprNodeT(std::move(x));
+  return new(allocate(alloc)) CmprNodeT(std::move(x));
 }
 
 template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
 inline _CmprNode<T,Sz,Next,Alloc>*
-_CmprNode<T,Sz,Next,Alloc>::move(CmprNodeT& x)
+_CmprNode<T,Sz,Next,Alloc>::move(Alloc& alloc, CmprNodeT& x)
 {
-  return new(allocate()) CmprNodeT(std::move(x));
+  return new(allocate(alloc)) CmprNodeT(std::move(x));
 }
 
 template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
 inline _CmprNode<T,Sz,Next,Alloc>*
-_CmprNode<T,Sz,Next,Alloc>::move(FullNodeT& x)
+_CmprNode<T,Sz,Next,Alloc>::move(Alloc& alloc, IndexNodeT& x)
 {
-  return new(allocate()) CmprNodeT(std::move(x));
+  return new(allocate(alloc)) CmprNodeT(std::move(x));
 }
 
 template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
-inline _BaseNode<T,Next,Alloc>*
-_CmprNode<T,Sz,Next,Alloc>::moveAddValue(const T& valueToAdd)
+inline _CmprNode<T,Sz,Next,Alloc>*
+_CmprNode<T,Sz,Next,Alloc>::move(Alloc& alloc, FullNodeT& x)
 {
-  return CmprValueNodeT::move(*this, valueToAdd);
+  return new(allocate(alloc)) CmprNodeT(std::move(x));
 }
 
 template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
 inline _BaseNode<T,Next,Alloc>*
-_CmprNode<T,Sz,Next,Alloc>::clone() const
+_CmprNode<T,Sz,Next,Alloc>::clone(Alloc& alloc) const
 {
-  return new(allocate()) CmprNodeT(*this);
+  return new(allocate(alloc)) CmprNodeT(alloc, *this);
 }
 
 template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
 inline void
-_CmprNode<T,Sz,Next,Alloc>::destroy()
+_CmprNode<T,Sz,Next,Alloc>::destroy(Alloc& alloc)
 {
-  typename Alloc::template rebind<CmprNodeT>::other alloc;
+  for (u_char i = 0; i < mNumChildren; ++i) {
+    NodeT::destroyEntry(alloc, mChildren[i]);
+  }
+  this->destroyInner(alloc);
+  typename std::allocator_traits<Alloc>::template rebind_alloc<CmprNodeT>
+      nodeAlloc(alloc);
   this->~_CmprNode<T,Sz,Next,Alloc>();
-  alloc.deallocate(this, 1);
+  nodeAlloc.deallocate(this, 1);
 }
 
 template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
@@ -267,17 +194,18 @@ _CmprNode<T,Sz,Next,Alloc>::treeSize() const
 {
    size_t size = this->hasValue() ? 1 : 0;
    for (u_char i = 0; i < mNumChildren; ++i) {
-      size += mChildren[i]->treeSize();
+      size += NodeT::entryTreeSize(mChildren[i]);
    }
    return size;
 }
 
 template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
 inline _CmprNode<T,Sz,Next,Alloc>*
-_CmprNode<T,Sz,Next,Alloc>::allocate()
+_CmprNode<T,Sz,Next,Alloc>::allocate(Alloc& alloc)
 {
-  typename Alloc::template rebind<CmprNodeT>::other alloc;
-  return alloc.allocate(1);
+  typename std::allocator_traits<Alloc>::template rebind_alloc<CmprNodeT>
+      nodeAlloc(alloc);
+  return nodeAlloc.allocate(1);
 }
 
 template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
@@ -285,6 +213,11 @@ std::pair<size_t, bool>
 _CmprNode<T,Sz,Next,Alloc>::findEntry(char key) const
 {
   u_char ukey = static_cast<u_char>(key);
+#if defined(__SSE2__)
+  if (Sz >= 8 && Sz <= 32) {
+    return findEntryVector(ukey);
+  }
+#endif
   if (mNumChildren <= 4) {
     // For small sizes, it is faster to just compare each one.
     if (mNumChildren == 0) {
@@ -341,15 +274,52 @@ _CmprNode<T,Sz,Next,Alloc>::findEntry(char key) const
   }
 }
 
+// Search the whole character table at once with byte compares.  Since the
+// table is sorted, the lowest table entry that is >= the key is the index we
+// want, and the key is found if that entry is also equal to the key.
+template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
+inline std::pair<size_t, bool>
+_CmprNode<T,Sz,Next,Alloc>::findEntryVector(u_char ukey) const
+{
+  uint64_t geMask = 0;
+  uint64_t eqMask = 0;
+#if defined(__SSE2__)
+#if defined(__AVX2__)
+  if (Sz == 32) {
+    __m256i k = _mm256_set1_epi8(static_cast<char>(ukey));
+    __m256i t = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i*>(mCharTable));
+    geMask = static_cast<uint32_t>(
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(t, k), t)));
+    eqMask = static_cast<uint32_t>(
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(t, k)));
+  } else
+#endif
+  {
+    __m128i k = _mm_set1_epi8(static_cast<char>(ukey));
+    for (size_t offset = 0; offset < Sz; offset += 16) {
+      const __m128i* p = reinterpret_cast<const __m128i*>(mCharTable + offset);
+      __m128i t = Sz <= 8 ? _mm_loadl_epi64(p) : _mm_loadu_si128(p);
+      geMask |= static_cast<uint64_t>(static_cast<uint32_t>(
+          _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(t, k), t)))) << offset;
+      eqMask |= static_cast<uint64_t>(static_cast<uint32_t>(
+          _mm_movemask_epi8(_mm_cmpeq_epi8(t, k)))) << offset;
+    }
+  }
+#endif
+  geMask &= (static_cast<uint64_t>(1) << mNumChildren) - 1;
+  if (geMask == 0) {
+    return std::make_pair(NodeT::endIndex(), false);
+  }
+  size_t index = static_cast<size_t>(__builtin_ctzll(geMask));
+  return std::make_pair(index, ((eqMask >> index) & 1) != 0);
+}
+
 template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
 size_t
-_CmprNode<T,Sz,Next,Alloc>::insertEntry(
+_CmprNode<T,Sz,Next,Alloc>::insertEntry(Alloc& alloc,
     NodeT* entry, size_t index, char key, NodeT** replacement)
 {
-  if (dynamic_cast<LeafT*>(entry) == 0) {
-    entry->setParent(this);
-    entry->setParentIndex(key);
-  }
   if (mNumChildren != Sz) {
     // Make room for the new entry in the compressed array
     if (index == NodeT::endIndex()) {
@@ -358,44 +328,29 @@ _CmprNode<T,Sz,Next,Alloc>::insertEntry(
       memmove(mCharTable + index + 1, mCharTable + index,
           (mNumChildren - index) * sizeof(char));
       memmove(mChildren + index + 1, mChildren + index,
-          (mNumChildren - index) * sizeof(void*));
+          (mNumChildren - index) * sizeof(SlotT));
     }
     mCharTable[index] = key;
-    mChildren[index] = entry;
+    mChildren[index] = NodeT::makeEntry(entry);
     ++mNumChildren;
     return index;
   }
 
   // This node has run out of room, so we need to replace this node with the
-  // next size up.
+  // next size up.  The next size may index its entries differently, so look
+  // up where the key goes in the new node.
+  typedef _NodeSize<T,Next<Sz>::up,Next,Alloc> UpT;
   assert(replacement != nullptr);
-  if (Next<Sz>::up == std::numeric_limits<u_char>::max()) {
-    // Create an uncompressed node before inserting
-    CmprValueNodeT *nodeWithValue = dynamic_cast<CmprValueNodeT*>(this);
-    if (nodeWithValue) {
-      *replacement = FullValueNodeT::move(*nodeWithValue);
-    } else {
-      *replacement = FullNodeT::move(*this);
-    }
-    this->destroy();
-    return (*replacement)->insertEntry(
-        entry, static_cast<size_t>(key), key, replacement);
-  } else {
-    CmprValueNodeT *nodeWithValue = dynamic_cast<CmprValueNodeT*>(this);
-    if (this->hasValue()) {
-      *replacement =
-          _CmprValueNode<T,Next<Sz>::up,Next,Alloc>::move(*nodeWithValue);
-    } else {
-      *replacement = _CmprNode<T,Next<Sz>::up,Next,Alloc>::move(*this);
-    }
-    this->destroy();
-    return (*replacement)->insertEntry(entry, index, key, replacement);
-  }
+  *replacement = UpT::Type::move(alloc, *this);
+  destroy(alloc);
+  index = (*replacement)->findEntry(key).first;
+  return (*replacement)->insertEntry(alloc, entry, index, key, replacement);
 }
 
 template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
 size_t
-_CmprNode<T,Sz,Next,Alloc>::eraseEntry(size_t index, NodeT** newNode)
+_CmprNode<T,Sz,Next,Alloc>::eraseEntry(
+    Alloc& alloc, size_t index, NodeT** newNode)
 {
   assert(mNumChildren != 0);
   *newNode = this;
@@ -408,17 +363,14 @@ _CmprNode<T,Sz,Next,Alloc>::eraseEntry(size_t index, NodeT** newNode)
     memmove(mCharTable + index, mCharTable + index + 1,
             (mNumChildren - index) * sizeof(char));
     memmove(mChildren + index, mChildren + index + 1,
-            (mNumChildren - index) * sizeof(void*));
+            (mNumChildren - index) * sizeof(SlotT));
   }
 
-  if (mNumChildren <= Next<Sz>::downThreshold) {
-    CmprValueNodeT *nodeWithValue = dynamic_cast<CmprValueNodeT*>(this);
-    if (nodeWithValue) {
-      *newNode =
-          _CmprValueNode<T,Next<Sz>::down,Next,Alloc>::move(*nodeWithValue);
-    } else {
-      *newNode = _CmprNode<T,Next<Sz>::down,Next,Alloc>::move(*this);
-    }
+  // The smallest size has no size below it, and just becomes empty.
+  typedef _NodeSize<T,Next<Sz>::down,Next,Alloc> DownT;
+  if (Next<Sz>::down != std::numeric_limits<u_char>::max() &&
+      mNumChildren <= Next<Sz>::downThreshold) {
+    *newNode = DownT::Type::move(alloc, *this);
   }
   return nextIndex;
 }
@@ -470,120 +422,28 @@ _CmprNode<T,Sz,Next,Alloc>::moveChildren(_CmprNode<T,SrcSz,Next,Alloc>& src)
   std::swap_ranges(
       src.mCharTable, src.mCharTable + src.mNumChildren, mCharTable);
   std::swap_ranges(src.mChildren, src.mChildren + src.mNumChildren, mChildren);
-  for (NodeT* child : mChildren) {
-    if (child && dynamic_cast<LeafT*>(child) == 0) {
-      child->setParent(this);
-    }
-  }
-}
-
-template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
-inline
-_CmprValueNode<T,Sz,Next,Alloc>::_CmprValueNode(NodeT* parent, const char* str,
-    size_t strLen, char parentIndex, const T& value)
-  : _CmprNode<T,Sz,Next,Alloc>(parent, str, strLen, parentIndex), mValue(value)
-{}
-
-template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
-inline
-_CmprValueNode<T,Sz,Next,Alloc>::_CmprValueNode(NodeT* parent, const char* str,
-    size_t strLen, char parentIndex, T&& value)
-  : _CmprNode<T,Sz,Next,Alloc>(parent, str, strLen, parentIndex),
-    mValue(std::move(value))
-{}
-
-template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
-inline
-_CmprValueNode<T,Sz,Next,Alloc>::_CmprValueNode(CmprNodeT&& src, const T& value)
-  : _CmprNode<T,Sz,Next,Alloc>(std::move(src)),
-    mValue(value)
-{}
-
-template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
-inline
-_CmprValueNode<T,Sz,Next,Alloc>::_CmprValueNode(const ValueNodeT& src)
-  : _CmprNode<T,Sz,Next,Alloc>(src),
-    mValue(src.value())
-{}
-
-template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
-inline
-_CmprValueNode<T,Sz,Next,Alloc>::_CmprValueNode(
-    _FullValueNode<T,Next,Alloc>&& src)
-  : _CmprNode<T,Sz,Next,Alloc>(std::move(src)),
-    mValue(src.valueToMove())
-{}
-
-template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
-template<u_char SrcSz>
-inline
-_CmprValueNode<T,Sz,Next,Alloc>::_CmprValueNode(
-    _CmprValueNode<T,SrcSz,Next,Alloc>&& src)
-  : _CmprNode<T,Sz,Next,Alloc>(std::move(src)),
-    mValue(src.valueToMove())
-{}
-
-template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
-inline _CmprValueNode<T,Sz,Next,Alloc>*
-_CmprValueNode<T,Sz,Next,Alloc>::create(NodeT* parent, const char* str,
-    size_t strLen, char parentIndex, const T& value)
-{
-  return new(allocate()) ValueNodeT(parent, str, strLen, parentIndex, value);
-}
-
-template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
-inline _CmprValueNode<T,Sz,Next,Alloc>*
-_CmprValueNode<T,Sz,Next,Alloc>::create(NodeT* parent, const char* str,
-    size_t strLen, char parentIndex, T&& value)
-{
-  return new(allocate()) ValueNodeT(parent, str, strLen, parentIndex, value);
-}
-
-template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
-inline _CmprValueNode<T,Sz,Next,Alloc>*
-_CmprValueNode<T,Sz,Next,Alloc>::move(
-    _CmprNode<T,Sz,Next,Alloc>& x, const T& value)
-{
-  return new(allocate()) ValueNodeT(std::move(x), value);
-}
-
-template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
-template<u_char SrcSz>
-inline _CmprValueNode<T,Sz,Next,Alloc>*
-_CmprValueNode<T,Sz,Next,Alloc>::move(_CmprValueNode<T,SrcSz,Next,Alloc>& x)
-{
-  return new(allocate()) ValueNodeT(std::move(x));
-}
-
-template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
-inline _CmprValueNode<T,Sz,Next,Alloc>*
-_CmprValueNode<T,Sz,Next,Alloc>::move(_FullValueNode<T,Next,Alloc>& x)
-{
-  return new(allocate()) ValueNodeT(std::move(x));
-}
-
-template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
-inline _BaseNode<T,Next,Alloc>*
-_CmprValueNode<T,Sz,Next,Alloc>::clone() const
-{
-  return new(allocate()) ValueNodeT(*this);
-}
-
-template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
-inline _CmprValueNode<T,Sz,Next,Alloc>*
-_CmprValueNode<T,Sz,Next,Alloc>::allocate()
-{
-  typename Alloc::template rebind<ValueNodeT>::other alloc;
-  return alloc.allocate(1);
 }
 
+// Move the children of a node that is indexed by key (an _IndexNode or a
+// _FullNode) into this node's table, in key order.
 template<typename T, u_char Sz, template<u_char> class Next, class Alloc>
+template<class SrcT>
 inline void
-_CmprValueNode<T,Sz,Next,Alloc>::destroy()
+_CmprNode<T,Sz,Next,Alloc>::moveKeyedChildren(SrcT& src)
 {
-  typename Alloc::template rebind<ValueNodeT>::other alloc;
-  this->~_CmprValueNode<T,Sz,Next,Alloc>();
-  alloc.deallocate(this, 1);
+  assert(src.size() <= Sz);
+  init();
+
+  size_t count = 0;
+  for (size_t i = src.firstEntry(); i != NodeT::endIndex();
+      i = src.nextEntry(i)) {
+    SlotT* node = src.getEntryPtr(i);
+    mCharTable[count] = static_cast<u_char>(i);
+    mChildren[count] = *node;
+    *node = 0;
+    ++count;
+  }
+  mNumChildren = static_cast<u_char>(count);
 }
 
 } // end namespace ctrie
@@ -0,0 +1,348 @@
+#ifndef _CTRIE_COMPACT_H
+#define _CTRIE_COMPACT_H
+ 
+namespace ctrie {
+
+// Lists of freed blocks by size, for an allocator that carves its blocks out
+// of memory of its own.  A block of up to sMaxBlockSize bytes goes on the list
+// for its size, as in _SlabPool, and is reused by the next request of that
+// size.  Larger blocks, which only leaves with long suffixes need, share one
+// list that is searched for a block of the same size.
+class _FreeLists {
+public:
+  static const size_t sGranule = 8;
+  static const size_t sMaxBlockSize = 4096;
+  static const size_t sNumClasses = sMaxBlockSize / sGranule;
+
+private:
+  struct LargeBlock {
+    LargeBlock* next;
+    size_t size;
+  };
+
+  void* mFree[sNumClasses];
+  LargeBlock* mLarge;
+
+public:
+  _FreeLists();
+
+  // The sizes given to pop() and push() must be rounded up with roundUp().
+  static size_t roundUp(size_t bytes)
+                              {return (bytes + sGranule - 1) & ~(sGranule - 1);}
+  void* pop(size_t size);
+  void push(void* p, size_t size);
+};
+
+// A region of address space that holds all of the memory of one trie, so
+// that a node can refer to its children by their 32-bit offsets from the
+// start of the region rather than by pointers.  The whole region is reserved
+// up front, aligned on its own size so that its start can be found by masking
+// the address of anything in it, and its pages are committed as they are
+// first handed out.  The _Region itself lives at the start of the region, so
+// no block has the offset 0.
+class _Region {
+public:
+  static const uint64_t sRegionSize = static_cast<uint64_t>(1) << 32;
+  static const size_t sCommitSize = 1024 * 1024;
+
+  static_assert(sizeof(void*) == 8,
+                "A _Region needs 64-bit pointers to be worth having");
+
+private:
+  char* mNext;                // The start of the never used part
+  char* mCommitted;           // The end of the committed pages
+  _FreeLists mFreeLists;
+  size_t mRefs;
+
+public:
+  static _Region* create();
+  void ref()                                                      {++mRefs;}
+  void unref();
+
+  void* allocate(size_t bytes);
+  void deallocate(void* p, size_t bytes)
+                            {mFreeLists.push(p, _FreeLists::roundUp(bytes));}
+  size_t bytesCommitted() const
+                   {return static_cast<size_t>(mCommitted - base(this));}
+
+  static char* base(const void* p)
+  {
+    return reinterpret_cast<char*>(reinterpret_cast<uintptr_t>(p) &
+        ~static_cast<uintptr_t>(sRegionSize - 1));
+  }
+
+private:
+  _Region();
+  _Region(const _Region&) = delete;
+  _Region& operator=(const _Region&) = delete;
+  ~_Region()                                                               {}
+
+  void* allocateNew(size_t size);
+  static void commit(char* start, size_t len);
+};
+
+// An entry slot that holds the offset of the entry from the start of the
+// _Region that holds the slot.  A slot finds its region from its own address,
+// so it may only be read in a node of the same region as the entry.  Its bits
+// may be copied around freely, as memmove and std::swap do, as long as they
+// are read back in that region.
+template<class NodeT>
+class _CompactSlot {
+private:
+  uint32_t mOffset;
+
+public:
+  _CompactSlot& operator=(NodeT* entry);
+  operator NodeT*() const;
+  NodeT* operator->() const                 {return static_cast<NodeT*>(*this);}
+
+  // Read and write the offset as an atomic (see _loadSlot()).
+  NodeT* load() const;
+  void store(NodeT* entry);
+};
+
+template<class NodeT>
+inline NodeT*
+_loadSlot(const _CompactSlot<NodeT>& slot)
+{
+  return slot.load();
+}
+
+template<class NodeT>
+inline void
+_storeSlot(_CompactSlot<NodeT>& slot, NodeT* entry)
+{
+  slot.store(entry);
+}
+
+// An allocator that can be given to CTrie as its Alloc, which puts all of the
+// trie's memory in a _Region of its own, so that inner nodes store their
+// children as 32-bit offsets.  That halves the child tables: a _FullNode
+// drops from over 2KB to about 1KB, and a _CmprNode<32> from 256 bytes of
+// pointers to 128.  Since the children are not pointers, the tables do not
+// change if the region is mapped somewhere else.
+//
+// A trie's memory is limited to the 4GB of its region.  A copy of the trie
+// gets a region of its own, and a trie that is moved or swapped takes its
+// region with it.
+template<class T>
+class CompactAllocator {
+private:
+  _Region* mRegion;
+
+  template<class U> friend class CompactAllocator;
+
+public:
+  typedef T value_type;
+  typedef T* pointer;
+  typedef const T* const_pointer;
+  typedef T& reference;
+  typedef const T& const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+
+  static_assert(alignof(T) <= _FreeLists::sGranule,
+                "A _Region does not align blocks beyond its granule");
+
+  template<class U> struct rebind {typedef CompactAllocator<U> other;};
+
+  CompactAllocator() : mRegion(_Region::create())                          {}
+  CompactAllocator(const CompactAllocator& x)
+    : mRegion(x.mRegion)                                    {mRegion->ref();}
+  template<class U> CompactAllocator(const CompactAllocator<U>& x)
+    : mRegion(x.mRegion)                                    {mRegion->ref();}
+  CompactAllocator& operator=(const CompactAllocator& x);
+  ~CompactAllocator()                                     {mRegion->unref();}
+
+  CompactAllocator select_on_container_copy_construction() const
+                                                  {return CompactAllocator();}
+
+  T* allocate(size_t n)
+                {return static_cast<T*>(mRegion->allocate(n * sizeof(T)));}
+  void deallocate(T* p, size_t n)
+                                {mRegion->deallocate(p, n * sizeof(T));}
+  size_t max_size() const
+                    {return std::numeric_limits<size_t>::max() / sizeof(T);}
+
+  template<class U, class... Args> void construct(U* p, Args&&... args)
+               {::new(static_cast<void*>(p)) U(std::forward<Args>(args)...);}
+  template<class U> void destroy(U* p)                               {p->~U();}
+
+  size_t bytesCommitted() const             {return mRegion->bytesCommitted();}
+
+  template<class U> bool operator==(const CompactAllocator<U>& x) const
+                                               {return mRegion == x.mRegion;}
+  template<class U> bool operator!=(const CompactAllocator<U>& x) const
+                                               {return mRegion != x.mRegion;}
+};
+
+template<class NodeT, class T>
+struct _EntrySlot<NodeT,CompactAllocator<T> > {
+  typedef _CompactSlot<NodeT> Type;
+};
+
+inline
+_FreeLists::_FreeLists()
+  : mLarge(nullptr)
+{
+  std::fill(mFree, mFree + sNumClasses, nullptr);
+}
+
+inline void*
+_FreeLists::pop(size_t size)
+{
+  if (size <= sMaxBlockSize) {
+    void*& head = mFree[size / sGranule - 1];
+    void* block = head;
+    if (block) {
+      head = *static_cast<void**>(block);
+    }
+    return block;
+  }
+  for (LargeBlock** p = &mLarge; *p; p = &(*p)->next) {
+    if ((*p)->size == size) {
+      LargeBlock* block = *p;
+      *p = block->next;
+      return block;
+    }
+  }
+  return nullptr;
+}
+
+inline void
+_FreeLists::push(void* p, size_t size)
+{
+  if (size <= sMaxBlockSize) {
+    void*& head = mFree[size / sGranule - 1];
+    *static_cast<void**>(p) = head;
+    head = p;
+  } else {
+    LargeBlock* block = static_cast<LargeBlock*>(p);
+    block->next = mLarge;
+    block->size = size;
+    mLarge = block;
+  }
+}
+
+// Reserve twice the region size, so that an aligned region fits somewhere in
+// it, and give back the rest.
+inline _Region*
+_Region::create()
+{
+  size_t len = static_cast<size_t>(2 * sRegionSize);
+  void* mem = mmap(nullptr, len, PROT_NONE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mem == MAP_FAILED) {
+    throw std::bad_alloc();
+  }
+  char* start = static_cast<char*>(mem);
+  char* region = base(start + sRegionSize - 1);
+  if (region != start) {
+    munmap(start, static_cast<size_t>(region - start));
+  }
+  char* end = region + sRegionSize;
+  if (end != start + len) {
+    munmap(end, static_cast<size_t>(start + len - end));
+  }
+
+  commit(region, sCommitSize);
+  return new(region) _Region();
+}
+
+inline
+_Region::_Region()
+  : mNext(reinterpret_cast<char*>(this) +
+        _FreeLists::roundUp(sizeof(_Region))),
+    mCommitted(reinterpret_cast<char*>(this) + sCommitSize), mRefs(1) {}
+
+inline void
+_Region::unref()
+{
+  if (--mRefs == 0) {
+    this->~_Region();
+    munmap(this, static_cast<size_t>(sRegionSize));
+  }
+}
+
+inline void*
+_Region::allocate(size_t bytes)
+{
+  size_t size = _FreeLists::roundUp(bytes);
+  void* block = mFreeLists.pop(size);
+  return block ? block : allocateNew(size);
+}
+
+inline void*
+_Region::allocateNew(size_t size)
+{
+  char* end = base(this) + sRegionSize;
+  if (size > static_cast<size_t>(end - mNext)) {
+    throw std::bad_alloc();
+  }
+  if (mNext + size > mCommitted) {
+    size_t len = static_cast<size_t>(mNext + size - mCommitted);
+    len = (len + sCommitSize - 1) / sCommitSize * sCommitSize;
+    commit(mCommitted, len);
+    mCommitted += len;
+  }
+  void* block = mNext;
+  mNext += size;
+  return block;
+}
+
+inline void
+_Region::commit(char* start, size_t len)
+{
+  if (mprotect(start, len, PROT_READ | PROT_WRITE) != 0) {
+    throw std::bad_alloc();
+  }
+}
+
+template<class NodeT>
+inline _CompactSlot<NodeT>&
+_CompactSlot<NodeT>::operator=(NodeT* entry)
+{
+  mOffset = entry ? static_cast<uint32_t>(
+      reinterpret_cast<char*>(entry) - _Region::base(this)) : 0;
+  return *this;
+}
+
+template<class NodeT>
+inline _CompactSlot<NodeT>::operator NodeT*() const
+{
+  return mOffset ?
+      reinterpret_cast<NodeT*>(_Region::base(this) + mOffset) : nullptr;
+}
+
+template<class NodeT>
+inline NodeT*
+_CompactSlot<NodeT>::load() const
+{
+  uint32_t offset = __atomic_load_n(&mOffset, __ATOMIC_CONSUME);
+  return offset ?
+      reinterpret_cast<NodeT*>(_Region::base(this) + offset) : nullptr;
+}
+
+template<class NodeT>
+inline void
+_CompactSlot<NodeT>::store(NodeT* entry)
+{
+  uint32_t offset = entry ? static_cast<uint32_t>(
+      reinterpret_cast<char*>(entry) - _Region::base(this)) : 0;
+  __atomic_store_n(&mOffset, offset, __ATOMIC_RELEASE);
+}
+
+template<class T>
+inline CompactAllocator<T>&
+CompactAllocator<T>::operator=(const CompactAllocator& x)
+{
+  x.mRegion->ref();
+  mRegion->unref();
+  mRegion = x.mRegion;
+  return *this;
+}
+
+} // end namespace ctrie
+#endif
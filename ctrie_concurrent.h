@@ -0,0 +1,735 @@
+#ifndef _CTRIE_CONCURRENT_H
+#define _CTRIE_CONCURRENT_H
+ 
+namespace ctrie {
+
+// Epoch-based reclamation for a ConcurrentCTrie.  A reader announces the
+// global epoch in a slot of its own for as long as it may hold pointers into
+// the trie.  A writer tags each node it unlinks with the epoch it was
+// unlinked in, and moves the epoch on.  A node can be freed once every reader
+// that is still reading started in a later epoch, since such a reader can
+// only have found the trie without it.
+//
+// The slots come in blocks of sNumSlots.  When every slot is taken, a reader
+// adds a block, so any number of threads may read at once.  Blocks are only
+// freed with the _Epochs.
+class _Epochs {
+public:
+  static const size_t sNumSlots = 64;
+
+  // Each slot has a cache line of its own, so that readers entering and
+  // leaving do not contend.
+  struct Slot {
+    std::atomic<uint64_t> epoch;      // 0 when not in use
+    char pad[64 - sizeof(std::atomic<uint64_t>)];
+  };
+
+private:
+  struct Block {
+    Slot slots[sNumSlots];
+    std::atomic<Block*> next;
+
+    Block();
+  };
+
+  std::atomic<uint64_t> mEpoch;
+  Block mFirst;
+
+public:
+  _Epochs() : mEpoch(1) {}
+  _Epochs(const _Epochs&) = delete;
+  _Epochs& operator=(const _Epochs&) = delete;
+  ~_Epochs();
+
+  Slot* enter();
+  void exit(Slot* slot)                            {slot->epoch.store(0);}
+  uint64_t advance()                               {return mEpoch++;}
+  uint64_t oldestReader() const;
+};
+
+// The node locks that a writer holds, which are all released together.
+class _HeldLocks {
+private:
+  std::vector<_NodeLock*> mLocks;
+
+public:
+  _HeldLocks() {}
+  _HeldLocks(const _HeldLocks&) = delete;
+  _HeldLocks& operator=(const _HeldLocks&) = delete;
+  ~_HeldLocks()                                                {release();}
+
+  bool add(_NodeLock& lock);
+  void release();
+};
+
+// A trie that can be read and changed by any number of threads at once.  The
+// readers take no locks: a reader only pins the current epoch, and walks the
+// nodes as the writers left them.
+//
+// A writer never changes a node that a reader can reach.  To change a node,
+// it makes a copy that shares the node's children (see cloneShell()),
+// changes the copy, and then stores the copy in the parent's entry, or at the
+// top, with a release store.  The old node, and any leaf that was replaced,
+// are retired, and freed once no reader can still be walking them.  A reader
+// thus sees each node either before or after a change, never half-way.  It
+// reads each entry and the top with a consume load (see _loadSlot()), and
+// relies on the address dependency from each entry to the node it refers to,
+// as in RCU.
+//
+// Each change copies one node, and a removal that empties nodes also copies
+// their parents.  Writers lock the nodes they copy, and the parent they store
+// the copy in, with the lock in each inner node, so writers in different parts
+// of the trie do not wait for each other.  A copied node is marked obsolete,
+// so a writer that found it before it was replaced fails to lock it and
+// starts again.  Since a reachable node never changes, readers do not need to
+// check the locks.  Values are handed out const, since a reader may be
+// reading a value that a writer is replacing.
+template<typename T,
+    template<u_char Sz> class Next = Medium,
+    class Alloc = std::allocator<T> >
+class ConcurrentCTrie {
+private:
+  typedef CTrie<T,Next,Alloc> TrieT;
+  typedef _BaseNode<T,Next,Alloc> NodeT;
+  typedef _Leaf<T,Next,Alloc> LeafT;
+  typedef _NodePath<T,Next,Alloc> PathT;
+
+  // A node that has been unlinked from the trie, and the epoch it was
+  // unlinked in.  A shell is an inner node whose entries now belong to the
+  // copy that replaced it.
+  struct Retired {
+    NodeT* node;
+    bool shell;
+    uint64_t epoch;
+  };
+
+  // Nodes that writers have retired, and that freeRetired() has not yet
+  // taken in.  A writer adds to the list that its thread's id picks, so
+  // writers seldom wait for each other to retire nodes.
+  struct RetireList {
+    std::mutex mutex;
+    std::vector<Retired> retired;
+  };
+
+  static const size_t sReclaimBatch = 64;
+  static const size_t sNumRetireLists = 16;
+
+  TrieT mTrie;
+  std::atomic<size_t> mSize;
+  _NodeLock mTopLock;                 // Guards mTrie.mTop
+  std::mutex mWriteMutex;             // For an Alloc that is not thread-safe
+  RetireList mRetireLists[sNumRetireLists];
+  std::mutex mRetireMutex;            // Guards mRetired
+  std::vector<Retired> mRetired;
+  mutable _Epochs mEpochs;
+
+public:
+  typedef typename TrieT::key_type key_type;
+  typedef T value_type;
+  typedef size_t size_type;
+  typedef typename TrieT::const_iterator const_iterator;
+  typedef typename TrieT::const_prefix_iter const_prefix_iter;
+
+  // A reader pins the trie's nodes for as long as it lives, so the pointers
+  // and iterators it returns stay valid until it is destroyed.  The trie may
+  // change in the meantime, and an iterator may or may not see a change made
+  // after it was created.  Iterators must be checked with at_end(), since
+  // the trie's end() moves as the trie changes.
+  class reader {
+  private:
+    const ConcurrentCTrie& mTrie;
+    _Epochs::Slot* mSlot;
+
+  public:
+    explicit reader(const ConcurrentCTrie& trie)
+      : mTrie(trie), mSlot(trie.mEpochs.enter()) {}
+    reader(const reader&) = delete;
+    reader& operator=(const reader&) = delete;
+    ~reader()                                 {mTrie.mEpochs.exit(mSlot);}
+
+    const T* find(const key_type& key) const
+                                    {return find(key.data(), key.length());}
+    const T* find(const char* keyData, size_t keyLen = key_type::npos) const;
+    const_iterator begin() const                {return mTrie.mTrie.begin();}
+    const_iterator lower_bound(const key_type& key) const
+                                         {return mTrie.mTrie.lower_bound(key);}
+    const_prefix_iter prefix_begin(const key_type& prefix) const
+                                      {return mTrie.mTrie.prefix_begin(prefix);}
+  };
+
+  ConcurrentCTrie() : mSize(0) {}
+  explicit ConcurrentCTrie(const Alloc& alloc) : mTrie(alloc), mSize(0) {}
+  ConcurrentCTrie(const ConcurrentCTrie&) = delete;
+  ConcurrentCTrie& operator=(const ConcurrentCTrie&) = delete;
+  ~ConcurrentCTrie();
+
+  size_t size() const                                  {return mSize.load();}
+  bool empty() const                                    {return size() == 0;}
+
+  bool insert(const key_type& key, const T& value)
+                            {return insert(key.data(), key.length(), value);}
+  bool insert(const char* keyData, size_t keyLen, const T& value);
+  size_t erase(const key_type& key)     {return erase(key.data(), key.size());}
+  size_t erase(const char* keyData, size_t keyLen = key_type::npos);
+  void clear();
+
+  // Free the retired nodes that no reader can reach any more.  The writers
+  // do this as nodes pile up, so this is only needed to give memory back
+  // sooner.
+  void reclaim();
+
+private:
+  NodeT* top() const                                {return mTrie.loadTop();}
+  static _NodeLock& nodeLock(NodeT* node)
+          {return static_cast<typename NodeT::InnerNodeT*>(node)->lock();}
+  _NodeLock& parentLock(const PathT& path);
+  NodeT* linkedEntry(const PathT& path) const;
+  bool tryInsert(const char* keyData, size_t keyLen, const T& value,
+      bool& inserted);
+  bool tryErase(const char* keyData, size_t keyLen, size_t& erased);
+  void publish(const PathT& path, NodeT* entry);
+  void lockSubtree(_HeldLocks& locks, NodeT* node);
+  void retire(std::vector<Retired>& retired, NodeT* node, bool shell);
+  void endChange(std::vector<Retired>& retired);
+  void freeRetired();
+  void freeNode(const Retired& retired);
+  NodeT* eraseCopyEntry(NodeT* copy, char key);
+};
+
+inline
+_Epochs::Block::Block()
+  : next(nullptr)
+{
+  for (size_t i = 0; i < sNumSlots; ++i) {
+    slots[i].epoch.store(0);
+  }
+}
+
+inline
+_Epochs::~_Epochs()
+{
+  Block* block = mFirst.next.load();
+  while (block) {
+    Block* next = block->next.load();
+    delete block;
+    block = next;
+  }
+}
+
+// Claim a free slot for the calling thread, starting in each block from one
+// picked by the thread's id so that threads tend to keep to different slots,
+// and announce the current epoch in it.  If every slot is taken, claim one in
+// a new block before linking the block in after the first, so that a writer
+// that misses the block can only have looked before the reader started.
+inline _Epochs::Slot*
+_Epochs::enter()
+{
+  size_t start = std::hash<std::thread::id>()(std::this_thread::get_id()) %
+      sNumSlots;
+  for (Block* block = &mFirst; block; block = block->next.load()) {
+    for (size_t i = 0; i < sNumSlots; ++i) {
+      Slot& slot = block->slots[(start + i) % sNumSlots];
+      uint64_t free = 0;
+      if (slot.epoch.compare_exchange_strong(free, mEpoch.load())) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return &slot;
+      }
+    }
+  }
+
+  Block* block = new Block();
+  Slot& slot = block->slots[start];
+  slot.epoch.store(mEpoch.load());
+  Block* next = mFirst.next.load();
+  do {
+    block->next.store(next);
+  } while (!mFirst.next.compare_exchange_weak(next, block));
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  return &slot;
+}
+
+// Return the oldest epoch that a reader is in, or the current epoch if no
+// reader is.
+inline uint64_t
+_Epochs::oldestReader() const
+{
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  uint64_t oldest = mEpoch.load();
+  for (const Block* block = &mFirst; block; block = block->next.load()) {
+    for (size_t i = 0; i < sNumSlots; ++i) {
+      uint64_t epoch = block->slots[i].epoch.load();
+      if (epoch && epoch < oldest) {
+        oldest = epoch;
+      }
+    }
+  }
+  return oldest;
+}
+
+// Take the lock if it is free and the node is not obsolete.
+inline bool
+_HeldLocks::add(_NodeLock& lock)
+{
+  if (!lock.tryLock()) {
+    return false;
+  }
+  mLocks.push_back(&lock);
+  return true;
+}
+
+inline void
+_HeldLocks::release()
+{
+  for (size_t i = 0; i < mLocks.size(); ++i) {
+    mLocks[i]->unlock();
+  }
+  mLocks.clear();
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+const T*
+ConcurrentCTrie<T,Next,Alloc>::reader::find(const char* keyData,
+    size_t keyLen) const
+{
+  NodeT* node = mTrie.top();
+  if (!node) {
+    return nullptr;
+  }
+  if (keyLen == key_type::npos) {
+    keyLen = strlen(keyData);
+  }
+  typename NodeT::FindRtn result = node->find(keyData, keyLen);
+  if (result.cmpValue != 0) {
+    return nullptr;
+  }
+  if (result.index == NodeT::valueIndex()) {
+    return &result.node->value();
+  }
+  return &NodeT::entryLeaf(result.node->getEntry(result.index))->value();
+}
+
+// No reader may be left, so everything retired can go.
+template<typename T, template<u_char> class Next, class Alloc>
+ConcurrentCTrie<T,Next,Alloc>::~ConcurrentCTrie()
+{
+  for (size_t i = 0; i < mRetired.size(); ++i) {
+    freeNode(mRetired[i]);
+  }
+  for (size_t i = 0; i < sNumRetireLists; ++i) {
+    std::vector<Retired>& retired = mRetireLists[i].retired;
+    for (size_t j = 0; j < retired.size(); ++j) {
+      freeNode(retired[j]);
+    }
+  }
+}
+
+// Writers go through the trie like readers, with the epoch pinned so that
+// what they find is not freed under them, and then lock only the nodes they
+// replace, and the parent whose entry they store the copy in.  If a writer
+// cannot take one of those locks, or another writer has changed what it found
+// in the meantime, it starts again.  An allocator that may not be used from
+// several threads at once serializes the writers instead.
+template<typename T, template<u_char> class Next, class Alloc>
+bool
+ConcurrentCTrie<T,Next,Alloc>::insert(
+    const char* keyData, size_t keyLen, const T& value)
+{
+  std::unique_lock<std::mutex> serial(mWriteMutex, std::defer_lock);
+  if (!_ConcurrentTraits<Alloc>::sThreadSafe) {
+    serial.lock();
+  }
+  reader pin(*this);
+  bool inserted;
+  while (!tryInsert(keyData, keyLen, value, inserted)) {
+    std::this_thread::yield();
+  }
+  return inserted;
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+size_t
+ConcurrentCTrie<T,Next,Alloc>::erase(const char* keyData, size_t keyLen)
+{
+  if (keyLen == key_type::npos) {
+    keyLen = strlen(keyData);
+  }
+  std::unique_lock<std::mutex> serial(mWriteMutex, std::defer_lock);
+  if (!_ConcurrentTraits<Alloc>::sThreadSafe) {
+    serial.lock();
+  }
+  reader pin(*this);
+  size_t erased;
+  while (!tryErase(keyData, keyLen, erased)) {
+    std::this_thread::yield();
+  }
+  return erased;
+}
+
+// Find the node that the new key changes: the first one whose string the key
+// does not match, where the key ends, or which has no inner node for the
+// key's next character.  Insert into a copy of it, as CTrie::insert would,
+// and put the copy in its place.  If the key leads to a leaf, the leaf is
+// copied too, since the insert replaces or splits it.  Return false if the
+// insert has to be tried again.
+template<typename T, template<u_char> class Next, class Alloc>
+bool
+ConcurrentCTrie<T,Next,Alloc>::tryInsert(
+    const char* keyData, size_t keyLen, const T& value, bool& inserted)
+{
+  Alloc& alloc = mTrie.mAlloc;
+  _HeldLocks locks;
+  PathT path;
+  NodeT* node = top();
+  inserted = false;
+  if (!node) {
+    if (!locks.add(mTopLock) || top()) {
+      return false;
+    }
+    publish(path, NodeT::createNode(alloc, keyData, keyLen, value));
+    ++mSize;
+    inserted = true;
+    return true;
+  }
+
+  size_t nodePos = 0;
+  NodeT* leafEntry = nullptr;
+  size_t leafIndex = 0;
+  while (1) {
+    size_t pos = nodePos + node->strLen();
+    if (pos > keyLen || memcmp(node->str(), keyData + nodePos,
+        node->strLen()) != 0) {
+      break;
+    }
+    if (pos == keyLen) {
+      if (node->hasValue()) {
+        return true;
+      }
+      break;
+    }
+    std::pair<size_t, bool> findRtn = node->findEntry(keyData[pos]);
+    if (!findRtn.second) {
+      break;
+    }
+    NodeT* entry = node->getEntry(findRtn.first);
+    if (NodeT::isLeafEntry(entry)) {
+      LeafT* leaf = NodeT::entryLeaf(entry);
+      if (leaf->strLen() == keyLen - pos - 1 &&
+          memcmp(leaf->str(), keyData + pos + 1, leaf->strLen()) == 0) {
+        return true;
+      }
+      leafEntry = entry;
+      leafIndex = findRtn.first;
+      break;
+    }
+    path.push(node, findRtn.first);
+    node = entry;
+    nodePos = pos + 1;
+  }
+
+  if (!locks.add(parentLock(path)) || !locks.add(nodeLock(node)) ||
+      linkedEntry(path) != node ||
+      (leafEntry && node->getEntry(leafIndex) != leafEntry)) {
+    return false;
+  }
+
+  std::vector<Retired> retired;
+  NodeT* copy = node->cloneShell(alloc, 1);
+  if (leafEntry) {
+    char ch = keyData[nodePos + node->strLen()];
+    *copy->getEntryPtr(copy->findEntry(ch).first) =
+        NodeT::makeEntry(NodeT::entryLeaf(leafEntry)->clone(alloc));
+    retire(retired, NodeT::entryLeaf(leafEntry), false);
+  }
+  NodeT::insert(alloc, &copy, keyData, keyLen, nodePos, value);
+  publish(path, copy);
+  retire(retired, node, true);
+  ++mSize;
+  locks.release();
+  inserted = true;
+  endChange(retired);
+  return true;
+}
+
+// Remove the key from a copy of the node that holds it.  As in CTrie::erase,
+// a node left with no children is removed from its parent, or becomes a leaf
+// if it still has a value, so those parents are copied as well.  All of the
+// nodes that are copied are locked first, top down, and the parent of the
+// topmost one.  Return false if the erase has to be tried again.
+template<typename T, template<u_char> class Next, class Alloc>
+bool
+ConcurrentCTrie<T,Next,Alloc>::tryErase(
+    const char* keyData, size_t keyLen, size_t& erased)
+{
+  Alloc& alloc = mTrie.mAlloc;
+  erased = 0;
+  NodeT* node = top();
+  if (!node) {
+    return true;
+  }
+  PathT path;
+  typename NodeT::FindRtn result = node->find(keyData, keyLen, &path);
+  if (result.cmpValue != 0) {
+    return true;
+  }
+  node = result.node;
+  bool leafKey = result.index != NodeT::valueIndex();
+  NodeT* leafEntry = leafKey ? node->getEntry(result.index) : nullptr;
+
+  // The nodes from path[first] down are left with nothing in them.
+  bool gone = leafKey ? node->size() == 1 && !node->hasValue() :
+      node->empty();
+  size_t first = path.size();
+  while (gone && first > 0) {
+    NodeT* parent = path[--first].node;
+    gone = parent->size() == 1 && !parent->hasValue();
+  }
+
+  _HeldLocks locks;
+  PathT upper;
+  for (size_t i = 0; i < first; ++i) {
+    upper.push(path[i].node, path[i].index);
+  }
+  if (!locks.add(parentLock(upper)) ||
+      linkedEntry(upper) != (first < path.size() ? path[first].node : node)) {
+    return false;
+  }
+  for (size_t i = first; i < path.size(); ++i) {
+    NodeT* child = i + 1 < path.size() ? path[i + 1].node : node;
+    if (!locks.add(nodeLock(path[i].node)) ||
+        path[i].node->getEntry(path[i].index) != child) {
+      return false;
+    }
+  }
+  if (!locks.add(nodeLock(node)) ||
+      (leafKey && node->getEntry(result.index) != leafEntry)) {
+    return false;
+  }
+
+  std::vector<Retired> retired;
+  NodeT* copy = node->cloneShell(alloc, 0);
+  if (leafKey) {
+    retire(retired, NodeT::entryLeaf(leafEntry), false);
+    copy = eraseCopyEntry(copy, node->key(result.index));
+  } else {
+    copy->removeValue(alloc);
+  }
+  retire(retired, node, true);
+
+  while (copy->empty()) {
+    if (copy->hasValue()) {
+      if (!path.empty()) {
+        LeafT* leaf = LeafT::create(
+            alloc, copy->str(), copy->strLen(), copy->valueToMove());
+        copy->destroy(alloc);
+        copy = NodeT::makeEntry(leaf);
+      }
+      break;
+    }
+    copy->destroy(alloc);
+    if (path.empty()) {
+      copy = nullptr;
+      break;
+    }
+    node = path.back().node;
+    char ch = node->key(path.back().index);
+    path.pop();
+    copy = eraseCopyEntry(node->cloneShell(alloc, 0), ch);
+    retire(retired, node, true);
+  }
+
+  publish(path, copy);
+  --mSize;
+  locks.release();
+  erased = 1;
+  endChange(retired);
+  return true;
+}
+
+// The top is swapped out whole, after every inner node has been locked and
+// marked obsolete, so that a writer that is part way through a change either
+// finishes it first or fails to lock its nodes and starts again on the empty
+// trie.  The writers count their changes before they let go of their locks,
+// so the count is reset with every node still locked.
+template<typename T, template<u_char> class Next, class Alloc>
+void
+ConcurrentCTrie<T,Next,Alloc>::clear()
+{
+  std::unique_lock<std::mutex> serial(mWriteMutex, std::defer_lock);
+  if (!_ConcurrentTraits<Alloc>::sThreadSafe) {
+    serial.lock();
+  }
+  _HeldLocks locks;
+  while (!locks.add(mTopLock)) {
+    std::this_thread::yield();
+  }
+  NodeT* node = top();
+  if (node) {
+    std::vector<Retired> retired;
+    lockSubtree(locks, node);
+    publish(PathT(), nullptr);
+    retire(retired, node, false);
+    mSize = 0;
+    locks.release();
+    endChange(retired);
+  }
+}
+
+// Lock node and the inner nodes under it, top down, and mark them obsolete.
+// The parent is locked already, so no writer can replace node, and a writer
+// that holds node's lock only holds it until it fails to take another.
+template<typename T, template<u_char> class Next, class Alloc>
+void
+ConcurrentCTrie<T,Next,Alloc>::lockSubtree(_HeldLocks& locks, NodeT* node)
+{
+  while (!locks.add(nodeLock(node))) {
+    std::this_thread::yield();
+  }
+  nodeLock(node).makeObsolete();
+  for (size_t index = node->firstEntry(); index != NodeT::endIndex();
+      index = node->nextEntry(index)) {
+    NodeT* entry = node->getEntry(index);
+    if (!NodeT::isLeafEntry(entry)) {
+      lockSubtree(locks, entry);
+    }
+  }
+}
+
+// The writers free retired nodes with the allocator, so an allocator that
+// may not be used from several threads at once keeps them out meanwhile.
+template<typename T, template<u_char> class Next, class Alloc>
+void
+ConcurrentCTrie<T,Next,Alloc>::reclaim()
+{
+  std::unique_lock<std::mutex> serial(mWriteMutex, std::defer_lock);
+  if (!_ConcurrentTraits<Alloc>::sThreadSafe) {
+    serial.lock();
+  }
+  std::lock_guard<std::mutex> lock(mRetireMutex);
+  freeRetired();
+}
+
+// Take in what the writers have retired, and free what no reader can reach.
+// The caller holds mRetireMutex.
+template<typename T, template<u_char> class Next, class Alloc>
+void
+ConcurrentCTrie<T,Next,Alloc>::freeRetired()
+{
+  for (size_t i = 0; i < sNumRetireLists; ++i) {
+    RetireList& list = mRetireLists[i];
+    std::lock_guard<std::mutex> lock(list.mutex);
+    mRetired.insert(mRetired.end(), list.retired.begin(), list.retired.end());
+    list.retired.clear();
+  }
+
+  uint64_t oldest = mEpochs.oldestReader();
+  size_t kept = 0;
+  for (size_t i = 0; i < mRetired.size(); ++i) {
+    if (mRetired[i].epoch >= oldest) {
+      mRetired[kept++] = mRetired[i];
+    } else {
+      freeNode(mRetired[i]);
+    }
+  }
+  mRetired.resize(kept);
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline void
+ConcurrentCTrie<T,Next,Alloc>::freeNode(const Retired& retired)
+{
+  if (retired.shell) {
+    retired.node->destroyShell(mTrie.mAlloc);
+  } else {
+    retired.node->destroy(mTrie.mAlloc);
+  }
+}
+
+// Make entry visible to readers in place of the entry at the end of path,
+// or as the top of the trie if path is empty.  The release store orders the
+// writes that built entry before the store that links it in.
+template<typename T, template<u_char> class Next, class Alloc>
+inline void
+ConcurrentCTrie<T,Next,Alloc>::publish(const PathT& path, NodeT* entry)
+{
+  if (path.empty()) {
+    __atomic_store_n(&mTrie.mTop, entry, __ATOMIC_RELEASE);
+  } else {
+    _storeSlot(*path.back().node->getEntryPtr(path.back().index), entry);
+  }
+}
+
+// The node has been unlinked by the change being made.  A replaced inner
+// node is also marked obsolete, so that no writer locks it again.
+template<typename T, template<u_char> class Next, class Alloc>
+inline void
+ConcurrentCTrie<T,Next,Alloc>::retire(
+    std::vector<Retired>& retired, NodeT* node, bool shell)
+{
+  if (shell) {
+    nodeLock(node).makeObsolete();
+  }
+  Retired item = {node, shell, 0};
+  retired.push_back(item);
+}
+
+// Tag the nodes that a change retired with the epoch that the change ends,
+// and add them to this thread's list.  Once enough have piled up there, free
+// what can be freed, unless another writer already is.
+template<typename T, template<u_char> class Next, class Alloc>
+void
+ConcurrentCTrie<T,Next,Alloc>::endChange(std::vector<Retired>& retired)
+{
+  uint64_t epoch = mEpochs.advance();
+  RetireList& list = mRetireLists[
+      std::hash<std::thread::id>()(std::this_thread::get_id()) %
+      sNumRetireLists];
+  size_t pending;
+  {
+    std::lock_guard<std::mutex> lock(list.mutex);
+    for (size_t i = 0; i < retired.size(); ++i) {
+      retired[i].epoch = epoch;
+      list.retired.push_back(retired[i]);
+    }
+    pending = list.retired.size();
+  }
+  if (pending >= sReclaimBatch) {
+    std::unique_lock<std::mutex> lock(mRetireMutex, std::try_to_lock);
+    if (lock.owns_lock()) {
+      freeRetired();
+    }
+  }
+}
+
+// The entry that path ends at, or the top if path is empty.
+template<typename T, template<u_char> class Next, class Alloc>
+inline typename ConcurrentCTrie<T,Next,Alloc>::NodeT*
+ConcurrentCTrie<T,Next,Alloc>::linkedEntry(const PathT& path) const
+{
+  return path.empty() ? top() :
+      path.back().node->getEntry(path.back().index);
+}
+
+// The lock that guards the entry that path ends at.
+template<typename T, template<u_char> class Next, class Alloc>
+inline _NodeLock&
+ConcurrentCTrie<T,Next,Alloc>::parentLock(const PathT& path)
+{
+  return path.empty() ? mTopLock : nodeLock(path.back().node);
+}
+
+// Erase the entry for key from a node that is not yet visible to readers,
+// and return the node, which may have been replaced by a smaller one.
+template<typename T, template<u_char> class Next, class Alloc>
+typename ConcurrentCTrie<T,Next,Alloc>::NodeT*
+ConcurrentCTrie<T,Next,Alloc>::eraseCopyEntry(NodeT* copy, char key)
+{
+  NodeT* replacement;
+  copy->eraseEntry(mTrie.mAlloc, copy->findEntry(key).first, &replacement);
+  if (replacement != copy) {
+    copy->destroy(mTrie.mAlloc);
+  }
+  return replacement;
+}
+
+} // end namespace ctrie
+#endif
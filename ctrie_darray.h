@@ -0,0 +1,345 @@
+#ifndef _CTRIE_DARRAY_H
+#define _CTRIE_DARRAY_H
+ 
+namespace ctrie {
+
+// A read-only trie for exact lookups, compiled from a CTrie into a double
+// array.  Each state has a base and a check: the entry for code c out of
+// state s is state base(s) + c, if that state's check is s.  The code of a
+// character is its value plus one, and code 0 ends a key, so each step of a
+// lookup reads two adjacent words and makes one comparison, whatever kind
+// of node the CTrie had.
+//
+// An inner node's string becomes a chain of states, one per character.  A
+// leaf becomes a state with a negative base, which holds the leaf's number;
+// the leaf keeps the rest of its key, its tail, and its value.  There is no
+// iteration: use a CTrie, a FrozenCTrie or a LoudsCTrie for that.
+template<typename T>
+class DoubleArrayCTrie {
+private:
+  struct Unit {
+    int32_t base;                     // ~leaf number for a leaf
+    uint32_t check;                   // The parent state, or sFree
+  };
+
+  struct Leaf {
+    uint32_t tail;                    // The tail's offset in mTails
+    uint32_t tailLen;
+    T value;
+  };
+
+  // A state whose children are still to be placed, with the CTrie entry it
+  // stands for and how much of the entry's string it has gone past.
+  template<class NodeT>
+  struct Pending {
+    uint32_t state;
+    NodeT* entry;
+    size_t strPos;
+  };
+
+  // The free states while building, in order, so that a search for room
+  // does not pass over the states in use.  A free state that is dropped from
+  // the list stays free, but has itself as its next.
+  struct FreeStates {
+    std::vector<uint32_t> next;
+    std::vector<uint32_t> prev;
+    uint32_t head;
+    uint32_t tail;
+    size_t headFails;                 // Searches the head has failed in a row
+
+    FreeStates() : head(sFree), tail(sFree), headFails(0) {}
+    void append(uint32_t state);
+    void remove(uint32_t state);
+  };
+
+  static const uint32_t sFree = static_cast<uint32_t>(-1);
+  static const size_t sNumCodes = 257;
+  static const size_t sMaxTries = 256;
+  static const size_t sMaxHeadFails = 16;
+
+  std::vector<Unit> mUnits;
+  std::vector<Leaf> mLeaves;
+  std::vector<char> mTails;
+
+public:
+  typedef std::string key_type;
+  typedef T value_type;
+  typedef size_t size_type;
+
+  DoubleArrayCTrie() {}
+  template<template<u_char> class Next, class Alloc>
+    explicit DoubleArrayCTrie(const CTrie<T,Next,Alloc>& trie);
+
+  size_t size() const                               {return mLeaves.size();}
+  bool empty() const                                  {return mLeaves.empty();}
+  size_t stateCount() const;
+  size_t memoryUsage() const;
+
+  // Return the key's value, or null.
+  const T* find(const key_type& key) const
+                                    {return find(key.data(), key.length());}
+  const T* find(const char* keyData, size_t keyLen = key_type::npos) const;
+  size_t count(const key_type& key) const         {return find(key) ? 1 : 0;}
+  size_t count(const char* keyData, size_t keyLen = key_type::npos) const
+                                      {return find(keyData, keyLen) ? 1 : 0;}
+
+private:
+  template<class NodeT>
+    void addState(std::vector<Pending<NodeT> >& pending, FreeStates& free,
+        uint32_t state, NodeT* entry, size_t strPos);
+  int32_t addLeaf(const char* tail, size_t tailLen, const T& value);
+  size_t placeCodes(FreeStates& free, uint32_t state, const uint16_t* codes,
+      size_t numCodes);
+  bool isFree(size_t state) const
+              {return state >= mUnits.size() || mUnits[state].check == sFree;}
+};
+
+// Place the states depth first.  The root is state 0; its check is 0, and
+// every base is at least 1, so no entry leads back to it.
+template<typename T>
+template<template<u_char> class Next, class Alloc>
+DoubleArrayCTrie<T>::DoubleArrayCTrie(const CTrie<T,Next,Alloc>& trie)
+{
+  typedef _BaseNode<T,Next,Alloc> NodeT;
+  if (!trie.mTop) {
+    return;
+  }
+  Unit root = {0, 0};
+  mUnits.push_back(root);
+  mLeaves.reserve(trie.size());
+  std::vector<Pending<NodeT> > pending;
+  FreeStates free;
+  free.next.push_back(0);
+  free.prev.push_back(0);
+  addState(pending, free, 0, trie.mTop, 0);
+  while (!pending.empty()) {
+    Pending<NodeT> next = pending.back();
+    pending.pop_back();
+    addState(pending, free, next.state, next.entry, next.strPos);
+  }
+
+  // Leave room after the last state for every code, so a lookup never needs
+  // to check that it is still in the array.
+  size_t end = 0;
+  for (size_t i = 0; i < mUnits.size(); ++i) {
+    if (mUnits[i].base > 0) {
+      end = std::max(end, static_cast<size_t>(mUnits[i].base) + sNumCodes);
+    }
+  }
+  Unit freeUnit = {0, sFree};
+  mUnits.resize(std::max(end, mUnits.size()), freeUnit);
+  mUnits.shrink_to_fit();
+  mTails.shrink_to_fit();
+}
+
+// Fill in a state's base: a leaf's number, or where its entries go.  The
+// states of the entries are pushed, to be filled in later.
+template<typename T>
+template<class NodeT>
+void
+DoubleArrayCTrie<T>::addState(std::vector<Pending<NodeT> >& pending,
+    FreeStates& free, uint32_t state, NodeT* entry, size_t strPos)
+{
+  if (NodeT::isLeafEntry(entry)) {
+    typename NodeT::LeafT* leaf = NodeT::entryLeaf(entry);
+    mUnits[state].base = addLeaf(leaf->str(), leaf->strLen(), leaf->value());
+    return;
+  }
+
+  uint16_t codes[sNumCodes];
+  size_t numCodes = 0;
+  if (strPos < entry->strLen()) {
+    codes[numCodes++] = static_cast<uint16_t>(
+        static_cast<u_char>(entry->str()[strPos]) + 1);
+  } else {
+    if (entry->hasValue()) {
+      codes[numCodes++] = 0;
+    }
+    for (size_t index = entry->firstEntry(); index != NodeT::endIndex();
+        index = entry->nextEntry(index)) {
+      codes[numCodes++] =
+          static_cast<uint16_t>(static_cast<u_char>(entry->key(index)) + 1);
+    }
+  }
+  size_t base = placeCodes(free, state, codes, numCodes);
+
+  if (strPos < entry->strLen()) {
+    Pending<NodeT> next = {static_cast<uint32_t>(base + codes[0]), entry,
+        strPos + 1};
+    pending.push_back(next);
+    return;
+  }
+  size_t i = 0;
+  if (entry->hasValue()) {
+    mUnits[base].base = addLeaf("", 0, entry->value());
+    ++i;
+  }
+  for (size_t index = entry->firstEntry(); index != NodeT::endIndex();
+      index = entry->nextEntry(index), ++i) {
+    Pending<NodeT> next = {static_cast<uint32_t>(base + codes[i]),
+        entry->getEntry(index), 0};
+    pending.push_back(next);
+  }
+}
+
+template<typename T>
+int32_t
+DoubleArrayCTrie<T>::addLeaf(const char* tail, size_t tailLen, const T& value)
+{
+  if (mLeaves.size() >= static_cast<size_t>(INT32_MAX) ||
+      mTails.size() + tailLen > UINT32_MAX) {
+    throw std::length_error("DoubleArrayCTrie: too many keys");
+  }
+  Leaf leaf = {static_cast<uint32_t>(mTails.size()),
+      static_cast<uint32_t>(tailLen), value};
+  mTails.insert(mTails.end(), tail, tail + tailLen);
+  mLeaves.push_back(leaf);
+  return ~static_cast<int32_t>(mLeaves.size() - 1);
+}
+
+// Find the first base at which every code's state is free, trying each free
+// state in turn for the first code, claim those states for the given one,
+// and return the base.  Once the array is mostly full, most free states fit
+// nothing, so after sMaxTries of them the codes go at the end, and a state
+// that heads the list but fits nothing time after time is dropped from it.
+template<typename T>
+size_t
+DoubleArrayCTrie<T>::placeCodes(FreeStates& free, uint32_t state,
+    const uint16_t* codes, size_t numCodes)
+{
+  size_t base = std::max(mUnits.size(), static_cast<size_t>(codes[0]) + 1) -
+      codes[0];
+  size_t tries = 0;
+  for (uint32_t pos = free.head; pos != sFree && tries < sMaxTries;
+      pos = free.next[pos], ++tries) {
+    if (pos <= codes[0]) {
+      continue;
+    }
+    size_t i = 1;
+    while (i < numCodes && isFree(pos - codes[0] + codes[i])) {
+      ++i;
+    }
+    if (i == numCodes) {
+      base = pos - codes[0];
+      break;
+    }
+  }
+  if (free.head != sFree && base + codes[0] != free.head &&
+      ++free.headFails == sMaxHeadFails) {
+    free.remove(free.head);
+  }
+
+  size_t last = base + codes[numCodes - 1];
+  if (last >= static_cast<size_t>(INT32_MAX) - sNumCodes) {
+    throw std::length_error("DoubleArrayCTrie: too many states");
+  }
+  if (last >= mUnits.size()) {
+    Unit freeUnit = {0, sFree};
+    size_t size = mUnits.size();
+    mUnits.resize(last + 1, freeUnit);
+    free.next.resize(last + 1);
+    free.prev.resize(last + 1);
+    for (; size <= last; ++size) {
+      free.append(static_cast<uint32_t>(size));
+    }
+  }
+  mUnits[state].base = static_cast<int32_t>(base);
+  for (size_t i = 0; i < numCodes; ++i) {
+    mUnits[base + codes[i]].check = state;
+    free.remove(static_cast<uint32_t>(base + codes[i]));
+  }
+  return base;
+}
+
+template<typename T>
+void
+DoubleArrayCTrie<T>::FreeStates::append(uint32_t state)
+{
+  next[state] = sFree;
+  prev[state] = tail;
+  if (tail == sFree) {
+    head = state;
+  } else {
+    next[tail] = state;
+  }
+  tail = state;
+}
+
+template<typename T>
+void
+DoubleArrayCTrie<T>::FreeStates::remove(uint32_t state)
+{
+  if (next[state] == state) {
+    return;
+  }
+  if (state == head) {
+    headFails = 0;
+  }
+  if (prev[state] == sFree) {
+    head = next[state];
+  } else {
+    next[prev[state]] = next[state];
+  }
+  if (next[state] == sFree) {
+    tail = prev[state];
+  } else {
+    prev[next[state]] = prev[state];
+  }
+  next[state] = state;
+}
+
+template<typename T>
+size_t
+DoubleArrayCTrie<T>::stateCount() const
+{
+  size_t count = 0;
+  for (size_t i = 0; i < mUnits.size(); ++i) {
+    count += mUnits[i].check != sFree;
+  }
+  return count;
+}
+
+template<typename T>
+size_t
+DoubleArrayCTrie<T>::memoryUsage() const
+{
+  return sizeof(*this) + mUnits.capacity() * sizeof(Unit) +
+      mLeaves.capacity() * sizeof(Leaf) + mTails.capacity();
+}
+
+// A key that ends at an inner node takes code 0 to that node's value, which
+// leaves pos one past the key's end.
+template<typename T>
+const T*
+DoubleArrayCTrie<T>::find(const char* keyData, size_t keyLen) const
+{
+  if (mUnits.empty()) {
+    return nullptr;
+  }
+  if (keyLen == key_type::npos) {
+    keyLen = strlen(keyData);
+  }
+  const Unit* units = mUnits.data();
+  const u_char* key = reinterpret_cast<const u_char*>(keyData);
+  uint32_t state = 0;
+  size_t pos = 0;
+  int32_t base;
+  while ((base = units[state].base) >= 0) {
+    size_t next = static_cast<size_t>(base) + (pos < keyLen ? key[pos] + 1 : 0);
+    if (units[next].check != state) {
+      return nullptr;
+    }
+    state = static_cast<uint32_t>(next);
+    ++pos;
+  }
+  const Leaf& leaf = mLeaves[static_cast<size_t>(~base)];
+  size_t rest = pos < keyLen ? keyLen - pos : 0;
+  if (leaf.tailLen != rest || (rest != 0 &&
+      memcmp(mTails.data() + leaf.tail, keyData + keyLen - rest, rest) != 0)) {
+    return nullptr;
+  }
+  return &leaf.value;
+}
+
+} // end namespace ctrie
+#endif
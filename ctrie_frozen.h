@@ -0,0 +1,745 @@
+#ifndef _CTRIE_FROZEN_H
+#define _CTRIE_FROZEN_H
+ 
+namespace ctrie {
+
+// The image that CTrie::freeze() writes, and that FrozenCTrie maps.  It holds
+// no pointers: a node refers to its children by their offsets in the image,
+// so the image can be mapped at any address, and shared by every process that
+// maps the same file.  It is in the byte order of the machine that wrote it.
+//
+// The header comes first.  Each node follows it as a record that starts on an
+// 8 byte boundary: a _FrozenNode, then the value, if it has one, the offsets
+// of the children, their characters in ascending order, and last the node's
+// key fragment.  A leaf is a node with no children.  Children are written
+// before their parents, so the top node is the last one.
+struct _FrozenHeader {
+  static const uint32_t sVersion = 1;
+  static const uint32_t sByteOrder = 0x01020304;
+
+  char magic[8];
+  uint32_t version;
+  uint32_t byteOrder;
+  uint32_t valueSize;
+  uint32_t valueAlign;
+  uint64_t size;              // The number of keys
+  uint64_t top;               // The offset of the top node, or 0 if empty
+  uint64_t fileSize;
+
+  static const char* sMagic()                             {return "CTRIEFZ";}
+};
+
+template<typename T>
+class _FrozenNode {
+public:
+  typedef _FrozenNode<T> NodeT;
+  static const size_t sAlign = 8;
+
+private:
+  uint32_t mStrLen;
+  uint16_t mNumChildren;
+  uint8_t mHasValue;
+  uint8_t mPad;
+
+public:
+  static size_t roundUp(size_t n)    {return (n + sAlign - 1) & ~(sAlign - 1);}
+  static size_t valueBytes(bool hasValue)
+                                  {return hasValue ? roundUp(sizeof(T)) : 0;}
+  static size_t recordSize(size_t strLen, size_t numChildren, bool hasValue);
+  static void makeHeader(char* record, size_t strLen, size_t numChildren,
+      bool hasValue);
+
+  size_t strLen() const                                   {return mStrLen;}
+  size_t numChildren() const                         {return mNumChildren;}
+  bool hasValue() const                                 {return mHasValue;}
+  const T& value() const
+             {return *reinterpret_cast<const T*>(bytes() + sizeof(*this));}
+  uint64_t child(size_t i) const;
+  const u_char* keys() const;
+  const char* str() const
+          {return reinterpret_cast<const char*>(keys()) + mNumChildren;}
+  size_t findChild(u_char key) const;
+
+private:
+  const char* bytes() const      {return reinterpret_cast<const char*>(this);}
+};
+
+// Writes an image to a temporary file next to the one it is for, and
+// renames it into place once it is complete, so that a process which has
+// the old image mapped keeps a whole one.
+template<typename T>
+class _FrozenWriter {
+private:
+  std::string mPath;
+  std::string mTempPath;
+  FILE* mFile;
+  uint64_t mOffset;
+  std::vector<char> mRecord;
+
+public:
+  explicit _FrozenWriter(const std::string& path);
+  _FrozenWriter(const _FrozenWriter&) = delete;
+  _FrozenWriter& operator=(const _FrozenWriter&) = delete;
+  ~_FrozenWriter();
+
+  uint64_t writeNode(const char* str, size_t strLen, const T* value,
+      const uint64_t* children, const u_char* keys, size_t numChildren);
+  void finish(uint64_t top, uint64_t size);
+
+private:
+  void write(const void* data, size_t len);
+  void fail(const char* what);
+};
+
+// A read-only trie served straight from an image that CTrie::freeze() wrote.
+// The file is mapped, not read, so opening one costs a few system calls, and
+// the pages are faulted in as lookups touch them.  The values are the bytes
+// that were written, so T must be trivially copyable, and must be the type
+// the image was written with.  The image is trusted: only its header is
+// checked.
+//
+// Lookups work like those of a CTrie.  Children are found by a binary search
+// of a node's characters.
+template<typename T>
+class FrozenCTrie {
+  static_assert(std::is_trivially_copyable<T>::value,
+      "A FrozenCTrie can only hold trivially copyable values");
+  static_assert(alignof(T) <= _FrozenNode<T>::sAlign,
+      "A FrozenCTrie value must not need more than 8 byte alignment");
+
+private:
+  typedef _FrozenNode<T> NodeT;
+
+  const char* mBase;
+  size_t mLength;
+  const NodeT* mTop;
+  size_t mSize;
+
+public:
+  typedef std::string key_type;
+  typedef T value_type;
+  typedef size_t size_type;
+
+  // Iterates in key order.  The key is built up as the iterator moves, so
+  // key() costs nothing.
+  class const_iterator {
+  public:
+    typedef T value_type;
+    typedef const T& reference;
+    typedef const T* pointer;
+    typedef std::ptrdiff_t difference_type;
+    typedef std::forward_iterator_tag iterator_category;
+
+  private:
+    // A node on the way from the top, with the key's length before it, and
+    // the child being visited, or -1 for the node's own value.
+    struct Step {
+      const NodeT* node;
+      size_t keyLen;
+      ptrdiff_t child;
+    };
+
+    const FrozenCTrie* mTrie;
+    std::vector<Step> mPath;
+    key_type mKey;
+
+  public:
+    const_iterator() : mTrie(nullptr) {}
+
+    bool operator==(const const_iterator& x) const;
+    bool operator!=(const const_iterator& x) const {return !operator==(x);}
+    const T& operator*() const                     {return *operator->();}
+    const T* operator->() const        {return &mPath.back().node->value();}
+    const_iterator& operator++();
+
+    const key_type& key() const                               {return mKey;}
+    bool at_end() const                               {return mPath.empty();}
+
+  private:
+    explicit const_iterator(const FrozenCTrie* trie) : mTrie(trie) {}
+    void push(const NodeT* node);
+    void settle();
+
+    friend class FrozenCTrie;
+  };
+
+  // Iterates over the keys that are prefixes of a key, shortest first, as
+  // CTrie::prefix_begin() does.
+  class const_prefix_iter {
+  public:
+    typedef T value_type;
+    typedef const T& reference;
+    typedef const T* pointer;
+    typedef std::ptrdiff_t difference_type;
+    typedef std::forward_iterator_tag iterator_category;
+
+  private:
+    const FrozenCTrie* mTrie;
+    key_type mSearchStr;
+    const NodeT* mNode;               // Null at the end
+    size_t mPos;                      // Where the node's key ends
+
+  public:
+    const_prefix_iter() : mTrie(nullptr), mNode(nullptr), mPos(0) {}
+
+    bool operator==(const const_prefix_iter& x) const
+                                                   {return mNode == x.mNode;}
+    bool operator!=(const const_prefix_iter& x) const
+                                                    {return !operator==(x);}
+    const T& operator*() const                     {return mNode->value();}
+    const T* operator->() const                   {return &mNode->value();}
+    const_prefix_iter& operator++();
+
+    key_type key() const                  {return mSearchStr.substr(0, mPos);}
+    bool at_end() const                                  {return !mNode;}
+
+  private:
+    const_prefix_iter(const FrozenCTrie* trie, const key_type& searchStr);
+    void nextPrefix(const NodeT* node, size_t pos);
+
+    friend class FrozenCTrie;
+  };
+
+  explicit FrozenCTrie(const std::string& path);
+  FrozenCTrie(FrozenCTrie&& x);
+  FrozenCTrie(const FrozenCTrie&) = delete;
+  FrozenCTrie& operator=(const FrozenCTrie&) = delete;
+  ~FrozenCTrie();
+
+  size_t size() const                                        {return mSize;}
+  bool empty() const                                     {return mSize == 0;}
+  size_t imageSize() const                                 {return mLength;}
+
+  const_iterator begin() const;
+  const_iterator end() const                        {return const_iterator();}
+  const_iterator find(const key_type& key) const
+                                    {return find(key.data(), key.length());}
+  const_iterator find(const char* keyData,
+      size_t keyLen = key_type::npos) const;
+  size_t count(const key_type& key) const
+                                   {return count(key.data(), key.length());}
+  size_t count(const char* keyData, size_t keyLen = key_type::npos) const;
+  const_iterator lower_bound(const key_type& key) const
+                             {return lower_bound(key.data(), key.length());}
+  const_iterator lower_bound(const char* keyData,
+      size_t keyLen = key_type::npos) const;
+  const_prefix_iter prefix_begin(const key_type& key) const
+                                      {return const_prefix_iter(this, key);}
+  const_prefix_iter prefix_end() const           {return const_prefix_iter();}
+
+private:
+  const NodeT* node(uint64_t offset) const
+                     {return reinterpret_cast<const NodeT*>(mBase + offset);}
+  const NodeT* findNode(const char* keyData, size_t keyLen) const;
+};
+
+template<typename T>
+inline size_t
+_FrozenNode<T>::recordSize(size_t strLen, size_t numChildren, bool hasValue)
+{
+  return roundUp(sizeof(NodeT) + valueBytes(hasValue) +
+      numChildren * (sizeof(uint64_t) + 1) + strLen);
+}
+
+template<typename T>
+inline void
+_FrozenNode<T>::makeHeader(char* record, size_t strLen, size_t numChildren,
+    bool hasValue)
+{
+  NodeT node;
+  node.mStrLen = static_cast<uint32_t>(strLen);
+  node.mNumChildren = static_cast<uint16_t>(numChildren);
+  node.mHasValue = hasValue;
+  node.mPad = 0;
+  memcpy(record, &node, sizeof(node));
+}
+
+template<typename T>
+inline uint64_t
+_FrozenNode<T>::child(size_t i) const
+{
+  const char* p = bytes() + sizeof(*this) + valueBytes(mHasValue);
+  return reinterpret_cast<const uint64_t*>(p)[i];
+}
+
+template<typename T>
+inline const u_char*
+_FrozenNode<T>::keys() const
+{
+  return reinterpret_cast<const u_char*>(bytes() + sizeof(*this) +
+      valueBytes(mHasValue) + mNumChildren * sizeof(uint64_t));
+}
+
+// Return the index of the first child whose character is not less than key,
+// which may be numChildren().
+template<typename T>
+inline size_t
+_FrozenNode<T>::findChild(u_char key) const
+{
+  const u_char* k = keys();
+  return std::lower_bound(k, k + mNumChildren, key) - k;
+}
+
+template<typename T>
+_FrozenWriter<T>::_FrozenWriter(const std::string& path)
+  : mPath(path), mTempPath(path + ".tmp"), mFile(nullptr), mOffset(0)
+{
+  mFile = fopen(mTempPath.c_str(), "wb");
+  if (!mFile) {
+    fail("Cannot create the frozen trie image");
+  }
+  _FrozenHeader header;
+  memset(&header, 0, sizeof(header));
+  write(&header, sizeof(header));
+}
+
+// An image that was not finished is removed.
+template<typename T>
+_FrozenWriter<T>::~_FrozenWriter()
+{
+  if (mFile) {
+    fclose(mFile);
+    unlink(mTempPath.c_str());
+  }
+}
+
+// Write a node, and return its offset.
+template<typename T>
+uint64_t
+_FrozenWriter<T>::writeNode(const char* str, size_t strLen, const T* value,
+    const uint64_t* children, const u_char* keys, size_t numChildren)
+{
+  typedef _FrozenNode<T> NodeT;
+  bool hasValue = value != nullptr;
+  mRecord.assign(NodeT::recordSize(strLen, numChildren, hasValue), 0);
+  char* p = mRecord.data();
+  NodeT::makeHeader(p, strLen, numChildren, hasValue);
+  p += sizeof(NodeT);
+  if (value) {
+    memcpy(p, value, sizeof(T));
+    p += NodeT::valueBytes(true);
+  }
+  if (numChildren) {
+    memcpy(p, children, numChildren * sizeof(uint64_t));
+    p += numChildren * sizeof(uint64_t);
+    memcpy(p, keys, numChildren);
+  }
+  if (strLen) {
+    memcpy(p + numChildren, str, strLen);
+  }
+
+  uint64_t offset = mOffset;
+  write(mRecord.data(), mRecord.size());
+  return offset;
+}
+
+template<typename T>
+void
+_FrozenWriter<T>::finish(uint64_t top, uint64_t size)
+{
+  _FrozenHeader header;
+  memset(&header, 0, sizeof(header));
+  strcpy(header.magic, _FrozenHeader::sMagic());
+  header.version = _FrozenHeader::sVersion;
+  header.byteOrder = _FrozenHeader::sByteOrder;
+  header.valueSize = sizeof(T);
+  header.valueAlign = alignof(T);
+  header.size = size;
+  header.top = top;
+  header.fileSize = mOffset;
+  if (fseek(mFile, 0, SEEK_SET) != 0 ||
+      fwrite(&header, sizeof(header), 1, mFile) != 1) {
+    fail("Cannot write the frozen trie image");
+  }
+  if (fflush(mFile) != 0 || fsync(fileno(mFile)) != 0) {
+    fail("Cannot write the frozen trie image");
+  }
+  FILE* file = mFile;
+  mFile = nullptr;
+  if (fclose(file) != 0) {
+    unlink(mTempPath.c_str());
+    fail("Cannot write the frozen trie image");
+  }
+  if (rename(mTempPath.c_str(), mPath.c_str()) != 0) {
+    int error = errno;
+    unlink(mTempPath.c_str());
+    errno = error;
+    fail("Cannot rename the frozen trie image");
+  }
+}
+
+template<typename T>
+inline void
+_FrozenWriter<T>::write(const void* data, size_t len)
+{
+  if (fwrite(data, 1, len, mFile) != len) {
+    fail("Cannot write the frozen trie image");
+  }
+  mOffset += len;
+}
+
+template<typename T>
+inline void
+_FrozenWriter<T>::fail(const char* what)
+{
+  throw std::system_error(errno, std::generic_category(), what);
+}
+
+// Write an image of the trie to path, which FrozenCTrie can map.  Throw
+// std::system_error if the image cannot be written.
+template<typename T, template<u_char> class Next, class Alloc>
+void
+CTrie<T,Next,Alloc>::freeze(const std::string& path) const
+{
+  static_assert(std::is_trivially_copyable<T>::value,
+      "Only a trie of trivially copyable values can be frozen");
+  _FrozenWriter<T> out(path);
+  out.finish(mTop ? freezeEntry(out, mTop) : 0, mSize);
+}
+
+// Write the entry's children, and then the entry, and return its offset.
+template<typename T, template<u_char> class Next, class Alloc>
+uint64_t
+CTrie<T,Next,Alloc>::freezeEntry(_FrozenWriter<T>& out, NodeT* entry)
+{
+  if (NodeT::isLeafEntry(entry)) {
+    LeafT* leaf = NodeT::entryLeaf(entry);
+    return out.writeNode(leaf->str(), leaf->strLen(), &leaf->value(),
+        nullptr, nullptr, 0);
+  }
+  std::vector<uint64_t> children;
+  std::vector<u_char> keys;
+  for (size_t index = entry->firstEntry(); index != NodeT::endIndex();
+      index = entry->nextEntry(index)) {
+    keys.push_back(static_cast<u_char>(entry->key(index)));
+    children.push_back(freezeEntry(out, entry->getEntry(index)));
+  }
+  return out.writeNode(entry->str(), entry->strLen(),
+      entry->hasValue() ? &entry->value() : nullptr, children.data(),
+      keys.data(), children.size());
+}
+
+// Map the image at path.  Throw std::system_error if it cannot be opened or
+// mapped, and std::runtime_error if it is not an image of a trie of T.
+template<typename T>
+FrozenCTrie<T>::FrozenCTrie(const std::string& path)
+  : mBase(nullptr), mLength(0), mTop(nullptr), mSize(0)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::system_error(errno, std::generic_category(),
+        "Cannot open the frozen trie image");
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    int error = errno;
+    close(fd);
+    throw std::system_error(error, std::generic_category(),
+        "Cannot open the frozen trie image");
+  }
+  mLength = static_cast<size_t>(st.st_size);
+  if (mLength < sizeof(_FrozenHeader)) {
+    close(fd);
+    throw std::runtime_error("Not a frozen trie image");
+  }
+  void* mem = mmap(nullptr, mLength, PROT_READ, MAP_SHARED, fd, 0);
+  int error = errno;
+  close(fd);
+  if (mem == MAP_FAILED) {
+    throw std::system_error(error, std::generic_category(),
+        "Cannot map the frozen trie image");
+  }
+  mBase = static_cast<const char*>(mem);
+
+  const _FrozenHeader* header =
+      reinterpret_cast<const _FrozenHeader*>(mBase);
+  const char* problem = nullptr;
+  if (strncmp(header->magic, _FrozenHeader::sMagic(), sizeof(header->magic))
+      != 0 || header->byteOrder != _FrozenHeader::sByteOrder) {
+    problem = "Not a frozen trie image";
+  } else if (header->version != _FrozenHeader::sVersion) {
+    problem = "Unknown frozen trie image version";
+  } else if (header->valueSize != sizeof(T) ||
+      header->valueAlign != alignof(T)) {
+    problem = "The frozen trie image holds a different value type";
+  } else if (header->fileSize != mLength || header->top >= mLength) {
+    problem = "The frozen trie image is truncated";
+  }
+  if (problem) {
+    munmap(const_cast<char*>(mBase), mLength);
+    throw std::runtime_error(problem);
+  }
+  mSize = header->size;
+  if (header->top) {
+    mTop = node(header->top);
+  }
+}
+
+template<typename T>
+inline
+FrozenCTrie<T>::FrozenCTrie(FrozenCTrie&& x)
+  : mBase(x.mBase), mLength(x.mLength), mTop(x.mTop), mSize(x.mSize)
+{
+  x.mBase = nullptr;
+  x.mLength = 0;
+  x.mTop = nullptr;
+  x.mSize = 0;
+}
+
+template<typename T>
+FrozenCTrie<T>::~FrozenCTrie()
+{
+  if (mBase) {
+    munmap(const_cast<char*>(mBase), mLength);
+  }
+}
+
+template<typename T>
+typename FrozenCTrie<T>::const_iterator
+FrozenCTrie<T>::begin() const
+{
+  const_iterator iter(this);
+  if (mTop) {
+    iter.push(mTop);
+    iter.settle();
+  }
+  return iter;
+}
+
+// Return the node whose key is the given one, or null.
+template<typename T>
+const typename FrozenCTrie<T>::NodeT*
+FrozenCTrie<T>::findNode(const char* keyData, size_t keyLen) const
+{
+  const NodeT* n = mTop;
+  size_t pos = 0;
+  while (n) {
+    size_t end = pos + n->strLen();
+    if (end > keyLen || memcmp(n->str(), keyData + pos, n->strLen()) != 0) {
+      return nullptr;
+    }
+    if (end == keyLen) {
+      return n->hasValue() ? n : nullptr;
+    }
+    u_char key = static_cast<u_char>(keyData[end]);
+    size_t i = n->findChild(key);
+    if (i == n->numChildren() || n->keys()[i] != key) {
+      return nullptr;
+    }
+    n = node(n->child(i));
+    pos = end + 1;
+  }
+  return nullptr;
+}
+
+// Go down the key's path as findNode() does, but building the iterator on
+// the way.
+template<typename T>
+typename FrozenCTrie<T>::const_iterator
+FrozenCTrie<T>::find(const char* keyData, size_t keyLen) const
+{
+  const_iterator iter(this);
+  if (!mTop) {
+    return iter;
+  }
+  if (keyLen == key_type::npos) {
+    keyLen = strlen(keyData);
+  }
+  iter.push(mTop);
+  size_t pos = 0;
+  while (1) {
+    typename const_iterator::Step& step = iter.mPath.back();
+    const NodeT* n = step.node;
+    size_t nodeEnd = pos + n->strLen();
+    if (nodeEnd > keyLen ||
+        memcmp(n->str(), keyData + pos, n->strLen()) != 0) {
+      return end();
+    }
+    if (nodeEnd == keyLen) {
+      return n->hasValue() ? iter : end();
+    }
+    u_char key = static_cast<u_char>(keyData[nodeEnd]);
+    size_t i = n->findChild(key);
+    if (i == n->numChildren() || n->keys()[i] != key) {
+      return end();
+    }
+    step.child = static_cast<ptrdiff_t>(i);
+    iter.mKey += static_cast<char>(key);
+    iter.push(node(n->child(i)));
+    pos = nodeEnd + 1;
+  }
+}
+
+template<typename T>
+size_t
+FrozenCTrie<T>::count(const char* keyData, size_t keyLen) const
+{
+  if (keyLen == key_type::npos) {
+    keyLen = strlen(keyData);
+  }
+  return findNode(keyData, keyLen) ? 1 : 0;
+}
+
+// Go down the key's path.  At the first node whose string differs from the
+// key, all of the node's keys are either less than the key, so the answer
+// is the key after them, or greater, so it is the node's first key.
+template<typename T>
+typename FrozenCTrie<T>::const_iterator
+FrozenCTrie<T>::lower_bound(const char* keyData, size_t keyLen) const
+{
+  const_iterator iter(this);
+  if (!mTop) {
+    return iter;
+  }
+  if (keyLen == key_type::npos) {
+    keyLen = strlen(keyData);
+  }
+  iter.push(mTop);
+  size_t pos = 0;
+  while (1) {
+    typename const_iterator::Step& step = iter.mPath.back();
+    const NodeT* n = step.node;
+    size_t len = std::min(n->strLen(), keyLen - pos);
+    int cmp = memcmp(n->str(), keyData + pos, len);
+    if (cmp < 0) {
+      step.child = static_cast<ptrdiff_t>(n->numChildren());
+      break;
+    }
+    if (cmp > 0 || pos + n->strLen() >= keyLen) {
+      break;
+    }
+    pos += n->strLen();
+    u_char key = static_cast<u_char>(keyData[pos]);
+    size_t i = n->findChild(key);
+    step.child = static_cast<ptrdiff_t>(i);
+    if (i == n->numChildren() || n->keys()[i] != key) {
+      break;
+    }
+    iter.mKey += static_cast<char>(key);
+    iter.push(node(n->child(i)));
+    ++pos;
+  }
+  iter.settle();
+  return iter;
+}
+
+template<typename T>
+bool
+FrozenCTrie<T>::const_iterator::operator==(const const_iterator& x) const
+{
+  if (at_end() || x.at_end()) {
+    return at_end() == x.at_end();
+  }
+  return mPath.back().node == x.mPath.back().node;
+}
+
+template<typename T>
+typename FrozenCTrie<T>::const_iterator&
+FrozenCTrie<T>::const_iterator::operator++()
+{
+  mPath.back().child = 0;
+  settle();
+  return *this;
+}
+
+// Start visiting a node, whose key is mKey followed by the node's string.
+// The character that leads to it must already be in mKey.
+template<typename T>
+inline void
+FrozenCTrie<T>::const_iterator::push(const NodeT* node)
+{
+  Step step = {node, mKey.size(), -1};
+  if (!mPath.empty()) {
+    --step.keyLen;
+  }
+  mPath.push_back(step);
+  mKey.append(node->str(), node->strLen());
+}
+
+// Move on from where the path ends to the first value at or after it.
+template<typename T>
+void
+FrozenCTrie<T>::const_iterator::settle()
+{
+  while (!mPath.empty()) {
+    Step& step = mPath.back();
+    const NodeT* node = step.node;
+    if (step.child < 0) {
+      if (node->hasValue()) {
+        return;
+      }
+      step.child = 0;
+    }
+    size_t i = static_cast<size_t>(step.child);
+    if (i < node->numChildren()) {
+      mKey.resize(step.keyLen + (mPath.size() > 1) + node->strLen());
+      mKey += static_cast<char>(node->keys()[i]);
+      push(mTrie->node(node->child(i)));
+      continue;
+    }
+    mKey.resize(step.keyLen);
+    mPath.pop_back();
+    if (!mPath.empty()) {
+      ++mPath.back().child;
+    }
+  }
+  mKey.clear();
+}
+
+template<typename T>
+inline
+FrozenCTrie<T>::const_prefix_iter::const_prefix_iter(
+    const FrozenCTrie* trie, const key_type& searchStr)
+  : mTrie(trie), mSearchStr(searchStr), mNode(nullptr), mPos(0)
+{
+  nextPrefix(trie->mTop, 0);
+}
+
+template<typename T>
+typename FrozenCTrie<T>::const_prefix_iter&
+FrozenCTrie<T>::const_prefix_iter::operator++()
+{
+  const NodeT* node = mNode;
+  mNode = nullptr;
+  if (mPos < mSearchStr.size()) {
+    u_char key = static_cast<u_char>(mSearchStr[mPos]);
+    size_t i = node->findChild(key);
+    if (i < node->numChildren() && node->keys()[i] == key) {
+      nextPrefix(mTrie->node(node->child(i)), mPos + 1);
+    }
+  }
+  return *this;
+}
+
+// Find the first node from node down whose key is a prefix of the search
+// string and which has a value.  node's key starts at pos.
+template<typename T>
+void
+FrozenCTrie<T>::const_prefix_iter::nextPrefix(const NodeT* node, size_t pos)
+{
+  while (node) {
+    size_t end = pos + node->strLen();
+    if (end > mSearchStr.size() ||
+        memcmp(node->str(), mSearchStr.data() + pos, node->strLen()) != 0) {
+      return;
+    }
+    if (node->hasValue()) {
+      mNode = node;
+      mPos = end;
+      return;
+    }
+    if (end == mSearchStr.size()) {
+      return;
+    }
+    u_char key = static_cast<u_char>(mSearchStr[end]);
+    size_t i = node->findChild(key);
+    if (i == node->numChildren() || node->keys()[i] != key) {
+      return;
+    }
+    node = mTrie->node(node->child(i));
+    pos = end + 1;
+  }
+}
+
+} // end namespace ctrie
+#endif
@@ -3,61 +3,59 @@
  
 namespace ctrie {
 
-template<typename T, template<u_char Sz> class Next, class Alloc>
-class _FullNode : public _BaseNode<T,Next,Alloc> {
+template<typename T, template<u_char> class Next, class Alloc>
+class _FullNode : public _InnerNode<T,Next,Alloc> {
 public:
   typedef _BaseNode<T,Next,Alloc> NodeT;
+  typedef typename NodeT::SlotT SlotT;
   typedef _Leaf<T,Next,Alloc> LeafT;
   typedef _FullNode<T,Next,Alloc> FullNodeT;
-  typedef _FullValueNode<T,Next,Alloc> FullValueNodeT;
+  typedef _IndexNode<T,Next,Alloc> IndexNodeT;
 
 private:
   static const size_t sMaxNumChildren = 1 << (8 * sizeof(char));
-  NodeT* mParent;
-  char mParentIndex;
-  u_char mNumChildren; // really, number of children - 1
-  NodeT* mChildren[sMaxNumChildren];
+  static const u_char sNodeSize = std::numeric_limits<u_char>::max();
+  _KeyBitmap mBitmap;                 // Which entries of mChildren are set
+  SlotT mChildren[sMaxNumChildren];
 
 public:
-  static FullNodeT*
-      create(NodeT* parent, const char* str, size_t strLen, char parentIndex);
-  static FullNodeT* move(FullNodeT& x);
+  static FullNodeT* create(Alloc& alloc, const char* str, size_t strLen);
+  static FullNodeT* move(Alloc& alloc, FullNodeT& x);
   template<u_char SrcSz>
-    static FullNodeT* move(_CmprNode<T,SrcSz,Next,Alloc>& x);
-  NodeT* moveAddValue(const T& valueToAdd) /*override*/;
-  NodeT* clone() const /*override*/;
-  void destroy() /*override*/;
+    static FullNodeT* move(Alloc& alloc, _CmprNode<T,SrcSz,Next,Alloc>& x);
+  static FullNodeT* move(Alloc& alloc, IndexNodeT& x);
+  NodeT* clone(Alloc& alloc) const;
+  void destroy(Alloc& alloc);
+  void detachEntries()                                    {mBitmap.clear();}
   _FullNode& operator=(const _FullNode&) = delete;
 
-  bool empty() const /*override*/                   {return false;}
-  size_t size() const /*override*/                  {return mNumChildren + 1;}
-  size_t treeSize() const /*override*/;
-  NodeT* parent() const /*override */               {return mParent;}
-  void setParent(NodeT* parent)                     {mParent = parent;}
-  char parentIndex() const /*override*/             {return mParentIndex;}
-  void setParentIndex(char i)/*override*/           {mParentIndex = i;}
-  char key(size_t i) /*override*/                   {return (char) i;}
-
-  NodeT** getEntryPtr(size_t i) /*override*/        {return mChildren + i;}
-  NodeT* getEntry(size_t i) const /*override*/      {return mChildren[i];}
-  std::pair<size_t, bool> findEntry(char key) const /*override*/;
-  size_t insertEntry(NodeT* entry, size_t index, char key, NodeT** replacement)
-      /*override*/;
-  size_t eraseEntry(size_t index, NodeT** newNode) /*override*/;
-  size_t firstEntry() const /*override*/;
-  size_t lastEntry() const /*override*/;
-  size_t nextEntry(size_t index) const /*override*/;
-  size_t prevEntry(size_t index) const /*override*/;
+  bool empty() const                                {return false;}
+  size_t size() const                               {return mBitmap.count();}
+  size_t treeSize() const;
+  char key(size_t i)                                {return (char) i;}
+
+  SlotT* getEntryPtr(size_t i)                      {return mChildren + i;}
+  NodeT* getEntry(size_t i) const          {return _loadSlot(mChildren[i]);}
+  std::pair<size_t, bool> findEntry(char key) const;
+  size_t insertEntry(Alloc& alloc,
+      NodeT* entry, size_t index, char key, NodeT** replacement);
+  size_t eraseEntry(Alloc& alloc, size_t index, NodeT** newNode);
+  size_t firstEntry() const;
+  size_t lastEntry() const;
+  size_t nextEntry(size_t index) const;
+  size_t prevEntry(size_t index) const;
 
 protected:
-  _FullNode(NodeT* parent, const char* str, size_t strLen, char parentIndex);
-  _FullNode(const FullNodeT& x);
+  _FullNode(Alloc& alloc, const char* str, size_t strLen);
+  _FullNode(Alloc& alloc, const FullNodeT& x);
+  _FullNode(FullNodeT&& x);
   template<u_char SrcSz>
     _FullNode(_CmprNode<T,SrcSz,Next,Alloc>&& src);
-  ~_FullNode();
+  _FullNode(IndexNodeT&& src);
+  ~_FullNode()                                                             {}
 
 private:
-  static FullNodeT* allocate();
+  static FullNodeT* allocate(Alloc& alloc);
   void init();
 
   friend class _CmprNode<T,2,Next,Alloc>;
@@ -65,56 +63,14 @@ private:
   friend class _CmprNode<T,8,Next,Alloc>;
   friend class _CmprNode<T,16,Next,Alloc>;
   friend class _CmprNode<T,32,Next,Alloc>;
-};
-
-template<typename T, template<u_char Sz> class Next, class Alloc>
-class _FullValueNode : public _FullNode<T,Next,Alloc> {
-private:
-  T mValue;
-
-public:
-  typedef _BaseNode<T,Next,Alloc> NodeT;
-  typedef _FullNode<T,Next,Alloc> FullNodeT;
-  typedef _FullValueNode<T,Next,Alloc> ValueNodeT;
-
-  static ValueNodeT* create(NodeT* parent, const char* str, size_t strLen,
-      char parentIndex);
-  template<u_char SrcSz>
-    static ValueNodeT* move(_CmprValueNode<T,SrcSz,Next,Alloc>& x);
-  static ValueNodeT* move(_FullNode<T,Next,Alloc>& x, const T& value);
-
-  NodeT* clone() const /*override*/;
-  NodeT* moveRemoveValue() /*override*/        {return FullNodeT::move(*this);}
-  void destroy() /*override*/;
-  _FullValueNode(const ValueNodeT&&) = delete;
-  ValueNodeT& operator=(const ValueNodeT&) = delete;
-  ValueNodeT& operator=(const ValueNodeT&&) = delete;
-
-  bool hasValue() const /*override*/           {return true;}
-  T& value() /*override*/                      {return mValue;}
-  const T& value() const /*override*/          {return mValue;}
-  T&& valueToMove() /*override*/               {return std::move(mValue);}
-
-protected:
-  ~_FullValueNode()                            {}
-
-private:
-  _FullValueNode(NodeT* parent, const char* str, size_t strLen,
-      char parentIndex, T& value);
-  _FullValueNode(const ValueNodeT& src);
-  _FullValueNode(FullNodeT&& src, const T& value);
-  template<u_char SrcSz>
-    _FullValueNode(_CmprValueNode<T,SrcSz,Next,Alloc>&& src);
-
-  static ValueNodeT* allocate();
+  friend class _IndexNode<T,Next,Alloc>;
 };
 
 template<typename T, template<u_char> class Next, class Alloc>
 inline
 _FullNode<T,Next,Alloc>::_FullNode(
-    NodeT* parent, const char* str, size_t strLen, char parentIndex)
-  : _BaseNode<T,Next,Alloc>(str, strLen), mParent(parent),
-    mParentIndex(parentIndex), mNumChildren(0)
+    Alloc& alloc, const char* str, size_t strLen)
+  : _InnerNode<T,Next,Alloc>(alloc, str, strLen, sNodeSize)
 {
   init();
 }
@@ -122,94 +78,104 @@ _FullNode<T,Next,Alloc>::_FullNode(
 template<typename T, template<u_char> class Next, class Alloc>
 template<u_char SrcSz>
 _FullNode<T,Next,Alloc>::_FullNode(_CmprNode<T,SrcSz,Next,Alloc>&& src)
-  : _BaseNode<T,Next,Alloc>(std::move(src)), mParent(0), mParentIndex(0),
-     mNumChildren(0)
+  : _InnerNode<T,Next,Alloc>(std::move(src), sNodeSize)
 {
   init();
-  std::swap(mParent, src.mParent);
-  mNumChildren = static_cast<u_char>(src.mNumChildren - 1);
-  src.mNumChildren = 0;
-  mParentIndex = src.parentIndex();
-  for (u_char i = 0; i <= mNumChildren; ++i) {
+  for (u_char i = 0; i < src.mNumChildren; ++i) {
     mChildren[src.mCharTable[i]] = src.mChildren[i];
-    if (dynamic_cast<LeafT*>(src.mChildren[i]) == 0) {
-      src.mChildren[i]->setParent(this);
-    }
+    mBitmap.set(src.mCharTable[i]);
     src.mChildren[i] = 0;
   }
+  src.mNumChildren = 0;
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+_FullNode<T,Next,Alloc>::_FullNode(IndexNodeT&& src)
+  : _InnerNode<T,Next,Alloc>(std::move(src), sNodeSize)
+{
+  init();
+  for (size_t i = src.firstEntry(); i != NodeT::endIndex();
+      i = src.nextEntry(i)) {
+    SlotT* node = src.getEntryPtr(i);
+    mChildren[i] = *node;
+    mBitmap.set(i);
+    *node = 0;
+  }
+  src.clearEntries();
 }
 
 template<typename T, template<u_char> class Next, class Alloc>
-_FullNode<T,Next,Alloc>::_FullNode(const FullNodeT& x)
-  : _BaseNode<T,Next,Alloc>(x), mParent(x.mParent),
-    mParentIndex(x.mParentIndex), mNumChildren(x.mNumChildren)
+_FullNode<T,Next,Alloc>::_FullNode(Alloc& alloc, const FullNodeT& x)
+  : _InnerNode<T,Next,Alloc>(alloc, x, sNodeSize)
 {
-  for (size_t i = 0; i < sMaxNumChildren; ++i) {
-    mChildren[i] = nullptr;
-    if (x.mChildren[i]) {
-      mChildren[i] = x.mChildren[i]->clone();
-      if (dynamic_cast<LeafT*>(mChildren[i]) == 0) {
-        mChildren[i]->setParent(this);
-      }
-    }
+  init();
+  mBitmap = x.mBitmap;
+  for (size_t i = firstEntry(); i != NodeT::endIndex(); i = nextEntry(i)) {
+    mChildren[i] = NodeT::cloneEntry(alloc, x.mChildren[i]);
   }
 }
 
 template<typename T, template<u_char> class Next, class Alloc>
-_FullNode<T,Next,Alloc>::~_FullNode()
+_FullNode<T,Next,Alloc>::_FullNode(FullNodeT&& src)
+  : _InnerNode<T,Next,Alloc>(std::move(src), sNodeSize)
 {
-  for (size_t i = 0; i < sMaxNumChildren; ++i) {
-    if (mChildren[i]) {
-      mChildren[i]->destroy();
-      mChildren[i] = nullptr;
-    }
+  init();
+  std::swap(mBitmap, src.mBitmap);
+  for (size_t i = firstEntry(); i != NodeT::endIndex(); i = nextEntry(i)) {
+    std::swap(mChildren[i], src.mChildren[i]);
   }
 }
 
 template<typename T, template<u_char> class Next, class Alloc>
 inline _FullNode<T,Next,Alloc>*
 _FullNode<T,Next,Alloc>::create(
-    NodeT* parent, const char* str, size_t strLen, char parentIndex)
+    Alloc& alloc, const char* str, size_t strLen)
 {
-  return new(allocate()) FullNodeT(parent, str, strLen, parentIndex);
+  return new(allocate(alloc)) FullNodeT(alloc, str, strLen);
 }
 
 template<typename T, template<u_char> class Next, class Alloc>
 inline _FullNode<T,Next,Alloc>*
-_FullNode<T,Next,Alloc>::move(FullNodeT& x)
+_FullNode<T,Next,Alloc>::move(Alloc& alloc, FullNodeT& x)
 {
-  return new(allocate()) FullNodeT(std::move(x));
+  return new(allocate(alloc)) FullNodeT(std::move(x));
 }
 
 template<typename T, template<u_char> class Next, class Alloc>
 template<u_char SrcSz>
 inline _FullNode<T,Next,Alloc>*
-_FullNode<T,Next,Alloc>::move(_CmprNode<T,SrcSz,Next,Alloc>& x)
+_FullNode<T,Next,Alloc>::move(
+    Alloc& alloc, _CmprNode<T,SrcSz,Next,Alloc>& x)
 {
-  return new(allocate()) FullNodeT(std::move(x));
+  return new(allocate(alloc)) FullNodeT(std::move(x));
 }
 
 template<typename T, template<u_char> class Next, class Alloc>
-inline _BaseNode<T,Next,Alloc>*
-_FullNode<T,Next,Alloc>::moveAddValue(const T& valueToAdd)
+inline _FullNode<T,Next,Alloc>*
+_FullNode<T,Next,Alloc>::move(Alloc& alloc, IndexNodeT& x)
 {
-  return FullValueNodeT::move(*this, valueToAdd);
+  return new(allocate(alloc)) FullNodeT(std::move(x));
 }
 
 template<typename T, template<u_char> class Next, class Alloc>
 inline _BaseNode<T,Next,Alloc>*
-_FullNode<T,Next,Alloc>::clone() const
+_FullNode<T,Next,Alloc>::clone(Alloc& alloc) const
 {
-  return new(allocate()) FullNodeT(*this);
+  return new(allocate(alloc)) FullNodeT(alloc, *this);
 }
 
 template<typename T, template<u_char> class Next, class Alloc>
 inline void
-_FullNode<T,Next,Alloc>::destroy()
+_FullNode<T,Next,Alloc>::destroy(Alloc& alloc)
 {
-  typename Alloc::template rebind<FullNodeT>::other alloc;
+  for (size_t i = firstEntry(); i != NodeT::endIndex(); i = nextEntry(i)) {
+    NodeT::destroyEntry(alloc, mChildren[i]);
+  }
+  this->destroyInner(alloc);
+  typename std::allocator_traits<Alloc>::template rebind_alloc<FullNodeT>
+      nodeAlloc(alloc);
   this->~_FullNode<T,Next,Alloc>();
-  alloc.deallocate(this, 1);
+  nodeAlloc.deallocate(this, 1);
 }
 
 template<typename T, template<u_char> class Next, class Alloc>
@@ -217,10 +183,8 @@ size_t
 _FullNode<T,Next,Alloc>::treeSize() const
 {
    size_t size = this->hasValue() ? 1 : 0;
-   for (size_t i = 0; i < sMaxNumChildren; ++i) {
-      if (mChildren[i]) {
-	 size += mChildren[i]->treeSize();
-      }
+   for (size_t i = firstEntry(); i != NodeT::endIndex(); i = nextEntry(i)) {
+      size += NodeT::entryTreeSize(mChildren[i]);
    }
    return size;
 }
@@ -229,46 +193,37 @@ template<typename T, template<u_char> class Next, class Alloc>
 inline std::pair<size_t, bool>
 _FullNode<T,Next,Alloc>::findEntry(char key) const
 {
-  return std::make_pair(key, mChildren[static_cast<u_char>(key)] != nullptr);
+  size_t index = static_cast<u_char>(key);
+  return std::make_pair(index, mBitmap.test(index));
 }
 
 template<typename T, template<u_char> class Next, class Alloc>
 size_t
 _FullNode<T,Next,Alloc>::insertEntry(
-    NodeT* entry, size_t index, char key, NodeT**)
+    Alloc&, NodeT* entry, size_t index, char, NodeT**)
 {
   assert(index < sMaxNumChildren);
   assert(mChildren[index] == nullptr);
-  if (dynamic_cast<LeafT*>(entry) == 0) {
-    entry->setParent(this);
-    entry->setParentIndex(key);
-  }
-  mChildren[index] = entry;
-  ++mNumChildren;
+  mChildren[index] = NodeT::makeEntry(entry);
+  mBitmap.set(index);
   return index;
 }
 
 template<typename T, template<u_char> class Next, class Alloc>
 size_t
-_FullNode<T,Next,Alloc>::eraseEntry(size_t index, NodeT** newNode)
+_FullNode<T,Next,Alloc>::eraseEntry(
+    Alloc& alloc, size_t index, NodeT** newNode)
 {
-  --mNumChildren;
+  typedef _NodeSize<T,Next<std::numeric_limits<u_char>::max()>::down,Next,
+      Alloc> DownT;
+
   *newNode = this;
   size_t nextIndex = nextEntry(index);
   bool atEnd = (nextIndex == NodeT::endIndex());
   mChildren[index] = 0;
-  if (mNumChildren + 1 <=
-      Next<std::numeric_limits<u_char>::max()>::downThreshold) {
-    FullValueNodeT *nodeWithValue = dynamic_cast<FullValueNodeT*>(this);
-    if (nodeWithValue) {
-      *newNode = _CmprValueNode<
-          T,Next<std::numeric_limits<u_char>::max()>::down,Next,Alloc>::
-          move(*nodeWithValue);
-    } else {
-      *newNode = _CmprNode<
-          T,Next<std::numeric_limits<u_char>::max()>::down,Next,Alloc>::
-          move(*this);
-    }
+  mBitmap.reset(index);
+  if (size() <= Next<std::numeric_limits<u_char>::max()>::downThreshold) {
+    *newNode = DownT::Type::move(alloc, *this);
     nextIndex = atEnd ? NodeT::endIndex() :
         (*newNode)->findEntry((char) nextIndex).first;
   }
@@ -290,123 +245,42 @@ _FullNode<T,Next,Alloc>::lastEntry() const
 }
 
 template<typename T, template<u_char> class Next, class Alloc>
-size_t
+inline size_t
 _FullNode<T,Next,Alloc>::nextEntry(size_t index) const
 {
-  index = index == NodeT::valueIndex() ? 0 : (index + 1);
-  for (; index < sMaxNumChildren && mChildren[index] == nullptr; ++index) {}
-  return index < sMaxNumChildren ? index : NodeT::endIndex();
+  index = mBitmap.next(index == NodeT::valueIndex() ? 0 : (index + 1));
+  return index == _KeyBitmap::npos ? NodeT::endIndex() : index;
 }
 
 template<typename T, template<u_char> class Next, class Alloc>
-size_t
+inline size_t
 _FullNode<T,Next,Alloc>::prevEntry(size_t index) const
 {
   if (index == NodeT::valueIndex() || index == 0) {
     return NodeT::valueIndex();
   }
 
-  index = index == NodeT::endIndex() ? (sMaxNumChildren - 1) : (index - 1);
-  for (; mChildren[index] == nullptr; --index) {
-    if (index == 0) {
-      return NodeT::valueIndex();
-    }
-  }
-  return index;
+  index = mBitmap.prev(
+      index == NodeT::endIndex() ? (sMaxNumChildren - 1) : (index - 1));
+  return index == _KeyBitmap::npos ? NodeT::valueIndex() : index;
 }
 
 template<typename T, template<u_char> class Next, class Alloc>
 inline _FullNode<T,Next,Alloc>*
-_FullNode<T,Next,Alloc>::allocate()
+_FullNode<T,Next,Alloc>::allocate(Alloc& alloc)
 {
-  typename Alloc::template rebind<FullNodeT>::other alloc;
-  return alloc.allocate(1);
+  typename std::allocator_traits<Alloc>::template rebind_alloc<FullNodeT>
+      nodeAlloc(alloc);
+  return nodeAlloc.allocate(1);
 }
 
 template<typename T, template<u_char> class Next, class Alloc>
 inline void
 _FullNode<T,Next,Alloc>::init()
 {
+  mBitmap.clear();
   std::fill(mChildren, mChildren + sMaxNumChildren, nullptr);
 }
 
-template<typename T, template<u_char> class Next, class Alloc>
-inline
-_FullValueNode<T,Next,Alloc>::_FullValueNode(
-    NodeT* parent, const char* str, size_t strLen, char parentIndex, T& value)
-  : _FullNode<T,Next,Alloc>(str, strLen, parentIndex),
-    mValue(value)
-{}
-
-template<typename T, template<u_char> class Next, class Alloc>
-inline
-_FullValueNode<T,Next,Alloc>::_FullValueNode(const ValueNodeT& src)
-  : _FullNode<T,Next,Alloc>(src),
-   mValue(src.value())
-{}
-
-template<typename T, template<u_char> class Next, class Alloc>
-inline
-_FullValueNode<T,Next,Alloc>::_FullValueNode(FullNodeT&& src, const T& value)
-  : _FullNode<T,Next,Alloc>(std::move(src)),
-    mValue(value)
-{}
-
-template<typename T, template<u_char> class Next, class Alloc>
-template<u_char SrcSz>
-inline
-_FullValueNode<T,Next,Alloc>::_FullValueNode(
-    _CmprValueNode<T,SrcSz,Next,Alloc>&& src)
-  : _FullNode<T,Next,Alloc>(std::move(src)),
-    mValue(src.valueToMove())
-{}
-
-template<typename T, template<u_char> class Next, class Alloc>
-inline _FullValueNode<T,Next,Alloc>*
-_FullValueNode<T,Next,Alloc>::create(
-    NodeT* parent, const char* str, size_t strLen, char parentIndex)
-{
-  return new(allocate()) ValueNodeT(parent, str, strLen, parentIndex);
-}
-
-template<typename T, template<u_char> class Next, class Alloc>
-template<u_char SrcSz>
-inline _FullValueNode<T,Next,Alloc>*
-_FullValueNode<T,Next,Alloc>::move(_CmprValueNode<T,SrcSz,Next,Alloc>& x)
-{
-  return new(allocate()) ValueNodeT(std::move(x));
-}
-
-template<typename T, template<u_char> class Next, class Alloc>
-inline _FullValueNode<T,Next,Alloc>*
-_FullValueNode<T,Next,Alloc>:: move(_FullNode<T,Next,Alloc>& x, const T& value)
-{
-  return new(allocate()) ValueNodeT(std::move(x), value);
-}
-
-template<typename T, template<u_char> class Next, class Alloc>
-inline _BaseNode<T,Next,Alloc>*
-_FullValueNode<T,Next,Alloc>::clone() const
-{
-  return new(allocate()) ValueNodeT(*this);
-}
-
-template<typename T, template<u_char> class Next, class Alloc>
-inline _FullValueNode<T,Next,Alloc>*
-_FullValueNode<T,Next,Alloc>::allocate()
-{
-  typename Alloc::template rebind<ValueNodeT>::other alloc;
-  return alloc.allocate(1);
-}
-
-template<typename T, template<u_char> class Next, class Alloc>
-inline void
-_FullValueNode<T,Next,Alloc>::destroy()
-{
-  typename Alloc::template rebind<ValueNodeT>::other alloc;
-  this->~_FullValueNode<T,Next,Alloc>();
-  alloc.deallocate(this, 1);
-}
-
 } // end namespace ctrie
 #endif
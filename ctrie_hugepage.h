@@ -0,0 +1,267 @@
+#ifndef _CTRIE_HUGEPAGE_H
+#define _CTRIE_HUGEPAGE_H
+ 
+namespace ctrie {
+
+// A heap for one trie, carved out of spans that are aligned on the 2MB huge
+// page size and marked with madvise(MADV_HUGEPAGE), so that the kernel can
+// back them with transparent huge pages.  The trie's nodes then sit in a few
+// huge pages rather than in small pages spread across the process heap, and a
+// random lookup needs far fewer TLB entries.
+//
+// Spans start at one huge page and double up to sMaxSpanSize.  Freed blocks
+// are reused through _FreeLists.  If the kernel has no THP support, madvise
+// fails and the spans are just ordinary pages.
+class _HugePageHeap {
+public:
+  static const size_t sHugePageSize = 2 * 1024 * 1024;
+  static const size_t sMaxSpanSize = 64 * 1024 * 1024;
+  static const size_t sColourStep = 1024 + 64;
+  static const size_t sNumColours = 64;
+
+private:
+  struct Span {
+    Span* next;
+    size_t size;
+  };
+
+  Span* mSpans;
+  char* mNext;                // The free space left in the current span
+  char* mEnd;
+  size_t mSpanSize;           // The size of the next span
+  _FreeLists mFreeLists;
+  size_t mRefs;
+  bool mHugePages;            // Whether madvise took every span
+  size_t mColour;
+
+public:
+  _HugePageHeap()
+    : mSpans(nullptr), mNext(nullptr), mEnd(nullptr),
+      mSpanSize(sHugePageSize), mRefs(1), mHugePages(true),
+      mColour(nextColour()) {}
+  _HugePageHeap(const _HugePageHeap&) = delete;
+  _HugePageHeap& operator=(const _HugePageHeap&) = delete;
+  ~_HugePageHeap();
+
+  void ref()                                                      {++mRefs;}
+  bool unref()                                       {return --mRefs == 0;}
+
+  void* allocate(size_t bytes);
+  void deallocate(void* p, size_t bytes)
+                            {mFreeLists.push(p, _FreeLists::roundUp(bytes));}
+  size_t spanCount() const;
+  size_t bytesReserved() const;
+  bool hugePages() const                         {return mSpans && mHugePages;}
+
+private:
+  void* allocateSpan(size_t size);
+  Span* mapSpan(size_t size);
+  static size_t nextColour();
+};
+
+// An allocator that can be given to CTrie as its Alloc, which takes all of
+// the trie's memory from a _HugePageHeap of its own.  It is meant for large
+// tries, where the TLB misses of walking nodes all over the heap are a good
+// part of the cost of find(); every trie with one holds at least a 2MB span.
+//
+// A copy of the trie gets a heap of its own, and a trie that is moved or
+// swapped takes its heap with it.
+template<class T>
+class HugePageAllocator {
+private:
+  _HugePageHeap* mHeap;
+
+  template<class U> friend class HugePageAllocator;
+
+public:
+  typedef T value_type;
+  typedef T* pointer;
+  typedef const T* const_pointer;
+  typedef T& reference;
+  typedef const T& const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+
+  static_assert(alignof(T) <= _FreeLists::sGranule,
+                "A _HugePageHeap does not align blocks beyond its granule");
+
+  template<class U> struct rebind {typedef HugePageAllocator<U> other;};
+
+  HugePageAllocator() : mHeap(new _HugePageHeap)                           {}
+  HugePageAllocator(const HugePageAllocator& x)
+    : mHeap(x.mHeap)                                          {mHeap->ref();}
+  template<class U> HugePageAllocator(const HugePageAllocator<U>& x)
+    : mHeap(x.mHeap)                                          {mHeap->ref();}
+  HugePageAllocator& operator=(const HugePageAllocator& x);
+  ~HugePageAllocator()                     {if (mHeap->unref()) delete mHeap;}
+
+  HugePageAllocator select_on_container_copy_construction() const
+                                                 {return HugePageAllocator();}
+
+  T* allocate(size_t n)
+                  {return static_cast<T*>(mHeap->allocate(n * sizeof(T)));}
+  void deallocate(T* p, size_t n)   {mHeap->deallocate(p, n * sizeof(T));}
+  size_t max_size() const
+                    {return std::numeric_limits<size_t>::max() / sizeof(T);}
+
+  template<class U, class... Args> void construct(U* p, Args&&... args)
+               {::new(static_cast<void*>(p)) U(std::forward<Args>(args)...);}
+  template<class U> void destroy(U* p)                               {p->~U();}
+
+  size_t spanCount() const                         {return mHeap->spanCount();}
+  size_t bytesReserved() const                 {return mHeap->bytesReserved();}
+  bool hugePages() const                           {return mHeap->hugePages();}
+
+  template<class U> bool operator==(const HugePageAllocator<U>& x) const
+                                                   {return mHeap == x.mHeap;}
+  template<class U> bool operator!=(const HugePageAllocator<U>& x) const
+                                                   {return mHeap != x.mHeap;}
+};
+
+inline
+_HugePageHeap::~_HugePageHeap()
+{
+  while (mSpans) {
+    Span* next = mSpans->next;
+    munmap(mSpans, mSpans->size);
+    mSpans = next;
+  }
+}
+
+inline void*
+_HugePageHeap::allocate(size_t bytes)
+{
+  size_t size = _FreeLists::roundUp(bytes);
+  void* block = mFreeLists.pop(size);
+  if (block) {
+    return block;
+  }
+  if (size <= static_cast<size_t>(mEnd - mNext)) {
+    block = mNext;
+    mNext += size;
+    return block;
+  }
+  return allocateSpan(size);
+}
+
+inline size_t
+_HugePageHeap::spanCount() const
+{
+  size_t count = 0;
+  for (const Span* span = mSpans; span; span = span->next) {
+    ++count;
+  }
+  return count;
+}
+
+inline size_t
+_HugePageHeap::bytesReserved() const
+{
+  size_t bytes = 0;
+  for (const Span* span = mSpans; span; span = span->next) {
+    bytes += span->size;
+  }
+  return bytes;
+}
+
+// Start a new span for a request that does not fit in the current one.  What
+// is left of the current span is not used, unless the request is large
+// compared with the largest spans, in which case it gets a span of its own.
+inline void*
+_HugePageHeap::allocateSpan(size_t size)
+{
+  size_t header = _FreeLists::roundUp(sizeof(Span));
+  size_t needed = header + size;
+  if (needed > sMaxSpanSize / 4) {
+    size_t spanSize = (needed + sHugePageSize - 1) / sHugePageSize *
+        sHugePageSize;
+    return reinterpret_cast<char*>(mapSpan(spanSize)) + header;
+  }
+
+  if (!mSpans) {
+    needed += mColour * sColourStep;
+  }
+  while (mSpanSize < needed) {
+    mSpanSize *= 2;
+  }
+  Span* span = mapSpan(mSpanSize);
+  mNext = reinterpret_cast<char*>(span) + header;
+  if (!span->next) {
+    mNext += mColour * sColourStep;
+  }
+  mEnd = reinterpret_cast<char*>(span) + mSpanSize;
+  if (mSpanSize < sMaxSpanSize) {
+    mSpanSize *= 2;
+  }
+
+  void* block = mNext;
+  mNext += size;
+  return block;
+}
+
+// Since every span starts on a huge page boundary, the first nodes of
+// different tries would all map to the same cache sets, and a search that goes
+// through many tries would keep evicting them.  So each heap starts its first
+// span at a different offset, its colour.  Tries may be made on several
+// threads at once, so the count is atomic.
+inline size_t
+_HugePageHeap::nextColour()
+{
+  static std::atomic<size_t> sNextColour(0);
+  return sNextColour.fetch_add(1, std::memory_order_relaxed) % sNumColours;
+}
+
+// Map size bytes aligned on a huge page, by mapping an extra huge page and
+// giving back what is left over on either side of the aligned span.
+inline _HugePageHeap::Span*
+_HugePageHeap::mapSpan(size_t size)
+{
+  size_t len = size + sHugePageSize;
+  void* mem = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    throw std::bad_alloc();
+  }
+  char* start = static_cast<char*>(mem);
+  uintptr_t addr = reinterpret_cast<uintptr_t>(start);
+  char* aligned =
+      start + (sHugePageSize - addr % sHugePageSize) % sHugePageSize;
+  if (aligned != start) {
+    munmap(start, static_cast<size_t>(aligned - start));
+  }
+  char* end = aligned + size;
+  if (end != start + len) {
+    munmap(end, static_cast<size_t>(start + len - end));
+  }
+
+#ifdef MADV_HUGEPAGE
+  if (madvise(aligned, size, MADV_HUGEPAGE) != 0) {
+    mHugePages = false;
+  }
+#else
+  mHugePages = false;
+#endif
+
+  Span* span = reinterpret_cast<Span*>(aligned);
+  span->next = mSpans;
+  span->size = size;
+  mSpans = span;
+  return span;
+}
+
+template<class T>
+inline HugePageAllocator<T>&
+HugePageAllocator<T>::operator=(const HugePageAllocator& x)
+{
+  x.mHeap->ref();
+  if (mHeap->unref()) {
+    delete mHeap;
+  }
+  mHeap = x.mHeap;
+  return *this;
+}
+
+} // end namespace ctrie
+#endif
@@ -0,0 +1,349 @@
+#ifndef _CTRIE_INDEX_H
+#define _CTRIE_INDEX_H
+
+namespace ctrie {
+
+// A node for up to 48 children.  Like a _FullNode, its entries are indexed by
+// key, but the key only selects a byte in mSlots, which in turn selects one of
+// the 48 child pointers.  This keeps wide nodes much smaller than a _FullNode
+// while still avoiding any search of a character table.
+template<typename T, template<u_char> class Next, class Alloc>
+class _IndexNode : public _InnerNode<T,Next,Alloc> {
+public:
+  typedef _BaseNode<T,Next,Alloc> NodeT;
+  typedef typename NodeT::SlotT SlotT;
+  typedef _Leaf<T,Next,Alloc> LeafT;
+  typedef _IndexNode<T,Next,Alloc> IndexNodeT;
+  typedef _FullNode<T,Next,Alloc> FullNodeT;
+
+private:
+  static const size_t sMaxNumChildren = 48;
+  static const size_t sNumKeys = 1 << (8 * sizeof(char));
+  u_char mNumChildren;
+  u_char mSlots[sNumKeys];            // 1 + the mChildren index of each key
+  _KeyBitmap mBitmap;                 // Which keys have an entry
+  SlotT mChildren[sMaxNumChildren];
+
+public:
+  static IndexNodeT* create(Alloc& alloc, const char* str, size_t strLen);
+  static IndexNodeT* move(Alloc& alloc, IndexNodeT& x);
+  template<u_char SrcSz>
+    static IndexNodeT* move(Alloc& alloc, _CmprNode<T,SrcSz,Next,Alloc>& x);
+  static IndexNodeT* move(Alloc& alloc, FullNodeT& x);
+  NodeT* clone(Alloc& alloc) const;
+  void destroy(Alloc& alloc);
+  void detachEntries()                                     {clearEntries();}
+  _IndexNode& operator=(const _IndexNode&) = delete;
+
+  bool empty() const                             {return mNumChildren == 0;}
+  size_t size() const                            {return mNumChildren;}
+  size_t treeSize() const;
+  char key(size_t i)                             {return (char) i;}
+
+  SlotT* getEntryPtr(size_t i)           {return mChildren + mSlots[i] - 1;}
+  NodeT* getEntry(size_t i) const;
+  std::pair<size_t, bool> findEntry(char key) const;
+  size_t insertEntry(Alloc& alloc,
+      NodeT* entry, size_t index, char key, NodeT** replacement);
+  size_t eraseEntry(Alloc& alloc, size_t index, NodeT** newNode);
+  size_t firstEntry() const;
+  size_t lastEntry() const;
+  size_t nextEntry(size_t index) const;
+  size_t prevEntry(size_t index) const;
+
+protected:
+  _IndexNode(Alloc& alloc, const char* str, size_t strLen);
+  _IndexNode(Alloc& alloc, const IndexNodeT& x);
+  _IndexNode(IndexNodeT&& x);
+  template<u_char SrcSz>
+    _IndexNode(_CmprNode<T,SrcSz,Next,Alloc>&& src);
+  _IndexNode(FullNodeT&& src);
+  ~_IndexNode()                                                            {}
+
+private:
+  static IndexNodeT* allocate(Alloc& alloc);
+  void init();
+  void clearEntries();
+  void addEntry(NodeT* entry, size_t index);
+
+  friend class _CmprNode<T,2,Next,Alloc>;
+  friend class _CmprNode<T,4,Next,Alloc>;
+  friend class _CmprNode<T,8,Next,Alloc>;
+  friend class _CmprNode<T,16,Next,Alloc>;
+  friend class _CmprNode<T,32,Next,Alloc>;
+  friend class _FullNode<T,Next,Alloc>;
+};
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline
+_IndexNode<T,Next,Alloc>::_IndexNode(
+    Alloc& alloc, const char* str, size_t strLen)
+  : _InnerNode<T,Next,Alloc>(alloc, str, strLen, 48), mNumChildren(0)
+{
+  init();
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+template<u_char SrcSz>
+_IndexNode<T,Next,Alloc>::_IndexNode(_CmprNode<T,SrcSz,Next,Alloc>&& src)
+  : _InnerNode<T,Next,Alloc>(std::move(src), 48), mNumChildren(0)
+{
+  assert(src.mNumChildren <= sMaxNumChildren);
+  init();
+  for (u_char i = 0; i < src.mNumChildren; ++i) {
+    addEntry(src.mChildren[i], src.mCharTable[i]);
+    src.mChildren[i] = 0;
+  }
+  src.mNumChildren = 0;
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+_IndexNode<T,Next,Alloc>::_IndexNode(FullNodeT&& src)
+  : _InnerNode<T,Next,Alloc>(std::move(src), 48), mNumChildren(0)
+{
+  assert(src.size() <= sMaxNumChildren);
+  init();
+  for (size_t i = src.firstEntry(); i != NodeT::endIndex();
+      i = src.nextEntry(i)) {
+    addEntry(src.mChildren[i], i);
+    src.mChildren[i] = 0;
+  }
+  src.mBitmap.clear();
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+_IndexNode<T,Next,Alloc>::_IndexNode(Alloc& alloc, const IndexNodeT& x)
+  : _InnerNode<T,Next,Alloc>(alloc, x, 48), mNumChildren(0)
+{
+  init();
+  for (size_t i = x.firstEntry(); i != NodeT::endIndex(); i = x.nextEntry(i)) {
+    addEntry(NodeT::cloneEntry(alloc, x.getEntry(i)), i);
+  }
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+_IndexNode<T,Next,Alloc>::_IndexNode(IndexNodeT&& src)
+  : _InnerNode<T,Next,Alloc>(std::move(src), 48), mNumChildren(0)
+{
+  init();
+  for (size_t i = src.firstEntry(); i != NodeT::endIndex();
+      i = src.nextEntry(i)) {
+    SlotT* node = src.getEntryPtr(i);
+    addEntry(*node, i);
+    *node = 0;
+  }
+  src.clearEntries();
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline _IndexNode<T,Next,Alloc>*
+_IndexNode<T,Next,Alloc>::create(
+    Alloc& alloc, const char* str, size_t strLen)
+{
+  return new(allocate(alloc)) IndexNodeT(alloc, str, strLen);
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline _IndexNode<T,Next,Alloc>*
+_IndexNode<T,Next,Alloc>::move(Alloc& alloc, IndexNodeT& x)
+{
+  return new(allocate(alloc)) IndexNodeT(std::move(x));
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+template<u_char SrcSz>
+inline _IndexNode<T,Next,Alloc>*
+_IndexNode<T,Next,Alloc>::move(
+    Alloc& alloc, _CmprNode<T,SrcSz,Next,Alloc>& x)
+{
+  return new(allocate(alloc)) IndexNodeT(std::move(x));
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline _IndexNode<T,Next,Alloc>*
+_IndexNode<T,Next,Alloc>::move(Alloc& alloc, FullNodeT& x)
+{
+  return new(allocate(alloc)) IndexNodeT(std::move(x));
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline _BaseNode<T,Next,Alloc>*
+_IndexNode<T,Next,Alloc>::clone(Alloc& alloc) const
+{
+  return new(allocate(alloc)) IndexNodeT(alloc, *this);
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline void
+_IndexNode<T,Next,Alloc>::destroy(Alloc& alloc)
+{
+  for (u_char i = 0; i < mNumChildren; ++i) {
+    NodeT::destroyEntry(alloc, mChildren[i]);
+  }
+  this->destroyInner(alloc);
+  typename std::allocator_traits<Alloc>::template rebind_alloc<IndexNodeT>
+      nodeAlloc(alloc);
+  this->~_IndexNode<T,Next,Alloc>();
+  nodeAlloc.deallocate(this, 1);
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+size_t
+_IndexNode<T,Next,Alloc>::treeSize() const
+{
+   size_t size = this->hasValue() ? 1 : 0;
+   for (u_char i = 0; i < mNumChildren; ++i) {
+      size += NodeT::entryTreeSize(mChildren[i]);
+   }
+   return size;
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline _BaseNode<T,Next,Alloc>*
+_IndexNode<T,Next,Alloc>::getEntry(size_t i) const
+{
+  if (!mSlots[i]) {
+    return nullptr;
+  }
+  return _loadSlot(mChildren[mSlots[i] - 1]);
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline std::pair<size_t, bool>
+_IndexNode<T,Next,Alloc>::findEntry(char key) const
+{
+  size_t index = static_cast<u_char>(key);
+  return std::make_pair(index, mSlots[index] != 0);
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+size_t
+_IndexNode<T,Next,Alloc>::insertEntry(Alloc& alloc,
+    NodeT* entry, size_t index, char key, NodeT** replacement)
+{
+  assert(index < sNumKeys);
+  assert(mSlots[index] == 0);
+  if (mNumChildren != sMaxNumChildren) {
+    addEntry(NodeT::makeEntry(entry), index);
+    return index;
+  }
+
+  // This node has run out of room, so replace it with the next size up.
+  typedef _NodeSize<T,Next<48>::up,Next,Alloc> UpT;
+  assert(replacement != nullptr);
+  *replacement = UpT::Type::move(alloc, *this);
+  destroy(alloc);
+  index = (*replacement)->findEntry(key).first;
+  return (*replacement)->insertEntry(alloc, entry, index, key, replacement);
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+size_t
+_IndexNode<T,Next,Alloc>::eraseEntry(
+    Alloc& alloc, size_t index, NodeT** newNode)
+{
+  typedef _NodeSize<T,Next<48>::down,Next,Alloc> DownT;
+  assert(mSlots[index] != 0);
+
+  // Keep the child array packed by moving the last child into the hole.
+  *newNode = this;
+  size_t slot = mSlots[index] - 1;
+  --mNumChildren;
+  if (slot != mNumChildren) {
+    for (size_t i = firstEntry(); i != NodeT::endIndex(); i = nextEntry(i)) {
+      if (mSlots[i] == mNumChildren + 1) {
+        mSlots[i] = static_cast<u_char>(slot + 1);
+        break;
+      }
+    }
+    mChildren[slot] = mChildren[mNumChildren];
+  }
+  mChildren[mNumChildren] = nullptr;
+  mSlots[index] = 0;
+  mBitmap.reset(index);
+
+  size_t nextIndex = nextEntry(index);
+  if (mNumChildren <= Next<48>::downThreshold) {
+    bool atEnd = (nextIndex == NodeT::endIndex());
+    *newNode = DownT::Type::move(alloc, *this);
+    nextIndex = atEnd ? NodeT::endIndex() :
+        (*newNode)->findEntry((char) nextIndex).first;
+  }
+  return nextIndex;
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline size_t
+_IndexNode<T,Next,Alloc>::firstEntry() const
+{
+  return nextEntry(NodeT::valueIndex());
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline size_t
+_IndexNode<T,Next,Alloc>::lastEntry() const
+{
+  return prevEntry(NodeT::endIndex());
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline size_t
+_IndexNode<T,Next,Alloc>::nextEntry(size_t index) const
+{
+  index = mBitmap.next(index == NodeT::valueIndex() ? 0 : (index + 1));
+  return index == _KeyBitmap::npos ? NodeT::endIndex() : index;
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline size_t
+_IndexNode<T,Next,Alloc>::prevEntry(size_t index) const
+{
+  if (index == NodeT::valueIndex() || index == 0) {
+    return NodeT::valueIndex();
+  }
+
+  index = mBitmap.prev(
+      index == NodeT::endIndex() ? (sNumKeys - 1) : (index - 1));
+  return index == _KeyBitmap::npos ? NodeT::valueIndex() : index;
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline _IndexNode<T,Next,Alloc>*
+_IndexNode<T,Next,Alloc>::allocate(Alloc& alloc)
+{
+  typename std::allocator_traits<Alloc>::template rebind_alloc<IndexNodeT>
+      nodeAlloc(alloc);
+  return nodeAlloc.allocate(1);
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline void
+_IndexNode<T,Next,Alloc>::init()
+{
+  std::fill(mSlots, mSlots + sNumKeys, 0);
+  mBitmap.clear();
+  std::fill(mChildren, mChildren + sMaxNumChildren, nullptr);
+}
+
+// Forget all of the entries, after they have been moved to another node.
+template<typename T, template<u_char> class Next, class Alloc>
+inline void
+_IndexNode<T,Next,Alloc>::clearEntries()
+{
+  init();
+  mNumChildren = 0;
+}
+
+// Add an entry at the end of the child array and point the key's slot at it.
+template<typename T, template<u_char> class Next, class Alloc>
+inline void
+_IndexNode<T,Next,Alloc>::addEntry(NodeT* entry, size_t index)
+{
+  assert(mNumChildren < sMaxNumChildren);
+  mChildren[mNumChildren++] = entry;
+  mSlots[index] = mNumChildren;
+  mBitmap.set(index);
+}
+
+} // end namespace ctrie
+#endif
@@ -3,28 +3,37 @@
  
 namespace ctrie {
 
+// A leaf is a single variable sized allocation: the node, followed by the
+// bytes of its key suffix.  The allocation is counted in units of LeafT, so
+// that it is aligned like a LeafT for any allocator.
 template<typename T, template<u_char> class Next, class Alloc>
 class _Leaf : public _BaseNode<T,Next,Alloc> {
 private:
+  uint32_t mStrLen;
   T mValue;
 
 public:
   typedef _BaseNode<T,Next,Alloc> NodeT;
   typedef _Leaf<T,Next,Alloc> LeafT;
 
-  static LeafT* create(const char* str, size_t strLen, const T& value);
-  static LeafT* create(const char* str, size_t strLen, T&& value);
-  NodeT* clone() const /*override*/;
+  static LeafT* create(
+      Alloc& alloc, const char* str, size_t strLen, const T& value);
+  static LeafT* create(Alloc& alloc, const char* str, size_t strLen, T&& value);
+  LeafT* moveTail(Alloc& alloc, size_t pos);
+  NodeT* clone(Alloc& alloc) const;
   _Leaf& operator=(const _Leaf&) = delete;
-  void destroy() /*override*/;
+  void destroy(Alloc& alloc);
 
-  bool hasValue() const /*override*/                {return true;}
-  T& value() /*override*/                           {return mValue;}
-  const T& value() const /*override*/               {return mValue;}
-  T&& valueToMove() /*override*/                    {return std::move(mValue);}
+  size_t strLen() const                             {return mStrLen;}
+  char* str()                     {return reinterpret_cast<char*>(this + 1);}
+  const char* str() const   {return reinterpret_cast<const char*>(this + 1);}
 
-  size_t size() const /*override*/                  {return 1;};
-  size_t treeSize() const /*override*/              {return 1;};
+  T& value()                                        {return mValue;}
+  const T& value() const                            {return mValue;}
+  T&& valueToMove()                                 {return std::move(mValue);}
+
+  size_t size() const                               {return 1;};
+  size_t treeSize() const                           {return 1;};
 
 protected:
   ~_Leaf()                                          {}
@@ -32,59 +41,125 @@ protected:
 private:
   _Leaf(const char* str, size_t strLen, const T& value);
   _Leaf(const char* str, size_t strLen, T&& value);
-  _Leaf(const _Leaf&) = default;
+  _Leaf(const _Leaf& src);
 
-  static LeafT* allocate();
+  static LeafT* allocate(Alloc& alloc, size_t strLen);
+  static void deallocate(Alloc& alloc, LeafT* leaf, size_t strLen);
+  static size_t numUnits(size_t strLen);
 };
 
 template<typename T, template<u_char> class Next, class Alloc>
 inline
 _Leaf<T,Next,Alloc>::_Leaf(const char* str, size_t strLen, const T& value)
-  : _BaseNode<T,Next,Alloc>(str, strLen), mValue(value)
-{}
+  : _BaseNode<T,Next,Alloc>(0), mStrLen(static_cast<uint32_t>(strLen)),
+    mValue(value)
+{
+  assert(strLen <= std::numeric_limits<uint32_t>::max());
+  memcpy(this->str(), str, strLen * sizeof(char));
+}
 
 template<typename T, template<u_char> class Next, class Alloc>
 inline
 _Leaf<T,Next,Alloc>::_Leaf(const char* str, size_t strLen, T&& value)
-  : _BaseNode<T,Next,Alloc>(str, strLen), mValue(value)
-{}
+  : _BaseNode<T,Next,Alloc>(0), mStrLen(static_cast<uint32_t>(strLen)),
+    mValue(std::move(value))
+{
+  assert(strLen <= std::numeric_limits<uint32_t>::max());
+  memcpy(this->str(), str, strLen * sizeof(char));
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline
+_Leaf<T,Next,Alloc>::_Leaf(const _Leaf& src)
+  : _BaseNode<T,Next,Alloc>(0), mStrLen(src.mStrLen), mValue(src.mValue)
+{
+  memcpy(str(), src.str(), mStrLen * sizeof(char));
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline _Leaf<T,Next,Alloc>*
+_Leaf<T,Next,Alloc>::create(
+    Alloc& alloc, const char* str, size_t strLen, const T& value)
+{
+  LeafT* leaf = allocate(alloc, strLen);
+  try {
+    return new(leaf) LeafT(str, strLen, value);
+  } catch (...) {
+    deallocate(alloc, leaf, strLen);
+    throw;
+  }
+}
 
 template<typename T, template<u_char> class Next, class Alloc>
 inline _Leaf<T,Next,Alloc>*
-_Leaf<T,Next,Alloc>::create(const char* str, size_t strLen, const T& value)
+_Leaf<T,Next,Alloc>::create(
+    Alloc& alloc, const char* str, size_t strLen, T&& value)
 {
-  return new(allocate()) LeafT(str, strLen, value);
+  LeafT* leaf = allocate(alloc, strLen);
+  try {
+    return new(leaf) LeafT(str, strLen, std::move(value));
+  } catch (...) {
+    deallocate(alloc, leaf, strLen);
+    throw;
+  }
 }
 
+// Replace this leaf with one whose suffix starts at pos in this suffix.
 template<typename T, template<u_char> class Next, class Alloc>
 inline _Leaf<T,Next,Alloc>*
-_Leaf<T,Next,Alloc>::create(const char* str, size_t strLen, T&& value)
+_Leaf<T,Next,Alloc>::moveTail(Alloc& alloc, size_t pos)
 {
-  return new(allocate()) LeafT(str, strLen, value);
+  assert(pos <= mStrLen);
+  LeafT* leaf = create(alloc, str() + pos, mStrLen - pos, std::move(mValue));
+  destroy(alloc);
+  return leaf;
 }
 
 template<typename T, template<u_char> class Next, class Alloc>
 inline _BaseNode<T,Next,Alloc>*
-_Leaf<T,Next,Alloc>::clone() const
+_Leaf<T,Next,Alloc>::clone(Alloc& alloc) const
 {
-  return new(allocate()) LeafT(*this);
+  LeafT* leaf = allocate(alloc, mStrLen);
+  try {
+    return new(leaf) LeafT(*this);
+  } catch (...) {
+    deallocate(alloc, leaf, mStrLen);
+    throw;
+  }
 }
 
 template<typename T, template<u_char> class Next, class Alloc>
 inline void
-_Leaf<T,Next,Alloc>::destroy()
+_Leaf<T,Next,Alloc>::destroy(Alloc& alloc)
 {
-  typename Alloc::template rebind<LeafT>::other alloc;
+  size_t strLen = mStrLen;
   this->~_Leaf<T,Next,Alloc>();
-  alloc.deallocate(this, 1);
+  deallocate(alloc, this, strLen);
 }
 
 template<typename T, template<u_char> class Next, class Alloc>
 inline _Leaf<T,Next,Alloc>*
-_Leaf<T,Next,Alloc>::allocate()
+_Leaf<T,Next,Alloc>::allocate(Alloc& alloc, size_t strLen)
+{
+  typename std::allocator_traits<Alloc>::template rebind_alloc<LeafT>
+      leafAlloc(alloc);
+  return leafAlloc.allocate(numUnits(strLen));
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline void
+_Leaf<T,Next,Alloc>::deallocate(Alloc& alloc, LeafT* leaf, size_t strLen)
+{
+  typename std::allocator_traits<Alloc>::template rebind_alloc<LeafT>
+      leafAlloc(alloc);
+  leafAlloc.deallocate(leaf, numUnits(strLen));
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline size_t
+_Leaf<T,Next,Alloc>::numUnits(size_t strLen)
 {
-  typename Alloc::template rebind<LeafT>::other alloc;
-  return alloc.allocate(1);
+  return 1 + (strLen + sizeof(LeafT) - 1) / sizeof(LeafT);
 }
 
 } // end namespace ctrie
@@ -0,0 +1,702 @@
+#ifndef _CTRIE_LOUDS_H
+#define _CTRIE_LOUDS_H
+ 
+namespace ctrie {
+
+// A bit vector with rank and select.  The number of ones before each block of
+// sBlockBits bits is kept, so rank() is a lookup and a few popcounts, and
+// select() is a binary search over the blocks followed by a scan of one
+// block.
+class _BitVector {
+public:
+  static const size_t sWordBits = 64;
+  static const size_t sBlockWords = 8;
+  static const size_t sBlockBits = sWordBits * sBlockWords;
+
+private:
+  std::vector<uint64_t> mWords;
+  std::vector<uint64_t> mRanks;       // The ones before each block
+  size_t mSize;
+
+public:
+  _BitVector() : mSize(0) {}
+
+  void push_back(bool bit);
+  void build();
+
+  size_t size() const                                       {return mSize;}
+  bool operator[](size_t i) const
+                         {return (mWords[i / sWordBits] >> i % sWordBits) & 1;}
+  size_t rank1(size_t i) const;
+  size_t rank0(size_t i) const                       {return i - rank1(i);}
+  size_t select1(size_t k) const;
+  size_t select0(size_t k) const;
+  size_t nextOne(size_t i) const;
+  size_t nextZero(size_t i) const;
+  size_t memoryUsage() const;
+
+private:
+  template<bool Bit> size_t select(size_t k) const;
+  template<bool Bit> size_t next(size_t i) const;
+  static uint64_t word(uint64_t w, bool bit)             {return bit ? w : ~w;}
+  static size_t selectInWord(uint64_t w, size_t k);
+};
+
+// A read-only trie in a few flat arrays, for tries that are large and no
+// longer change.  It keeps the nodes of the CTrie it is built from, with
+// their key fragments, and numbers them in breadth-first order, so that the
+// children of a node have consecutive numbers.  The shape of the trie is then
+// a LOUDS bit vector: for each node in turn, a one for each child and a zero.
+// The children of node i are the ones that follow the (i-1)th zero, and the
+// kth one stands for node k+1.
+//
+// Each node also has the character of the entry that leads to it, a bit for
+// whether it has a value, and a bit for whether it has a fragment.  The values
+// and the fragments are kept in node order, found by rank on those bits, and
+// the fragments are joined together, with a bit that marks the start of each.
+// The shape and the characters take about 10 bits a node.
+//
+// Lookups, lower_bound() and prefix iteration work as in a CTrie.  They use
+// rank and select rather than pointers, so they are slower than a CTrie's.
+template<typename T>
+class LoudsCTrie {
+private:
+  _BitVector mLouds;
+  std::vector<u_char> mLabels;        // The character leading to each node
+  _BitVector mHasValue;
+  std::vector<T> mValues;
+  _BitVector mHasStr;
+  std::vector<char> mStrs;
+  _BitVector mStrStarts;
+  size_t mSize;
+
+public:
+  typedef std::string key_type;
+  typedef T value_type;
+  typedef size_t size_type;
+
+  // Iterates in key order.  The key is built up as the iterator moves, so
+  // key() costs nothing.
+  class const_iterator {
+  public:
+    typedef T value_type;
+    typedef const T& reference;
+    typedef const T* pointer;
+    typedef std::ptrdiff_t difference_type;
+    typedef std::forward_iterator_tag iterator_category;
+
+  private:
+    // A node on the way from the top, with the key's length before it, its
+    // first child and number of children, and the child being visited, or -1
+    // for the node's own value.
+    struct Step {
+      size_t node;
+      size_t keyLen;
+      size_t firstChild;
+      size_t numChildren;
+      ptrdiff_t child;
+    };
+
+    const LoudsCTrie* mTrie;
+    std::vector<Step> mPath;
+    key_type mKey;
+
+  public:
+    const_iterator() : mTrie(nullptr) {}
+
+    bool operator==(const const_iterator& x) const;
+    bool operator!=(const const_iterator& x) const {return !operator==(x);}
+    const T& operator*() const                     {return *operator->();}
+    const T* operator->() const     {return &mTrie->value(mPath.back().node);}
+    const_iterator& operator++();
+
+    const key_type& key() const                               {return mKey;}
+    bool at_end() const                               {return mPath.empty();}
+
+  private:
+    explicit const_iterator(const LoudsCTrie* trie) : mTrie(trie) {}
+    void push(size_t node);
+    void settle();
+
+    friend class LoudsCTrie;
+  };
+
+  // Iterates over the keys that are prefixes of a key, shortest first, as
+  // CTrie::prefix_begin() does.
+  class const_prefix_iter {
+  public:
+    typedef T value_type;
+    typedef const T& reference;
+    typedef const T* pointer;
+    typedef std::ptrdiff_t difference_type;
+    typedef std::forward_iterator_tag iterator_category;
+
+  private:
+    const LoudsCTrie* mTrie;
+    key_type mSearchStr;
+    size_t mNode;                     // sNoNode at the end
+    size_t mPos;                      // Where the node's key ends
+
+  public:
+    const_prefix_iter() : mTrie(nullptr), mNode(sNoNode), mPos(0) {}
+
+    bool operator==(const const_prefix_iter& x) const
+                                                   {return mNode == x.mNode;}
+    bool operator!=(const const_prefix_iter& x) const
+                                                    {return !operator==(x);}
+    const T& operator*() const               {return mTrie->value(mNode);}
+    const T* operator->() const             {return &mTrie->value(mNode);}
+    const_prefix_iter& operator++();
+
+    key_type key() const                  {return mSearchStr.substr(0, mPos);}
+    bool at_end() const                            {return mNode == sNoNode;}
+
+  private:
+    const_prefix_iter(const LoudsCTrie* trie, const key_type& searchStr);
+    void nextPrefix(size_t node, size_t pos);
+
+    friend class LoudsCTrie;
+  };
+
+  LoudsCTrie() : mSize(0) {}
+  template<template<u_char> class Next, class Alloc>
+    explicit LoudsCTrie(const CTrie<T,Next,Alloc>& trie);
+
+  size_t size() const                                        {return mSize;}
+  bool empty() const                                     {return mSize == 0;}
+  size_t nodeCount() const                         {return mLabels.size();}
+  size_t memoryUsage() const;
+
+  const_iterator begin() const;
+  const_iterator end() const                        {return const_iterator();}
+  const_iterator find(const key_type& key) const
+                                    {return find(key.data(), key.length());}
+  const_iterator find(const char* keyData,
+      size_t keyLen = key_type::npos) const;
+  size_t count(const key_type& key) const
+                                   {return count(key.data(), key.length());}
+  size_t count(const char* keyData, size_t keyLen = key_type::npos) const;
+  const_iterator lower_bound(const key_type& key) const
+                             {return lower_bound(key.data(), key.length());}
+  const_iterator lower_bound(const char* keyData,
+      size_t keyLen = key_type::npos) const;
+  const_prefix_iter prefix_begin(const key_type& key) const
+                                      {return const_prefix_iter(this, key);}
+  const_prefix_iter prefix_end() const           {return const_prefix_iter();}
+
+private:
+  static const size_t sNoNode = static_cast<size_t>(-1);
+
+  void addNode(const char* str, size_t strLen, const T* value);
+  size_t firstChild(size_t node, size_t& numChildren) const;
+  size_t findChild(size_t first, size_t numChildren, u_char key) const;
+  const char* str(size_t node, size_t& strLen) const;
+  const T& value(size_t node) const
+                                      {return mValues[mHasValue.rank1(node)];}
+  size_t findNode(const char* keyData, size_t keyLen) const;
+};
+
+inline void
+_BitVector::push_back(bool bit)
+{
+  if (mSize % sWordBits == 0) {
+    mWords.push_back(0);
+  }
+  if (bit) {
+    mWords.back() |= static_cast<uint64_t>(1) << mSize % sWordBits;
+  }
+  ++mSize;
+}
+
+// Count the ones before each block, once all of the bits are in.
+inline void
+_BitVector::build()
+{
+  mWords.shrink_to_fit();
+  mRanks.clear();
+  uint64_t ones = 0;
+  for (size_t i = 0; i < mWords.size(); ++i) {
+    if (i % sBlockWords == 0) {
+      mRanks.push_back(ones);
+    }
+    ones += __builtin_popcountll(mWords[i]);
+  }
+  mRanks.push_back(ones);
+  mRanks.shrink_to_fit();
+}
+
+// The number of ones before bit i.
+inline size_t
+_BitVector::rank1(size_t i) const
+{
+  size_t wordIndex = i / sWordBits;
+  size_t rank = mRanks[wordIndex / sBlockWords];
+  for (size_t w = wordIndex - wordIndex % sBlockWords; w < wordIndex; ++w) {
+    rank += __builtin_popcountll(mWords[w]);
+  }
+  if (i % sWordBits) {
+    rank += __builtin_popcountll(
+        mWords[wordIndex] & ((static_cast<uint64_t>(1) << i % sWordBits) - 1));
+  }
+  return rank;
+}
+
+inline size_t
+_BitVector::select1(size_t k) const
+{
+  return select<true>(k);
+}
+
+inline size_t
+_BitVector::select0(size_t k) const
+{
+  return select<false>(k);
+}
+
+inline size_t
+_BitVector::nextOne(size_t i) const
+{
+  return next<true>(i);
+}
+
+inline size_t
+_BitVector::nextZero(size_t i) const
+{
+  return next<false>(i);
+}
+
+inline size_t
+_BitVector::memoryUsage() const
+{
+  return mWords.capacity() * sizeof(uint64_t) +
+      mRanks.capacity() * sizeof(uint64_t);
+}
+
+// The position of the kth (from 0) bit that is set to Bit.  Find the last
+// block with fewer than k+1 such bits before it, and then the word.
+template<bool Bit>
+size_t
+_BitVector::select(size_t k) const
+{
+  size_t low = 0;
+  size_t high = mRanks.size() - 1;
+  while (high - low > 1) {
+    size_t mid = (low + high) / 2;
+    size_t before = Bit ? mRanks[mid] : mid * sBlockBits - mRanks[mid];
+    if (before <= k) {
+      low = mid;
+    } else {
+      high = mid;
+    }
+  }
+  k -= Bit ? mRanks[low] : low * sBlockBits - mRanks[low];
+  for (size_t w = low * sBlockWords; ; ++w) {
+    uint64_t bits = word(mWords[w], Bit);
+    size_t count = __builtin_popcountll(bits);
+    if (k < count) {
+      return w * sWordBits + selectInWord(bits, k);
+    }
+    k -= count;
+  }
+}
+
+// The position of the first bit at or after i that is set to Bit, or size()
+// if there is none.
+template<bool Bit>
+size_t
+_BitVector::next(size_t i) const
+{
+  size_t w = i / sWordBits;
+  if (w >= mWords.size()) {
+    return mSize;
+  }
+  uint64_t bits =
+      word(mWords[w], Bit) & (~static_cast<uint64_t>(0) << i % sWordBits);
+  while (!bits) {
+    if (++w == mWords.size()) {
+      return mSize;
+    }
+    bits = word(mWords[w], Bit);
+  }
+  return std::min(w * sWordBits + __builtin_ctzll(bits), mSize);
+}
+
+inline size_t
+_BitVector::selectInWord(uint64_t w, size_t k)
+{
+  for (; k > 0; --k) {
+    w &= w - 1;
+  }
+  return __builtin_ctzll(w);
+}
+
+// Number the nodes of the trie breadth first.  Each node's children are
+// queued as it is added, so they are added, and numbered, one after another.
+template<typename T>
+template<template<u_char> class Next, class Alloc>
+LoudsCTrie<T>::LoudsCTrie(const CTrie<T,Next,Alloc>& trie)
+  : mSize(trie.size())
+{
+  typedef _BaseNode<T,Next,Alloc> NodeT;
+  typedef _Leaf<T,Next,Alloc> LeafT;
+  std::deque<NodeT*> queue;
+  if (trie.mTop) {
+    queue.push_back(trie.mTop);
+    mLabels.push_back(0);
+  }
+  while (!queue.empty()) {
+    NodeT* entry = queue.front();
+    queue.pop_front();
+    if (NodeT::isLeafEntry(entry)) {
+      LeafT* leaf = NodeT::entryLeaf(entry);
+      addNode(leaf->str(), leaf->strLen(), &leaf->value());
+    } else {
+      addNode(entry->str(), entry->strLen(),
+          entry->hasValue() ? &entry->value() : nullptr);
+      for (size_t index = entry->firstEntry(); index != NodeT::endIndex();
+          index = entry->nextEntry(index)) {
+        mLouds.push_back(true);
+        mLabels.push_back(static_cast<u_char>(entry->key(index)));
+        queue.push_back(entry->getEntry(index));
+      }
+    }
+    mLouds.push_back(false);
+  }
+
+  mLouds.build();
+  mHasValue.build();
+  mHasStr.build();
+  mStrStarts.build();
+  mLabels.shrink_to_fit();
+  mValues.shrink_to_fit();
+  mStrs.shrink_to_fit();
+}
+
+template<typename T>
+void
+LoudsCTrie<T>::addNode(const char* str, size_t strLen, const T* value)
+{
+  mHasValue.push_back(value != nullptr);
+  if (value) {
+    mValues.push_back(*value);
+  }
+  mHasStr.push_back(strLen != 0);
+  for (size_t i = 0; i < strLen; ++i) {
+    mStrs.push_back(str[i]);
+    mStrStarts.push_back(i == 0);
+  }
+}
+
+template<typename T>
+size_t
+LoudsCTrie<T>::memoryUsage() const
+{
+  return sizeof(*this) + mLouds.memoryUsage() + mLabels.capacity() +
+      mHasValue.memoryUsage() + mValues.capacity() * sizeof(T) +
+      mHasStr.memoryUsage() + mStrs.capacity() +
+      mStrStarts.memoryUsage();
+}
+
+// Return the number of the node's first child, and set numChildren.
+template<typename T>
+inline size_t
+LoudsCTrie<T>::firstChild(size_t node, size_t& numChildren) const
+{
+  size_t start = node == 0 ? 0 : mLouds.select0(node - 1) + 1;
+  numChildren = mLouds.nextZero(start) - start;
+  return mLouds.rank1(start) + 1;
+}
+
+// Return the first of the children whose character is not less than key.
+template<typename T>
+inline size_t
+LoudsCTrie<T>::findChild(size_t first, size_t numChildren, u_char key) const
+{
+  const u_char* labels = mLabels.data();
+  return std::lower_bound(labels + first, labels + first + numChildren, key) -
+      labels;
+}
+
+template<typename T>
+inline const char*
+LoudsCTrie<T>::str(size_t node, size_t& strLen) const
+{
+  if (!mHasStr[node]) {
+    strLen = 0;
+    return "";
+  }
+  size_t start = mStrStarts.select1(mHasStr.rank1(node));
+  strLen = mStrStarts.nextOne(start + 1) - start;
+  return mStrs.data() + start;
+}
+
+template<typename T>
+typename LoudsCTrie<T>::const_iterator
+LoudsCTrie<T>::begin() const
+{
+  const_iterator iter(this);
+  if (!mLabels.empty()) {
+    iter.push(0);
+    iter.settle();
+  }
+  return iter;
+}
+
+// Return the node whose key is the given one and which has a value, or
+// sNoNode.
+template<typename T>
+size_t
+LoudsCTrie<T>::findNode(const char* keyData, size_t keyLen) const
+{
+  if (mLabels.empty()) {
+    return sNoNode;
+  }
+  size_t node = 0;
+  size_t pos = 0;
+  while (1) {
+    size_t strLen;
+    const char* s = str(node, strLen);
+    size_t end = pos + strLen;
+    if (end > keyLen || memcmp(s, keyData + pos, strLen) != 0) {
+      return sNoNode;
+    }
+    if (end == keyLen) {
+      return mHasValue[node] ? node : sNoNode;
+    }
+    size_t numChildren;
+    size_t first = firstChild(node, numChildren);
+    u_char key = static_cast<u_char>(keyData[end]);
+    size_t child = findChild(first, numChildren, key);
+    if (child == first + numChildren || mLabels[child] != key) {
+      return sNoNode;
+    }
+    node = child;
+    pos = end + 1;
+  }
+}
+
+// Go down the key's path as findNode() does, but building the iterator on
+// the way.  Each node's string is checked against the key once push() has
+// added it to the iterator's key.
+template<typename T>
+typename LoudsCTrie<T>::const_iterator
+LoudsCTrie<T>::find(const char* keyData, size_t keyLen) const
+{
+  const_iterator iter(this);
+  if (mLabels.empty()) {
+    return iter;
+  }
+  if (keyLen == key_type::npos) {
+    keyLen = strlen(keyData);
+  }
+  iter.push(0);
+  size_t pos = 0;
+  while (1) {
+    typename const_iterator::Step& step = iter.mPath.back();
+    size_t nodeEnd = iter.mKey.size();
+    if (nodeEnd > keyLen ||
+        memcmp(iter.mKey.data() + pos, keyData + pos, nodeEnd - pos) != 0) {
+      return end();
+    }
+    if (nodeEnd == keyLen) {
+      return mHasValue[step.node] ? iter : end();
+    }
+    u_char key = static_cast<u_char>(keyData[nodeEnd]);
+    size_t child = findChild(step.firstChild, step.numChildren, key);
+    if (child == step.firstChild + step.numChildren ||
+        mLabels[child] != key) {
+      return end();
+    }
+    step.child = static_cast<ptrdiff_t>(child - step.firstChild);
+    iter.mKey += static_cast<char>(key);
+    iter.push(child);
+    pos = nodeEnd + 1;
+  }
+}
+
+template<typename T>
+size_t
+LoudsCTrie<T>::count(const char* keyData, size_t keyLen) const
+{
+  if (keyLen == key_type::npos) {
+    keyLen = strlen(keyData);
+  }
+  return findNode(keyData, keyLen) == sNoNode ? 0 : 1;
+}
+
+// Go down the key's path.  At the first node whose string differs from the
+// key, all of the node's keys are either less than the key, so the answer
+// is the key after them, or greater, so it is the node's first key.
+template<typename T>
+typename LoudsCTrie<T>::const_iterator
+LoudsCTrie<T>::lower_bound(const char* keyData, size_t keyLen) const
+{
+  const_iterator iter(this);
+  if (mLabels.empty()) {
+    return iter;
+  }
+  if (keyLen == key_type::npos) {
+    keyLen = strlen(keyData);
+  }
+  iter.push(0);
+  size_t pos = 0;
+  while (1) {
+    typename const_iterator::Step& step = iter.mPath.back();
+    size_t strLen;
+    const char* s = str(step.node, strLen);
+    int cmp = memcmp(s, keyData + pos, std::min(strLen, keyLen - pos));
+    if (cmp < 0) {
+      step.child = static_cast<ptrdiff_t>(step.numChildren);
+      break;
+    }
+    if (cmp > 0 || pos + strLen >= keyLen) {
+      break;
+    }
+    pos += strLen;
+    u_char key = static_cast<u_char>(keyData[pos]);
+    size_t child = findChild(step.firstChild, step.numChildren, key);
+    step.child = static_cast<ptrdiff_t>(child - step.firstChild);
+    if (child == step.firstChild + step.numChildren ||
+        mLabels[child] != key) {
+      break;
+    }
+    iter.mKey += static_cast<char>(key);
+    iter.push(child);
+    ++pos;
+  }
+  iter.settle();
+  return iter;
+}
+
+template<typename T>
+bool
+LoudsCTrie<T>::const_iterator::operator==(const const_iterator& x) const
+{
+  if (at_end() || x.at_end()) {
+    return at_end() == x.at_end();
+  }
+  return mPath.back().node == x.mPath.back().node;
+}
+
+template<typename T>
+typename LoudsCTrie<T>::const_iterator&
+LoudsCTrie<T>::const_iterator::operator++()
+{
+  mPath.back().child = 0;
+  settle();
+  return *this;
+}
+
+// Start visiting a node, whose key is mKey followed by the node's string.
+// The character that leads to it must already be in mKey.
+template<typename T>
+inline void
+LoudsCTrie<T>::const_iterator::push(size_t node)
+{
+  Step step;
+  step.node = node;
+  step.keyLen = mKey.size() - (mPath.empty() ? 0 : 1);
+  step.firstChild = mTrie->firstChild(node, step.numChildren);
+  step.child = -1;
+  mPath.push_back(step);
+  size_t strLen;
+  const char* s = mTrie->str(node, strLen);
+  mKey.append(s, strLen);
+}
+
+// Move on from where the path ends to the first value at or after it.
+template<typename T>
+void
+LoudsCTrie<T>::const_iterator::settle()
+{
+  while (!mPath.empty()) {
+    Step& step = mPath.back();
+    if (step.child < 0) {
+      if (mTrie->mHasValue[step.node]) {
+        return;
+      }
+      step.child = 0;
+    }
+    size_t i = static_cast<size_t>(step.child);
+    if (i < step.numChildren) {
+      size_t strLen;
+      mTrie->str(step.node, strLen);
+      mKey.resize(step.keyLen + (mPath.size() > 1) + strLen);
+      mKey += static_cast<char>(mTrie->mLabels[step.firstChild + i]);
+      push(step.firstChild + i);
+      continue;
+    }
+    mKey.resize(step.keyLen);
+    mPath.pop_back();
+    if (!mPath.empty()) {
+      ++mPath.back().child;
+    }
+  }
+  mKey.clear();
+}
+
+template<typename T>
+inline
+LoudsCTrie<T>::const_prefix_iter::const_prefix_iter(
+    const LoudsCTrie* trie, const key_type& searchStr)
+  : mTrie(trie), mSearchStr(searchStr), mNode(sNoNode), mPos(0)
+{
+  if (!trie->mLabels.empty()) {
+    nextPrefix(0, 0);
+  }
+}
+
+template<typename T>
+typename LoudsCTrie<T>::const_prefix_iter&
+LoudsCTrie<T>::const_prefix_iter::operator++()
+{
+  size_t node = mNode;
+  mNode = sNoNode;
+  if (mPos < mSearchStr.size()) {
+    size_t numChildren;
+    size_t first = mTrie->firstChild(node, numChildren);
+    u_char key = static_cast<u_char>(mSearchStr[mPos]);
+    size_t child = mTrie->findChild(first, numChildren, key);
+    if (child < first + numChildren && mTrie->mLabels[child] == key) {
+      nextPrefix(child, mPos + 1);
+    }
+  }
+  return *this;
+}
+
+// Find the first node from node down whose key is a prefix of the search
+// string and which has a value.  node's key starts at pos.
+template<typename T>
+void
+LoudsCTrie<T>::const_prefix_iter::nextPrefix(size_t node, size_t pos)
+{
+  while (1) {
+    size_t strLen;
+    const char* s = mTrie->str(node, strLen);
+    size_t end = pos + strLen;
+    if (end > mSearchStr.size() ||
+        memcmp(s, mSearchStr.data() + pos, strLen) != 0) {
+      return;
+    }
+    if (mTrie->mHasValue[node]) {
+      mNode = node;
+      mPos = end;
+      return;
+    }
+    if (end == mSearchStr.size()) {
+      return;
+    }
+    size_t numChildren;
+    size_t first = mTrie->firstChild(node, numChildren);
+    u_char key = static_cast<u_char>(mSearchStr[end]);
+    size_t child = mTrie->findChild(first, numChildren, key);
+    if (child == first + numChildren || mTrie->mLabels[child] != key) {
+      return;
+    }
+    node = child;
+    pos = end + 1;
+  }
+}
+
+} // end namespace ctrie
+#endif
@@ -25,15 +25,20 @@ template<> struct Small<16> {
   static const u_char downThreshold = 4;
 };
 template<> struct Small<32> {
-  static const u_char up = std::numeric_limits<u_char>::max();
+  static const u_char up = 48;
   static const u_char down = 16;
   static const u_char downThreshold = 8;
 };
-template<> struct Small<std::numeric_limits<u_char>::max()> {
-  static const u_char up = 2;       // The initial size of a new node
+template<> struct Small<48> {
+  static const u_char up = std::numeric_limits<u_char>::max();
   static const u_char down = 32;
   static const u_char downThreshold = 16;
 };
+template<> struct Small<std::numeric_limits<u_char>::max()> {
+  static const u_char up = 2;       // The initial size of a new node
+  static const u_char down = 48;
+  static const u_char downThreshold = 24;
+};
 
 template<u_char Sz> struct Medium {};
 template<> struct Medium<4> {
@@ -42,27 +47,87 @@ template<> struct Medium<4> {
   static const u_char downThreshold = 0;
 };
 template<> struct Medium<16> {
-  static const u_char up = std::numeric_limits<u_char>::max();
+  static const u_char up = 48;
   static const u_char down = 4;
   static const u_char downThreshold = 2;
 };
-template<> struct Medium<std::numeric_limits<u_char>::max()> {
-  static const u_char up = 4;       // The initial size of a new node
+template<> struct Medium<48> {
+  static const u_char up = std::numeric_limits<u_char>::max();
   static const u_char down = 16;
   static const u_char downThreshold = 8;
 };
+template<> struct Medium<std::numeric_limits<u_char>::max()> {
+  static const u_char up = 4;       // The initial size of a new node
+  static const u_char down = 48;
+  static const u_char downThreshold = 24;
+};
 
 template<u_char Sz> struct Fast {};
 template<> struct Fast<8> {
-  static const u_char up = std::numeric_limits<u_char>::max();
+  static const u_char up = 48;
   static const u_char down = std::numeric_limits<u_char>::max();
   static const u_char downThreshold = 0;
 };
-template<> struct Fast<std::numeric_limits<u_char>::max()> {
-  static const u_char up = 8;       // The initial size of a new node
+template<> struct Fast<48> {
+  static const u_char up = std::numeric_limits<u_char>::max();
   static const u_char down = 8;
   static const u_char downThreshold = 4;
 };
+template<> struct Fast<std::numeric_limits<u_char>::max()> {
+  static const u_char up = 8;       // The initial size of a new node
+  static const u_char down = 48;
+  static const u_char downThreshold = 24;
+};
+
+// Whether an allocator can free all of its memory at once.  When the values
+// do not need destructors, and canDrop() says that the allocator need not be
+// given back the nodes one by one, a trie can drop all of its nodes without
+// visiting them, and then call release() to let the allocator give back its
+// memory.
+template<class Alloc>
+struct _MonotonicTraits {
+  static const bool sMonotonic = false;
+  static bool canDrop(const Alloc&)                          {return false;}
+  static void release(Alloc&)                                              {}
+};
+
+// Whether an allocator may be used from several threads at once, as a
+// build_sorted() with more than one thread needs.  Other allocators can say
+// that they may by specializing this.
+template<class Alloc>
+struct _ConcurrentTraits {
+  static const bool sThreadSafe = false;
+};
+
+template<class T>
+struct _ConcurrentTraits<std::allocator<T> > {
+  static const bool sThreadSafe = true;
+};
+
+// Joins the threads that a build or a walk has started, however it ends.  A
+// std::thread that is destroyed while it could still be joined ends the
+// program, so if starting a thread throws, the ones already running must be
+// waited for before the exception goes any further.
+class _ThreadJoiner {
+private:
+  std::vector<std::thread>& mThreads;
+
+public:
+  explicit _ThreadJoiner(std::vector<std::thread>& threads)
+    : mThreads(threads) {}
+  _ThreadJoiner(const _ThreadJoiner&) = delete;
+  _ThreadJoiner& operator=(const _ThreadJoiner&) = delete;
+  ~_ThreadJoiner()                                                 {join();}
+
+  void join()
+  {
+    for (size_t i = 0; i < mThreads.size(); ++i) {
+      if (mThreads[i].joinable()) {
+        mThreads[i].join();
+      }
+    }
+  }
+};
 
 template<typename T,
     template<u_char Sz> class Next = Medium,
@@ -71,21 +136,40 @@ class CTrie {
 private:
   typedef _BaseNode<T,Next,Alloc> NodeT;
   typedef _Leaf<T,Next,Alloc> LeafT;
+  typedef _NodePath<T,Next,Alloc> PathT;
+  typedef std::allocator_traits<Alloc> AllocTraits;
 
 private:
   NodeT* mTop;
   size_t mSize;
+  Alloc mAlloc;
+  bool mShares;                 // Set by snapshot(), so nodes may be shared
     
 public:
   typedef std::string key_type;
   typedef T value_type;
   typedef size_t size_type;
+  typedef Alloc allocator_type;
 
   class const_iterator;
   class iterator {
   private:
+    PathT mPath;                    // The nodes above mCurrentNode
     NodeT* mCurrentNode;
     size_t mCurrentIndex;
+    // The key down to the end of mCurrentNode's string, followed by the rest
+    // of a leaf's key, which key() fills in.  The first key() builds it from
+    // the path, and moving down and up keeps it up to date after that.  A
+    // copy starts without it, so that copying an iterator does not copy a
+    // string.
+    mutable key_type mKey;
+    mutable size_t mNodeKeyLen;     // sNoKey until key() builds mKey
+    // The trie, for an iterator from a non-const member, which copies the
+    // nodes it is in before a value is written through it, while the trie
+    // shares nodes with a snapshot.
+    CTrie* mTrie;
+
+    static const size_t sNoKey = static_cast<size_t>(-1);
       
   public:
     typedef T value_type;
@@ -95,11 +179,18 @@ public:
     typedef std::bidirectional_iterator_tag iterator_category;
 
   public:
-    iterator() : mCurrentNode(nullptr), mCurrentIndex(0) {}
-    iterator(const iterator&) = default;
+    iterator()
+      : mCurrentNode(nullptr), mCurrentIndex(0), mNodeKeyLen(sNoKey),
+        mTrie(nullptr) {}
+    iterator(const iterator& x)
+      : mPath(x.mPath), mCurrentNode(x.mCurrentNode),
+        mCurrentIndex(x.mCurrentIndex), mNodeKeyLen(sNoKey),
+        mTrie(x.mTrie) {}
+    iterator(iterator&&) = default;
     ~iterator() = default;
 
-    iterator& operator=(const iterator&) = default;
+    iterator& operator=(const iterator& x);
+    iterator& operator=(iterator&&) = default;
     bool operator==(const iterator& x) const;
     bool operator!=(const iterator& x) const           {return !operator==(x);}
     T& operator*()                                     {return *operator->();}
@@ -109,18 +200,34 @@ public:
     iterator& operator++();
     iterator& operator--();
 
-    key_type key() const;
+    key_type key() const                                   {return fillKey();}
+#ifdef _CTRIE_HAS_STRING_VIEW
+    // The key without a copy, valid until the iterator moves or is destroyed.
+    std::string_view key_view() const                      {return fillKey();}
+#endif
     bool at_end() const;
 
   private:
     // The default of the current index is a special case to make end() fast.
     iterator(NodeT* n, size_t i=NodeT::endIndex())
-      : mCurrentNode(n), mCurrentIndex(i) {}
+      : mCurrentNode(n), mCurrentIndex(i), mNodeKeyLen(sNoKey),
+        mTrie(nullptr) {}
     iterator(NodeT* n, size_t i, bool after)
-      : mCurrentNode(n), mCurrentIndex(i) {init(after);}
+      : mCurrentNode(n), mCurrentIndex(i), mNodeKeyLen(sNoKey),
+        mTrie(nullptr)                                          {init(after);}
+    iterator(const PathT& path, NodeT* n, size_t i)
+      : mPath(path), mCurrentNode(n), mCurrentIndex(i), mNodeKeyLen(sNoKey),
+        mTrie(nullptr) {}
+    iterator(const PathT& path, NodeT* n, size_t i, bool after)
+      : mPath(path), mCurrentNode(n), mCurrentIndex(i), mNodeKeyLen(sNoKey),
+        mTrie(nullptr)                                          {init(after);}
 
     void init(bool after);
-    void findLeaf(NodeT* p);
+    void toFirst();
+    void initKey() const;
+    const key_type& fillKey() const;
+    void findLeaf();
+    void moveDown();
     void moveUpOne();
 
     friend class CTrie::const_iterator;
@@ -148,35 +255,98 @@ public:
     bool operator==(const const_iterator& x) const {return mIter == x.mIter;}
     bool operator!=(const const_iterator& x) const {return !operator==(x);}
     const value_type& operator*()                  {return *operator->();}
-    const value_type* operator->()                 {return mIter.operator->();}
+    const value_type* operator->()
+                    {return static_cast<const iterator&>(mIter).operator->();}
     const_iterator& operator++()                   {++mIter; return *this;}
     const_iterator& operator--()                   {--mIter; return *this;}
+    bool at_end() const                            {return mIter.at_end();}
     key_type key() const                           {return mIter.key();}
+#ifdef _CTRIE_HAS_STRING_VIEW
+    std::string_view key_view() const         {return mIter.key_view();}
+#endif
 
   protected:
     const_iterator(NodeT* node, size_t index=NodeT::endIndex())
       : mIter(node, index) {}
     const_iterator(NodeT* node, size_t index, bool after)
       : mIter(node, index, after) {}
+    const_iterator(const PathT& path, NodeT* node, size_t index)
+      : mIter(path, node, index) {}
+    const_iterator(const PathT& path, NodeT* node, size_t index, bool after)
+      : mIter(path, node, index, after) {}
+
+    void toFirst()                                        {mIter.toFirst();}
 
     friend class CTrie;
   };
 
-  class reverse_iterator: public std::reverse_iterator<iterator> {
+private:
+  // A reverse iterator that holds an iterator at its own key, rather than at
+  // the key after it, as std::reverse_iterator does.  Dereferencing it and
+  // asking for its key then need no copy of the iterator, and the iterator's
+  // key buffer is kept up to date as it moves.  Past the first key, the
+  // iterator is left at its end, and the first key is found again if this
+  // moves back.
+  template<class IterT>
+  class ReverseIter {
   public:
-    reverse_iterator() : std::reverse_iterator<iterator>() {}
-    reverse_iterator(const iterator& x) : std::reverse_iterator<iterator>(x) {}
-    key_type key() const      {iterator p = this->base(); --p; return p.key();}
-  };
+    typedef IterT iterator_type;
+    typedef typename IterT::value_type value_type;
+    typedef typename IterT::reference reference;
+    typedef typename IterT::pointer pointer;
+    typedef typename IterT::difference_type difference_type;
+    typedef typename IterT::iterator_category iterator_category;
+
+  private:
+    IterT mIter;
+    bool mAtEnd;
 
-  class const_reverse_iterator: public std::reverse_iterator<const_iterator> {
   public:
-    const_reverse_iterator() : std::reverse_iterator<const_iterator>() {}
-    const_reverse_iterator(const const_iterator& x)
-            : std::reverse_iterator<const_iterator>(x) {}
-    key_type key() const {const_iterator p = this->base(); --p; return p.key();}
+    ReverseIter() : mAtEnd(false) {}
+    ReverseIter(const IterT& x) : mIter(x), mAtEnd(false)     {operator++();}
+
+    bool operator==(const ReverseIter& x) const
+              {return mAtEnd == x.mAtEnd && (mAtEnd || mIter == x.mIter);}
+    bool operator!=(const ReverseIter& x) const      {return !operator==(x);}
+    reference operator*()                                 {return *mIter;}
+    pointer operator->()                        {return mIter.operator->();}
+    ReverseIter& operator++()
+    {
+      --mIter;
+      mAtEnd = mIter.at_end();
+      return *this;
+    }
+    ReverseIter& operator--()
+    {
+      if (mAtEnd) {
+        mIter.toFirst();
+        mAtEnd = false;
+      } else {
+        ++mIter;
+      }
+      return *this;
+    }
+
+    IterT base() const
+    {
+      IterT p(mIter);
+      if (mAtEnd) {
+        p.toFirst();
+      } else {
+        ++p;
+      }
+      return p;
+    }
+    key_type key() const                               {return mIter.key();}
+#ifdef _CTRIE_HAS_STRING_VIEW
+    std::string_view key_view() const             {return mIter.key_view();}
+#endif
   };
 
+public:
+  typedef ReverseIter<iterator> reverse_iterator;
+  typedef ReverseIter<const_iterator> const_reverse_iterator;
+
   class const_prefix_iter;
   class prefix_iter : private iterator {
   public:
@@ -207,6 +377,9 @@ public:
 
     iterator base() const                      {return iterator(*this);}
     key_type key() const                       {return iterator::key();}
+#ifdef _CTRIE_HAS_STRING_VIEW
+    std::string_view key_view() const     {return iterator::key_view();}
+#endif
     bool at_end() const                        {return iterator::at_end();}
 
   private:
@@ -215,6 +388,7 @@ public:
     prefix_iter(NodeT* node, const key_type& searchStr)
       : iterator(node), mSearchStr(searchStr), mSearchStrIndex(0) {}
 
+    void toFirst();
     bool nextPrefix();
 
     friend class CTrie::const_prefix_iter;
@@ -234,7 +408,7 @@ public:
       
   public:
     const_prefix_iter() : mIter() {}
-    const_prefix_iter(const prefix_iter& x) : mIter(x.mIter) {}
+    const_prefix_iter(const prefix_iter& x) : mIter(x) {}
     const_prefix_iter(const const_prefix_iter&) = default;
     ~const_prefix_iter() = default;
 
@@ -242,11 +416,15 @@ public:
     bool operator==(const const_prefix_iter& x) const {return mIter == x.mIter;}
     bool operator!=(const const_prefix_iter& x) const {return !operator==(x);}
     const value_type& operator*()                  {return *operator->();}
-    const value_type* operator->()                 {return mIter.operator->();}
+    const value_type* operator->()
+                 {return static_cast<const prefix_iter&>(mIter).operator->();}
     const_prefix_iter& operator++()                {++mIter; return *this;}
     const_prefix_iter& operator--()                {--mIter; return *this;}
 
     key_type key() const                           {return mIter.key();}
+#ifdef _CTRIE_HAS_STRING_VIEW
+    std::string_view key_view() const         {return mIter.key_view();}
+#endif
     bool at_end() const                            {return mIter.at_end();}
     const_iterator base() const                    {return mIter.base();}
 
@@ -257,39 +435,31 @@ public:
     const_prefix_iter(NodeT* node, const key_type& searchStr)
       : mIter(node, searchStr) {}
 
+    void toFirst()                                        {mIter.toFirst();}
+
     friend class CTrie;
   };
 
-  class reverse_prefix_iter: public std::reverse_iterator<prefix_iter> {
-  public:
-    reverse_prefix_iter() : std::reverse_iterator<prefix_iter>() {}
-    reverse_prefix_iter(const prefix_iter& x)
-        : std::reverse_iterator<prefix_iter>(x) {}
-    key_type key() const   {prefix_iter p = this->base(); --p; return p.key();}
-  };
-
-  class const_reverse_prefix_iter:
-      public std::reverse_iterator<const_prefix_iter> {
-  public:
-    const_reverse_prefix_iter() : std::reverse_iterator<const_prefix_iter>() {}
-    const_reverse_prefix_iter(const const_prefix_iter& x)
-        : std::reverse_iterator<const_prefix_iter>(x) {}
-    key_type key() const
-                     {const_prefix_iter p = this->base(); --p; return p.key();}
-  };
+  typedef ReverseIter<prefix_iter> reverse_prefix_iter;
+  typedef ReverseIter<const_prefix_iter> const_reverse_prefix_iter;
 
 public:
-  CTrie() : mTop(nullptr), mSize(0) {}
+  CTrie() : mTop(nullptr), mSize(0), mShares(false) {}
+  explicit CTrie(const Alloc& alloc)
+    : mTop(nullptr), mSize(0), mAlloc(alloc), mShares(false) {}
   CTrie(const CTrie& x);
   CTrie(CTrie&& x);
   CTrie& operator=(const CTrie& x);
   CTrie& operator=(CTrie&& x);
-  ~CTrie()                          {if (mTop) mTop->destroy();}
+  ~CTrie()                          {destroyTree();}
 
+  allocator_type get_allocator() const                       {return mAlloc;}
   size_t size() const               {return mSize;}
   bool empty() const                {return mSize == 0;}
   void clear();
-  void swap(CTrie& x)               {swap(mTop, x.mTop); swap(mSize, x.mSize);}
+  void swap(CTrie& x);
+  CTrie snapshot();
+  void freeze(const std::string& path) const;
   T& operator[](const key_type& key) {return *insert(key,T()).first;}
 
   std::pair<iterator, bool>
@@ -297,6 +467,11 @@ public:
   std::pair<iterator, bool> insert(const key_type& key, const T& value);
   template<class InputIterator>
     void insert(InputIterator first, InputIterator last);
+  template<class ForwardIterator>
+    void build_sorted(ForwardIterator first, ForwardIterator last);
+  template<class ForwardIterator>
+    void build_sorted(
+        ForwardIterator first, ForwardIterator last, size_t numThreads);
 
   size_t erase(const key_type& key)     {return erase(key.data(), key.size());}
   size_t erase(const char* keyData, size_t keyLen = key_type::npos);
@@ -333,13 +508,13 @@ public:
       size_t keyLen = key_type::npos, bool matchPart=false) const;
 
   iterator begin()
-  { return iterator(mTop, NodeT::valueIndex(), false); }
+  { return writable(iterator(mTop, NodeT::valueIndex(), false)); }
 
   const_iterator begin() const
-  { return const_iterator(mTop, NodeT::valueIndex(), false); }
+  { return const_iterator(loadTop(), NodeT::valueIndex(), false); }
 
   iterator end()
-  { return iterator(mTop); }
+  { return writable(iterator(mTop)); }
 
   const_iterator end() const
   { return const_iterator(mTop); }
@@ -357,19 +532,19 @@ public:
   { return const_reverse_iterator(begin()); }
 
   prefix_iter prefix_begin(const key_type& prefix)
-  { return prefix_iter(mTop, prefix, 0); }
+  { return writable(prefix_iter(mTop, prefix, 0)); }
 
   const_prefix_iter prefix_begin(const key_type& prefix) const
-  { return const_prefix_iter(mTop, prefix, 0); }
+  { return const_prefix_iter(loadTop(), prefix, 0); }
 
   prefix_iter prefix_end()
-  { return prefix_iter(mTop, std::string()); }
+  { return writable(prefix_iter(mTop, std::string())); }
 
   const_prefix_iter prefix_end() const
   { return const_prefix_iter(mTop, std::string()); }
 
   reverse_prefix_iter prefix_rbegin(const key_type& prefix)
-  { return reverse_prefix_iter(prefix_iter(mTop, prefix)); }
+  { return reverse_prefix_iter(writable(prefix_iter(mTop, prefix))); }
 
   const_reverse_prefix_iter prefix_rbegin(const key_type& prefix) const
   { return const_reverse_prefix_iter(const_prefix_iter(mTop, prefix)); }
@@ -381,43 +556,166 @@ public:
   { return const_reverse_prefix_iter(prefix_begin( prefix)); }
 
 private:
-  void maybeFixParentTable(NodeT* node, NodeT* replacementNode);
+  // The top, read as an atomic by the const lookups, since a ConcurrentCTrie
+  // reader makes them while a writer may be replacing it.
+  NodeT* loadTop() const     {return __atomic_load_n(&mTop, __ATOMIC_CONSUME);}
+  void destroyTree();
+  void stealTree(CTrie& x);
+  bool sharesNodes() const                                {return mShares;}
+  NodeT* unshareEntry(NodeT* entry);
+  NodeT* unshareSlot(NodeT* parent, size_t index);
+  void unsharePath(const char* keyData, size_t keyLen);
+  void unshareIter(iterator& iter);
+  void unshareTree();
+  void unshareChildren(NodeT* node);
+  template<class IterT> IterT writable(IterT iter)
+                                              {iter.mTrie = this; return iter;}
+  void eraseUnshared(iterator& iter);
+  void releaseEntry(NodeT* entry);
+  static uint64_t freezeEntry(_FrozenWriter<T>& out, NodeT* entry);
+  // A run of sorted keys whose node a build_sorted() thread is to build,
+  // and then add to parent under key.
+  template<class ForwardIterator>
+  struct BuildTask {
+    NodeT* parent;
+    char key;
+    ForwardIterator first;
+    ForwardIterator last;
+    size_t pos;
+    size_t size;
+    NodeT* node;
+    size_t numKeys;
+    std::exception_ptr error;
+
+    BuildTask(NodeT* _parent, char _key, ForwardIterator _first,
+        ForwardIterator _last, size_t _pos, size_t _size)
+      : parent(_parent), key(_key), first(_first), last(_last), pos(_pos),
+        size(_size), node(nullptr), numKeys(0) {}
+  };
+
+  // Holds a node that build_sorted() is still filling in, and destroys it,
+  // with whatever entries it has so far, if an exception unwinds before it
+  // is released to its parent.
+  struct BuildOwner {
+    Alloc& alloc;
+    NodeT* node;
+
+    BuildOwner(Alloc& _alloc, NodeT* _node) : alloc(_alloc), node(_node) {}
+    ~BuildOwner()                         {if (node) node->destroy(alloc);}
+    NodeT* release()               {NodeT* n = node; node = nullptr; return n;}
+  };
+
+  // Orders task indexes by the size of their tasks, largest first.
+  template<class ForwardIterator>
+  struct BuildTaskLarger {
+    const std::vector<BuildTask<ForwardIterator> >& tasks;
+    explicit BuildTaskLarger(
+        const std::vector<BuildTask<ForwardIterator> >& _tasks)
+      : tasks(_tasks) {}
+    bool operator()(size_t x, size_t y) const
+                                    {return tasks[x].size > tasks[y].size;}
+  };
+
+  template<class ForwardIterator>
+    NodeT* startNode(ForwardIterator first, ForwardIterator last, size_t pos,
+        ForwardIterator& children, size_t& end, size_t& numChildren,
+        size_t& numKeys);
+  template<class ForwardIterator>
+    static ForwardIterator groupEnd(
+        ForwardIterator first, ForwardIterator last, size_t pos);
+  template<class ForwardIterator>
+    NodeT* buildNode(ForwardIterator first, ForwardIterator last, size_t pos,
+        size_t& numKeys);
+  template<class ForwardIterator>
+    NodeT* planNode(ForwardIterator first, ForwardIterator last, size_t pos,
+        size_t levels, size_t taskSize,
+        std::vector<BuildTask<ForwardIterator> >& tasks, size_t& numKeys);
+  template<class ForwardIterator>
+    void runBuildTasks(std::vector<BuildTask<ForwardIterator> >* tasks,
+        const std::vector<size_t>* order, std::atomic<size_t>* nextTask);
+
+  // Copy or swap allocators only where the allocator says they propagate.
+  // std::pmr::polymorphic_allocator does not, and cannot be assigned.
+  static void copyAlloc(Alloc& to, const Alloc& from, std::true_type)
+                                                                 {to = from;}
+  static void copyAlloc(Alloc&, const Alloc&, std::false_type)             {}
+  static void swapAlloc(Alloc& a, Alloc& b, std::true_type)
+                                                          {std::swap(a, b);}
+  static void swapAlloc(Alloc&, Alloc&, std::false_type)                   {}
+
+  void maybeFixParentTable(
+      const PathT& path, NodeT* node, NodeT* replacementNode);
 
   friend class iterator;
   friend class const_iterator;
+  template<class TrieT, class Visit> friend class _ParallelWalk;
+  template<typename U, template<u_char> class N, class A>
+    friend class ConcurrentCTrie;
+  template<typename U> friend class LoudsCTrie;
+  template<typename U> friend class DoubleArrayCTrie;
 };
 
+// Copy the position but not the key, which the copy builds if it needs it.
+// The buffer of this iterator's old key is kept for that.
 template<typename T, template<u_char> class Next, class Alloc>
-typename CTrie<T,Next,Alloc>::key_type
-CTrie<T,Next,Alloc>::iterator::key() const
+inline typename CTrie<T,Next,Alloc>::iterator&
+CTrie<T,Next,Alloc>::iterator::operator=(const iterator& x)
 {
-  key_type key;
-  if (mCurrentNode == nullptr) {
-    return key;
+  mPath = x.mPath;
+  mCurrentNode = x.mCurrentNode;
+  mCurrentIndex = x.mCurrentIndex;
+  mNodeKeyLen = sNoKey;
+  mTrie = x.mTrie;
+  return *this;
+}
+
+// Build the key down to the current node from the path, the first time that
+// key() is called.
+template<typename T, template<u_char> class Next, class Alloc>
+void
+CTrie<T,Next,Alloc>::iterator::initKey() const
+{
+  mKey.clear();
+  if (mCurrentNode != nullptr) {
+    for (size_t i = 0; i < mPath.size(); ++i) {
+      NodeT* n = mPath[i].node;
+      mKey.append(n->str(), n->strLen());
+      mKey += n->key(mPath[i].index);
+    }
+    mKey.append(mCurrentNode->str(), mCurrentNode->strLen());
   }
+  mNodeKeyLen = mKey.size();
+}
 
-  const NodeT *n;
-  for (n = mCurrentNode; n->parent() != nullptr; n = n->parent()) {
-    key.insert(0, n->str(), n->strLen());
-    key.insert(0, 1, n->parentIndex());
+// Add the rest of a leaf's key to the key down to the current node.
+template<typename T, template<u_char> class Next, class Alloc>
+inline const typename CTrie<T,Next,Alloc>::key_type&
+CTrie<T,Next,Alloc>::iterator::fillKey() const
+{
+  if (mNodeKeyLen == sNoKey) {
+    initKey();
   }
-  key.insert(0,  n->str(), n->strLen());
-  if (mCurrentIndex != NodeT::valueIndex()) {
-    key += mCurrentNode->key(mCurrentIndex);
-    NodeT* leaf = mCurrentNode->getEntry(mCurrentIndex);
-    key.append(leaf->str(), leaf->strLen());
+  mKey.resize(mNodeKeyLen);
+  if (mCurrentNode != nullptr && mCurrentIndex != NodeT::valueIndex() &&
+      mCurrentIndex != NodeT::endIndex()) {
+    mKey += mCurrentNode->key(mCurrentIndex);
+    LeafT* leaf = NodeT::entryLeaf(mCurrentNode->getEntry(mCurrentIndex));
+    mKey.append(leaf->str(), leaf->strLen());
   }
-  return key;
+  return mKey;
 }
 
 template<typename T, template<u_char> class Next, class Alloc>
 inline T*
 CTrie<T,Next,Alloc>::iterator::operator->()
 {
+  if (mTrie != nullptr && mTrie->sharesNodes()) {
+    mTrie->unshareIter(*this);
+  }
   if (mCurrentIndex == NodeT::valueIndex()) {
     return &(mCurrentNode->value());
   } else {
-    return &(mCurrentNode->getEntry(mCurrentIndex)->value());
+    return &(NodeT::entryLeaf(mCurrentNode->getEntry(mCurrentIndex))->value());
   }
 }
 
@@ -428,7 +726,7 @@ CTrie<T,Next,Alloc>::iterator::operator->() const
   if (mCurrentIndex == NodeT::valueIndex()) {
     return &(mCurrentNode->value());
   } else {
-    return &(mCurrentNode->getEntry(mCurrentIndex)->value());
+    return &(NodeT::entryLeaf(mCurrentNode->getEntry(mCurrentIndex))->value());
   }
 }
 
@@ -444,7 +742,7 @@ inline bool
 CTrie<T,Next,Alloc>::iterator::at_end() const
 {
   return mCurrentNode == nullptr ||
-      (mCurrentIndex == NodeT::endIndex() && mCurrentNode->parent() == nullptr);
+      (mCurrentIndex == NodeT::endIndex() && mPath.empty());
 }
 
 template<typename T, template<u_char> class Next, class Alloc>
@@ -455,16 +753,16 @@ CTrie<T,Next,Alloc>::iterator::operator++()
   while (mCurrentIndex == NodeT::endIndex()) {
     // Move up the tree until we find a node with something left to iterate
     // over.
-    if (mCurrentNode->parent() == nullptr) {
+    if (mPath.empty()) {
       return *this;
     }
     moveUpOne();
     mCurrentIndex = mCurrentNode->nextEntry(mCurrentIndex);
   }
 
-  NodeT* entry = mCurrentNode->getEntry(mCurrentIndex);
-  if (dynamic_cast<LeafT*>(entry) == nullptr) {
-    findLeaf(entry);
+  if (!NodeT::isLeafEntry(mCurrentNode->getEntry(mCurrentIndex))) {
+    moveDown();
+    findLeaf();
   }
   return *this;
 }
@@ -473,14 +771,19 @@ template<typename T, template<u_char> class Next, class Alloc>
 typename CTrie<T,Next,Alloc>::iterator&
 CTrie<T,Next,Alloc>::iterator::operator--()
 {
+  if (mCurrentNode == nullptr) {
+    return *this;
+  }
   bool goUp = mCurrentIndex == NodeT::valueIndex();
   if (!goUp) {
     mCurrentIndex = mCurrentNode->prevEntry(mCurrentIndex);
     goUp = mCurrentIndex == NodeT::valueIndex() && !mCurrentNode->hasValue();
   }
   while (goUp) {
-    if (mCurrentNode->parent() == nullptr) {
-      return *this;       // The user iterated before the first node
+    if (mPath.empty()) {
+      // The user iterated before the first node, which leaves this at the end
+      mCurrentIndex = NodeT::endIndex();
+      return *this;
     }
     moveUpOne();
     mCurrentIndex = mCurrentNode->prevEntry(mCurrentIndex);
@@ -491,16 +794,28 @@ CTrie<T,Next,Alloc>::iterator::operator--()
       assert(mCurrentNode->hasValue());
       return *this;
     }
-    NodeT* entry = mCurrentNode->getEntry(mCurrentIndex);
-    if (dynamic_cast<LeafT*>(entry) != nullptr) {
+    if (NodeT::isLeafEntry(mCurrentNode->getEntry(mCurrentIndex))) {
       return *this;
     }
-    mCurrentNode = entry;
+    moveDown();
     mCurrentIndex = mCurrentNode->lastEntry();
   }
   return *this;
 }
 
+// Move to the first key from the end, where the iterator is at the top node.
+template<typename T, template<u_char> class Next, class Alloc>
+void
+CTrie<T,Next,Alloc>::iterator::toFirst()
+{
+  assert(mPath.empty());
+  if (mNodeKeyLen != sNoKey && mCurrentNode != nullptr) {
+    mNodeKeyLen = mCurrentNode->strLen();
+  }
+  mCurrentIndex = NodeT::valueIndex();
+  init(false);
+}
+
 template<typename T, template<u_char> class Next, class Alloc>
 void
 CTrie<T,Next,Alloc>::iterator::init(bool after)
@@ -514,7 +829,7 @@ CTrie<T,Next,Alloc>::iterator::init(bool after)
 
   // If we are after the end of this node, move up until we get something.
   while (mCurrentIndex == NodeT::endIndex()) {
-    if (mCurrentNode->parent() == nullptr) {
+    if (mPath.empty()) {
       return;
     }
     moveUpOne();
@@ -524,46 +839,64 @@ CTrie<T,Next,Alloc>::iterator::init(bool after)
   // If the index has a corresponding value, use that; otherwise, traverse
   // down until we find a value.
   if (mCurrentIndex != NodeT::valueIndex()) {
-    NodeT* entry = mCurrentNode->getEntry(mCurrentIndex);
-    if (dynamic_cast<LeafT*>(entry) == nullptr) {
-      findLeaf(entry);
+    if (!NodeT::isLeafEntry(mCurrentNode->getEntry(mCurrentIndex))) {
+      moveDown();
+      findLeaf();
     }
   } else if (mCurrentNode->hasValue() || !mCurrentNode->empty()) {
-    findLeaf(mCurrentNode);
+    findLeaf();
   } else {
     // There are no values in this nodes, so this better be the top node
     // of an empty tree.
-    assert(mCurrentNode->parent() == nullptr);
+    assert(mPath.empty());
     mCurrentIndex = NodeT::endIndex();
   }
 }
 
+// Move down from the current node to the first value at or below it.
 template<typename T, template<u_char> class Next, class Alloc>
 void
-CTrie<T,Next,Alloc>::iterator::findLeaf(NodeT* node)
+CTrie<T,Next,Alloc>::iterator::findLeaf()
 {
-  mCurrentNode = node;
   mCurrentIndex = NodeT::valueIndex();
   while (!mCurrentNode->hasValue()) {
     mCurrentIndex = mCurrentNode->firstEntry();
     assert(mCurrentIndex != NodeT::endIndex());
-    NodeT* entry = mCurrentNode->getEntry(mCurrentIndex);
-    if (dynamic_cast<LeafT*>(entry) != nullptr) {
+    if (NodeT::isLeafEntry(mCurrentNode->getEntry(mCurrentIndex))) {
       break;
     }
+    moveDown();
+  }
+}
 
-    mCurrentNode = entry;
-    mCurrentIndex = NodeT::valueIndex();
+// Move down to the node at the current index of the current node.
+template<typename T, template<u_char> class Next, class Alloc>
+inline void
+CTrie<T,Next,Alloc>::iterator::moveDown()
+{
+  NodeT* node = mCurrentNode->getEntry(mCurrentIndex);
+  if (mNodeKeyLen != sNoKey) {
+    mKey.resize(mNodeKeyLen);
+    mKey += mCurrentNode->key(mCurrentIndex);
+    mKey.append(node->str(), node->strLen());
+    mNodeKeyLen = mKey.size();
   }
+  mPath.push(mCurrentNode, mCurrentIndex);
+  mCurrentNode = node;
+  mCurrentIndex = NodeT::valueIndex();
 }
 
+// Move up to the entry of the parent node that leads to the current node.
 template<typename T, template<u_char> class Next, class Alloc>
 inline void
 CTrie<T,Next,Alloc>::iterator::moveUpOne()
 {
-  char parentIndex = mCurrentNode->parentIndex();
-  mCurrentNode = mCurrentNode->parent();
-  mCurrentIndex = mCurrentNode->findEntry(parentIndex).first;
+  if (mNodeKeyLen != sNoKey) {
+    mNodeKeyLen -= mCurrentNode->strLen() + 1;
+  }
+  mCurrentNode = mPath.back().node;
+  mCurrentIndex = mPath.back().index;
+  mPath.pop();
 }
 
 template<typename T, template<u_char> class Next, class Alloc>
@@ -574,6 +907,24 @@ CTrie<T,Next,Alloc>::prefix_iter::prefix_iter(
     mSearchStr(searchStr),
     mSearchStrIndex(0)
 {
+  toFirst();
+}
+
+// Move to the first key with the prefix, from the top node, where the
+// iterator starts and where it is left at the end.
+template<typename T, template<u_char> class Next, class Alloc>
+void
+CTrie<T,Next,Alloc>::prefix_iter::toFirst()
+{
+  if (this->mCurrentNode == nullptr) {
+    return;
+  }
+  assert(this->mPath.empty());
+  mSearchStrIndex = 0;
+  if (this->mNodeKeyLen != iterator::sNoKey) {
+    this->mNodeKeyLen = this->mCurrentNode->strLen();
+  }
+  this->mCurrentIndex = NodeT::valueIndex();
   if (!this->mCurrentNode->hasValue() && !nextPrefix()) {
     this->mCurrentIndex = NodeT::endIndex();
   }
@@ -599,8 +950,12 @@ CTrie<T,Next,Alloc>::prefix_iter::operator++()
 {
   if (!nextPrefix()) {
     // We are done, so create the end() iterator by moving up to the top.
-    while (this->mCurrentNode->parent() != nullptr) {
-      this->mCurrentNode = this->mCurrentNode->parent();
+    if (!this->mPath.empty()) {
+      this->mCurrentNode = this->mPath[0].node;
+      this->mPath.clear();
+      if (this->mNodeKeyLen != iterator::sNoKey) {
+        this->mNodeKeyLen = this->mCurrentNode->strLen();
+      }
     }
     this->mCurrentIndex = NodeT::endIndex();
   }
@@ -611,39 +966,36 @@ template<typename T, template<u_char> class Next, class Alloc>
 typename CTrie<T,Next,Alloc>::prefix_iter&
 CTrie<T,Next,Alloc>::prefix_iter::operator--()
 {
-  if (this->mCurrentNode->parent() == nullptr &&
-      this->mCurrentIndex == NodeT::endIndex()) {
+  if (this->mCurrentNode == nullptr) {
+    return *this;
+  }
+  if (this->mPath.empty() && this->mCurrentIndex == NodeT::endIndex()) {
     // We are going backwards from the end, so traverse to the last
     // element, if there is one.
     this->mCurrentIndex = NodeT::valueIndex();
     while (nextPrefix()) {}
-    if (this->mCurrentNode->parent() == nullptr &&
+    if (this->mPath.empty() &&
         this->mCurrentIndex == NodeT::valueIndex() &&
         !this->mCurrentNode->hasValue()) {
       // There is nothing to find
       this->mCurrentIndex = NodeT::endIndex();
     }
-  } else if (this->mCurrentNode->parent() == nullptr &&
+  } else if (this->mPath.empty() &&
       this->mCurrentIndex == NodeT::valueIndex()) {
     // We were at the value of the top node, so we are done iterating
     this->mCurrentIndex = NodeT::endIndex();
   } else {
-    if (this->mCurrentIndex != NodeT::valueIndex()) {
-      // We are currently at a leaf, so move to the node
-      this->mCurrentIndex = NodeT::valueIndex();
-    } else {
-      // We are currently at a node that is not the top node,
-      // so move up a node.
-      this->mCurrentNode = this->mCurrentNode->parent();
+    // If we are currently at a leaf, start from the leaf's node; otherwise,
+    // we are at a node that is not the top node, so move up a node.
+    if (this->mCurrentIndex == NodeT::valueIndex()) {
+      this->moveUpOne();
     }
-    while (!this->mCurrentNode->hasValue() &&
-        this->mCurrentNode->parent() != nullptr) {
+    while (!this->mCurrentNode->hasValue() && !this->mPath.empty()) {
       // This node has no value, so keep moving up
-      this->mCurrentNode = this->mCurrentNode->parent();
+      this->moveUpOne();
     }
-    if (!this->mCurrentNode->hasValue() &&
-        this->mCurrentNode->parent() == nullptr)
-      this->mCurrentIndex = NodeT::endIndex();
+    this->mCurrentIndex = this->mCurrentNode->hasValue() ?
+        NodeT::valueIndex() : NodeT::endIndex();
   }
   return *this;
 }
@@ -661,7 +1013,7 @@ CTrie<T,Next,Alloc>::prefix_iter::nextPrefix()
     return false;   // The last value found was a leaf, so there is no more
 
   size_t nodeStrLen = this->mCurrentNode->strLen();
-  if (this->mCurrentNode->parent() == nullptr && nodeStrLen) {
+  if (this->mPath.empty() && nodeStrLen) {
     // This is the top node, so we are just getting started.  Make sure the
     // beginning of mSearchStr matches this node.
     assert(mSearchStrIndex == 0);
@@ -677,36 +1029,45 @@ CTrie<T,Next,Alloc>::prefix_iter::nextPrefix()
   }
 
   // Move down the tree until we find a match.  Bail if we run out of search
-  // string or no part of the tree matches the search string.
+  // string or no part of the tree matches the search string.  The nodes
+  // passed on the way down are added to the path, so drop them if we bail.
+  size_t pathSize = this->mPath.size();
+  size_t nodeKeyLen = this->mNodeKeyLen;
   NodeT* node = this->mCurrentNode;
-  while (1) {
-    if (mSearchStrIndex >= mSearchStr.length())
-      return false;
-
+  while (mSearchStrIndex < mSearchStr.length()) {
     std::pair<size_t, bool> findRtn =
         node->findEntry(mSearchStr[mSearchStrIndex++]);
     if (!findRtn.second)
-      return false;
+      break;
 
     NodeT* entry = node->getEntry(findRtn.first);
+    bool isLeaf = NodeT::isLeafEntry(entry);
+    entry = NodeT::entryNode(entry);
     size_t entryStrLen = entry->strLen();
     if (entryStrLen) {
       // Compare this node's string against the search string.
       if (entryStrLen > mSearchStr.length() - mSearchStrIndex)
-        return false;
+        break;
       int cmpResult = mSearchStr.compare(
           mSearchStrIndex, entryStrLen, entry->str(), entryStrLen);
       if (cmpResult != 0) {
-        return false;
+        break;
       }
       mSearchStrIndex += entryStrLen;
     }
-    if (dynamic_cast<LeafT*>(entry) != nullptr) {
+    if (isLeaf) {
       this->mCurrentNode = node;
       this->mCurrentIndex = findRtn.first;
       return true;
     }
 
+    this->mPath.push(node, findRtn.first);
+    if (this->mNodeKeyLen != iterator::sNoKey) {
+      this->mKey.resize(this->mNodeKeyLen);
+      this->mKey += node->key(findRtn.first);
+      this->mKey.append(entry->str(), entryStrLen);
+      this->mNodeKeyLen = this->mKey.size();
+    }
     if (entry->hasValue()) {
       this->mCurrentNode = entry;
       this->mCurrentIndex = NodeT::valueIndex();
@@ -714,63 +1075,320 @@ CTrie<T,Next,Alloc>::prefix_iter::nextPrefix()
     }
     node = entry;
   }
+  this->mPath.resize(pathSize);
+  this->mNodeKeyLen = nodeKeyLen;
+  return false;
 }
 
 template<typename T, template<u_char> class Next, class Alloc>
 inline CTrie<T,Next,Alloc>::CTrie(const CTrie& x)
-  : mTop(nullptr), mSize(x.mSize)
+  : mTop(nullptr), mSize(x.mSize),
+    mAlloc(AllocTraits::select_on_container_copy_construction(x.mAlloc)),
+    mShares(false)
 {
   if (x.mTop) {
-    mTop = x.mTop->clone();
+    mTop = x.mTop->clone(mAlloc);
   }
 }
 
 template<typename T, template<u_char> class Next, class Alloc>
 inline CTrie<T,Next,Alloc>::CTrie(CTrie&& x)
-  : mTop(x.mTop), mSize(x.mSize)
+  : mTop(x.mTop), mSize(x.mSize), mAlloc(x.mAlloc), mShares(x.mShares)
 {
   x.mTop = nullptr;
   x.mSize = 0;
+  x.mShares = false;
 }
 
 template<typename T, template<u_char> class Next, class Alloc>
 CTrie<T,Next,Alloc>&
 CTrie<T,Next,Alloc>::operator=(const CTrie& x)
 {
-  if (mTop) {
-    mTop->destroy();
-    mTop = nullptr;
-  }
-  if (x.mTop) {
-    mTop = x.mTop->clone();
+  if (this != &x) {
+    destroyTree();
+    copyAlloc(mAlloc, x.mAlloc,
+        typename AllocTraits::propagate_on_container_copy_assignment());
+    if (x.mTop) {
+      mTop = x.mTop->clone(mAlloc);
+    }
+    mSize = x.mSize;
   }
-  mSize = x.mSize;
   return *this;
 }
     
+// The nodes of x can only be taken over if this trie's allocator will be
+// able to free them, either because x's allocator comes along with them or
+// because the two allocators are equal.  Otherwise they are copied.
 template<typename T, template<u_char> class Next, class Alloc>
 CTrie<T,Next,Alloc>&
 CTrie<T,Next,Alloc>::operator=(CTrie&& x)
 {
-  if (mTop) {
-    mTop->destroy();
-    mTop = nullptr;
+  if (this != &x) {
+    destroyTree();
     mSize = 0;
+    if (AllocTraits::propagate_on_container_move_assignment::value ||
+        mAlloc == x.mAlloc) {
+      copyAlloc(mAlloc, x.mAlloc,
+          typename AllocTraits::propagate_on_container_move_assignment());
+      stealTree(x);
+    } else {
+      if (x.mTop) {
+        mTop = x.mTop->clone(mAlloc);
+      }
+      mSize = x.mSize;
+      x.clear();
+    }
   }
-  std::swap(mTop, x.mTop);
-  std::swap(mSize, x.mSize);
   return *this;
 }
     
+// Unless the allocators propagate on swap, they must be equal.
+template<typename T, template<u_char> class Next, class Alloc>
+inline void
+CTrie<T,Next,Alloc>::swap(CTrie& x)
+{
+  std::swap(mTop, x.mTop);
+  std::swap(mSize, x.mSize);
+  std::swap(mShares, x.mShares);
+  swapAlloc(mAlloc, x.mAlloc,
+      typename AllocTraits::propagate_on_container_swap());
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+inline void
+CTrie<T,Next,Alloc>::stealTree(CTrie& x)
+{
+  mTop = x.mTop;
+  mSize = x.mSize;
+  mShares = x.mShares;
+  x.mTop = nullptr;
+  x.mSize = 0;
+  x.mShares = false;
+}
+
 template<typename T, template<u_char> class Next, class Alloc>
 inline void
 CTrie<T,Next,Alloc>::clear()
 {
-  if (mTop) {
-    mTop->destroy();
+  destroyTree();
+  mSize = 0;
+}
+
+// Free all of the nodes.  With a monotonic allocator, the nodes are only
+// visited if their values need to be destroyed, or the allocator wants them
+// back, and then the allocator releases its memory in one go.  Nodes that a
+// snapshot still shares are left to it, and the allocator is not released,
+// since it holds them.
+template<typename T, template<u_char> class Next, class Alloc>
+inline void
+CTrie<T,Next,Alloc>::destroyTree()
+{
+  if (!mTop) {
+    mShares = false;
+    return;
+  }
+  if (sharesNodes()) {
+    releaseEntry(mTop);
     mTop = nullptr;
-    mSize = 0;
+    mShares = false;
+    return;
+  }
+  if (!_MonotonicTraits<Alloc>::sMonotonic ||
+      !std::is_trivially_destructible<T>::value ||
+      !_MonotonicTraits<Alloc>::canDrop(mAlloc)) {
+    mTop->destroy(mAlloc);
+  }
+  mTop = nullptr;
+  _MonotonicTraits<Alloc>::release(mAlloc);
+}
+
+// Return a trie that shares all of this trie's nodes, which takes constant
+// time.  Either trie may then be changed: a change copies the nodes on the
+// path to its key that the other trie still shares, and changes the copies,
+// so the other trie does not see it.  Nodes are freed when the last trie
+// that holds them is done with them.
+//
+// Lookups do not copy anything.  insert(), erase() and operator[]() copy the
+// path to their key.  A value written through an iterator is copied, with
+// the path to it, when the iterator is first dereferenced for writing, and
+// parallel_for_each() copies every node that is still shared before it
+// starts.  Like an insert, such a copy invalidates the other iterators into
+// the nodes that were copied.
+//
+// Each node counts the parents and tries that hold it, atomically, and a
+// trie only changes a node that it alone holds, so the two tries may be used
+// and destroyed by different threads, as long as the allocator may be used
+// by several threads at once (see _ConcurrentTraits).
+template<typename T, template<u_char> class Next, class Alloc>
+CTrie<T,Next,Alloc>
+CTrie<T,Next,Alloc>::snapshot()
+{
+  CTrie copy(mAlloc);
+  if (mTop) {
+    mTop->addRef();
+    mShares = true;
+    copy.mTop = mTop;
+    copy.mSize = mSize;
+    copy.mShares = true;
+  }
+  return copy;
+}
+
+// Return entry, or a copy of it if another trie holds it too.  The copy of an
+// inner node shares the children, which gain a reference each.  If the other
+// holders let go of entry while it is being copied, dropping this trie's
+// reference frees it, and its references to the children with it.
+template<typename T, template<u_char> class Next, class Alloc>
+typename CTrie<T,Next,Alloc>::NodeT*
+CTrie<T,Next,Alloc>::unshareEntry(NodeT* entry)
+{
+  if (!NodeT::entryNode(entry)->shared()) {
+    return entry;
+  }
+  NodeT* copy;
+  if (NodeT::isLeafEntry(entry)) {
+    copy = NodeT::makeEntry(NodeT::entryLeaf(entry)->clone(mAlloc));
+  } else {
+    copy = entry->cloneShell(mAlloc, 0);
+    for (size_t index = copy->firstEntry(); index != NodeT::endIndex();
+        index = copy->nextEntry(index)) {
+      NodeT::entryNode(copy->getEntry(index))->addRef();
+    }
   }
+  releaseEntry(entry);
+  return copy;
+}
+
+// Make the entry at index in parent, or the top if parent is null, this
+// trie's own, and return it.  The parent must be this trie's own already.
+template<typename T, template<u_char> class Next, class Alloc>
+inline typename CTrie<T,Next,Alloc>::NodeT*
+CTrie<T,Next,Alloc>::unshareSlot(NodeT* parent, size_t index)
+{
+  if (parent == nullptr) {
+    mTop = unshareEntry(mTop);
+    return mTop;
+  }
+  typename NodeT::SlotT* slot = parent->getEntryPtr(index);
+  NodeT* entry = unshareEntry(*slot);
+  *slot = entry;
+  return entry;
+}
+
+// Make sure that the nodes which a change for the key may change are this
+// trie's own: the nodes that the key leads through, down to the one where
+// it ends or leaves the trie, and the leaf there, if any.
+template<typename T, template<u_char> class Next, class Alloc>
+void
+CTrie<T,Next,Alloc>::unsharePath(const char* keyData, size_t keyLen)
+{
+  if (!mTop || !sharesNodes()) {
+    return;
+  }
+  NodeT* node = unshareSlot(nullptr, 0);
+  size_t pos = 0;
+  while (1) {
+    size_t end = pos + node->strLen();
+    if (end >= keyLen ||
+        memcmp(node->str(), keyData + pos, node->strLen()) != 0) {
+      return;
+    }
+    std::pair<size_t, bool> findRtn = node->findEntry(keyData[end]);
+    if (!findRtn.second) {
+      return;
+    }
+    NodeT* entry = unshareSlot(node, findRtn.first);
+    if (NodeT::isLeafEntry(entry)) {
+      return;
+    }
+    node = entry;
+    pos = end + 1;
+  }
+}
+
+// Make the nodes that iter is in, and the leaf it is at, this trie's own, so
+// that a value written through it is not seen by the other tries, and move
+// iter to the copies.  A copy may be of another size class than the node it
+// copies, and so number its entries differently, so each entry is found
+// again by its key.  The key is read before the node may be freed.
+template<typename T, template<u_char> class Next, class Alloc>
+void
+CTrie<T,Next,Alloc>::unshareIter(iterator& iter)
+{
+  if (iter.at_end()) {
+    return;
+  }
+  NodeT* parent = nullptr;
+  size_t index = 0;
+  for (size_t i = 0; i < iter.mPath.size(); ++i) {
+    typename PathT::Step& step = iter.mPath[i];
+    char key = step.node->key(step.index);
+    NodeT* node = unshareSlot(parent, index);
+    if (node != step.node) {
+      step.node = node;
+      step.index = node->findEntry(key).first;
+    }
+    parent = step.node;
+    index = step.index;
+  }
+  bool atLeaf = iter.mCurrentIndex != NodeT::valueIndex() &&
+      iter.mCurrentIndex != NodeT::endIndex();
+  char key = atLeaf ? iter.mCurrentNode->key(iter.mCurrentIndex) : 0;
+  NodeT* node = unshareSlot(parent, index);
+  if (node != iter.mCurrentNode) {
+    iter.mCurrentNode = node;
+    if (atLeaf) {
+      iter.mCurrentIndex = node->findEntry(key).first;
+    }
+  }
+  if (atLeaf) {
+    unshareSlot(node, iter.mCurrentIndex);
+  }
+}
+
+// Make every node this trie's own, for a walk that may change any value.
+// Nothing is shared after that, so changes stop looking for shared nodes.
+template<typename T, template<u_char> class Next, class Alloc>
+void
+CTrie<T,Next,Alloc>::unshareTree()
+{
+  if (mTop && sharesNodes()) {
+    unshareChildren(unshareSlot(nullptr, 0));
+  }
+  mShares = false;
+}
+
+template<typename T, template<u_char> class Next, class Alloc>
+void
+CTrie<T,Next,Alloc>::unshareChildren(NodeT* node)
+{
+  for (size_t index = node->firstEntry(); index != NodeT::endIndex();
+      index = node->nextEntry(index)) {
+    NodeT* entry = unshareSlot(node, index);
+    if (!NodeT::isLeafEntry(entry)) {
+      unshareChildren(entry);
+    }
+  }
+}
+
+// Drop this trie's reference to the entry, and free it, and then its
+// children in turn, if no other trie holds it.
+template<typename T, template<u_char> class Next, class Alloc>
+void
+CTrie<T,Next,Alloc>::releaseEntry(NodeT* entry)
+{
+  if (!NodeT::entryNode(entry)->dropRef()) {
+    return;
+  }
+  if (NodeT::isLeafEntry(entry)) {
+    NodeT::entryLeaf(entry)->destroy(mAlloc);
+    return;
+  }
+  for (size_t index = entry->firstEntry(); index != NodeT::endIndex();
+      index = entry->nextEntry(index)) {
+    releaseEntry(entry->getEntry(index));
+  }
+  entry->destroyShell(mAlloc);
 }
 
 template<typename T, template<u_char> class Next, class Alloc>
@@ -778,17 +1396,21 @@ std::pair<typename CTrie<T,Next,Alloc>::iterator, bool>
 CTrie<T,Next,Alloc>::insert(
     const char* searchKey, size_t keyLen, const T& value)
 {
-  typename NodeT::InsertRtn rtn;
   if (mTop == nullptr) {
-    mTop = NodeT::createNode(nullptr, searchKey, keyLen, 0, value);
-    rtn = NodeT::InsertRtn(mTop, NodeT::valueIndex(), true);
-  } else {
-    rtn = NodeT::insert(&mTop, searchKey, keyLen, 0, value);
+    mTop = NodeT::createNode(mAlloc, searchKey, keyLen, value);
+    this->mSize = 1;
+    return std::make_pair(
+        writable(iterator(mTop, NodeT::valueIndex(), false)), true);
   }
+
+  unsharePath(searchKey, keyLen);
+  PathT path;
+  typename NodeT::InsertRtn rtn =
+      NodeT::insert(mAlloc, &mTop, searchKey, keyLen, 0, value, &path);
   if (rtn.succeeded)
-      ++this->mSize;
-  iterator iter(rtn.node, rtn.index, false);
-  return std::make_pair(iter, rtn.succeeded);
+    ++this->mSize;
+  return std::make_pair(
+      writable(iterator(path, rtn.node, rtn.index, false)), rtn.succeeded);
 }
 
 template<typename T, template<u_char> class Next, class Alloc>
@@ -797,16 +1419,20 @@ CTrie<T,Next,Alloc>::insert(const key_type& searchKey, const T& value)
 {
   if (mTop == nullptr) {
     mTop = NodeT::createNode(
-        nullptr, searchKey.data(), searchKey.length(), 0, value);
+        mAlloc, searchKey.data(), searchKey.length(), value);
     this->mSize = 1;
-    return std::make_pair(iterator(mTop, NodeT::valueIndex(), false), true);
+    return std::make_pair(
+        writable(iterator(mTop, NodeT::valueIndex(), false)), true);
   }
 
-  typename NodeT::InsertRtn rtn =
-      NodeT::insert(&mTop, searchKey.data(), searchKey.length(), 0, value);
+  unsharePath(searchKey.data(), searchKey.length());
+  PathT path;
+  typename NodeT::InsertRtn rtn = NodeT::insert(
+      mAlloc, &mTop, searchKey.data(), searchKey.length(), 0, value, &path);
   if (rtn.succeeded)
     ++this->mSize;
-  return std::make_pair(iterator(rtn.node, rtn.index, false), rtn.succeeded);
+  return std::make_pair(
+      writable(iterator(path, rtn.node, rtn.index, false)), rtn.succeeded);
 }
 
 template<typename T, template<u_char> class Next, class Alloc>
@@ -815,7 +1441,13 @@ void
 CTrie<T,Next,Alloc>::insert(InputIterator firsti, InputIterator lasti)
 {
   while (firsti != lasti) {
-    typename NodeT::InsertRtn rtn = NodeT::insert(&mTop,
+    if (mTop == nullptr) {
+      insert(firsti->first, firsti->second);
+      ++firsti;
+      continue;
+    }
+    unsharePath(firsti->first.data(), firsti->first.length());
+    typename NodeT::InsertRtn rtn = NodeT::insert(mAlloc, &mTop,
         firsti->first.data(), firsti->first.length(), 0, firsti->second);
     if (rtn.succeeded) {
       ++mSize;
@@ -824,13 +1456,288 @@ CTrie<T,Next,Alloc>::insert(InputIterator firsti, InputIterator lasti)
   }
 }
 
+// Replace the contents of the trie with the (key, value) pairs in [first,
+// last), which must be sorted by key.  As with insert(), the first of
+// several equal keys wins.  Since the keys are sorted, the keys under each
+// node are next to each other, so each node is created once, with its whole
+// string and at the size class that holds all of its children, rather than
+// being split and grown as the keys arrive one at a time.
+template<typename T, template<u_char> class Next, class Alloc>
+template<class ForwardIterator>
+void
+CTrie<T,Next,Alloc>::build_sorted(ForwardIterator first, ForwardIterator last)
+{
+  clear();
+  if (first == last) {
+    return;
+  }
+  ForwardIterator lastKey = first;
+  for (ForwardIterator p = first; ++p != last; ) {
+    lastKey = p;
+  }
+  size_t numKeys = 0;
+  mTop = buildNode(first, lastKey, 0, numKeys);
+  mSize = numKeys;
+}
+
+// The same, but with the subtrees built by numThreads threads.  The node for
+// the keys' common prefix, and those for the runs of keys that share their
+// next one or two characters, are created first.  The runs under them are
+// then built by the threads, largest first, and joined to their parents.
+// This needs an allocator that is safe to use from several threads, and
+// falls back to one thread for any other.
+template<typename T, template<u_char> class Next, class Alloc>
+template<class ForwardIterator>
+void
+CTrie<T,Next,Alloc>::build_sorted(
+    ForwardIterator first, ForwardIterator last, size_t numThreads)
+{
+  if (numThreads <= 1 || !_ConcurrentTraits<Alloc>::sThreadSafe) {
+    build_sorted(first, last);
+    return;
+  }
+
+  clear();
+  if (first == last) {
+    return;
+  }
+  ForwardIterator lastKey = first;
+  size_t numInput = 1;
+  for (ForwardIterator p = first; ++p != last; ++numInput) {
+    lastKey = p;
+  }
+
+  std::vector<BuildTask<ForwardIterator> > tasks;
+  size_t taskSize =
+      std::max(numInput / (numThreads * 8), static_cast<size_t>(1));
+  size_t numKeys = 0;
+  mTop = planNode(first, lastKey, 0, 2, taskSize, tasks, numKeys);
+  mSize = numKeys;
+
+  std::vector<size_t> order(tasks.size());
+  for (size_t i = 0; i < tasks.size(); ++i) {
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(),
+      BuildTaskLarger<ForwardIterator>(tasks));
+
+  // If a thread fails to start, the ones that did are told to take no more
+  // tasks, and what they built is freed with the rest of the trie.
+  std::atomic<size_t> nextTask(0);
+  std::exception_ptr error;
+  {
+    std::vector<std::thread> threads;
+    _ThreadJoiner joiner(threads);
+    numThreads = std::min(numThreads, tasks.size());
+    try {
+      threads.reserve(numThreads);
+      for (size_t i = 0; i < numThreads; ++i) {
+        threads.push_back(std::thread(&CTrie::runBuildTasks<ForwardIterator>,
+            this, &tasks, &order, &nextTask));
+      }
+    } catch (...) {
+      error = std::current_exception();
+      nextTask = tasks.size();
+    }
+  }
+
+  for (size_t i = 0; i < tasks.size(); ++i) {
+    BuildTask<ForwardIterator>& task = tasks[i];
+    if (task.node) {
+      task.parent->insertEntry(
+          mAlloc, task.node, task.parent->findEntry(task.key).first, task.key);
+      mSize += task.numKeys;
+    } else if (task.error) {
+      error = task.error;
+    }
+  }
+  if (error) {
+    clear();
+    std::rethrow_exception(error);
+  }
+}
+
+// Create the node for the keys from first up to and including last, which all
+// start with the same pos characters, with its string and its value, if one
+// of the keys ends at it.  Return where its children's keys start, the
+// position of the character that tells them apart, and how many there are.
+template<typename T, template<u_char> class Next, class Alloc>
+template<class ForwardIterator>
+typename CTrie<T,Next,Alloc>::NodeT*
+CTrie<T,Next,Alloc>::startNode(ForwardIterator first, ForwardIterator last,
+    size_t pos, ForwardIterator& children, size_t& end, size_t& numChildren,
+    size_t& numKeys)
+{
+  // The node's string is what the first and last keys have in common, which,
+  // since the keys are sorted, all of the keys between them share too.
+  const key_type& firstKey = first->first;
+  const key_type& lastKey = last->first;
+  end = pos;
+  size_t maxEnd = std::min(firstKey.length(), lastKey.length());
+  while (end < maxEnd && firstKey[end] == lastKey[end]) {
+    ++end;
+  }
+
+  // A key that ends at this node sorts before the others.
+  children = first;
+  bool hasValue = firstKey.length() == end;
+  if (hasValue) {
+    while (children != last && children->first.length() == end) {
+      ++children;
+    }
+  }
+
+  numChildren = 0;
+  if (children->first.length() != end) {
+    numChildren = 1;
+    for (ForwardIterator q = children; q != last; ) {
+      u_char prevCh = static_cast<u_char>(q->first[end]);
+      u_char ch = static_cast<u_char>((++q)->first[end]);
+      assert(prevCh <= ch);
+      if (ch != prevCh) {
+        ++numChildren;
+      }
+    }
+  }
+
+  BuildOwner node(mAlloc, NodeT::createSizedNode(
+      mAlloc, firstKey.data() + pos, end - pos, numChildren));
+  if (hasValue) {
+    node.node->addValue(mAlloc, first->second);
+    ++numKeys;
+  }
+  return node.release();
+}
+
+// Return the last of the keys from first on that have the same character at
+// pos as first.
+template<typename T, template<u_char> class Next, class Alloc>
+template<class ForwardIterator>
+ForwardIterator
+CTrie<T,Next,Alloc>::groupEnd(
+    ForwardIterator first, ForwardIterator last, size_t pos)
+{
+  char ch = first->first[pos];
+  ForwardIterator groupLast = first;
+  while (groupLast != last) {
+    ForwardIterator next = groupLast;
+    if ((++next)->first[pos] != ch) {
+      break;
+    }
+    groupLast = next;
+  }
+  return groupLast;
+}
+
+// Build the node for the keys from first up to and including last, which all
+// start with the same pos characters, and add the number of distinct keys to
+// numKeys.  Each run of keys with the same next character becomes one child:
+// a leaf if it is a single key, and a node otherwise.
+template<typename T, template<u_char> class Next, class Alloc>
+template<class ForwardIterator>
+typename CTrie<T,Next,Alloc>::NodeT*
+CTrie<T,Next,Alloc>::buildNode(ForwardIterator first, ForwardIterator last,
+    size_t pos, size_t& numKeys)
+{
+  ForwardIterator p;
+  size_t end;
+  size_t numChildren;
+  BuildOwner node(
+      mAlloc, startNode(first, last, pos, p, end, numChildren, numKeys));
+  while (numChildren != 0) {
+    ForwardIterator groupLast = groupEnd(p, last, end);
+    char ch = p->first[end];
+    const key_type& key = p->first;
+    NodeT* child;
+    if (key == groupLast->first) {
+      child = LeafT::create(mAlloc, key.data() + end + 1,
+          key.length() - end - 1, p->second);
+      ++numKeys;
+    } else {
+      child = buildNode(p, groupLast, end + 1, numKeys);
+    }
+    node.node->insertEntry(mAlloc, child, node.node->findEntry(ch).first, ch);
+
+    p = groupLast;
+    if (--numChildren != 0) {
+      ++p;
+    }
+  }
+  return node.release();
+}
+
+// Like buildNode(), but a run of more than taskSize keys, down to the given
+// number of levels, is split into its own node here.  Any other run that
+// needs a node is left to a BuildTask.
+template<typename T, template<u_char> class Next, class Alloc>
+template<class ForwardIterator>
+typename CTrie<T,Next,Alloc>::NodeT*
+CTrie<T,Next,Alloc>::planNode(ForwardIterator first, ForwardIterator last,
+    size_t pos, size_t levels, size_t taskSize,
+    std::vector<BuildTask<ForwardIterator> >& tasks, size_t& numKeys)
+{
+  ForwardIterator p;
+  size_t end;
+  size_t numChildren;
+  BuildOwner node(
+      mAlloc, startNode(first, last, pos, p, end, numChildren, numKeys));
+  while (numChildren != 0) {
+    ForwardIterator groupLast = groupEnd(p, last, end);
+    char ch = p->first[end];
+    const key_type& key = p->first;
+    size_t groupSize = static_cast<size_t>(std::distance(p, groupLast)) + 1;
+    if (key == groupLast->first) {
+      NodeT* leaf = LeafT::create(mAlloc, key.data() + end + 1,
+          key.length() - end - 1, p->second);
+      node.node->insertEntry(mAlloc, leaf, node.node->findEntry(ch).first, ch);
+      ++numKeys;
+    } else if (levels > 0 && groupSize > taskSize) {
+      NodeT* child = planNode(
+          p, groupLast, end + 1, levels - 1, taskSize, tasks, numKeys);
+      node.node->insertEntry(mAlloc, child, node.node->findEntry(ch).first, ch);
+    } else {
+      tasks.push_back(BuildTask<ForwardIterator>(
+          node.node, ch, p, groupLast, end + 1, groupSize));
+    }
+
+    p = groupLast;
+    if (--numChildren != 0) {
+      ++p;
+    }
+  }
+  return node.release();
+}
+
+// The body of each build_sorted() thread.  An exception is kept with its
+// task, to be rethrown once all of the threads are done.
+template<typename T, template<u_char> class Next, class Alloc>
+template<class ForwardIterator>
+void
+CTrie<T,Next,Alloc>::runBuildTasks(
+    std::vector<BuildTask<ForwardIterator> >* tasks,
+    const std::vector<size_t>* order, std::atomic<size_t>* nextTask)
+{
+  size_t i;
+  while ((i = (*nextTask)++) < tasks->size()) {
+    BuildTask<ForwardIterator>& task = (*tasks)[(*order)[i]];
+    try {
+      task.node = buildNode(task.first, task.last, task.pos, task.numKeys);
+    } catch (...) {
+      task.error = std::current_exception();
+    }
+  }
+}
+
 template<typename T, template<u_char> class Next, class Alloc>
 inline size_t
 CTrie<T,Next,Alloc>::erase(const char* keyData, size_t keyLen)
 {
   iterator p = find(keyData, keyLen);
   if (p != end()) {
-      erase(p);
+      if (sharesNodes()) {
+        unshareIter(p);
+      }
+      eraseUnshared(p);
       return 1;
   } else {
       return 0;
@@ -840,31 +1747,36 @@ CTrie<T,Next,Alloc>::erase(const char* keyData, size_t keyLen)
 template<typename T, template<u_char> class Next, class Alloc>
 void
 CTrie<T,Next,Alloc>::erase(iterator& iter)
+{
+  if (sharesNodes()) {
+    // The iterator may be in nodes that a snapshot shares.
+    unshareIter(iter);
+  }
+  eraseUnshared(iter);
+}
+
+// Erase the key that iter is at, whose path no snapshot shares, and move iter
+// on to the next key.
+template<typename T, template<u_char> class Next, class Alloc>
+void
+CTrie<T,Next,Alloc>::eraseUnshared(iterator& iter)
 {
   --mSize;
   NodeT *node = iter.mCurrentNode;
   if (iter.mCurrentIndex == NodeT::valueIndex()) {
-    // Remove the value from this node by moving the node to a non-value node.
-    NodeT* newNode = node->moveRemoveValue();
-    node->destroy();
-    if (newNode->parent() == nullptr) {
-      mTop = newNode;
-    } else {
-      NodeT *parent = newNode->parent();
-      size_t thisIndex = parent->findEntry(newNode->parentIndex()).first;
-      *parent->getEntryPtr(thisIndex) = newNode;
-    }
-    iter.mCurrentNode = newNode;
-    if (!newNode->empty()) {
-      iter.findLeaf(newNode);
+    // Remove the value from this node's end-of-key slot.
+    node->removeValue(mAlloc);
+    if (!node->empty()) {
+      iter.findLeaf();
       return;
     }
   } else {
     // Remove a leaf.
     NodeT* replacementNode;
-    node->getEntry(iter.mCurrentIndex)->destroy();
-    iter.mCurrentIndex = node->eraseEntry(iter.mCurrentIndex, &replacementNode);
-    maybeFixParentTable(node, replacementNode);
+    NodeT::entryLeaf(node->getEntry(iter.mCurrentIndex))->destroy(mAlloc);
+    iter.mCurrentIndex =
+        node->eraseEntry(mAlloc, iter.mCurrentIndex, &replacementNode);
+    maybeFixParentTable(iter.mPath, node, replacementNode);
     iter.mCurrentNode = replacementNode;
   }
 
@@ -872,33 +1784,36 @@ CTrie<T,Next,Alloc>::erase(iterator& iter)
   bool convertToLeaf = false;
   node = iter.mCurrentNode;
   while (node->empty()) {
-    if (node->parent() == nullptr) {
+    if (iter.mPath.empty() && node->hasValue()) {
+      // The top node has no children left, but still holds its own value.
+      break;
+    }
+    if (iter.mPath.empty()) {
       // Nothing left in the tree.
       assert(node == mTop);
-      node->destroy();
+      node->destroy(mAlloc);
       node = mTop = nullptr;
       iter = end();
       return;
     }
-    NodeT* parent = iter.mCurrentNode = node->parent();
-    iter.mCurrentIndex = parent->findEntry(node->parentIndex()).first;
-    assert(iter.mCurrentIndex != NodeT::endIndex());
+    iter.moveUpOne();
+    NodeT* parent = iter.mCurrentNode;
 
     if (node->hasValue()) {
       // Convert this node to a leaf.
-      LeafT *leaf =
-          LeafT::create(node->str(), node->strLen(), node->valueToMove());
-      *parent->getEntryPtr(iter.mCurrentIndex) = leaf;
-      node->destroy();
+      LeafT *leaf = LeafT::create(
+          mAlloc, node->str(), node->strLen(), node->valueToMove());
+      *parent->getEntryPtr(iter.mCurrentIndex) = NodeT::makeEntry(leaf);
+      node->destroy(mAlloc);
       convertToLeaf = true;
       break;
     }
 
     NodeT *replacementParent;
     iter.mCurrentIndex =
-        parent->eraseEntry(iter.mCurrentIndex, &replacementParent);
-    maybeFixParentTable(parent, replacementParent);
-    node->destroy();
+        parent->eraseEntry(mAlloc, iter.mCurrentIndex, &replacementParent);
+    maybeFixParentTable(iter.mPath, parent, replacementParent);
+    node->destroy(mAlloc);
     node = iter.mCurrentNode = replacementParent;
   }
 
@@ -916,10 +1831,20 @@ template<typename T, template<u_char> class Next, class Alloc>
 void
 CTrie<T,Next,Alloc>::erase(iterator first, const iterator& last)
 {
+  // Erasing moves the iterator to the next entry, and keeps its path to the
+  // top valid, which a copy of the iterator would not.  If the trie shares
+  // nodes, erasing may copy the nodes that last is in, so the keys are
+  // compared instead.
+  if (sharesNodes()) {
+    bool toEnd = last.at_end();
+    key_type lastKey = toEnd ? key_type() : last.key();
+    while (!first.at_end() && (toEnd || first.key() != lastKey)) {
+      erase(first);
+    }
+    return;
+  }
   while (first != last) {
-    iterator p = first;
-    ++first;
-    erase(p);
+    erase(first);
   }
 }
 
@@ -947,11 +1872,12 @@ CTrie<T,Next,Alloc>::find(const char* keyData, size_t keyLen, bool matchPart)
   if (keyLen == key_type::npos) {
     keyLen = strlen(keyData);
   }
-  typename NodeT::FindRtn result = mTop->find(keyData, keyLen);
+  PathT path;
+  typename NodeT::FindRtn result = mTop->find(keyData, keyLen, &path);
   if (result.cmpValue == 0) {
-    return iterator(result.node, result.index);
+    return writable(iterator(path, result.node, result.index));
   } else if (matchPart && result.cmpValue == 1) {
-    return iterator(result.node, result.index, false);
+    return writable(iterator(path, result.node, result.index, false));
   } else {
     return end();
   }
@@ -968,11 +1894,12 @@ CTrie<T,Next,Alloc>::find(const char* keyData, size_t keyLen, bool matchPart)
   if (keyLen == key_type::npos) {
     keyLen = strlen(keyData);
   }
-  typename NodeT::FindRtn result = mTop->find(keyData, keyLen);
+  PathT path;
+  typename NodeT::FindRtn result = mTop->find(keyData, keyLen, &path);
   if (result.cmpValue == 0) {
-    return const_iterator(result.node, result.index);
+    return const_iterator(path, result.node, result.index);
   } else if (matchPart && result.cmpValue == 1) {
-    return const_iterator(result.node, result.index, false);
+    return const_iterator(path, result.node, result.index, false);
   } else {
     return end();
   }
@@ -1029,8 +1956,10 @@ CTrie<T,Next,Alloc>::lower_bound(const char* keyData, size_t keyLen)
   if (keyLen == key_type::npos) {
     keyLen = strlen(keyData);
   }
-  typename NodeT::FindRtn result = mTop->find(keyData, keyLen);
-  return iterator(result.node, result.index, result.cmpValue < 0);
+  PathT path;
+  typename NodeT::FindRtn result = mTop->find(keyData, keyLen, &path);
+  return writable(
+      iterator(path, result.node, result.index, result.cmpValue < 0));
 }
 
 template<typename T, template<u_char> class Next, class Alloc>
@@ -1038,14 +1967,16 @@ inline typename CTrie<T,Next,Alloc>::const_iterator
 CTrie<T,Next,Alloc>::lower_bound(const char* keyData,
 	size_t keyLen) const
 {
-  if (mTop == nullptr) {
-    return end();
+  NodeT* top = loadTop();
+  if (top == nullptr) {
+    return const_iterator(top);
   }
   if (keyLen == key_type::npos) {
     keyLen = strlen(keyData);
   }
-  typename NodeT::FindRtn result = mTop->find(keyData, keyLen);
-  return const_iterator(result.node, result.index, result.cmpValue < 0);
+  PathT path;
+  typename NodeT::FindRtn result = top->find(keyData, keyLen, &path);
+  return const_iterator(path, result.node, result.index, result.cmpValue < 0);
 }
 
 template<typename T, template<u_char> class Next, class Alloc>
@@ -1073,22 +2004,24 @@ CTrie<T,Next,Alloc>::upper_bound(
   if (keyLen == key_type::npos) {
     keyLen = strlen(keyData);
   }
-  typename NodeT::FindRtn result = mTop->find(keyData, keyLen);
+  PathT path;
+  typename NodeT::FindRtn result = mTop->find(keyData, keyLen, &path);
   if (result.index == NodeT::valueIndex() && matchPart &&
       (result.cmpValue == 0 || result.cmpValue == 1)) {
     // We matched the entry in the node (not in the table) and 
     // all children nodes are meant to be before the given key, so
     // return the node after 'result.node'.  Force the index to be the
     // last element of the table to make this happen.
-    return iterator(result.node, result.node->lastEntry(), true);
+    return writable(
+        iterator(path, result.node, result.node->lastEntry(), true));
 
   } else if (result.cmpValue <= 0 || (matchPart && result.cmpValue == 1)) {
     // Only 'result.node' matches the key, so return the next node
     // after 'result.node'
-    return iterator(result.node, result.index, true);
+    return writable(iterator(path, result.node, result.index, true));
 
   } else {
-    return iterator(result.node, result.index, false);
+    return writable(iterator(path, result.node, result.index, false));
   }
 }
 
@@ -1104,22 +2037,23 @@ CTrie<T,Next,Alloc>::upper_bound(
   if (keyLen == key_type::npos) {
     keyLen = strlen(keyData);
   }
-  typename NodeT::FindRtn result = mTop->find(keyData, keyLen);
+  PathT path;
+  typename NodeT::FindRtn result = mTop->find(keyData, keyLen, &path);
   if (result.index == NodeT::valueIndex() && matchPart &&
       (result.cmpValue == 0 || result.cmpValue == 1)) {
     // We matched the entry in the node (not in the table) and 
     // all children nodes are meant to be before the given key , so
     // return the node after 'result.node'.  Force the index to be the
     // last element of the table to make this happen.
-    return const_iterator(result.node, result.node->lastEntry(), true);
+    return const_iterator(path, result.node, result.node->lastEntry(), true);
 
   } else if (result.cmpValue <= 0 || (matchPart && result.cmpValue == 1)) {
     // Only 'result.node' matches the key, so return the next node
     // after 'result.node'
-    return const_iterator(result.node, result.index, true);
+    return const_iterator(path, result.node, result.index, true);
 
   } else {
-    return const_iterator( result.node, result.index, false );
+    return const_iterator(path, result.node, result.index, false );
   }
 }
 
@@ -1151,16 +2085,20 @@ CTrie<T,Next,Alloc>::equal_range(
   if (keyLen == key_type::npos) {
     keyLen = strlen(keyData);
   }
-  typename NodeT::FindRtn result = mTop->find(keyData, keyLen);
+  PathT path;
+  typename NodeT::FindRtn result = mTop->find(keyData, keyLen, &path);
   if (result.index == NodeT::valueIndex() && matchPart &&
       (result.cmpValue == 0 || result.cmpValue == 1)) {
-    return std::make_pair(iterator(result.node, NodeT::valueIndex(), false),
-        iterator(result.node, result.node->lastEntry(), true));
+    return std::make_pair(
+        writable(iterator(path, result.node, NodeT::valueIndex(), false)),
+        writable(iterator(path, result.node, result.node->lastEntry(), true)));
   } else if (result.cmpValue == 0 || (matchPart && result.cmpValue == 1)) {
-    return std::make_pair(iterator(result.node, result.index, false),
-            iterator(result.node, result.index, true));
+    return std::make_pair(
+        writable(iterator(path, result.node, result.index, false)),
+        writable(iterator(path, result.node, result.index, true)));
   } else {
-    iterator iter = iterator(result.node, result.index, result.cmpValue < 0);
+    iterator iter = writable(
+        iterator(path, result.node, result.index, result.cmpValue < 0));
     return std::make_pair(iter, iter);
   }
 }
@@ -1177,42 +2115,55 @@ CTrie<T,Next,Alloc>::equal_range(
   if (keyLen == key_type::npos) {
     keyLen = strlen(keyData);
   }
-  typename NodeT::FindRtn result = mTop->find(keyData, keyLen);
+  PathT path;
+  typename NodeT::FindRtn result = mTop->find(keyData, keyLen, &path);
   if (result.index == NodeT::valueIndex() && matchPart &&
       (result.cmpValue == 0 || result.cmpValue == 1)) {
     return std::make_pair(
-        const_iterator(result.node, NodeT::valueIndex(), false),
-        const_iterator(result.node, result.node->lastEntry(), true));
+        const_iterator(path, result.node, NodeT::valueIndex(), false),
+        const_iterator(path, result.node, result.node->lastEntry(), true));
   } else if (result.cmpValue == 0 || (matchPart && result.cmpValue == 1)) {
     return std::make_pair(
-        const_iterator(result.node, result.index, false),
-        const_iterator(result.node, result.index, true));
+        const_iterator(path, result.node, result.index, false),
+        const_iterator(path, result.node, result.index, true));
   } else {
     const_iterator iter =
-          const_iterator(result.node, result.index, result.cmpValue < 0);
+          const_iterator(path, result.node, result.index, result.cmpValue < 0);
     return std::make_pair(iter, iter);
   }
 }
 
 template<typename T, template<u_char> class Next, class Alloc>
 void
-CTrie<T,Next,Alloc>::maybeFixParentTable(NodeT* node, NodeT* replacementNode)
+CTrie<T,Next,Alloc>::maybeFixParentTable(
+    const PathT& path, NodeT* node, NodeT* replacementNode)
 {
   if (node == replacementNode) {
     return;
   }
 
   // Removing an entry caused the node to be replaced with a node with
-  // a smaller table.
-  NodeT* parent = replacementNode->parent();
-  if (parent == nullptr) {
+  // a smaller table.  The path holds the entry of the parent that points to
+  // the node.
+  if (path.empty()) {
     mTop = replacementNode;
   } else {
-    size_t index = parent->findEntry(replacementNode->parentIndex()).first;
-    *parent->getEntryPtr(index) = replacementNode;
+    *path.back().node->getEntryPtr(path.back().index) = replacementNode;
   }
-  node->destroy();
+  node->destroy(mAlloc);
 }
 
+#ifdef _CTRIE_HAS_PMR
+namespace pmr {
+
+// A CTrie whose nodes and key fragments come from a std::pmr memory
+// resource, e.g. a monotonic_buffer_resource for a trie that is built once
+// and dropped all at once.  The resource must outlive the trie.
+template<typename T, template<u_char Sz> class Next = Medium>
+using CTrie = ctrie::CTrie<T, Next, std::pmr::polymorphic_allocator<T> >;
+
+} // end namespace pmr
+#endif
+
 } // end namespace ctrie
 #endif
@@ -0,0 +1,299 @@
+#ifndef _CTRIE_PARALLEL_H
+#define _CTRIE_PARALLEL_H
+ 
+namespace ctrie {
+
+// A visit of every (key, value) pair of a trie by several threads.  The work
+// is split at the children of inner nodes: each subtree is a task that holds
+// the node and the key that leads to it.  Every thread has a queue of tasks.
+// It takes its next task from the back of its own queue, and steals from the
+// front of the others' queues when its own is empty, so that the large
+// subtrees near the top are the ones that get stolen.
+//
+// A thread only turns a child into a task when some thread is idle, and walks
+// it in place otherwise, so a walk with no one waiting costs little more than
+// a recursive one.  Visit is called as visit(thread, key, value), where thread
+// is the number of the calling thread, below numThreads, and value is const
+// if the trie is.
+template<class TrieT, class Visit>
+class _ParallelWalk {
+public:
+  typedef typename std::remove_const<TrieT>::type TrieType;
+  typedef typename TrieType::NodeT NodeT;
+  typedef typename TrieType::LeafT LeafT;
+  typedef typename std::conditional<std::is_const<TrieT>::value,
+      const typename TrieType::value_type&,
+      typename TrieType::value_type&>::type reference;
+
+private:
+  struct Task {
+    NodeT* node;
+    std::string key;          // The key up to the node's string
+  };
+
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  Visit& mVisit;
+  std::vector<Queue> mQueues;
+  std::atomic<size_t> mPending;       // Tasks queued or being walked
+  std::atomic<size_t> mIdle;          // Threads looking for a task
+  std::atomic<bool> mStopped;
+  std::mutex mErrorMutex;
+  std::exception_ptr mError;
+
+public:
+  static void run(TrieT& trie, Visit& visit, size_t numThreads);
+
+private:
+  _ParallelWalk(Visit& visit, size_t numThreads);
+  _ParallelWalk(const _ParallelWalk&) = delete;
+  _ParallelWalk& operator=(const _ParallelWalk&) = delete;
+
+  void work(size_t thread);
+  bool popTask(size_t thread, Task& task);
+  void pushTask(size_t thread, NodeT* node, const std::string& key);
+  void walkNode(size_t thread, NodeT* node, std::string& key);
+  // A walk that may change the values first makes every node the trie's
+  // own, so that a snapshot does not see the changes.
+  static void unshare(TrieType& trie)                   {trie.unshareTree();}
+  static void unshare(const TrieType&)                                     {}
+};
+
+// The number of threads to use when the caller asks for 0.
+inline size_t
+_defaultThreads()
+{
+  size_t numThreads = std::thread::hardware_concurrency();
+  return numThreads ? numThreads : 1;
+}
+
+// The visits of parallel_for_each() and parallel_reduce().
+template<class Function>
+struct _ForEachVisit {
+  Function& fn;
+  explicit _ForEachVisit(Function& _fn) : fn(_fn) {}
+  template<class V> void operator()(size_t, const std::string& key, V& value)
+                                                           {fn(key, value);}
+};
+
+template<class Result, class Map, class Reduce>
+struct _ReduceVisit {
+  // Each thread's result so far, wrapped so that a bool Result does not get
+  // packed into shared words.
+  struct Partial {
+    Result value;
+    explicit Partial(const Result& _value) : value(_value) {}
+  };
+
+  std::vector<Partial> results;
+  Map& map;
+  Reduce& reduce;
+  _ReduceVisit(size_t numThreads, const Result& init, Map& _map,
+      Reduce& _reduce)
+    : results(numThreads, Partial(init)), map(_map), reduce(_reduce) {}
+  template<class V> void operator()(size_t thread, const std::string& key,
+      V& value)
+  {
+    Result& result = results[thread].value;
+    result = reduce(result, map(key, value));
+  }
+};
+
+// Call fn(key, value) for every key of the trie, from numThreads threads
+// (or one per core if numThreads is 0).  The keys are visited in no
+// particular order, and fn may be called from several threads at once, but
+// never twice for the same key.  fn may change the values, but not the trie;
+// any nodes still shared with a snapshot are copied first.
+// If fn throws, the walk stops early and the exception is rethrown.
+template<class TrieT, class Function>
+inline void
+parallel_for_each(TrieT& trie, Function fn, size_t numThreads = 0)
+{
+  _ForEachVisit<Function> visit(fn);
+  _ParallelWalk<TrieT,_ForEachVisit<Function> >::run(
+      trie, visit, numThreads ? numThreads : _defaultThreads());
+}
+
+// Return init combined with map(key, value) for every key of the trie, by
+// reduce(x, y), using numThreads threads (or one per core if numThreads is
+// 0).  Each thread reduces the keys it visits, starting from init, and the
+// threads' results are then reduced in turn, so reduce must be associative
+// and commutative, and init must be its identity.
+template<class TrieT, class Result, class Map, class Reduce>
+inline Result
+parallel_reduce(const TrieT& trie, Result init, Map map, Reduce reduce,
+    size_t numThreads = 0)
+{
+  typedef _ReduceVisit<Result,Map,Reduce> Visit;
+  if (!numThreads) {
+    numThreads = _defaultThreads();
+  }
+  Visit visit(numThreads, init, map, reduce);
+  _ParallelWalk<const TrieT,Visit>::run(trie, visit, numThreads);
+  Result result = init;
+  for (size_t i = 0; i < numThreads; ++i) {
+    result = reduce(result, visit.results[i].value);
+  }
+  return result;
+}
+
+template<class TrieT, class Visit>
+inline
+_ParallelWalk<TrieT,Visit>::_ParallelWalk(Visit& visit, size_t numThreads)
+  : mVisit(visit), mQueues(numThreads), mPending(0), mIdle(0),
+    mStopped(false) {}
+
+// Walk the trie, with the calling thread as thread 0.  With one thread, no
+// other thread is ever idle, so the top node is simply walked in place.  If
+// a thread fails to start, the walk is stopped as if a visit had thrown, and
+// thread 0 still works off the queued tasks, since the threads that did
+// start only return once there are none left.
+template<class TrieT, class Visit>
+void
+_ParallelWalk<TrieT,Visit>::run(TrieT& trie, Visit& visit, size_t numThreads)
+{
+  if (!trie.mTop) {
+    return;
+  }
+  unshare(trie);
+  _ParallelWalk walk(visit, numThreads);
+  walk.pushTask(0, trie.mTop, std::string());
+
+  {
+    std::vector<std::thread> threads;
+    _ThreadJoiner joiner(threads);
+    try {
+      threads.reserve(numThreads - 1);
+      for (size_t i = 1; i < numThreads; ++i) {
+        threads.push_back(std::thread(&_ParallelWalk::work, &walk, i));
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(walk.mErrorMutex);
+      if (!walk.mError) {
+        walk.mError = std::current_exception();
+      }
+      walk.mStopped = true;
+    }
+    walk.work(0);
+  }
+  if (walk.mError) {
+    std::rethrow_exception(walk.mError);
+  }
+}
+
+// Take and walk tasks until there are none left anywhere.  A task is only
+// counted as done after the tasks it splits off are queued, so mPending only
+// drops to 0 once the whole trie has been walked.
+template<class TrieT, class Visit>
+void
+_ParallelWalk<TrieT,Visit>::work(size_t thread)
+{
+  Task task;
+  bool idle = false;
+  while (mPending.load() != 0) {
+    if (!popTask(thread, task)) {
+      if (!idle) {
+        ++mIdle;
+        idle = true;
+      }
+      std::this_thread::yield();
+      continue;
+    }
+    if (idle) {
+      --mIdle;
+      idle = false;
+    }
+    try {
+      walkNode(thread, task.node, task.key);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mErrorMutex);
+      if (!mError) {
+        mError = std::current_exception();
+      }
+      mStopped = true;
+    }
+    --mPending;
+  }
+  if (idle) {
+    --mIdle;
+  }
+}
+
+template<class TrieT, class Visit>
+bool
+_ParallelWalk<TrieT,Visit>::popTask(size_t thread, Task& task)
+{
+  {
+    Queue& queue = mQueues[thread];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.tasks.empty()) {
+      task = std::move(queue.tasks.back());
+      queue.tasks.pop_back();
+      return true;
+    }
+  }
+  for (size_t i = 1; i < mQueues.size(); ++i) {
+    Queue& queue = mQueues[(thread + i) % mQueues.size()];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.tasks.empty()) {
+      task = std::move(queue.tasks.front());
+      queue.tasks.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
+
+template<class TrieT, class Visit>
+void
+_ParallelWalk<TrieT,Visit>::pushTask(
+    size_t thread, NodeT* node, const std::string& key)
+{
+  ++mPending;
+  Queue& queue = mQueues[thread];
+  std::lock_guard<std::mutex> lock(queue.mutex);
+  queue.tasks.push_back(Task());
+  queue.tasks.back().node = node;
+  queue.tasks.back().key = key;
+}
+
+// Visit the value of node and the keys below it.  key holds the key up to the
+// node's string, and is given back that way.
+template<class TrieT, class Visit>
+void
+_ParallelWalk<TrieT,Visit>::walkNode(
+    size_t thread, NodeT* node, std::string& key)
+{
+  if (mStopped.load(std::memory_order_relaxed)) {
+    return;
+  }
+  size_t keyLen = key.size();
+  key.append(node->str(), node->strLen());
+  size_t nodeKeyLen = key.size();
+  if (node->hasValue()) {
+    mVisit(thread, key, static_cast<reference>(node->value()));
+  }
+
+  for (size_t index = node->firstEntry(); index != NodeT::endIndex();
+      index = node->nextEntry(index)) {
+    NodeT* entry = node->getEntry(index);
+    key += node->key(index);
+    if (NodeT::isLeafEntry(entry)) {
+      LeafT* leaf = NodeT::entryLeaf(entry);
+      key.append(leaf->str(), leaf->strLen());
+      mVisit(thread, key, static_cast<reference>(leaf->value()));
+    } else if (mIdle.load(std::memory_order_relaxed) != 0) {
+      pushTask(thread, entry, key);
+    } else {
+      walkNode(thread, entry, key);
+    }
+    key.resize(nodeKeyLen);
+  }
+  key.resize(keyLen);
+}
+
+} // end namespace ctrie
+#endif
@@ -0,0 +1,418 @@
+#ifndef _CTRIE_SHARDED_H
+#define _CTRIE_SHARDED_H
+ 
+namespace ctrie {
+
+// A reader-writer lock, over pthreads since std::shared_mutex needs C++17.
+class _SharedMutex {
+private:
+  pthread_rwlock_t mLock;
+
+public:
+  _SharedMutex()                         {pthread_rwlock_init(&mLock, nullptr);}
+  _SharedMutex(const _SharedMutex&) = delete;
+  _SharedMutex& operator=(const _SharedMutex&) = delete;
+  ~_SharedMutex()                              {pthread_rwlock_destroy(&mLock);}
+
+  void lock()                                   {pthread_rwlock_wrlock(&mLock);}
+  void unlock()                                 {pthread_rwlock_unlock(&mLock);}
+  void lock_shared()                            {pthread_rwlock_rdlock(&mLock);}
+  void unlock_shared()                          {pthread_rwlock_unlock(&mLock);}
+};
+
+// A trie split into N independent CTries, the shards, each with a
+// reader-writer lock and an allocator of its own.  A key goes to the shard
+// picked by its first two bytes, so changes to keys that start differently
+// mostly lock different shards, and can run on different cores.  Keys with
+// the same first two bytes share a shard, so a set of keys that mostly shares
+// them spreads badly.
+//
+// Lookups and changes lock one shard.  A reader locks every shard for reading
+// while it lives, and gives a merged, ordered view of the whole trie.  Values
+// are handed out by copy, or by pointer through a reader, since a writer may
+// change a value as soon as its shard's lock is released.
+//
+// If Alloc is not thread-safe (see _ConcurrentTraits), the shards' copies of
+// it may share state, so writers are serialized by a mutex as well.
+template<typename T, size_t N,
+    template<u_char Sz> class Next = Medium,
+    class Alloc = std::allocator<T> >
+class ShardedCTrie {
+  static_assert(N > 0, "A ShardedCTrie needs at least one shard");
+
+private:
+  typedef CTrie<T,Next,Alloc> TrieT;
+
+  // Each shard has a cache line of its own, so that locking one does not
+  // slow down the others.
+  struct alignas(64) Shard {
+    mutable _SharedMutex lock;
+    TrieT trie;
+
+    Shard() {}
+    explicit Shard(const Alloc& alloc) : trie(alloc) {}
+  };
+
+  // The shards are constructed in place, so that each trie is built with the
+  // given allocator rather than assigned it, which an allocator that does not
+  // propagate on assignment would ignore.
+  union {
+    Shard mShards[N];
+  };
+  std::atomic<size_t> mSize;
+  std::mutex mWriteMutex;             // For an Alloc that is not thread-safe
+
+public:
+  typedef typename TrieT::key_type key_type;
+  typedef T value_type;
+  typedef size_t size_type;
+
+  // An iterator over all of the shards at once, in key order.  It keeps the
+  // current key of each shard, and steps whichever shard has the smallest.
+  class const_iterator {
+  public:
+    typedef T value_type;
+    typedef const T& reference;
+    typedef const T* pointer;
+    typedef std::ptrdiff_t difference_type;
+    typedef std::forward_iterator_tag iterator_category;
+
+  private:
+    typedef typename TrieT::const_iterator ShardIter;
+
+    ShardIter mIters[N];
+    key_type mKeys[N];
+    size_t mCurrent;                  // N at the end
+
+  public:
+    const_iterator() : mCurrent(N) {}
+    const_iterator(const const_iterator&) = default;
+    ~const_iterator() = default;
+
+    const_iterator& operator=(const const_iterator&) = default;
+    bool operator==(const const_iterator& x) const;
+    bool operator!=(const const_iterator& x) const {return !operator==(x);}
+    const T& operator*()                           {return *operator->();}
+    const T* operator->()              {return mIters[mCurrent].operator->();}
+    const_iterator& operator++();
+
+    const key_type& key() const                     {return mKeys[mCurrent];}
+    bool at_end() const                                {return mCurrent == N;}
+
+  private:
+    void setKey(size_t shard);
+    void pickCurrent();
+
+    friend class ShardedCTrie;
+  };
+
+  // A reader holds every shard's lock for reading for as long as it lives,
+  // so the pointers and iterators it returns stay valid until it is
+  // destroyed, and writers wait for it.  So a thread must not change the
+  // trie while it holds a reader.
+  class reader {
+  private:
+    const ShardedCTrie& mTrie;
+
+  public:
+    explicit reader(const ShardedCTrie& trie);
+    reader(const reader&) = delete;
+    reader& operator=(const reader&) = delete;
+    ~reader();
+
+    const T* find(const key_type& key) const
+                                    {return find(key.data(), key.length());}
+    const T* find(const char* keyData, size_t keyLen = key_type::npos) const;
+    const_iterator begin() const;
+    const_iterator end() const                      {return const_iterator();}
+    const_iterator lower_bound(const key_type& key) const
+                               {return lower_bound(key.data(), key.length());}
+    const_iterator lower_bound(
+        const char* keyData, size_t keyLen = key_type::npos) const;
+  };
+
+  ShardedCTrie();
+  explicit ShardedCTrie(const Alloc& alloc);
+  ShardedCTrie(const ShardedCTrie&) = delete;
+  ShardedCTrie& operator=(const ShardedCTrie&) = delete;
+  ~ShardedCTrie();
+
+  size_t size() const                                  {return mSize.load();}
+  bool empty() const                                    {return size() == 0;}
+  static size_t shardCount()                                     {return N;}
+  static size_t shardOf(const char* keyData, size_t keyLen);
+
+  bool insert(const key_type& key, const T& value)
+                            {return insert(key.data(), key.length(), value);}
+  bool insert(const char* keyData, size_t keyLen, const T& value);
+  size_t erase(const key_type& key)     {return erase(key.data(), key.size());}
+  size_t erase(const char* keyData, size_t keyLen = key_type::npos);
+  void clear();
+
+  // Copy the key's value to value and return true, or return false if the
+  // key is not in the trie.
+  bool find(const key_type& key, T& value) const
+                             {return find(key.data(), key.length(), value);}
+  bool find(const char* keyData, size_t keyLen, T& value) const;
+  size_t count(const key_type& key) const
+                                   {return count(key.data(), key.length());}
+  size_t count(const char* keyData, size_t keyLen = key_type::npos) const;
+
+private:
+  void constructShards(const Alloc* alloc);
+};
+
+// Mix the first two bytes, so that keys that differ only in the second byte
+// still go to different shards.
+template<typename T, size_t N, template<u_char> class Next, class Alloc>
+inline size_t
+ShardedCTrie<T,N,Next,Alloc>::shardOf(const char* keyData, size_t keyLen)
+{
+  size_t hash = 0;
+  if (keyLen > 0) {
+    hash = static_cast<u_char>(keyData[0]);
+    if (keyLen > 1) {
+      hash = hash * 257 + static_cast<u_char>(keyData[1]);
+    }
+  }
+  return (hash * 0x9e3779b1) % N;
+}
+
+// Without an allocator, each shard default-constructs one of its own.
+template<typename T, size_t N, template<u_char> class Next, class Alloc>
+ShardedCTrie<T,N,Next,Alloc>::ShardedCTrie()
+  : mSize(0)
+{
+  constructShards(nullptr);
+}
+
+template<typename T, size_t N, template<u_char> class Next, class Alloc>
+ShardedCTrie<T,N,Next,Alloc>::ShardedCTrie(const Alloc& alloc)
+  : mSize(0)
+{
+  constructShards(&alloc);
+}
+
+template<typename T, size_t N, template<u_char> class Next, class Alloc>
+ShardedCTrie<T,N,Next,Alloc>::~ShardedCTrie()
+{
+  for (size_t i = N; i > 0; --i) {
+    mShards[i - 1].~Shard();
+  }
+}
+
+template<typename T, size_t N, template<u_char> class Next, class Alloc>
+void
+ShardedCTrie<T,N,Next,Alloc>::constructShards(const Alloc* alloc)
+{
+  size_t i = 0;
+  try {
+    for (; i < N; ++i) {
+      if (alloc) {
+        new(&mShards[i]) Shard(*alloc);
+      } else {
+        new(&mShards[i]) Shard();
+      }
+    }
+  } catch (...) {
+    while (i > 0) {
+      mShards[--i].~Shard();
+    }
+    throw;
+  }
+}
+
+template<typename T, size_t N, template<u_char> class Next, class Alloc>
+bool
+ShardedCTrie<T,N,Next,Alloc>::insert(
+    const char* keyData, size_t keyLen, const T& value)
+{
+  Shard& shard = mShards[shardOf(keyData, keyLen)];
+  std::unique_lock<std::mutex> serial(mWriteMutex, std::defer_lock);
+  if (!_ConcurrentTraits<Alloc>::sThreadSafe) {
+    serial.lock();
+  }
+  std::lock_guard<_SharedMutex> lock(shard.lock);
+  if (!shard.trie.insert(keyData, keyLen, value).second) {
+    return false;
+  }
+  ++mSize;
+  return true;
+}
+
+template<typename T, size_t N, template<u_char> class Next, class Alloc>
+size_t
+ShardedCTrie<T,N,Next,Alloc>::erase(const char* keyData, size_t keyLen)
+{
+  if (keyLen == key_type::npos) {
+    keyLen = strlen(keyData);
+  }
+  Shard& shard = mShards[shardOf(keyData, keyLen)];
+  std::unique_lock<std::mutex> serial(mWriteMutex, std::defer_lock);
+  if (!_ConcurrentTraits<Alloc>::sThreadSafe) {
+    serial.lock();
+  }
+  std::lock_guard<_SharedMutex> lock(shard.lock);
+  size_t erased = shard.trie.erase(keyData, keyLen);
+  mSize -= erased;
+  return erased;
+}
+
+// Each shard is cleared on its own, so a reader created during a clear() may
+// see some shards cleared and others not.
+template<typename T, size_t N, template<u_char> class Next, class Alloc>
+void
+ShardedCTrie<T,N,Next,Alloc>::clear()
+{
+  std::unique_lock<std::mutex> serial(mWriteMutex, std::defer_lock);
+  if (!_ConcurrentTraits<Alloc>::sThreadSafe) {
+    serial.lock();
+  }
+  for (size_t i = 0; i < N; ++i) {
+    std::lock_guard<_SharedMutex> lock(mShards[i].lock);
+    mSize -= mShards[i].trie.size();
+    mShards[i].trie.clear();
+  }
+}
+
+template<typename T, size_t N, template<u_char> class Next, class Alloc>
+bool
+ShardedCTrie<T,N,Next,Alloc>::find(
+    const char* keyData, size_t keyLen, T& value) const
+{
+  if (keyLen == key_type::npos) {
+    keyLen = strlen(keyData);
+  }
+  const Shard& shard = mShards[shardOf(keyData, keyLen)];
+  shard.lock.lock_shared();
+  typename TrieT::const_iterator iter = shard.trie.find(keyData, keyLen);
+  bool found = !iter.at_end();
+  if (found) {
+    value = *iter;
+  }
+  shard.lock.unlock_shared();
+  return found;
+}
+
+template<typename T, size_t N, template<u_char> class Next, class Alloc>
+size_t
+ShardedCTrie<T,N,Next,Alloc>::count(const char* keyData, size_t keyLen) const
+{
+  if (keyLen == key_type::npos) {
+    keyLen = strlen(keyData);
+  }
+  const Shard& shard = mShards[shardOf(keyData, keyLen)];
+  shard.lock.lock_shared();
+  size_t n = shard.trie.count(keyData, keyLen);
+  shard.lock.unlock_shared();
+  return n;
+}
+
+// The shards are always locked in the same order, and a writer only ever
+// holds one shard's lock, so readers and writers cannot deadlock.
+template<typename T, size_t N, template<u_char> class Next, class Alloc>
+ShardedCTrie<T,N,Next,Alloc>::reader::reader(const ShardedCTrie& trie)
+  : mTrie(trie)
+{
+  for (size_t i = 0; i < N; ++i) {
+    mTrie.mShards[i].lock.lock_shared();
+  }
+}
+
+template<typename T, size_t N, template<u_char> class Next, class Alloc>
+ShardedCTrie<T,N,Next,Alloc>::reader::~reader()
+{
+  for (size_t i = N; i > 0; --i) {
+    mTrie.mShards[i - 1].lock.unlock_shared();
+  }
+}
+
+template<typename T, size_t N, template<u_char> class Next, class Alloc>
+const T*
+ShardedCTrie<T,N,Next,Alloc>::reader::find(
+    const char* keyData, size_t keyLen) const
+{
+  if (keyLen == key_type::npos) {
+    keyLen = strlen(keyData);
+  }
+  const TrieT& trie = mTrie.mShards[shardOf(keyData, keyLen)].trie;
+  typename TrieT::const_iterator iter = trie.find(keyData, keyLen);
+  return iter.at_end() ? nullptr : &*iter;
+}
+
+template<typename T, size_t N, template<u_char> class Next, class Alloc>
+typename ShardedCTrie<T,N,Next,Alloc>::const_iterator
+ShardedCTrie<T,N,Next,Alloc>::reader::begin() const
+{
+  const_iterator iter;
+  for (size_t i = 0; i < N; ++i) {
+    iter.mIters[i] = mTrie.mShards[i].trie.begin();
+    iter.setKey(i);
+  }
+  iter.pickCurrent();
+  return iter;
+}
+
+// The smallest key that is not less than the given one may be in any shard,
+// so this is a lower_bound() in each of them.
+template<typename T, size_t N, template<u_char> class Next, class Alloc>
+typename ShardedCTrie<T,N,Next,Alloc>::const_iterator
+ShardedCTrie<T,N,Next,Alloc>::reader::lower_bound(
+    const char* keyData, size_t keyLen) const
+{
+  const_iterator iter;
+  for (size_t i = 0; i < N; ++i) {
+    iter.mIters[i] = mTrie.mShards[i].trie.lower_bound(keyData, keyLen);
+    iter.setKey(i);
+  }
+  iter.pickCurrent();
+  return iter;
+}
+
+template<typename T, size_t N, template<u_char> class Next, class Alloc>
+bool
+ShardedCTrie<T,N,Next,Alloc>::const_iterator::operator==(
+    const const_iterator& x) const
+{
+  if (at_end() || x.at_end()) {
+    return at_end() == x.at_end();
+  }
+  return mCurrent == x.mCurrent && mIters[mCurrent] == x.mIters[mCurrent];
+}
+
+template<typename T, size_t N, template<u_char> class Next, class Alloc>
+typename ShardedCTrie<T,N,Next,Alloc>::const_iterator&
+ShardedCTrie<T,N,Next,Alloc>::const_iterator::operator++()
+{
+  ++mIters[mCurrent];
+  setKey(mCurrent);
+  pickCurrent();
+  return *this;
+}
+
+template<typename T, size_t N, template<u_char> class Next, class Alloc>
+inline void
+ShardedCTrie<T,N,Next,Alloc>::const_iterator::setKey(size_t shard)
+{
+  if (mIters[shard].at_end()) {
+    mKeys[shard].clear();
+  } else {
+    mKeys[shard] = mIters[shard].key();
+  }
+}
+
+template<typename T, size_t N, template<u_char> class Next, class Alloc>
+void
+ShardedCTrie<T,N,Next,Alloc>::const_iterator::pickCurrent()
+{
+  mCurrent = N;
+  for (size_t i = 0; i < N; ++i) {
+    if (!mIters[i].at_end() &&
+        (mCurrent == N || mKeys[i].compare(mKeys[mCurrent]) < 0)) {
+      mCurrent = i;
+    }
+  }
+}
+
+} // end namespace ctrie
+#endif
@@ -0,0 +1,386 @@
+#ifndef _CTRIE_SLAB_H
+#define _CTRIE_SLAB_H
+ 
+namespace ctrie {
+
+// A pool of slabs, each carved into blocks of a single size class.  The size
+// classes are multiples of sGranule bytes up to sMaxBlockSize, which covers
+// every node size; larger requests (leaves with long suffixes) go to
+// operator new, with a header that links them into the pool's list of large
+// blocks.
+//
+// Each slab is aligned on its own size, so a block finds its slab by masking
+// its address.  A slab keeps its own free list and count of live blocks, so
+// that a slab is returned to the system as soon as its last block is freed.
+// Each size class keeps one empty slab back, so that a node that grows and
+// shrinks across a slab boundary does not map and unmap a slab each time.
+// Every slab is also on the list of all of the pool's slabs, so that
+// release() can give them all back at once.
+//
+// A pool is shared by all of the SlabAllocators that are copied from the one
+// that created it, and it is deleted along with the last of them.  It is not
+// synchronized.
+class _SlabPool {
+public:
+  static const size_t sSlabSize = 64 * 1024;
+  static const size_t sGranule = 16;
+  static const size_t sMaxBlockSize = 4096;
+  static const size_t sNumClasses = sMaxBlockSize / sGranule;
+
+private:
+  struct Slab {
+    Slab* next;               // The list of slabs of a class with free blocks
+    Slab* prev;
+    Slab* nextSlab;           // The list of all of the pool's slabs
+    Slab* prevSlab;
+    void* freeList;           // Blocks that have been freed
+    char* unused;             // The blocks never handed out start here
+    uint32_t live;
+    uint32_t sizeClass;
+  };
+
+  struct Large {
+    Large* next;
+    Large* prev;
+  };
+
+  Slab* mPartial[sNumClasses];        // The slabs with a free block
+  Slab* mEmpty[sNumClasses];          // The slab kept back with no live blocks
+  Slab* mSlabs;
+  Large* mLarge;
+  size_t mSlabCount;
+  size_t mRefs;
+
+public:
+  _SlabPool();
+  _SlabPool(const _SlabPool&) = delete;
+  _SlabPool& operator=(const _SlabPool&) = delete;
+  ~_SlabPool()                                                  {release();}
+
+  void ref()                                                      {++mRefs;}
+  bool unref()                                       {return --mRefs == 0;}
+  bool shared() const                                   {return mRefs > 1;}
+
+  void* allocate(size_t bytes);
+  void deallocate(void* p, size_t bytes);
+  void trim();
+  void release();
+  size_t slabCount() const                               {return mSlabCount;}
+
+private:
+  static size_t sizeClass(size_t bytes)       {return (bytes - 1) / sGranule;}
+  static size_t blockSize(size_t cls)           {return (cls + 1) * sGranule;}
+  static size_t headerSize()
+                {return (sizeof(Slab) + sGranule - 1) / sGranule * sGranule;}
+  static size_t largeHeaderSize()
+               {return (sizeof(Large) + sGranule - 1) / sGranule * sGranule;}
+  static bool isFull(const Slab* slab);
+
+  void* allocateLarge(size_t bytes);
+  void deallocateLarge(void* p);
+  Slab* createSlab(size_t sizeClass);
+  void destroySlab(Slab* slab);
+  void link(Slab* slab);
+  void unlink(Slab* slab);
+};
+
+// An allocator that can be given to CTrie as its Alloc, which takes each
+// node from a _SlabPool.  Each default constructed allocator creates its own
+// pool, which every rebind of it shares, so each trie built with one owns
+// its pool.  Since each node size has its own free list, the churn of nodes
+// growing and shrinking through the policy sizes reuses blocks of the same
+// size rather than fragmenting the heap.
+//
+// When the values have trivial destructors, clear() and the destructor do
+// not visit the nodes, but release every slab of the pool at once, as long
+// as no other trie or allocator shares it.
+//
+// A copy of the trie gets a pool of its own, and a trie that is moved or
+// swapped takes its pool with it.  A snapshot shares the pool of the trie it
+// was taken from, so the two must be used from one thread at a time.
+template<class T>
+class SlabAllocator {
+private:
+  _SlabPool* mPool;
+
+  template<class U> friend class SlabAllocator;
+
+public:
+  typedef T value_type;
+  typedef T* pointer;
+  typedef const T* const_pointer;
+  typedef T& reference;
+  typedef const T& const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+
+  template<class U> struct rebind {typedef SlabAllocator<U> other;};
+
+  SlabAllocator() : mPool(new _SlabPool)                                   {}
+  SlabAllocator(const SlabAllocator& x) : mPool(x.mPool)      {mPool->ref();}
+  template<class U> SlabAllocator(const SlabAllocator<U>& x)
+    : mPool(x.mPool)                                          {mPool->ref();}
+  SlabAllocator& operator=(const SlabAllocator& x);
+  ~SlabAllocator()                         {if (mPool->unref()) delete mPool;}
+
+  SlabAllocator select_on_container_copy_construction() const
+                                                     {return SlabAllocator();}
+
+  T* allocate(size_t n)
+                  {return static_cast<T*>(mPool->allocate(n * sizeof(T)));}
+  void deallocate(T* p, size_t n)   {mPool->deallocate(p, n * sizeof(T));}
+  size_t max_size() const
+                    {return std::numeric_limits<size_t>::max() / sizeof(T);}
+
+  template<class U, class... Args> void construct(U* p, Args&&... args)
+               {::new(static_cast<void*>(p)) U(std::forward<Args>(args)...);}
+  template<class U> void destroy(U* p)                               {p->~U();}
+
+  // Release the empty slabs that the pool keeps back.
+  void trim()                                                {mPool->trim();}
+  bool shared() const                               {return mPool->shared();}
+  void release();
+  size_t slabCount() const                     {return mPool->slabCount();}
+
+  template<class U> bool operator==(const SlabAllocator<U>& x) const
+                                                   {return mPool == x.mPool;}
+  template<class U> bool operator!=(const SlabAllocator<U>& x) const
+                                                   {return mPool != x.mPool;}
+};
+
+template<class T>
+struct _MonotonicTraits<SlabAllocator<T> > {
+  static const bool sMonotonic = true;
+  static bool canDrop(const SlabAllocator<T>& alloc)
+                                                    {return !alloc.shared();}
+  static void release(SlabAllocator<T>& alloc)              {alloc.release();}
+};
+
+inline
+_SlabPool::_SlabPool()
+  : mSlabs(nullptr), mLarge(nullptr), mSlabCount(0), mRefs(1)
+{
+  for (size_t cls = 0; cls < sNumClasses; ++cls) {
+    mPartial[cls] = nullptr;
+    mEmpty[cls] = nullptr;
+  }
+}
+
+inline void*
+_SlabPool::allocate(size_t bytes)
+{
+  if (bytes > sMaxBlockSize) {
+    return allocateLarge(bytes);
+  }
+
+  size_t cls = sizeClass(bytes);
+  Slab* slab = mPartial[cls];
+  if (!slab) {
+    slab = createSlab(cls);
+  } else if (slab == mEmpty[cls]) {
+    mEmpty[cls] = nullptr;
+  }
+
+  void* block;
+  if (slab->freeList) {
+    block = slab->freeList;
+    slab->freeList = *static_cast<void**>(block);
+  } else {
+    block = slab->unused;
+    slab->unused += blockSize(cls);
+  }
+  ++slab->live;
+  if (isFull(slab)) {
+    unlink(slab);
+  }
+  return block;
+}
+
+inline void
+_SlabPool::deallocate(void* p, size_t bytes)
+{
+  if (bytes > sMaxBlockSize) {
+    deallocateLarge(p);
+    return;
+  }
+
+  Slab* slab = reinterpret_cast<Slab*>(
+      reinterpret_cast<uintptr_t>(p) & ~static_cast<uintptr_t>(sSlabSize - 1));
+  assert(slab->sizeClass == sizeClass(bytes));
+  if (isFull(slab)) {
+    link(slab);
+  }
+  *static_cast<void**>(p) = slab->freeList;
+  slab->freeList = p;
+
+  if (--slab->live == 0) {
+    Slab*& empty = mEmpty[slab->sizeClass];
+    if (!empty) {
+      empty = slab;
+    } else if (empty != slab) {
+      destroySlab(slab);
+    }
+  }
+}
+
+inline void
+_SlabPool::trim()
+{
+  for (size_t cls = 0; cls < sNumClasses; ++cls) {
+    if (mEmpty[cls]) {
+      destroySlab(mEmpty[cls]);
+      mEmpty[cls] = nullptr;
+    }
+  }
+}
+
+// Give back every slab and large block, without looking at the blocks in
+// them.  Nothing that was allocated may still be in use.
+inline void
+_SlabPool::release()
+{
+  while (mSlabs) {
+    Slab* next = mSlabs->nextSlab;
+    free(mSlabs);
+    mSlabs = next;
+  }
+  while (mLarge) {
+    Large* next = mLarge->next;
+    ::operator delete(mLarge);
+    mLarge = next;
+  }
+  for (size_t cls = 0; cls < sNumClasses; ++cls) {
+    mPartial[cls] = nullptr;
+    mEmpty[cls] = nullptr;
+  }
+  mSlabCount = 0;
+}
+
+inline bool
+_SlabPool::isFull(const Slab* slab)
+{
+  return !slab->freeList && slab->unused + blockSize(slab->sizeClass) >
+      reinterpret_cast<const char*>(slab) + sSlabSize;
+}
+
+inline void*
+_SlabPool::allocateLarge(size_t bytes)
+{
+  Large* large = static_cast<Large*>(
+      ::operator new(largeHeaderSize() + bytes));
+  large->prev = nullptr;
+  large->next = mLarge;
+  if (mLarge) {
+    mLarge->prev = large;
+  }
+  mLarge = large;
+  return reinterpret_cast<char*>(large) + largeHeaderSize();
+}
+
+inline void
+_SlabPool::deallocateLarge(void* p)
+{
+  Large* large = reinterpret_cast<Large*>(
+      static_cast<char*>(p) - largeHeaderSize());
+  if (large->prev) {
+    large->prev->next = large->next;
+  } else {
+    mLarge = large->next;
+  }
+  if (large->next) {
+    large->next->prev = large->prev;
+  }
+  ::operator delete(large);
+}
+
+inline _SlabPool::Slab*
+_SlabPool::createSlab(size_t sizeClass)
+{
+  void* mem;
+  if (posix_memalign(&mem, sSlabSize, sSlabSize) != 0) {
+    throw std::bad_alloc();
+  }
+  Slab* slab = static_cast<Slab*>(mem);
+  slab->freeList = nullptr;
+  slab->unused = static_cast<char*>(mem) + headerSize();
+  slab->live = 0;
+  slab->sizeClass = static_cast<uint32_t>(sizeClass);
+  link(slab);
+  slab->prevSlab = nullptr;
+  slab->nextSlab = mSlabs;
+  if (mSlabs) {
+    mSlabs->prevSlab = slab;
+  }
+  mSlabs = slab;
+  ++mSlabCount;
+  return slab;
+}
+
+inline void
+_SlabPool::destroySlab(Slab* slab)
+{
+  assert(slab->live == 0);
+  unlink(slab);
+  if (slab->prevSlab) {
+    slab->prevSlab->nextSlab = slab->nextSlab;
+  } else {
+    mSlabs = slab->nextSlab;
+  }
+  if (slab->nextSlab) {
+    slab->nextSlab->prevSlab = slab->prevSlab;
+  }
+  --mSlabCount;
+  free(slab);
+}
+
+inline void
+_SlabPool::link(Slab* slab)
+{
+  Slab*& head = mPartial[slab->sizeClass];
+  slab->prev = nullptr;
+  slab->next = head;
+  if (head) {
+    head->prev = slab;
+  }
+  head = slab;
+}
+
+inline void
+_SlabPool::unlink(Slab* slab)
+{
+  if (slab->prev) {
+    slab->prev->next = slab->next;
+  } else {
+    mPartial[slab->sizeClass] = slab->next;
+  }
+  if (slab->next) {
+    slab->next->prev = slab->prev;
+  }
+}
+
+template<class T>
+inline SlabAllocator<T>&
+SlabAllocator<T>::operator=(const SlabAllocator& x)
+{
+  x.mPool->ref();
+  if (mPool->unref()) {
+    delete mPool;
+  }
+  mPool = x.mPool;
+  return *this;
+}
+
+// Give back all of the pool's memory, unless the pool is still shared.
+template<class T>
+inline void
+SlabAllocator<T>::release()
+{
+  if (!mPool->shared()) {
+    mPool->release();
+  }
+}
+
+} // end namespace ctrie
+#endif
@@ -4,7 +4,12 @@
 #include <iostream>
 #include <string>
 #include <map>
+#include <memory>
+#include <vector>
 #include <algorithm>
+#include <atomic>
+#include <stdexcept>
+#include <thread>
 
 // TODO move to using gtest style of ASSERT and EXPECT.
 // TODO Add a debug option instead of commenting out various pieces.
@@ -37,6 +42,215 @@ getExpectedPrefixes(const string& str, const map<string,int>& map)
   return expected;
 }
 
+/*
+ * A value whose copy throws once a count of copies runs out, for checking
+ * that a build that fails partway frees what it built.
+ */
+struct ThrowingValue {
+  static atomic<int> sCopiesLeft;     // Negative for no limit
+  int value;
+
+  ThrowingValue(int _value = 0) : value(_value) {}
+  ThrowingValue(const ThrowingValue& x) : value(x.value) {
+    if (sCopiesLeft >= 0 && sCopiesLeft-- == 0) {
+      throw runtime_error("copy");
+    }
+  }
+  ThrowingValue& operator=(const ThrowingValue& x) = default;
+};
+
+atomic<int> ThrowingValue::sCopiesLeft(-1);
+
+typedef CTrie<ThrowingValue,Medium> ThrowingCTrie;
+
+/*
+ * Build trie from keys, with a copy of a value failing after copies, and
+ * return whether the build threw and left the trie empty.
+ */
+bool
+failedBuildIsEmpty(ThrowingCTrie& trie,
+    const vector<pair<string,ThrowingValue> >& keys, int copies,
+    size_t numThreads)
+{
+  bool thrown = false;
+  ThrowingValue::sCopiesLeft = copies;
+  try {
+    trie.build_sorted(keys.begin(), keys.end(), numThreads);
+  } catch (const runtime_error&) {
+    thrown = true;
+  }
+  ThrowingValue::sCopiesLeft = -1;
+  return thrown && trie.empty() && trie.size() == 0 &&
+      trie.begin() == trie.end();
+}
+
+#ifdef _CTRIE_HAS_PMR
+/*
+ * A memory resource that counts what it hands out, on top of new and delete.
+ */
+class CountingResource : public std::pmr::memory_resource {
+public:
+  size_t allocations;
+  size_t bytes;                       // Allocated and not yet freed
+
+  CountingResource() : allocations(0), bytes(0) {}
+
+private:
+  void* do_allocate(size_t size, size_t alignment) override
+  {
+    ++allocations;
+    bytes += size;
+    return std::pmr::new_delete_resource()->allocate(size, alignment);
+  }
+  void do_deallocate(void* p, size_t size, size_t alignment) override
+  {
+    bytes -= size;
+    std::pmr::new_delete_resource()->deallocate(p, size, alignment);
+  }
+  bool do_is_equal(const std::pmr::memory_resource& x) const noexcept override
+  {
+    return this == &x;
+  }
+};
+#endif
+
+bool
+pairKeyLess(const pair<string,int>& x, const pair<string,int>& y)
+{
+  return x.first < y.first;
+}
+
+/*
+ * Whether two tries have the same keys and values, in the same order.
+ */
+bool
+sameTrie(const IntCTrie& x, const IntCTrie& y)
+{
+  if (x.size() != y.size()) {
+    return false;
+  }
+  IntCTrie::const_iterator yp = y.begin();
+  for (IntCTrie::const_iterator xp = x.begin(); xp != x.end(); ++xp, ++yp) {
+    if (yp.key() != xp.key() || *yp != *xp) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool
+sameTrie(const IntCTrie& x, const map<string,int>& y)
+{
+  if (x.size() != y.size()) {
+    return false;
+  }
+  map<string,int>::const_iterator yp = y.begin();
+  for (IntCTrie::const_iterator xp = x.begin(); xp != x.end(); ++xp, ++yp) {
+    if (yp->first != xp.key() || yp->second != *xp) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * The value that a read-only trie's find() found, as a pointer, whether
+ * find() returns one or an iterator.
+ */
+const int*
+foundValue(const int* value)
+{
+  return value;
+}
+
+template<class IterT>
+const int*
+foundValue(const IterT& iter)
+{
+  return iter.at_end() ? nullptr : &*iter;
+}
+
+/*
+ * Check the lookups of a read-only trie built from the keys of refMap: its
+ * size, find() and count(), also of the keys one character shorter and
+ * longer.  name starts the error messages.
+ */
+template<class TrieT>
+void
+checkReadOnlyTrie(const TrieT& trie, const map<string,int>& refMap,
+    const string& name)
+{
+  if (trie.size() != refMap.size()) {
+    cout << "ERROR: " << name << " has " << trie.size() << " keys" << endl;
+  }
+  for (map<string,int>::const_iterator rp = refMap.begin();
+      rp != refMap.end(); ++rp) {
+    const int* value = foundValue(trie.find(rp->first));
+    string shorter = rp->first.substr(0, rp->first.size() - 1);
+    string longer = rp->first + static_cast<char>(rp->second % 256);
+    if (!value || *value != rp->second || trie.count(rp->first) != 1 ||
+        trie.count(shorter.data(), shorter.size()) != refMap.count(shorter) ||
+        trie.count(longer) != refMap.count(longer)) {
+      cout << "ERROR: " << name << " differs at '" << rp->first << "'" <<
+          endl;
+      break;
+    }
+  }
+}
+
+/*
+ * Check the iterators of a read-only trie built from sourceMap, which holds
+ * the keys of refMap: the walk in order, the iterators that find() and
+ * lower_bound() return, and the prefix iterators.
+ */
+template<class TrieT>
+void
+checkReadOnlyIters(const TrieT& trie, const map<string,int>& refMap,
+    const IntCTrie& sourceMap, const string& name)
+{
+  typename TrieT::const_iterator tp = trie.begin();
+  for (map<string,int>::const_iterator rp = refMap.begin();
+      rp != refMap.end(); ++rp) {
+    typename TrieT::const_iterator found = trie.find(rp->first);
+    if (tp.at_end() || tp.key() != rp->first || *tp != rp->second ||
+        found != tp || ++found != ++tp) {
+      cout << "ERROR: " << name << " iterator differs at '" << rp->first <<
+          "'" << endl;
+      break;
+    }
+  }
+  if (tp != trie.end() || (!refMap.empty() &&
+      trie.find(refMap.begin()->first + "\xff") != trie.end())) {
+    cout << "ERROR: " << name << " has extra keys" << endl;
+  }
+
+  for (map<string,int>::const_iterator rp = refMap.begin();
+      rp != refMap.end(); ++rp) {
+    string key = rp->first.substr(0, rp->first.size() / 2) +
+        (rp->second % 2 ? "" : "zz");
+    map<string,int>::const_iterator lp = refMap.lower_bound(key);
+    tp = trie.lower_bound(key);
+    if ((lp == refMap.end()) != tp.at_end() ||
+        (lp != refMap.end() && tp.key() != lp->first)) {
+      cout << "ERROR: " << name << " lower_bound of '" << key <<
+          "' is wrong" << endl;
+      break;
+    }
+    IntCTrie::const_prefix_iter pp = sourceMap.prefix_begin(rp->first);
+    typename TrieT::const_prefix_iter tpp = trie.prefix_begin(rp->first);
+    for (; !pp.at_end() && !tpp.at_end(); ++pp, ++tpp) {
+      if (pp.key() != tpp.key() || *pp != *tpp) {
+        break;
+      }
+    }
+    if (!pp.at_end() || tpp != trie.prefix_end()) {
+      cout << "ERROR: " << name << " prefixes of '" << rp->first <<
+          "' are wrong" << endl;
+      break;
+    }
+  }
+}
+
 void checkConst(const IntCTrie& cmap);
 int main()
 {
@@ -129,6 +343,12 @@ int main()
     cout << "ERROR: Got to beginning of the ref map " <<
 	"but not to the beginning of the CTrie" << endl;
   }
+  if (cmap.rend().base() != cmap.begin() ||
+      (--reverseCp).key() != refMap.begin()->first ||
+      reverseCp.base() != ++cmap.begin() ||
+      (--reverseCp).key() != (++refMap.begin())->first) {
+    cout << "ERROR: Going back from the reverse end is wrong" << endl;
+  }
 
   // Now go through every key and do a find(), lower_bound(), upper_bound(),
   // and equal_range() on both maps.  The results should be the same.
@@ -603,7 +823,8 @@ int main()
 //    cout << "Finding reverse prefixes for '" << *testWord << "'" << endl;
     vector<string> expected = getExpectedPrefixes(*testWord, refMap);
     vector<string>::reverse_iterator expectedIter = expected.rbegin();
-    for (IntCTrie::reverse_prefix_iter p = cmap.prefix_rbegin(*testWord);
+    IntCTrie::reverse_prefix_iter p;
+    for (p = cmap.prefix_rbegin(*testWord);
 	p != cmap.prefix_rend(*testWord); ++p) {
 //      cout << "Found reverse prefix of '" << p.key() << "' (" << *p << ")" <<
 //        endl;
@@ -620,6 +841,11 @@ int main()
       }
       ++expectedIter;
     }
+    if (expectedIter != expected.rend() ||
+        (!expected.empty() && (--p).key() != expected.front())) {
+      cout << "ERROR: Reverse prefixes of '" << *testWord << "' end wrongly" <<
+          endl;
+    }
   }
 
   ++cmap["ABSENTEEISM"];
@@ -632,8 +858,1132 @@ int main()
     cout << "ERROR: insertion with operator[] didn't work" << endl;
   }
 
+  cout << "Checking deep keys" << endl;
+  IntCTrie deepMap;
+  map<string,int> deepRefMap;
+  string deepKey;
+  for (int depth = 0; depth < 40; ++depth) {
+    deepKey += 'a';
+    deepMap.insert(deepKey, depth);
+    deepMap.insert(deepKey + 'b', depth + 100);
+    deepRefMap.insert(make_pair(deepKey, depth));
+    deepRefMap.insert(make_pair(deepKey + 'b', depth + 100));
+  }
+  map<string,int>::iterator deepRp = deepRefMap.begin();
+  for (cp = deepMap.begin(); !cp.at_end(); ++cp, ++deepRp) {
+    if (deepRp == deepRefMap.end() || cp.key() != deepRp->first ||
+        *cp != deepRp->second) {
+      cout << "ERROR: Deep key iteration is wrong at '" << cp.key() << "'" <<
+          endl;
+      break;
+    }
+  }
+  map<string,int>::reverse_iterator deepRrp = deepRefMap.rbegin();
+  for (IntCTrie::reverse_iterator rp = deepMap.rbegin();
+      rp != deepMap.rend(); ++rp, ++deepRrp) {
+    if (deepRrp == deepRefMap.rend() || rp.key() != deepRrp->first) {
+      cout << "ERROR: Deep key reverse iteration is wrong at '" <<
+          rp.key() << "'" << endl;
+      break;
+    }
+  }
+  deepMap.erase(deepMap.find(string(10, 'a')), deepMap.find(string(30, 'a')));
+  deepRefMap.erase(deepRefMap.find(string(10, 'a')),
+      deepRefMap.find(string(30, 'a')));
+  if (deepMap.size() != deepRefMap.size()) {
+    cout << "ERROR: Deep key range erase left " << deepMap.size() <<
+        " keys instead of " << deepRefMap.size() << endl;
+  }
+  deepRp = deepRefMap.begin();
+  for (cp = deepMap.begin(); !cp.at_end(); ++cp, ++deepRp) {
+    if (deepRp == deepRefMap.end() || cp.key() != deepRp->first) {
+      cout << "ERROR: Deep key iteration after erase is wrong at '" <<
+          cp.key() << "'" << endl;
+      break;
+    }
+  }
+
+#ifdef _CTRIE_HAS_STRING_VIEW
+  cout << "Checking key views" << endl;
+  {
+    IntCTrie viewMap;
+    viewMap.insert(refMap.begin(), refMap.end());
+    map<string,int>::iterator rp = refMap.begin();
+    IntCTrie::iterator vp;
+    IntCTrie::iterator last;
+    for (vp = viewMap.begin(); !vp.at_end(); ++vp, ++rp) {
+      if (rp == refMap.end() || vp.key_view() != rp->first ||
+          vp.key() != rp->first) {
+        cout << "ERROR: Key view is wrong at '" << vp.key() << "'" << endl;
+        break;
+      }
+      // A copy builds its own key, whether or not it has moved since.
+      if (rp != refMap.begin() && (++last).key_view() != rp->first) {
+        cout << "ERROR: Key view of a copy is wrong at '" << rp->first <<
+            "'" << endl;
+        break;
+      }
+      last = vp;
+    }
+    map<string,int>::reverse_iterator rrp = refMap.rbegin();
+    for (vp = viewMap.end(), --vp; rrp != refMap.rend(); --vp, ++rrp) {
+      if (vp.key_view() != rrp->first) {
+        cout << "ERROR: Key view going back is wrong at '" << rrp->first <<
+            "'" << endl;
+        break;
+      }
+      if (vp == viewMap.begin()) {
+        ++rrp;
+        break;
+      }
+    }
+    if (rrp != refMap.rend()) {
+      cout << "ERROR: Going back with key views stopped early" << endl;
+    }
+    IntCTrie::reverse_iterator rvp = viewMap.rbegin();
+    for (rrp = refMap.rbegin(); rrp != refMap.rend(); ++rrp, ++rvp) {
+      if (rvp == viewMap.rend() || rvp.key_view() != rrp->first ||
+          *rvp != rrp->second) {
+        cout << "ERROR: Reverse key view is wrong at '" << rrp->first << "'" <<
+            endl;
+        break;
+      }
+    }
+    if (rvp != viewMap.rend()) {
+      cout << "ERROR: Reverse key views went past the first key" << endl;
+    }
+
+    for (rp = refMap.begin(); rp != refMap.end(); ++rp) {
+      string key = rp->first.substr(0, rp->first.size() / 2) + "zz";
+      IntCTrie::const_iterator lp = viewMap.lower_bound(key);
+      map<string,int>::iterator bp = refMap.lower_bound(key);
+      if (lp.at_end() != (bp == refMap.end()) ||
+          (!lp.at_end() && lp.key_view() != bp->first)) {
+        cout << "ERROR: Key view of lower_bound('" << key << "') is wrong" <<
+            endl;
+        break;
+      }
+    }
+    for (const char** testWord = testWords; *testWord; ++testWord) {
+      vector<string> expected = getExpectedPrefixes(*testWord, refMap);
+      vector<string>::iterator expectedIter = expected.begin();
+      IntCTrie::prefix_iter p = viewMap.prefix_begin(*testWord);
+      for (; p != viewMap.prefix_end() && expectedIter != expected.end();
+          ++p, ++expectedIter) {
+        if (p.key_view() != *expectedIter) {
+          break;
+        }
+      }
+      if (p != viewMap.prefix_end() || expectedIter != expected.end()) {
+        cout << "ERROR: Prefix key views of '" << *testWord << "' are wrong" <<
+            endl;
+      }
+    }
+
+    rp = refMap.begin();
+    for (vp = viewMap.begin(); !vp.at_end(); ++rp) {
+      if (vp.key_view() != rp->first) {
+        cout << "ERROR: Key view after erase is wrong at '" << rp->first <<
+            "'" << endl;
+        break;
+      }
+      if (rp->second % 3 == 0) {
+        viewMap.erase(vp);
+      } else {
+        ++vp;
+      }
+    }
+  }
+#endif
+
+  cout << "Checking sorted build" << endl;
+  {
+    IntCTrie sortedMap;
+    sortedMap.insert("stale", 1);
+    sortedMap.build_sorted(refMap.begin(), refMap.end());
+    if (sortedMap.size() != refMap.size() ||
+        sortedMap.find("stale") != sortedMap.end()) {
+      cout << "ERROR: Sorted build has " << sortedMap.size() <<
+          " keys instead of " << refMap.size() << endl;
+    }
+    IntCTrie::iterator sp = sortedMap.begin();
+    for (map<string,int>::iterator rp = refMap.begin(); rp != refMap.end();
+        ++rp, ++sp) {
+      if (sp.at_end() || sp.key() != rp->first || *sp != rp->second ||
+          *sortedMap.find(rp->first) != rp->second) {
+        cout << "ERROR: Sorted build differs at '" << rp->first << "'" <<
+            endl;
+        break;
+      }
+    }
+
+    // Equal keys, keys that are prefixes of others, and a node with every
+    // possible next character.
+    vector<pair<string,int> > keys;
+    keys.push_back(make_pair(string(), 1));
+    keys.push_back(make_pair(string(), 2));
+    keys.push_back(make_pair(string("ab"), 3));
+    keys.push_back(make_pair(string("ab"), 4));
+    keys.push_back(make_pair(string("abc"), 5));
+    keys.push_back(make_pair(string("abd"), 6));
+    keys.push_back(make_pair(string(300, 'z'), 7));
+    keys.push_back(make_pair(string(300, 'z') + 'z', 8));
+    for (int ch = 1; ch < 256; ++ch) {
+      keys.push_back(make_pair(string("q") + static_cast<char>(ch), ch));
+    }
+    stable_sort(keys.begin(), keys.end(), pairKeyLess);
+    sortedMap.build_sorted(keys.begin(), keys.end());
+    if (sortedMap.size() != 261 || *sortedMap.find("") != 1 ||
+        *sortedMap.find("ab") != 3 || *sortedMap.find("abd") != 6 ||
+        *sortedMap.find(string(300, 'z') + 'z') != 8 ||
+        *sortedMap.find(string("q") + static_cast<char>(200)) != 200) {
+      cout << "ERROR: Sorted build of equal and prefix keys is wrong" << endl;
+    }
+    sp = sortedMap.begin();
+    for (vector<pair<string,int> >::iterator kp = keys.begin();
+        kp != keys.end(); ++kp) {
+      if (kp != keys.begin() && kp->first == (kp - 1)->first) {
+        continue;
+      }
+      if (sp.at_end() || sp.key() != kp->first) {
+        cout << "ERROR: Sorted build iterates wrongly at '" << kp->first <<
+            "'" << endl;
+        break;
+      }
+      ++sp;
+    }
+
+    // The built trie must take later changes like any other, and must match
+    // one built by inserting the same keys.
+    IntCTrie insertedMap;
+    insertedMap.insert(keys.begin(), keys.end());
+    if (insertedMap.size() != sortedMap.size() ||
+        *insertedMap.find("") != 1 || *insertedMap.find("ab") != 3) {
+      cout << "ERROR: Range insert into an empty map is wrong" << endl;
+    }
+    sortedMap.insert("abcd", 9);
+    sortedMap.insert("q", 10);
+    for (vector<pair<string,int> >::iterator kp = keys.begin();
+        kp != keys.end(); ++kp) {
+      sortedMap.erase(kp->first);
+    }
+    if (sortedMap.size() != 2 || *sortedMap.find("abcd") != 9 ||
+        *sortedMap.find("q") != 10) {
+      cout << "ERROR: Changing a sorted build failed" << endl;
+    }
+
+    // A value that fails to copy partway through leaves the trie empty, and
+    // frees the nodes built so far.
+    vector<pair<string,ThrowingValue> > throwingKeys;
+    for (map<string,int>::iterator rp = refMap.begin(); rp != refMap.end();
+        ++rp) {
+      throwingKeys.push_back(make_pair(rp->first, ThrowingValue(rp->second)));
+    }
+    ThrowingCTrie throwingMap;
+    throwingMap.insert("stale", ThrowingValue(1));
+    if (!failedBuildIsEmpty(throwingMap, throwingKeys,
+        static_cast<int>(throwingKeys.size() / 2), 1)) {
+      cout << "ERROR: Failed sorted build did not leave the trie empty" <<
+          endl;
+    }
+  }
+
+  cout << "Checking parallel sorted build" << endl;
+  {
+    IntCTrie sortedMap;
+    IntCTrie parallelMap;
+    parallelMap.insert("stale", 1);
+    sortedMap.build_sorted(refMap.begin(), refMap.end());
+    parallelMap.build_sorted(refMap.begin(), refMap.end(), 4);
+    if (parallelMap.size() != refMap.size() || !sameTrie(parallelMap, sortedMap)) {
+      cout << "ERROR: Parallel sorted build has " << parallelMap.size() <<
+          " keys instead of " << refMap.size() << endl;
+    }
+    for (map<string,int>::iterator rp = refMap.begin(); rp != refMap.end();
+        ++rp) {
+      IntCTrie::iterator pp = parallelMap.find(rp->first);
+      if (pp == parallelMap.end() || *pp != rp->second) {
+        cout << "ERROR: Parallel sorted build differs at '" << rp->first <<
+            "'" << endl;
+        break;
+      }
+    }
+
+    // Keys that all share a long prefix, so that the threads split below the
+    // root, with equal keys and keys that end at the split nodes.
+    vector<pair<string,int> > keys;
+    keys.push_back(make_pair(string("shared"), 1));
+    keys.push_back(make_pair(string("shared"), 2));
+    int value = 3;
+    for (map<string,int>::iterator rp = refMap.begin(); rp != refMap.end();
+        ++rp) {
+      keys.push_back(make_pair("shared" + rp->first, value++));
+      if (rp->first.length() == 1) {
+        keys.push_back(make_pair("shared" + rp->first, value++));
+      }
+    }
+    stable_sort(keys.begin(), keys.end(), pairKeyLess);
+    for (size_t numThreads = 1; numThreads <= 16; numThreads *= 4) {
+      sortedMap.build_sorted(keys.begin(), keys.end());
+      parallelMap.build_sorted(keys.begin(), keys.end(), numThreads);
+      if (!sameTrie(parallelMap, sortedMap) || *parallelMap.find("shared") != 1) {
+        cout << "ERROR: Parallel sorted build with " << numThreads <<
+            " threads differs from a sequential one" << endl;
+      }
+    }
+    parallelMap.build_sorted(keys.begin(), keys.begin() + 1, 4);
+    if (parallelMap.size() != 1 || *parallelMap.find("shared") != 1) {
+      cout << "ERROR: Parallel sorted build of one key is wrong" << endl;
+    }
+    parallelMap.build_sorted(keys.begin(), keys.begin(), 4);
+    if (!parallelMap.empty()) {
+      cout << "ERROR: Parallel sorted build of no keys is not empty" << endl;
+    }
+
+    // A failure in one thread frees what the others built, and the nodes
+    // built before the threads started.
+    vector<pair<string,ThrowingValue> > throwingKeys;
+    for (vector<pair<string,int> >::iterator kp = keys.begin();
+        kp != keys.end(); ++kp) {
+      throwingKeys.push_back(make_pair(kp->first, ThrowingValue(kp->second)));
+    }
+    ThrowingCTrie throwingMap;
+    throwingMap.insert("stale", ThrowingValue(1));
+    if (!failedBuildIsEmpty(throwingMap, throwingKeys,
+        static_cast<int>(throwingKeys.size() / 2), 4)) {
+      cout << "ERROR: Failed parallel sorted build did not leave the trie empty"
+          << endl;
+    }
+  }
+
+  cout << "Checking parallel walk" << endl;
+  {
+    IntCTrie walkMap;
+    walkMap.build_sorted(refMap.begin(), refMap.end());
+    long long refSum = 0;
+    for (map<string,int>::iterator rp = refMap.begin(); rp != refMap.end();
+        ++rp) {
+      refSum += rp->second;
+    }
+
+    for (size_t numThreads = 1; numThreads <= 8; numThreads *= 2) {
+      atomic<size_t> visited(0);
+      atomic<size_t> wrong(0);
+      parallel_for_each(walkMap, [&](const string& key, int& value) {
+        map<string,int>::const_iterator rp = refMap.find(key);
+        if (rp == refMap.end() || rp->second != value) {
+          ++wrong;
+        }
+        ++visited;
+        value = -value;
+      }, numThreads);
+      if (visited != refMap.size() || wrong != 0) {
+        cout << "ERROR: Parallel for_each with " << numThreads <<
+            " threads visited " << visited << " keys, " << wrong <<
+            " of them wrong" << endl;
+      }
+
+      const IntCTrie& constWalkMap = walkMap;
+      long long sum = parallel_reduce(constWalkMap, 0LL,
+          [](const string&, const int& value) {return -(long long) value;},
+          [](long long x, long long y) {return x + y;}, numThreads);
+      size_t keyChars = parallel_reduce(walkMap, (size_t) 0,
+          [](const string& key, const int&) {return key.length();},
+          [](size_t x, size_t y) {return x + y;}, numThreads);
+      size_t refKeyChars = 0;
+      for (map<string,int>::iterator rp = refMap.begin();
+          rp != refMap.end(); ++rp) {
+        refKeyChars += rp->first.length();
+      }
+      if (sum != refSum || keyChars != refKeyChars) {
+        cout << "ERROR: Parallel reduce with " << numThreads <<
+            " threads is wrong" << endl;
+      }
+      parallel_for_each(walkMap, [](const string&, int& value) {
+        value = -value;
+      }, numThreads);
+    }
+    if (*walkMap.find(refMap.begin()->first) != refMap.begin()->second) {
+      cout << "ERROR: Parallel for_each did not change the values" << endl;
+    }
+
+    bool thrown = false;
+    const string& stopKey = refMap.rbegin()->first;
+    try {
+      parallel_for_each(walkMap, [&](const string& key, int&) {
+        if (key == stopKey) {
+          throw runtime_error("stop");
+        }
+      }, 4);
+    } catch (const runtime_error&) {
+      thrown = true;
+    }
+    if (!thrown) {
+      cout << "ERROR: Parallel for_each did not pass on an exception" << endl;
+    }
+
+    IntCTrie emptyMap;
+    size_t emptyCount = parallel_reduce(emptyMap, (size_t) 0,
+        [](const string&, const int&) {return (size_t) 1;},
+        [](size_t x, size_t y) {return x + y;}, 4);
+    if (emptyCount != 0) {
+      cout << "ERROR: Parallel reduce of an empty map is not 0" << endl;
+    }
+  }
+
+  cout << "Checking concurrent trie" << endl;
+  {
+    // Erasing the last child of the top node keeps the top node's value.
+    IntCTrie topMap;
+    topMap.insert("", 1);
+    topMap.insert("a", 2);
+    topMap.erase("a");
+    if (topMap.size() != 1 || topMap.find("") == topMap.end()) {
+      cout << "ERROR: Erasing a child of the top node lost its value" << endl;
+    }
+
+    typedef ConcurrentCTrie<int> IntConcurrentCTrie;
+    IntConcurrentCTrie concMap;
+    for (map<string,int>::iterator rp = refMap.begin(); rp != refMap.end();
+        ++rp) {
+      if (!concMap.insert(rp->first, rp->second) ||
+          concMap.insert(rp->first, 0)) {
+        cout << "ERROR: Concurrent insert of '" << rp->first <<
+            "' is wrong" << endl;
+        break;
+      }
+    }
+    {
+      IntConcurrentCTrie::reader reader(concMap);
+      IntConcurrentCTrie::const_iterator cp = reader.begin();
+      for (map<string,int>::iterator rp = refMap.begin();
+          rp != refMap.end(); ++rp, ++cp) {
+        const int* value = reader.find(rp->first);
+        if (!value || *value != rp->second || cp.at_end() ||
+            cp.key() != rp->first) {
+          cout << "ERROR: Concurrent trie differs at '" << rp->first << "'" <<
+              endl;
+          break;
+        }
+      }
+    }
+    {
+      // More readers at once than a block of epoch slots holds, and a writer
+      // while they are all there.
+      vector<unique_ptr<IntConcurrentCTrie::reader> > manyReaders;
+      for (size_t i = 0; i < 3 * _Epochs::sNumSlots; ++i) {
+        manyReaders.push_back(unique_ptr<IntConcurrentCTrie::reader>(
+            new IntConcurrentCTrie::reader(concMap)));
+      }
+      concMap.insert("\xff", 1);
+      concMap.erase("\xff");
+      const int* value = manyReaders.back()->find(refMap.begin()->first);
+      if (!value || *value != refMap.begin()->second) {
+        cout << "ERROR: Concurrent trie with many readers is wrong" << endl;
+      }
+    }
+    size_t erased = 0;
+    for (map<string,int>::iterator rp = refMap.begin(); rp != refMap.end();
+        ++rp) {
+      if (rp->second % 2 == 0) {
+        erased += concMap.erase(rp->first);
+      }
+    }
+    if (concMap.size() + erased != refMap.size() ||
+        concMap.erase(refMap.begin()->first + "\xff") != 0) {
+      cout << "ERROR: Concurrent trie has " << concMap.size() <<
+          " keys after erasing " << erased << endl;
+    }
+    {
+      IntConcurrentCTrie::reader reader(concMap);
+      for (map<string,int>::iterator rp = refMap.begin();
+          rp != refMap.end(); ++rp) {
+        const int* value = reader.find(rp->first);
+        if ((rp->second % 2 == 0) != (value == nullptr)) {
+          cout << "ERROR: Concurrent erase is wrong at '" << rp->first <<
+              "'" << endl;
+          break;
+        }
+      }
+    }
+
+    // Readers look up the odd keys, which stay, while the writer erases and
+    // puts back the even ones.
+    vector<string> stayKeys;
+    vector<pair<string,int> > churnKeys;
+    for (map<string,int>::iterator rp = refMap.begin(); rp != refMap.end();
+        ++rp) {
+      if (rp->second % 2 != 0) {
+        stayKeys.push_back(rp->first);
+      } else {
+        churnKeys.push_back(*rp);
+      }
+    }
+    atomic<bool> done(false);
+    atomic<size_t> wrong(0);
+    vector<thread> readers;
+    for (int i = 0; i < 3; ++i) {
+      readers.push_back(thread([&, i]() {
+        size_t k = static_cast<size_t>(i);
+        while (!done) {
+          IntConcurrentCTrie::reader reader(concMap);
+          for (int j = 0; j < 100; ++j) {
+            k = (k + 7919) % stayKeys.size();
+            const int* value = reader.find(stayKeys[k]);
+            if (!value || *value != refMap.find(stayKeys[k])->second) {
+              ++wrong;
+            }
+          }
+          // The last key that is a prefix of a key is the key itself.
+          IntConcurrentCTrie::const_prefix_iter pp =
+              reader.prefix_begin(stayKeys[k]);
+          string lastPrefix;
+          for (; !pp.at_end(); ++pp) {
+            lastPrefix = pp.key();
+          }
+          if (lastPrefix != stayKeys[k]) {
+            ++wrong;
+          }
+        }
+      }));
+    }
+    for (int round = 0; round < 2; ++round) {
+      for (size_t i = 0; i < churnKeys.size(); ++i) {
+        concMap.insert(churnKeys[i].first, churnKeys[i].second);
+      }
+      for (size_t i = 0; i < churnKeys.size(); ++i) {
+        concMap.erase(churnKeys[i].first);
+      }
+    }
+    done = true;
+    for (size_t i = 0; i < readers.size(); ++i) {
+      readers[i].join();
+    }
+    if (wrong != 0 || concMap.size() != stayKeys.size()) {
+      cout << "ERROR: Concurrent readers found " << wrong <<
+          " wrong values" << endl;
+    }
+    concMap.reclaim();
+    concMap.clear();
+    if (!concMap.empty() || IntConcurrentCTrie::reader(concMap).find("a")) {
+      cout << "ERROR: Clearing a concurrent trie failed" << endl;
+    }
+
+    // Several writers each insert their share of the keys, and erase and put
+    // back the even ones, at the same time.
+    vector<pair<string,int> > allKeys(refMap.begin(), refMap.end());
+    vector<thread> writers;
+    for (size_t w = 0; w < 4; ++w) {
+      writers.push_back(thread([&, w]() {
+        for (size_t i = w; i < allKeys.size(); i += 4) {
+          if (!concMap.insert(allKeys[i].first, allKeys[i].second)) {
+            ++wrong;
+          }
+        }
+        for (int round = 0; round < 2; ++round) {
+          for (size_t i = w; i < allKeys.size(); i += 4) {
+            if (allKeys[i].second % 2 == 0 &&
+                concMap.erase(allKeys[i].first) != 1) {
+              ++wrong;
+            }
+          }
+          for (size_t i = w; i < allKeys.size() && round == 0; i += 4) {
+            if (allKeys[i].second % 2 == 0 &&
+                !concMap.insert(allKeys[i].first, allKeys[i].second)) {
+              ++wrong;
+            }
+          }
+        }
+      }));
+    }
+    for (size_t i = 0; i < writers.size(); ++i) {
+      writers[i].join();
+    }
+    if (wrong != 0 || concMap.size() != stayKeys.size()) {
+      cout << "ERROR: Concurrent writers made " << wrong <<
+          " wrong changes" << endl;
+    }
+    {
+      IntConcurrentCTrie::reader reader(concMap);
+      IntConcurrentCTrie::const_iterator cp = reader.begin();
+      for (size_t i = 0; i < stayKeys.size(); ++i, ++cp) {
+        const int* value = reader.find(stayKeys[i]);
+        if (!value || *value != refMap.find(stayKeys[i])->second ||
+            cp.at_end() || cp.key() != stayKeys[i]) {
+          cout << "ERROR: Concurrent writers left the trie wrong at '" <<
+              stayKeys[i] << "'" << endl;
+          break;
+        }
+      }
+      if (!cp.at_end()) {
+        cout << "ERROR: Concurrent writers left extra keys" << endl;
+      }
+    }
+
+    // Clearing while writers insert loses no count: the keys that are left
+    // are the ones counted.
+    std::atomic<bool> writing(true);
+    thread clearer([&]() {
+      while (writing) {
+        concMap.clear();
+        concMap.reclaim();
+        std::this_thread::yield();
+      }
+    });
+    writers.clear();
+    for (size_t w = 0; w < 4; ++w) {
+      writers.push_back(thread([&, w]() {
+        for (size_t i = w; i < allKeys.size(); i += 4) {
+          concMap.insert(allKeys[i].first, allKeys[i].second);
+          if (allKeys[i].second % 3 == 0) {
+            concMap.erase(allKeys[i].first);
+          }
+        }
+      }));
+    }
+    for (size_t i = 0; i < writers.size(); ++i) {
+      writers[i].join();
+    }
+    writing = false;
+    clearer.join();
+    {
+      IntConcurrentCTrie::reader reader(concMap);
+      size_t numKeys = 0;
+      for (IntConcurrentCTrie::const_iterator cp = reader.begin();
+          !cp.at_end(); ++cp) {
+        ++numKeys;
+      }
+      if (concMap.size() != numKeys) {
+        cout << "ERROR: Clearing during writes left a size of " <<
+            concMap.size() << " for " << numKeys << " keys" << endl;
+      }
+    }
+  }
+
+  cout << "Checking snapshots" << endl;
+  {
+    IntCTrie liveMap;
+    for (map<string,int>::iterator rp = refMap.begin(); rp != refMap.end();
+        ++rp) {
+      liveMap.insert(rp->first, rp->second);
+    }
+    IntCTrie snapMap = liveMap.snapshot();
+
+    // Change the live trie every way that copies shared nodes.
+    map<string,int> liveRef;
+    for (map<string,int>::iterator rp = refMap.begin(); rp != refMap.end();
+        ++rp) {
+      if (rp->second % 3 == 0) {
+        liveMap.erase(rp->first);
+      } else if (rp->second % 3 == 1) {
+        liveMap[rp->first] = -rp->second;
+        liveRef[rp->first] = -rp->second;
+      } else {
+        liveMap.insert(rp->first + "~", rp->second);
+        liveRef[rp->first] = rp->second;
+        liveRef[rp->first + "~"] = rp->second;
+      }
+    }
+    IntCTrie laterMap = liveMap.snapshot();
+    liveMap.erase(liveMap.lower_bound("b"), liveMap.lower_bound("d"));
+    IntCTrie::iterator dp = liveMap.find(liveRef.rbegin()->first);
+    *dp += 1;
+
+    if (snapMap.size() != refMap.size() || !sameTrie(snapMap, refMap)) {
+      cout << "ERROR: Changing the live trie changed its snapshot" << endl;
+    }
+    if (laterMap.size() != liveRef.size() || !sameTrie(laterMap, liveRef)) {
+      cout << "ERROR: Erasing a range changed a later snapshot" << endl;
+    }
+    liveRef.erase(liveRef.lower_bound("b"), liveRef.lower_bound("d"));
+    liveRef.rbegin()->second += 1;
+    if (liveMap.size() != liveRef.size() || !sameTrie(liveMap, liveRef)) {
+      cout << "ERROR: The live trie is wrong after a snapshot" << endl;
+    }
+
+    // A snapshot outlives the trie it was taken from, and can be changed.
+    IntCTrie* tempMap = new IntCTrie(snapMap);
+    IntCTrie tempSnap = tempMap->snapshot();
+    delete tempMap;
+    snapMap.clear();
+    for (map<string,int>::iterator rp = refMap.begin(); rp != refMap.end();
+        ++rp) {
+      if (tempSnap.erase(rp->first) != 1) {
+        cout << "ERROR: Erasing '" << rp->first << "' from a snapshot failed"
+            << endl;
+        break;
+      }
+    }
+    if (!tempSnap.empty() || !sameTrie(laterMap.snapshot(), laterMap)) {
+      cout << "ERROR: Emptying a snapshot failed" << endl;
+    }
+
+    // Lookups copy nothing, and writes through iterators copy only what
+    // they write to.
+    IntCTrie writeMap;
+    writeMap.insert(refMap.begin(), refMap.end());
+    IntCTrie writeSnap = writeMap.snapshot();
+    const IntCTrie& constWrite = writeMap;
+    const IntCTrie& constSnap = writeSnap;
+    const string& firstKey = refMap.begin()->first;
+    const string& lastKey = refMap.rbegin()->first;
+    writeMap.find(firstKey + "~");
+    writeMap.find(lastKey);
+    writeMap.lower_bound(lastKey);
+    if (&*constWrite.find(lastKey) != &*constSnap.find(lastKey)) {
+      cout << "ERROR: A lookup copied a shared node" << endl;
+    }
+    map<string,int> writeRef = refMap;
+    *writeMap.begin() += 1;
+    writeRef[firstKey] += 1;
+    *writeMap.lower_bound(lastKey) += 1;
+    writeRef[lastKey] += 1;
+    IntCTrie::prefix_iter pp = writeMap.prefix_begin(lastKey);
+    *pp += 1;
+    writeRef[pp.key()] += 1;
+    if (!sameTrie(writeSnap, refMap) || !sameTrie(writeMap, writeRef)) {
+      cout << "ERROR: Writing through an iterator changed a snapshot" << endl;
+    }
+    parallel_for_each(writeMap, [](const string&, int& value) {
+      value *= 2;
+    }, 2);
+    for (map<string,int>::iterator rp = writeRef.begin();
+        rp != writeRef.end(); ++rp) {
+      rp->second *= 2;
+    }
+    if (!sameTrie(writeSnap, refMap) || !sameTrie(writeMap, writeRef)) {
+      cout << "ERROR: parallel_for_each() changed a snapshot" << endl;
+    }
+
+    // Two snapshots of the same nodes may copy them on different threads.
+    IntCTrie threadSnap = writeSnap.snapshot();
+    IntCTrie mainSnap = writeSnap.snapshot();
+    writeSnap.clear();
+    std::thread writer([&]() {
+      for (map<string,int>::iterator rp = refMap.begin(); rp != refMap.end();
+          ++rp) {
+        threadSnap[rp->first] = -rp->second;
+      }
+    });
+    for (map<string,int>::iterator rp = refMap.begin(); rp != refMap.end();
+        ++rp) {
+      mainSnap.erase(rp->first);
+    }
+    writer.join();
+    map<string,int> negRef = refMap;
+    for (map<string,int>::iterator rp = negRef.begin(); rp != negRef.end();
+        ++rp) {
+      rp->second = -rp->second;
+    }
+    if (!mainSnap.empty() || !sameTrie(threadSnap, negRef)) {
+      cout << "ERROR: Snapshots changed on two threads went wrong" << endl;
+    }
+  }
+
+  // The read-only tries are built from the same trie, and also checked on a
+  // few keys where the empty key is the value of a node with children.
+  IntCTrie sourceMap;
+  sourceMap.insert(refMap.begin(), refMap.end());
+  map<string,int> smallRef;
+  smallRef[""] = 1;
+  smallRef["ab"] = 2;
+  smallRef["abc"] = 3;
+  IntCTrie smallMap;
+  smallMap.insert(smallRef.begin(), smallRef.end());
+
+  cout << "Checking frozen image" << endl;
+  {
+    string imagePathStr = "ctrie_tst.frozen." + to_string(getpid());
+    const char* imagePath = imagePathStr.c_str();
+    sourceMap.freeze(imagePath);
+    FrozenCTrie<int> frozenMap(imagePath);
+    unlink(imagePath);
+    checkReadOnlyTrie(frozenMap, refMap, "Frozen trie");
+    checkReadOnlyIters(frozenMap, refMap, sourceMap, "Frozen trie");
+
+    smallMap.freeze(imagePath);
+    FrozenCTrie<int> smallFrozen(imagePath);
+    unlink(imagePath);
+    checkReadOnlyTrie(smallFrozen, smallRef, "Small frozen trie");
+    checkReadOnlyIters(smallFrozen, smallRef, smallMap, "Small frozen trie");
+
+    IntCTrie().freeze(imagePath);
+    FrozenCTrie<int> emptyFrozen(imagePath);
+    unlink(imagePath);
+    if (!emptyFrozen.empty() || emptyFrozen.begin() != emptyFrozen.end() ||
+        !emptyFrozen.lower_bound("a").at_end()) {
+      cout << "ERROR: Frozen empty trie is not empty" << endl;
+    }
+    try {
+      FrozenCTrie<int> missing(imagePath);
+      cout << "ERROR: Mapping a missing frozen image succeeded" << endl;
+    } catch (const std::system_error&) {
+    }
+  }
+
+  cout << "Checking LOUDS trie" << endl;
+  {
+    LoudsCTrie<int> loudsMap(sourceMap);
+    checkReadOnlyTrie(loudsMap, refMap, "LOUDS trie");
+    checkReadOnlyIters(loudsMap, refMap, sourceMap, "LOUDS trie");
+
+    LoudsCTrie<int> smallLouds(smallMap);
+    checkReadOnlyTrie(smallLouds, smallRef, "Small LOUDS trie");
+    checkReadOnlyIters(smallLouds, smallRef, smallMap, "Small LOUDS trie");
+
+    LoudsCTrie<int> emptyLouds((IntCTrie()));
+    if (!emptyLouds.empty() || emptyLouds.begin() != emptyLouds.end() ||
+        !emptyLouds.lower_bound("a").at_end() || emptyLouds.count("") != 0) {
+      cout << "ERROR: LOUDS empty trie is not empty" << endl;
+    }
+  }
+
+  cout << "Checking double-array trie" << endl;
+  {
+    DoubleArrayCTrie<int> arrayMap(sourceMap);
+    checkReadOnlyTrie(arrayMap, refMap, "Double-array trie");
+
+    DoubleArrayCTrie<int> smallArray(smallMap);
+    checkReadOnlyTrie(smallArray, smallRef, "Small double-array trie");
+
+    IntCTrie oneMap;
+    oneMap["only"] = 4;
+    DoubleArrayCTrie<int> oneArray(oneMap);
+    DoubleArrayCTrie<int> emptyArray((IntCTrie()));
+    if (!oneArray.find("only") || oneArray.count("onl") != 0 ||
+        !emptyArray.empty() || emptyArray.count("") != 0) {
+      cout << "ERROR: Double-array trie of one or no keys is wrong" << endl;
+    }
+  }
+
+  cout << "Checking sharded trie" << endl;
+  {
+    typedef ShardedCTrie<int,8> IntShardedCTrie;
+    IntShardedCTrie shardMap;
+    vector<pair<string,int> > allKeys(refMap.begin(), refMap.end());
+    atomic<size_t> wrong(0);
+    vector<thread> writers;
+    for (size_t w = 0; w < 4; ++w) {
+      writers.push_back(thread([&, w]() {
+        for (size_t i = w; i < allKeys.size(); i += 4) {
+          if (!shardMap.insert(allKeys[i].first, allKeys[i].second) ||
+              shardMap.insert(allKeys[i].first, 0)) {
+            ++wrong;
+          }
+        }
+        for (size_t i = w; i < allKeys.size(); i += 4) {
+          if (allKeys[i].second % 3 == 0 &&
+              shardMap.erase(allKeys[i].first) != 1) {
+            ++wrong;
+          }
+        }
+      }));
+    }
+    for (size_t i = 0; i < writers.size(); ++i) {
+      writers[i].join();
+    }
+    map<string,int> leftMap;
+    for (size_t i = 0; i < allKeys.size(); ++i) {
+      if (allKeys[i].second % 3 != 0) {
+        leftMap.insert(allKeys[i]);
+      }
+    }
+    if (wrong != 0 || shardMap.size() != leftMap.size()) {
+      cout << "ERROR: Sharded writers made " << wrong <<
+          " wrong changes" << endl;
+    }
+
+    size_t used = 0;
+    vector<bool> shardUsed(IntShardedCTrie::shardCount());
+    for (map<string,int>::iterator rp = leftMap.begin(); rp != leftMap.end();
+        ++rp) {
+      int value;
+      if (!shardMap.find(rp->first, value) || value != rp->second ||
+          shardMap.count(rp->first) != 1) {
+        cout << "ERROR: Sharded find of '" << rp->first << "' failed" << endl;
+        break;
+      }
+      size_t shard =
+          IntShardedCTrie::shardOf(rp->first.data(), rp->first.size());
+      if (!shardUsed[shard]) {
+        shardUsed[shard] = true;
+        ++used;
+      }
+    }
+    if (used < IntShardedCTrie::shardCount() / 2) {
+      cout << "ERROR: Only " << used << " shards are used" << endl;
+    }
+
+    {
+      IntShardedCTrie::reader reader(shardMap);
+      IntShardedCTrie::const_iterator sp = reader.begin();
+      for (map<string,int>::iterator rp = leftMap.begin();
+          rp != leftMap.end(); ++rp, ++sp) {
+        if (sp.at_end() || sp.key() != rp->first || *sp != rp->second) {
+          cout << "ERROR: Sharded iteration differs at '" << rp->first <<
+              "'" << endl;
+          break;
+        }
+      }
+      if (sp != reader.end()) {
+        cout << "ERROR: Sharded iteration does not end" << endl;
+      }
+
+      for (size_t i = 0; i < allKeys.size(); i += 97) {
+        string key = allKeys[i].first.substr(0, allKeys[i].first.size() / 2);
+        map<string,int>::iterator rp = leftMap.lower_bound(key);
+        sp = reader.lower_bound(key);
+        if ((rp == leftMap.end()) != sp.at_end() ||
+            (rp != leftMap.end() && sp.key() != rp->first)) {
+          cout << "ERROR: Sharded lower_bound of '" << key << "' is wrong" <<
+              endl;
+          break;
+        }
+      }
+      const int* value = reader.find(leftMap.begin()->first);
+      if (!value || *value != leftMap.begin()->second ||
+          reader.find(allKeys[0].first + "\xff")) {
+        cout << "ERROR: Sharded reader find is wrong" << endl;
+      }
+    }
+
+    shardMap.clear();
+    if (!shardMap.empty() || IntShardedCTrie::reader(shardMap).begin() !=
+        IntShardedCTrie::const_iterator()) {
+      cout << "ERROR: Clearing a sharded trie failed" << endl;
+    }
+  }
+
+  cout << "Checking slab allocator" << endl;
+  typedef CTrie<int,Medium,SlabAllocator<int> > SlabCTrie;
+  {
+    SlabCTrie slabMap;
+    for (map<string,int>::iterator rp = refMap.begin(); rp != refMap.end();
+        ++rp) {
+      slabMap.insert(rp->first, rp->second);
+    }
+    SlabCTrie::iterator sp = slabMap.begin();
+    for (map<string,int>::iterator rp = refMap.begin(); rp != refMap.end();
+        ++rp, ++sp) {
+      if (sp.at_end() || sp.key() != rp->first || *sp != rp->second) {
+        cout << "ERROR: Slab allocated map differs at '" << rp->first <<
+            "'" << endl;
+        break;
+      }
+    }
+    size_t erased = 0;
+    for (map<string,int>::iterator rp = refMap.begin(); rp != refMap.end();
+        ++rp) {
+      if (rp->second % 2 == 0) {
+        erased += slabMap.erase(rp->first);
+      }
+    }
+    if (slabMap.size() + erased != refMap.size()) {
+      cout << "ERROR: Slab allocated map has " << slabMap.size() <<
+          " keys after erasing " << erased << endl;
+    }
+    SlabCTrie slabCopy(slabMap);
+    if (slabCopy.get_allocator() == slabMap.get_allocator()) {
+      cout << "ERROR: Copy of slab allocated map shares its pool" << endl;
+    }
+
+    // While another allocator shares the pool, clearing frees the nodes
+    // one by one, so only the empty slabs kept back are left.
+    SlabAllocator<int> slabAlloc = slabMap.get_allocator();
+    slabMap.clear();
+    slabAlloc.trim();
+    if (slabAlloc.slabCount() != 0) {
+      cout << "ERROR: " << slabAlloc.slabCount() <<
+          " slabs are still allocated" << endl;
+    }
+    if (slabCopy.size() + erased != refMap.size()) {
+      cout << "ERROR: Copy of slab allocated map has " << slabCopy.size() <<
+          " keys" << endl;
+    }
+
+    // A trie that alone holds its pool gives back every slab at once.
+    size_t copySlabs = slabCopy.get_allocator().slabCount();
+    slabCopy.clear();
+    if (copySlabs == 0 || slabCopy.get_allocator().slabCount() != 0) {
+      cout << "ERROR: Clearing a slab allocated map kept " <<
+          slabCopy.get_allocator().slabCount() << " slabs" << endl;
+    }
+  }
+
+  cout << "Checking arena allocator" << endl;
+  typedef CTrie<int,Medium,ArenaAllocator<int> > ArenaCTrie;
+  {
+    ArenaCTrie arenaMap;
+    for (map<string,int>::iterator rp = refMap.begin(); rp != refMap.end();
+        ++rp) {
+      arenaMap.insert(rp->first, rp->second);
+    }
+    arenaMap.insert(string(100, 'x'), -1);
+    arenaMap.insert(string(100, 'x') + 'y', -2);
+    arenaMap.erase(string(100, 'x'));
+    arenaMap.erase(string(100, 'x') + 'y');
+    ArenaCTrie::iterator ap = arenaMap.begin();
+    for (map<string,int>::iterator rp = refMap.begin(); rp != refMap.end();
+        ++rp, ++ap) {
+      if (ap.at_end() || ap.key() != rp->first || *ap != rp->second) {
+        cout << "ERROR: Arena allocated map differs at '" << rp->first <<
+            "'" << endl;
+        break;
+      }
+    }
+
+    // A copy shares the arena, so clearing one of them must not release it.
+    ArenaCTrie arenaCopy(arenaMap);
+    arenaMap.clear();
+    if (arenaCopy.get_allocator().chunkCount() == 0 ||
+        arenaCopy.size() != refMap.size() ||
+        *arenaCopy.find(refMap.begin()->first) != refMap.begin()->second) {
+      cout << "ERROR: Clearing an arena allocated map broke its copy" << endl;
+    }
+    arenaCopy = ArenaCTrie();
+    arenaMap = arenaCopy;
+    arenaMap.insert("arena", 1);
+    arenaMap.clear();
+    if (arenaMap.get_allocator().chunkCount() != 0) {
+      cout << "ERROR: Clearing an arena allocated map left " <<
+          arenaMap.get_allocator().chunkCount() << " chunks" << endl;
+    }
+  }
+
+  cout << "Checking compact allocator" << endl;
+  typedef CTrie<int,Medium,CompactAllocator<int> > CompactCTrie;
+  {
+    CompactCTrie compactMap;
+    for (map<string,int>::iterator rp = refMap.begin(); rp != refMap.end();
+        ++rp) {
+      compactMap.insert(rp->first, rp->second);
+    }
+    compactMap.insert(string(5000, 'x'), -1);
+    compactMap.erase(string(5000, 'x'));
+    compactMap.insert(string(5000, 'y'), -2);
+
+    // The copy is in a region of its own, so its entries are offsets from a
+    // different base.
+    CompactCTrie compactCopy(compactMap);
+    compactMap.clear();
+    if (compactCopy.get_allocator() == compactMap.get_allocator() ||
+        compactCopy.size() != refMap.size() + 1 ||
+        *compactCopy.find(string(5000, 'y')) != -2) {
+      cout << "ERROR: Copying a compact map failed" << endl;
+    }
+    compactCopy.erase(string(5000, 'y'));
+    compactMap = std::move(compactCopy);
+    CompactCTrie::iterator cp = compactMap.begin();
+    for (map<string,int>::iterator rp = refMap.begin(); rp != refMap.end();
+        ++rp, ++cp) {
+      if (cp.at_end() || cp.key() != rp->first || *cp != rp->second) {
+        cout << "ERROR: Compact map differs at '" << rp->first << "'" <<
+            endl;
+        break;
+      }
+    }
+    for (map<string,int>::iterator rp = refMap.begin(); rp != refMap.end();
+        ++rp) {
+      if (compactMap.erase(rp->first) != 1) {
+        cout << "ERROR: Could not erase '" << rp->first <<
+            "' from a compact map" << endl;
+        break;
+      }
+    }
+    if (!compactMap.empty()) {
+      cout << "ERROR: A compact map is not empty after erasing every key" <<
+          endl;
+    }
+  }
+
+  cout << "Checking huge page allocator" << endl;
+  typedef CTrie<int,Medium,HugePageAllocator<int> > HugePageCTrie;
+  {
+    HugePageCTrie hugeMap;
+    for (map<string,int>::iterator rp = refMap.begin(); rp != refMap.end();
+        ++rp) {
+      hugeMap.insert(rp->first, rp->second);
+    }
+    hugeMap.insert(string(100000, 'x'), -1);
+    hugeMap.erase(string(100000, 'x'));
+    if (hugeMap.get_allocator().spanCount() == 0) {
+      cout << "ERROR: A huge page map has no spans" << endl;
+    }
+
+    HugePageCTrie hugeCopy(hugeMap);
+    hugeMap.clear();
+    if (hugeCopy.get_allocator() == hugeMap.get_allocator()) {
+      cout << "ERROR: A copied huge page map shares its heap" << endl;
+    }
+    HugePageCTrie::iterator hp = hugeCopy.begin();
+    for (map<string,int>::iterator rp = refMap.begin(); rp != refMap.end();
+        ++rp, ++hp) {
+      if (hp.at_end() || hp.key() != rp->first || *hp != rp->second) {
+        cout << "ERROR: Huge page map differs at '" << rp->first << "'" <<
+            endl;
+        break;
+      }
+    }
+  }
+
+#ifdef _CTRIE_HAS_PMR
+  cout << "Checking pmr allocator" << endl;
+  {
+    std::pmr::unsynchronized_pool_resource pool;
+    std::pmr::monotonic_buffer_resource buffer;
+    ctrie::pmr::CTrie<int> pmrMap(&pool);
+    for (map<string,int>::iterator rp = refMap.begin(); rp != refMap.end();
+        ++rp) {
+      pmrMap.insert(rp->first, rp->second);
+    }
+    pmrMap.insert(string(100, 'x'), -1);
+    pmrMap.erase(string(100, 'x'));
+
+    // The copy and the move assignment stay on their own resources, so the
+    // nodes are copied into them.
+    ctrie::pmr::CTrie<int> pmrCopy(&buffer);
+    pmrCopy = pmrMap;
+    ctrie::pmr::CTrie<int> pmrMoved(&buffer);
+    pmrMoved = std::move(pmrMap);
+    if (pmrCopy.get_allocator().resource() != &buffer ||
+        pmrMoved.get_allocator().resource() != &buffer || pmrMap.size() != 0) {
+      cout << "ERROR: A pmr map's allocator propagated on assignment" << endl;
+    }
+
+    // Every shard allocates from the resource it was given.
+    CountingResource counting;
+    {
+      typedef std::pmr::polymorphic_allocator<int> PmrAlloc;
+      ShardedCTrie<int,8,Medium,PmrAlloc> pmrShards{PmrAlloc(&counting)};
+      for (map<string,int>::iterator rp = refMap.begin(); rp != refMap.end();
+          ++rp) {
+        pmrShards.insert(rp->first, rp->second);
+      }
+      if (counting.allocations < refMap.size() || counting.bytes == 0) {
+        cout << "ERROR: A sharded pmr map made only " <<
+            counting.allocations << " allocations from its resource" << endl;
+      }
+    }
+    if (counting.bytes != 0) {
+      cout << "ERROR: A sharded pmr map left " << counting.bytes <<
+          " bytes allocated" << endl;
+    }
+    pmrCopy.swap(pmrMoved);
+    pmrMap = std::move(pmrCopy);
+    ctrie::pmr::CTrie<int>::iterator pp = pmrMap.begin();
+    for (map<string,int>::iterator rp = refMap.begin(); rp != refMap.end();
+        ++rp, ++pp) {
+      if (pp.at_end() || pp.key() != rp->first || *pp != rp->second) {
+        cout << "ERROR: pmr allocated map differs at '" << rp->first <<
+            "'" << endl;
+        break;
+      }
+    }
+  }
+#endif
+
   checkConst(cmap);
-  
+
   return 0;
 }
 
@@ -1,5 +1,6 @@
 #include "ctrie.h"
 
+#include <fstream>
 #include <iostream>
 #include <map>
 #include <stdlib.h>
@@ -11,8 +12,12 @@ using namespace std;
 using namespace ctrie;
 
 typedef CTrie<int,Medium> IntCTrie;
+typedef CTrie<int,Medium,HugePageAllocator<int> > HugePageCTrie;
 
+template<class TrieT> void timeTries(const vector<char*>& words);
+void timeDoubleArray(const vector<char*>& words);
 void memoryUsage();
+void hugePageUsage();
 
 size_t
 uintRand(size_t interval)
@@ -35,21 +40,18 @@ myGet(istream& cin, char* buf, size_t buf_size, char delim)
   return !cin.fail();
 }
 
-int main()
+// With -hugepages, run the timings with std::allocator and then again with
+// HugePageAllocator, to compare the two.  With -doublearray, time exact
+// lookups in a CTrie against a DoubleArrayCTrie compiled from it.
+int main(int argc, char** argv)
 {
+  bool compareHugePages = argc > 1 && strcmp(argv[1], "-hugepages") == 0;
+  bool compareDoubleArray = argc > 1 && strcmp(argv[1], "-doublearray") == 0;
   vector<char*> words;
-  IntCTrie tries[1000];
   size_t wordBufSize = 4;
   char *wordBuf = new char[4];
-  int wordCount = 0;
   char nextc;
 
-  for (size_t i = 0; i < 1000; ++i) {
-    tries[i] = IntCTrie();
-  }
-
-  clock_t times[100];
-
   // Read in all the words and populate the test map and reference map.
   // We make the value the word position in the input file.
   while (1) {
@@ -70,6 +72,33 @@ int main()
     strcpy(word_copy, wordBuf);
     words.push_back(word_copy);
   }
+
+  if (compareHugePages) {
+    cout << "With std::allocator:\n";
+    timeTries<IntCTrie>(words);
+    cout << "\nWith HugePageAllocator:\n";
+    timeTries<HugePageCTrie>(words);
+  } else if (compareDoubleArray) {
+    timeDoubleArray(words);
+  } else {
+    timeTries<IntCTrie>(words);
+  }
+  return 0;
+}
+
+template<class TrieT>
+void
+timeTries(const vector<char*>& words)
+{
+  TrieT tries[1000];
+  int wordCount = 0;
+
+  for (size_t i = 0; i < 1000; ++i) {
+    tries[i] = TrieT();
+  }
+
+  clock_t times[100];
+
   times[0] = clock();
   for (vector<char*>::const_iterator p = words.begin(); p != words.end(); ++p) {
     ++wordCount;
@@ -85,7 +114,7 @@ int main()
   // values are the same.
   times[1] = clock();
   for (size_t loop = 0; loop < 1000; ++loop) {
-    IntCTrie::iterator rp;
+    typename TrieT::iterator rp;
     wordCount = 0;
     for (rp = tries[0].begin(); !rp.at_end(); ++rp, ++wordCount) {}
   }
@@ -97,7 +126,7 @@ int main()
   times[2] = clock();
   string key;
   int sum = 0;
-  for (IntCTrie::iterator rp = tries[0].begin(); !rp.at_end(); ++rp) {
+  for (typename TrieT::iterator rp = tries[0].begin(); !rp.at_end(); ++rp) {
     key = rp.key();
     for (size_t loop = 0; loop < 1000; ++loop) {
       sum += *tries[0].find(key);
@@ -116,7 +145,7 @@ int main()
       randomStr += static_cast<char>(uintRand(28) + '@');
     }
 
-    IntCTrie::iterator rp;
+    typename TrieT::iterator rp;
     for (size_t loop = 0; loop < 1000; ++loop) {
       rp = tries[0].find(randomStr);
       if (!rp.at_end()) {
@@ -124,7 +153,35 @@ int main()
       }
     }
   }
+#endif
+
+#if 1
+  // Build one large map, keyed by every word with each of 100 suffixes, and
+  // look up its keys in random order, which walks nodes all over the map.
   times[4] = clock();
+  TrieT largeTrie;
+  string largeKey;
+  for (size_t suffix = 0; suffix < 100; ++suffix) {
+    for (vector<char*>::const_iterator p = words.begin(); p != words.end();
+        ++p) {
+      largeKey = *p;
+      largeKey += static_cast<char>('0' + suffix / 10);
+      largeKey += static_cast<char>('0' + suffix % 10);
+      largeTrie.insert(largeKey, 1);
+    }
+  }
+  times[5] = clock();
+  srand(2);
+  sum = 0;
+  for (size_t loop = 0; loop < 1000000; ++loop) {
+    size_t suffix = uintRand(100);
+    largeKey = words[uintRand(words.size())];
+    largeKey += static_cast<char>('0' + suffix / 10);
+    largeKey += static_cast<char>('0' + suffix % 10);
+    sum += *largeTrie.find(largeKey);
+  }
+  times[6] = clock();
+  hugePageUsage();
 
   cout << "Time to create 100 maps: " << (times[1]-times[0])/1000 << " ms\n";
   cout << "Time to iterate 1000 times: " << (times[2]-times[1])/1000 << " ms\n";
@@ -132,8 +189,89 @@ int main()
       (times[3]-times[2])/1000 << " ms\n";
   cout << "Time to find 10000 random words 1000 times: " <<
       (times[4]-times[3])/1000 << " ms\n";
+  cout << "Time to create a map of " << largeTrie.size() << " keys: " <<
+      (times[5]-times[4])/1000 << " ms\n";
+  cout << "Time to find 1000000 random keys in it: " <<
+      (times[6]-times[5])/1000 << " ms\n";
 #endif
-  return 0;
+}
+
+// Look up every key, and then random words that are mostly missing, 1000
+// times each, first with CTrie::find() and then in the double array.
+void
+timeDoubleArray(const vector<char*>& words)
+{
+  IntCTrie trie;
+  int wordCount = 0;
+  for (vector<char*>::const_iterator p = words.begin(); p != words.end(); ++p) {
+    trie.insert(*p, ++wordCount);
+  }
+  clock_t times[6];
+  times[0] = clock();
+  DoubleArrayCTrie<int> array(trie);
+  times[1] = clock();
+
+  vector<string> keys;
+  for (IntCTrie::iterator rp = trie.begin(); !rp.at_end(); ++rp) {
+    keys.push_back(rp.key());
+  }
+  srand(1);
+  vector<string> randomStrs;
+  for (size_t wordNum = 0; wordNum < 10000; ++wordNum) {
+    size_t length = uintRand(14) + 1;
+    string randomStr;
+    for (size_t i = 0; i < length; ++i) {
+      randomStr += static_cast<char>(uintRand(28) + '@');
+    }
+    randomStrs.push_back(randomStr);
+  }
+
+  int trieSum = 0;
+  times[2] = clock();
+  for (size_t loop = 0; loop < 1000; ++loop) {
+    for (vector<string>::const_iterator p = keys.begin(); p != keys.end();
+        ++p) {
+      trieSum += *trie.find(*p);
+    }
+  }
+  times[3] = clock();
+  int arraySum = 0;
+  for (size_t loop = 0; loop < 1000; ++loop) {
+    for (vector<string>::const_iterator p = keys.begin(); p != keys.end();
+        ++p) {
+      arraySum += *array.find(*p);
+    }
+  }
+  times[4] = clock();
+  size_t trieFound = 0;
+  for (size_t loop = 0; loop < 1000; ++loop) {
+    for (vector<string>::const_iterator p = randomStrs.begin();
+        p != randomStrs.end(); ++p) {
+      trieFound += !trie.find(*p).at_end();
+    }
+  }
+  times[5] = clock();
+  size_t arrayFound = 0;
+  for (size_t loop = 0; loop < 1000; ++loop) {
+    for (vector<string>::const_iterator p = randomStrs.begin();
+        p != randomStrs.end(); ++p) {
+      arrayFound += array.count(*p);
+    }
+  }
+  clock_t end = clock();
+
+  if (trieSum != arraySum || trieFound != arrayFound) {
+    cout << "ERROR: The double array does not match the CTrie\n";
+  }
+  cout << "Time to compile a double array of " << array.size() << " keys, " <<
+      array.stateCount() << " states, " << array.memoryUsage() <<
+      " bytes: " << (times[1]-times[0])/1000 << " ms\n";
+  cout << "Time to find all keys 1000 times: CTrie " <<
+      (times[3]-times[2])/1000 << " ms, double array " <<
+      (times[4]-times[3])/1000 << " ms\n";
+  cout << "Time to find 10000 random words 1000 times: CTrie " <<
+      (times[5]-times[4])/1000 << " ms, double array " <<
+      (end-times[5])/1000 << " ms\n";
 }
 
 #define _INCLUDE_POSIX_SOURCE
@@ -156,3 +294,15 @@ void memoryUsage()
      "swaps = " << R.ru_nswap << ", " <<
      "page_faults = " << R.ru_majflt << "\n";
 }
+
+// Report how much of the process is backed by transparent huge pages.
+void hugePageUsage()
+{
+  ifstream smaps("/proc/self/smaps_rollup");
+  string line;
+  while (getline(smaps, line)) {
+    if (line.compare(0, 14, "AnonHugePages:") == 0) {
+      cout << line << "\n";
+    }
+  }
+}